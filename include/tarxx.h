@@ -28,29 +28,50 @@
 
 #ifdef WITH_LZ4
 
+#    include <lz4.h>
 #    include <lz4frame_static.h>
+#    include <lz4hc.h>
 
+#endif
+#ifdef WITH_ZSTD
+#    include <zstd.h>
 #endif
 #include <iostream>
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <bitset>
 #include <chrono>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <exception>
 #include <filesystem>
 #include <fstream>
 #include <functional>
-#include <iomanip>
+#include <future>
+#include <limits>
+#include <mutex>
 #include <optional>
-#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <system_error>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 #include <memory>
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#    include <coroutine>
+#    include <iterator>
+#endif
 
 #if defined(__linux)
 #    include <cerrno>
@@ -59,15 +80,31 @@
 #    include <ftw.h>
 #    include <grp.h>
 #    include <pwd.h>
+#    include <sys/mman.h>
+#    include <sys/sendfile.h>
 #    include <sys/stat.h>
+#    include <sys/syscall.h>
 #    include <sys/sysmacros.h>
 #    include <sys/types.h>
+#    include <sys/uio.h>
 #    include <unistd.h>
+#    ifdef WITH_IO_URING
+#        include <linux/io_uring.h>
+// linux/fs.h, included by linux/io_uring.h, defines a macro clashing with tarxx::BLOCK_SIZE
+#        undef BLOCK_SIZE
+#    endif
 
 #else
 #    error "no support for targeted platform"
 #endif
 
+#if defined(__x86_64__) && defined(__GNUC__)
+// SHA-256 uses the SHA extensions if the processor supports them
+#    define TARXX_SHA_EXTENSIONS
+#    include <cpuid.h>
+#    include <immintrin.h>
+#endif
+
 
 namespace tarxx {
 
@@ -92,6 +129,128 @@ namespace tarxx {
         using std::system_error::system_error;
     };
 
+    class file_descriptor {
+    public:
+        file_descriptor() = default;
+        explicit file_descriptor(int fd) : fd_(fd) {}
+
+        // delete copy special member functions, the descriptor is owned exclusively
+        file_descriptor(const file_descriptor& other) = delete;
+        file_descriptor& operator=(const file_descriptor& other) = delete;
+
+        file_descriptor(file_descriptor&& other) noexcept : fd_(other.release()) {}
+        file_descriptor& operator=(file_descriptor&& other) noexcept
+        {
+            if (this != &other) {
+                close();
+                fd_ = other.release();
+            }
+            return *this;
+        }
+
+        ~file_descriptor()
+        {
+            close();
+        }
+
+        [[nodiscard]] int get() const
+        {
+            return fd_;
+        }
+
+        [[nodiscard]] bool is_open() const
+        {
+            return fd_ >= 0;
+        }
+
+        int release()
+        {
+            const auto fd = fd_;
+            fd_ = -1;
+            return fd;
+        }
+
+        void close()
+        {
+            if (fd_ >= 0) {
+                ::close(fd_);
+                fd_ = -1;
+            }
+        }
+
+    private:
+        int fd_ = -1;
+    };
+
+    // read only mapping of a whole file
+    class mapped_file {
+    public:
+        mapped_file() = default;
+        explicit mapped_file(const std::string& path)
+        {
+            const file_descriptor fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+            if (!fd.is_open()) throw errno_exception();
+
+            struct ::stat file_stat {};
+            if (::fstat(fd.get(), &file_stat) != 0) throw errno_exception();
+            size_ = static_cast<std::size_t>(file_stat.st_size);
+            // empty files can't be mapped
+            if (size_ == 0) return;
+
+            auto* const data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+            if (data == MAP_FAILED) throw errno_exception();
+            data_ = static_cast<const char*>(data);
+        }
+
+        // delete copy special member functions, the mapping is owned exclusively
+        mapped_file(const mapped_file& other) = delete;
+        mapped_file& operator=(const mapped_file& other) = delete;
+
+        mapped_file(mapped_file&& other) noexcept
+            : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+        mapped_file& operator=(mapped_file&& other) noexcept
+        {
+            if (this != &other) {
+                unmap();
+                data_ = std::exchange(other.data_, nullptr);
+                size_ = std::exchange(other.size_, 0);
+            }
+            return *this;
+        }
+
+        ~mapped_file()
+        {
+            unmap();
+        }
+
+        [[nodiscard]] const char* data() const
+        {
+            return data_;
+        }
+
+        [[nodiscard]] std::size_t size() const
+        {
+            return size_;
+        }
+
+        void advise(const int advice) const
+        {
+            if (data_ != nullptr) ::madvise(const_cast<char*>(data_), size_, advice);
+        }
+
+    private:
+        void unmap()
+        {
+            if (data_ != nullptr) {
+                ::munmap(const_cast<char*>(data_), size_);
+                data_ = nullptr;
+            }
+        }
+
+        const char* data_ = nullptr;
+        std::size_t size_ = 0;
+    };
+
 #endif
 
     static constexpr int BLOCK_SIZE = 512;
@@ -125,1302 +284,7592 @@ namespace tarxx {
         mask = 07777
     };
 
-    struct Filesystem {
-        virtual void iterateDirectory(const std::string& path, std::function<void(const std::string&)>&& cb) const = 0;
-
-        [[nodiscard]] virtual file_type_flag type_flag(const std::string& path) const = 0;
-        [[nodiscard]] virtual size_t file_size(const std::string& path) const = 0;
-        [[nodiscard]] virtual mod_time_t mod_time(const std::string& path) const = 0;
-        [[nodiscard]] virtual mode_t mode(const std::string& path) const = 0;
-        [[nodiscard]] virtual std::string read_symlink(const std::string& path) const = 0;
-        [[nodiscard]] virtual bool file_exists(const std::string& path) const = 0;
-        [[nodiscard]] virtual std::string relative_path(std::string path) const
-        {
-            if (path.empty()) return "";
-            if (path == "../") return "./";
-            if (path == "/") throw std::invalid_argument("can't tar the rootfs");
-            if (path.find('/') == 0) {
-                path = path.erase(0, 1);
-                return relative_path(path);
-            }
+    // snapshot of everything the archive needs to know about a file system entry,
+    // gathered with a single metadata query.
+    struct file_metadata {
+        file_type_flag type = file_type_flag::REGULAR_FILE;
+        // permission bits only, same as Filesystem::mode
+        mode_t mode = 0;
+        uid_t uid = 0;
+        gid_t gid = 0;
+        size_t size = 0;
+        mod_time_t mod_time = 0;
+        mod_time_t change_time = 0;
+        // sub second part of the times, not stored in tar headers
+        uint32_t mod_time_nsec = 0;
+        uint32_t change_time_nsec = 0;
+        uint64_t dev = 0;
+        ino_t ino = 0;
+        uint64_t nlink = 0;
+        major_t dev_major = 0;
+        minor_t dev_minor = 0;
+        // bytes allocated on disk, less than size for sparse files
+        size_t allocated_size = 0;
+    };
 
-            if (path.find("..") == 0) {
-                path = path.erase(0, 2);
-                return relative_path(path);
-            }
+    // a range of a sparse file which contains data
+    struct sparse_extent {
+        size_t offset = 0;
+        size_t size = 0;
+    };
 
-            return path;
-        };
+    // an entry read ahead by OS::read_ahead
+    struct read_ahead_request {
+        std::string source_path;
+        // std::nullopt if the entry does not exist or reading it failed
+        std::optional<file_metadata> metadata;
+        // positioned after data
+        file_descriptor infile;
+        std::vector<char> data;
 
-        static char file_type_to_char(const tarxx::file_type_flag& type)
+        void reset()
         {
-            switch (type) {
-                case tarxx::file_type_flag::SYMBOLIC_LINK:
-                    return 'l';
-                case tarxx::file_type_flag::CHARACTER_SPECIAL_FILE:
-                    return 'c';
-                case tarxx::file_type_flag::BLOCK_SPECIAL_FILE:
-                    return 'b';
-                case tarxx::file_type_flag::DIRECTORY:
-                    return 'd';
-                case tarxx::file_type_flag::FIFO:
-                    return 'p';
-                case tarxx::file_type_flag::REGULAR_FILE:
-                    [[fallthrough]];
-                case tarxx::file_type_flag::HARD_LINK:
-                    [[fallthrough]];
-                case tarxx::file_type_flag::CONTIGUOUS_FILE:
-                    [[fallthrough]];
-                default:
-                    return '-';
-            }
+            metadata.reset();
+            infile.close();
+            data.clear();
         }
+    };
 
-        [[nodiscard]] std::string permissions_str(const std::string& path) const
-        {
-            const auto permissions = mode(path) & static_cast<unsigned int>(permission_t::mask);
-            constexpr auto permission_bit_count = 9;
-            std::bitset<permission_bit_count> bits(permissions);
-            std::string str = "----------";
-            for (int i = 0; i < bits.size(); i++) {
-                const auto c =
-                        (i % 3 == 2) ? 'r'
-                                     : ((i % 3 == 1)
-                                                ? 'w'
-                                                : 'x');
-                if (static_cast<bool>(bits[i])) {
-                    str[i] = c;
-                }
-            }
-            std::reverse(str.begin(), str.end());
-            const auto type = type_flag(path);
-            str[0] = file_type_to_char(type);
-            return str;
-        }
+    // an entry met by OS::walk_directory, only valid during the callback
+    struct walk_entry {
+        // starts with the walked path
+        std::string_view path;
+        file_metadata metadata;
+        // the entry is name in dir_fd, which is AT_FDCWD for the walked path itself.
+        // name is null terminated.
+        int dir_fd = -1;
+        std::string_view name;
     };
 
-    struct OS {
-        [[nodiscard]] virtual uid_t user_id() const = 0;
-        [[nodiscard]] virtual gid_t group_id() const = 0;
-        [[nodiscard]] virtual std::string user_name(uid_t uid) = 0;
-        [[nodiscard]] virtual std::string group_name(gid_t gid) = 0;
-        [[nodiscard]] virtual uid_t file_owner(const std::string& path) const = 0;
-        [[nodiscard]] virtual gid_t file_group(const std::string& path) const = 0;
-        virtual void major_minor(const std::string& path, major_t& major, minor_t& minor) const = 0;
-        [[nodiscard]] virtual char path_separator() const = 0;
-        [[nodiscard]] virtual int truncate(const std::string& path, long length) const = 0;
-        [[nodiscard]] virtual std::optional<std::string> file_equivalent_present(const std::string& path, const std::unordered_map<ino_t, std::string>& stored_files) const = 0;
-        [[nodiscard]] virtual ino_t ino(const std::string& path) const = 0;
-        [[nodiscard]] virtual std::string realpath(const std::string& path) const = 0;
+    using walk_callback_t = std::function<void(const walk_entry&)>;
+
+    // decides after the metadata query whether the content of a request is read, the capacity
+    // of its data has to be reserved for metadata->size bytes then
+    using read_ahead_select_t = std::function<bool(read_ahead_request&)>;
+
+    // Appends to an output file at its current position, see OS::create_output_writer.
+    struct output_writer {
+        virtual ~output_writer() = default;
+        // data can be reused as soon as write returns
+        virtual void write(const char* data, size_t size) = 0;
+        // completes all writes, the file position is behind the written data afterwards.
+        // The file position may be changed by others until the next write.
+        virtual void sync() = 0;
     };
 
-    struct StdFilesytem : public Filesystem {
-        void iterateDirectory(const std::string& path, std::function<void(const std::string&)>&& cb) const override
+    // writes synchronously, one system call at a time
+    class posix_output_writer : public output_writer {
+    public:
+        explicit posix_output_writer(const int fd) : fd_(fd) {}
+
+        void write(const char* const data, const size_t size) override
         {
-            if (std::filesystem::is_directory(std::filesystem::path(path))) {
-                cb(path);
-                for (const auto& f : std::filesystem::recursive_directory_iterator(path)) {
-                    cb(f.path().string());
+            size_t written = 0;
+            while (written < size) {
+                const auto result = ::write(fd_, data + written, size - written);
+                if (result < 0) {
+                    if (errno == EINTR) continue;
+                    throw errno_exception();
                 }
-            } else {
-                cb(path);
+                written += result;
             }
         }
 
-        [[nodiscard]] file_type_flag type_flag(const std::string& path) const override
-        {
-            // check symlink first because according to std::filesystem
-            // symlinks are also regular files, even though cppreference states otherwise.
-            if (std::filesystem::is_symlink(path)) {
-                return file_type_flag::SYMBOLIC_LINK;
-            } else if (std::filesystem::is_regular_file(path)) {
-                return file_type_flag::REGULAR_FILE;
-            } else if (std::filesystem::is_directory(path)) {
-                return file_type_flag::DIRECTORY;
-            } else if (std::filesystem::is_block_file(path)) {
-                return file_type_flag::BLOCK_SPECIAL_FILE;
-            } else if (std::filesystem::is_character_file(path)) {
-                return file_type_flag::CHARACTER_SPECIAL_FILE;
-            } else if (std::filesystem::is_fifo(path)) {
-                return file_type_flag::FIFO;
-            } else {
-                throw std::invalid_argument("Path is of an unsupported type or already deleted");
-            }
-        }
+        void sync() override {}
 
-        [[nodiscard]] uint64_t file_size(const std::string& path) const override
+    private:
+        const int fd_;
+    };
+
+    // Heap buffer starting at a configurable alignment, the content is not preserved on reserve.
+    class aligned_buffer {
+    public:
+        void reserve(const std::size_t capacity, const std::size_t alignment = alignof(std::max_align_t))
         {
-            return std::filesystem::file_size(path);
+            if (alignment == 0 || (alignment & (alignment - 1)) != 0) throw std::invalid_argument("buffer alignment must be a power of two");
+            if (capacity <= capacity_ && reinterpret_cast<std::uintptr_t>(data_.get()) % alignment == 0) return;
+
+            // aligned_alloc requires a multiple of the alignment
+            const auto alignment_size = std::max(alignment, sizeof(void*));
+            const auto allocation_size = (capacity + alignment_size - 1) / alignment_size * alignment_size;
+            auto* const data = static_cast<char*>(std::aligned_alloc(alignment_size, allocation_size));
+            if (data == nullptr) throw std::bad_alloc();
+            data_.reset(data);
+            capacity_ = capacity;
         }
 
-        [[nodiscard]] mod_time_t mod_time(const std::string& path) const override
+        [[nodiscard]] char* data() const
         {
-            auto file_time = std::filesystem::last_write_time(path);
-            using clock = std::chrono::system_clock;
-            auto system_time = std::chrono::time_point_cast<clock::duration>(
-                    file_time - decltype(file_time)::clock::now() + clock::now());
-            const auto time_t = clock::to_time_t(system_time);
-            return time_t;
+            return data_.get();
         }
 
-        [[nodiscard]] mode_t mode(const std::string& path) const override
+        [[nodiscard]] std::size_t capacity() const
         {
-            const auto status = std::filesystem::status(path);
-            const auto perms = status.permissions();
-            using std_perms = std::filesystem::perms;
-            mode_t mode = 0;
+            return capacity_;
+        }
 
-            if ((perms & std_perms::owner_read) == std_perms::owner_read) {
-                mode |= static_cast<unsigned int>(permission_t::owner_read);
-            }
-            if ((perms & std_perms::owner_write) == std_perms::owner_write) {
-                mode |= static_cast<unsigned int>(permission_t::owner_write);
-            }
-            if ((perms & std_perms::owner_exec) == std_perms::owner_exec) {
-                mode |= static_cast<unsigned int>(permission_t::owner_exec);
-            }
-            if ((perms & std_perms::group_read) == std_perms::group_read) {
-                mode |= static_cast<unsigned int>(permission_t::group_read);
-            }
-            if ((perms & std_perms::group_write) == std_perms::group_write) {
-                mode |= static_cast<unsigned int>(permission_t::group_write);
-            }
-            if ((perms & std_perms::group_exec) == std_perms::group_exec) {
-                mode |= static_cast<unsigned int>(permission_t::group_exec);
-            }
-            if ((perms & std_perms::others_read) == std_perms::others_read) {
-                mode |= static_cast<unsigned int>(permission_t::others_read);
-            }
-            if ((perms & std_perms::others_write) == std_perms::others_write) {
-                mode |= static_cast<unsigned int>(permission_t::others_write);
-            }
-            if ((perms & std_perms::others_exec) == std_perms::others_exec) {
-                mode |= static_cast<unsigned int>(permission_t::others_exec);
+    private:
+        struct free_deleter {
+            void operator()(char* const data) const
+            {
+                std::free(data);
             }
+        };
 
-            return mode;
-        }
+        std::unique_ptr<char, free_deleter> data_;
+        std::size_t capacity_ = 0;
+    };
 
-        [[nodiscard]] std::string read_symlink(const std::string& path) const override
+    // buffer tarfile uses for an output_sink
+    struct output_buffer_options {
+        // small writes are collected in a buffer of this size before they are passed on
+        std::size_t size = 512 * BLOCK_SIZE;
+        // alignment of the start of the buffer, e.g. for descriptors opened with O_DIRECT
+        std::size_t alignment = alignof(std::max_align_t);
+    };
+
+    // Receives the archive of a tarfile, see tarfile(std::unique_ptr<output_sink>, ...). Sinks which
+    // can patch allow rewriting headers in place. For the others, tarfile holds back a member whose
+    // header is rewritten in memory until its size is known, which is only done for members added
+    // via add_file_streaming.
+    class output_sink {
+    public:
+        using buffer_options = output_buffer_options;
+
+        explicit output_sink(const buffer_options& options = {}) : options_(options)
         {
-            return std::filesystem::read_symlink(path);
+            if (options_.size == 0) throw std::invalid_argument("output buffer size must not be 0");
         }
 
-        [[nodiscard]] bool file_exists(const std::string& path) const override
-        {
-            return std::filesystem::exists(path);
-        };
-    };
+        // delete non required special member functions
+        output_sink(const output_sink& other) = delete;
+        output_sink& operator=(const output_sink& other) = delete;
+        output_sink(output_sink&& other) = delete;
+        output_sink& operator=(output_sink&& other) = delete;
 
-#if defined(__linux)
-    struct PosixOS : OS {
-        [[nodiscard]] std::string user_name(uid_t uid) override
+        virtual ~output_sink() = default;
+
+        // appends data, which can be reused as soon as write returns
+        virtual void write(const char* data, size_t size) = 0;
+
+        // appends all buffers in order, sinks should pass them on without joining them first
+        virtual void writev(const iovec* const buffers, const std::size_t count)
         {
-            return user_name_buffered(uid);
+            for (std::size_t i = 0; i < count; ++i) write(static_cast<const char*>(buffers[i].iov_base), buffers[i].iov_len);
         }
 
-        [[nodiscard]] std::string group_name(gid_t gid) override
+        [[nodiscard]] virtual bool can_patch() const
         {
-            return group_name_buffered(gid);
+            return false;
         }
 
-        [[nodiscard]] uid_t user_id() const override
+        // overwrites data written before, offset counts from the first byte passed to the sink
+        virtual void patch([[maybe_unused]] size_t offset, [[maybe_unused]] const char* data, [[maybe_unused]] size_t size)
         {
-            const auto pw = passwd();
-            return !pw.has_value() ? std::numeric_limits<uid_t>::max() : pw.value().pw_uid;
+            throw std::logic_error("the output sink can't patch written data");
         }
 
-        [[nodiscard]] gid_t group_id() const override
+        // called once the archive is complete
+        virtual void flush() {}
+
+        [[nodiscard]] const buffer_options& buffer() const
         {
-            const auto pw = passwd();
-            return !pw.has_value() ? std::numeric_limits<gid_t>::max() : pw.value().pw_gid;
+            return options_;
         }
 
-        void major_minor(const std::string& path, major_t& major, minor_t& minor) const override
+    private:
+        buffer_options options_;
+    };
+
+    // Writes to a file descriptor, which may also be a pipe or a socket. Only descriptors which
+    // can seek support patching, offsets are relative to the position on construction.
+    class fd_output_sink : public output_sink {
+    public:
+        // the descriptor is not closed by the sink
+        explicit fd_output_sink(const int fd, const buffer_options& options = {})
+            : output_sink(options), fd_(fd), start_offset_(::lseek(fd, 0, SEEK_CUR))
         {
-            const auto file_stat = get_stat(path);
-            major = major(file_stat.st_rdev);
-            minor = minor(file_stat.st_rdev);
         }
 
-        [[nodiscard]] uid_t file_owner(const std::string& path) const override
+        explicit fd_output_sink(file_descriptor fd, const buffer_options& options = {})
+            : fd_output_sink(fd.get(), options)
         {
-            const auto file_stat = get_stat(path);
-            return file_stat.st_uid;
-        };
+            owned_fd_ = std::move(fd);
+        }
 
-        [[nodiscard]] gid_t file_group(const std::string& path) const override
+        void write(const char* const data, const size_t size) override
         {
-            const auto file_stat = get_stat(path);
-            return file_stat.st_gid;
-        };
+            iovec buffer {const_cast<char*>(data), size};
+            writev(&buffer, 1);
+        }
 
-        [[nodiscard]] char path_separator() const override
+        void writev(const iovec* buffers, std::size_t count) override
         {
-            return '/';
+            // skips empty buffers, so a short write always ends inside of the first buffer
+            std::array<iovec, 64> pending {};
+            std::size_t pending_count = 0;
+            const auto submit = [&]() {
+                auto* current = pending.data();
+                auto remaining = pending_count;
+                while (remaining > 0) {
+                    const auto result = ::writev(fd_, current, static_cast<int>(remaining));
+                    if (result < 0) {
+                        if (errno == EINTR) continue;
+                        throw errno_exception();
+                    }
+                    auto written = static_cast<size_t>(result);
+                    while (remaining > 0 && written >= current->iov_len) {
+                        written -= current->iov_len;
+                        ++current;
+                        --remaining;
+                    }
+                    if (remaining > 0) {
+                        current->iov_base = static_cast<char*>(current->iov_base) + written;
+                        current->iov_len -= written;
+                    }
+                }
+                pending_count = 0;
+            };
+
+            for (; count > 0; ++buffers, --count) {
+                if (buffers->iov_len == 0) continue;
+                pending[pending_count++] = *buffers;
+                if (pending_count == pending.size()) submit();
+            }
+            submit();
         }
 
-        [[nodiscard]] int truncate(const std::string& path, const long length) const override
+        [[nodiscard]] bool can_patch() const override
         {
-            return ::truncate(path.c_str(), static_cast<off_t>(length));
+            return start_offset_ >= 0;
         }
 
-        [[nodiscard]] std::optional<std::string> file_equivalent_present(
-                const std::string& path,
-                const std::unordered_map<ino_t, std::string>& stored_files) const override
+        void patch(const size_t offset, const char* const data, const size_t size) override
         {
-            const auto stat_info = get_stat(path);
-            if (stat_info.st_nlink > 1) {
-                const auto iter = stored_files.find(stat_info.st_ino);
-                if (iter != stored_files.end()) {
-                    return iter->second;
+            if (!can_patch()) output_sink::patch(offset, data, size);
+            size_t patched = 0;
+            while (patched < size) {
+                const auto result = ::pwrite(fd_, data + patched, size - patched, start_offset_ + static_cast<off_t>(offset + patched));
+                if (result < 0) {
+                    if (errno == EINTR) continue;
+                    throw errno_exception();
                 }
+                patched += result;
             }
-
-            return std::nullopt;
         }
 
-        [[nodiscard]] ino_t ino(const std::string& path) const override
+    private:
+        const int fd_;
+        // negative if the descriptor can't seek
+        const off_t start_offset_;
+        file_descriptor owned_fd_;
+    };
+
+    // Writes into a buffer allocated up front, e.g. for an archive whose size is known.
+    // Writing more than fits throws std::length_error.
+    class memory_output_sink : public output_sink {
+    public:
+        // the memory has to outlive the sink
+        memory_output_sink(char* const data, const std::size_t capacity, const buffer_options& options = {})
+            : output_sink(options), data_(data), capacity_(capacity)
         {
-            return get_stat(path).st_ino;
         }
 
-        [[nodiscard]] std::string realpath(const std::string& path) const override
+        void write(const char* const data, const size_t size) override
         {
-            const auto real_path = ::realpath(path.c_str(), nullptr);
-            std::string string_value(real_path);
-            free(real_path);
-            return string_value;
+            if (size > capacity_ - size_) throw std::length_error("archive exceeds the memory of the output sink");
+            std::copy_n(data, size, data_ + size_);
+            size_ += size;
         }
 
-    protected:
-        static std::optional<struct ::passwd> passwd()
+        [[nodiscard]] bool can_patch() const override
         {
-            const auto uid = geteuid();
-            struct ::passwd pwd {};
-            struct ::passwd* result = nullptr;
-            // sysconf(_SC_GETPW_R_SIZE_MAX) should
-            // also return the maximum username length
-            // but this is broken on some systems.
-            name_buffer_t buffer {};
-            const auto pw_uid_result = getpwuid_r(uid,
-                                                  &pwd,
-                                                  buffer.data(),
-                                                  buffer.size(),
-                                                  &result);
-            throw_exception_getpwd_getgrgid_on_error(pw_uid_result);
+            return true;
+        }
 
-            if (result == nullptr) {
-                return std::nullopt;
-            }
-            return {pwd};
+        void patch(const size_t offset, const char* const data, const size_t size) override
+        {
+            if (offset > size_ || size > size_ - offset) throw std::out_of_range("patched data was not written before");
+            std::copy_n(data, size, data_ + offset);
         }
 
-        static struct stat get_stat(const std::string& path)
+        // bytes written so far
+        [[nodiscard]] std::size_t size() const
         {
-            struct stat file_stat {};
-            const auto stat_res = stat(path.c_str(), &file_stat);
-            if (stat_res != 0) throw errno_exception();
-            return file_stat;
+            return size_;
         }
 
     private:
-        std::unordered_map<gid_t, std::string> grpid_cache_;
-        std::unordered_map<uid_t, std::string> pwuid_cache_;
-
-        std::string group_name_buffered(gid_t gid)
-        {
-            const auto iter = grpid_cache_.find(gid);
-            if (iter != grpid_cache_.end()) {
-                return iter->second;
-            }
+        char* const data_;
+        const std::size_t capacity_;
+        std::size_t size_ = 0;
+    };
 
-            struct ::group grp {};
-            struct ::group* result = nullptr;
-            // sysconf(_SC_GETGR_R_SIZE_MAX) should
-            // also return the maximum group name length
-            // but this is broken on some systems.
-            name_buffer_t buffer {};
-            const auto gr_gid_result = getgrgid_r(gid,
-                                                  &grp,
-                                                  buffer.data(),
-                                                  buffer.size(),
-                                                  &result);
-            throw_exception_getpwd_getgrgid_on_error(gr_gid_result);
+    // Passes the archive on to a callback in the pieces written by tarfile, without copying them.
+    class callback_output_sink : public output_sink {
+    public:
+        using callback_t = std::function<void(const char* data, size_t size)>;
 
-            std::string name;
-            if (result == nullptr) {
-                name = std::to_string(gid);
-            } else {
-                name = grp.gr_name;
-            }
-            grpid_cache_.insert({gid, name});
-            return name;
+        explicit callback_output_sink(callback_t callback, const buffer_options& options = {})
+            : output_sink(options), callback_(std::move(callback))
+        {
+            if (callback_ == nullptr) throw std::invalid_argument("callback must not be empty");
         }
 
-        std::string user_name_buffered(uid_t uid)
+        void write(const char* const data, const size_t size) override
         {
-            const auto iter = pwuid_cache_.find(uid);
-            if (iter != pwuid_cache_.end()) {
-                return iter->second;
-            }
+            if (size > 0) callback_(data, size);
+        }
 
-            struct ::passwd pwd {};
-            struct ::passwd* result = nullptr;
-            // sysconf(_SC_GETPW_R_SIZE_MAX) should
-            // also return the maximum user name length
-            // but this is broken on some systems.
-            name_buffer_t buffer {};
-            const auto pw_uid_result = getpwuid_r(uid,
-                                                  &pwd,
-                                                  buffer.data(),
-                                                  buffer.size(),
-                                                  &result);
-            if (pw_uid_result != 0) {
-                throw errno_exception(pw_uid_result);
-            }
-            throw_exception_getpwd_getgrgid_on_error(pw_uid_result);
+    private:
+        callback_t callback_;
+    };
 
-            std::string name;
-            if (result == nullptr) {
-                name = std::to_string(uid);
-            } else {
-                name = pwd.pw_name;
+    // Formats tar header fields directly into a block without allocating.
+    struct header_encoder {
+        // writes value as zero padded octal number using all len characters,
+        // leading digits which don't fit are dropped
+        static constexpr void write_octal(block_t& block, unsigned long long value, const unsigned pos, unsigned len)
+        {
+            // two digits per lookup
+            for (; len >= 2; len -= 2) {
+                const auto digits = octal_pairs_[value & 077U];
+                block[pos + len - 1] = digits[1];
+                block[pos + len - 2] = digits[0];
+                value >>= 6U;
             }
-            pwuid_cache_.insert({uid, name});
-            return name;
+            if (len == 1) block[pos] = static_cast<char>('0' + (value & 07U));
         }
 
-        static void throw_exception_getpwd_getgrgid_on_error(const int error)
+        // copies at most len characters, the remaining field is not modified
+        static constexpr void write_string(block_t& block, const std::string_view str, const unsigned pos, const unsigned len)
         {
-            switch (error) {
-                // Errors below are either success
-                // or indicate that the entry was not found
-                case 0:
-                case ENOENT:
-                case ESRCH:
-                case EBADF:
-                case EPERM:
-                    return;
-                default:
-                    throw errno_exception(error);
-            }
+            const auto copylen = str.size() < len ? str.size() : len;
+            for (auto i = 0U; i < copylen; ++i) block[pos + i] = str[i];
         }
 
-        static constexpr int NAME_BUFFER_SIZE = 8192;
-        using name_buffer_t = std::array<char, NAME_BUFFER_SIZE>;
-    };
+        // sum of all bytes treated as unsigned
+        static unsigned checksum(const block_t& block)
+        {
+            // add the bytes in 16 bit lanes of 64 bit words, 64 words of
+            // at most 2 * 0xFF can't overflow a lane
+            constexpr uint64_t lane_mask = 0x00FF00FF00FF00FFULL;
+            uint64_t lanes = 0;
+            for (auto i = 0U; i < block.size(); i += sizeof(uint64_t)) {
+                uint64_t word = 0;
+                std::memcpy(&word, block.data() + i, sizeof(word));
+                lanes += (word & lane_mask) + ((word >> 8U) & lane_mask);
+            }
 
-#endif
+            constexpr uint64_t lane_bits = 0xFFFFU;
+            return static_cast<unsigned>((lanes & lane_bits) + ((lanes >> 16U) & lane_bits) + ((lanes >> 32U) & lane_bits) + ((lanes >> 48U) & lane_bits));
+        }
 
-#if defined(__linux)
-    struct Platform : public PosixOS, public StdFilesytem {
-        virtual ~Platform() = default;
+    private:
+        static constexpr std::array<std::array<char, 2>, 64> octal_pairs_ = []() {
+            std::array<std::array<char, 2>, 64> pairs {};
+            for (auto i = 0U; i < pairs.size(); ++i) {
+                pairs[i] = {static_cast<char>('0' + (i >> 3U)), static_cast<char>('0' + (i & 07U))};
+            }
+            return pairs;
+        }();
     };
-#else
-#    error "no support for targeted platform"
-#endif
 
+    // Streaming XXH64 hash, fingerprints the content of regular files for deduplication.
+    class xxh64 {
+    public:
+        explicit xxh64(const uint64_t seed = 0)
+            : seed_(seed), acc_ {seed + PRIME1 + PRIME2, seed + PRIME2, seed, seed - PRIME1}
+        {
+        }
 
-    struct tarfile {
-
-        enum class tar_type {
-            unix_v7,
-            ustar,
-        };
+        void update(const char* data, size_t size)
+        {
+            length_ += size;
+            if (buffered_ + size < STRIPE_SIZE) {
+                std::copy_n(data, size, buffer_.data() + buffered_);
+                buffered_ += size;
+                return;
+            }
 
-        using callback_t = std::function<void(const block_t&, size_t size)>;
+            if (buffered_ > 0) {
+                const auto fill = STRIPE_SIZE - buffered_;
+                std::copy_n(data, fill, buffer_.data() + buffered_);
+                consume_stripe(buffer_.data());
+                data += fill;
+                size -= fill;
+                buffered_ = 0;
+            }
 
-#ifdef WITH_COMPRESSION
-        enum class compression_mode : unsigned {
-            none,
-#    ifdef WITH_LZ4
-            lz4,
-#    endif
-        };
+            for (; size >= STRIPE_SIZE; data += STRIPE_SIZE, size -= STRIPE_SIZE) consume_stripe(data);
+            std::copy_n(data, size, buffer_.data());
+            buffered_ = size;
+        }
 
-        explicit tarfile(const std::string& filename,
-                         tar_type type = tar_type::unix_v7,
-                         std::unique_ptr<Platform> platform = std::make_unique<Platform>())
-            : tarfile(filename, compression_mode::none, type, std::move(platform))
+        [[nodiscard]] uint64_t digest() const
         {
+            uint64_t hash = seed_ + PRIME5;
+            if (length_ >= STRIPE_SIZE) {
+                hash = rotl(acc_[0], 1) + rotl(acc_[1], 7) + rotl(acc_[2], 12) + rotl(acc_[3], 18);
+                for (const auto acc : acc_) hash = (hash ^ round(0, acc)) * PRIME1 + PRIME4;
+            }
+            hash += length_;
+
+            size_t pos = 0;
+            for (; pos + sizeof(uint64_t) <= buffered_; pos += sizeof(uint64_t)) {
+                hash ^= round(0, read<uint64_t>(buffer_.data() + pos));
+                hash = rotl(hash, 27) * PRIME1 + PRIME4;
+            }
+            if (pos + sizeof(uint32_t) <= buffered_) {
+                hash ^= read<uint32_t>(buffer_.data() + pos) * PRIME1;
+                hash = rotl(hash, 23) * PRIME2 + PRIME3;
+                pos += sizeof(uint32_t);
+            }
+            for (; pos < buffered_; ++pos) {
+                hash ^= static_cast<unsigned char>(buffer_[pos]) * PRIME5;
+                hash = rotl(hash, 11) * PRIME1;
+            }
+
+            hash ^= hash >> 33U;
+            hash *= PRIME2;
+            hash ^= hash >> 29U;
+            hash *= PRIME3;
+            hash ^= hash >> 32U;
+            return hash;
         }
 
-        explicit tarfile(callback_t&& callback,
-                         tar_type type = tar_type::unix_v7,
-                         std::unique_ptr<Platform> platform = std::make_unique<Platform>())
-            : tarfile(std::move(callback), compression_mode::none, type, std::move(platform))
+        // number of bytes hashed so far
+        [[nodiscard]] uint64_t length() const
         {
+            return length_;
         }
 
-        explicit tarfile(const std::string& filename,
-                         compression_mode compression = compression_mode::none,
-                         tar_type type = tar_type::unix_v7,
-                         std::unique_ptr<Platform> platform = std::make_unique<Platform>())
-            : file_(filename, std::ios::out | std::ios::binary),
-              file_name_(filename),
-              file_buffer_used_(0),
-              callback_(nullptr), mode_(output_mode::file_output),
-              compression_(compression),
-              type_(type), stream_file_header_pos_(-1), stream_block_ {0}, stream_block_used_(0),
-              platform_(std::move(platform))
+    private:
+        static constexpr uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+        static constexpr uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+        static constexpr uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+        static constexpr uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+        static constexpr uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+        static constexpr size_t STRIPE_SIZE = 32;
+
+        static constexpr uint64_t rotl(const uint64_t value, const unsigned bits)
         {
-#    ifdef WITH_LZ4
-            init_lz4();
-#    else
-            file_buffer_.reserve(file_buffer_default_size_);
-#    endif
+            return (value << bits) | (value >> (64U - bits));
         }
 
-        explicit tarfile(callback_t&& callback,
-                         compression_mode compression = compression_mode::none,
-                         tar_type type = tar_type::unix_v7,
-                         std::unique_ptr<Platform> platform = std::make_unique<Platform>())
-            : file_(), file_name_(), file_buffer_used_(0), callback_(std::move(callback)), mode_(output_mode::stream_output),
-              compression_(compression),
-              type_(type), stream_file_header_pos_(-1), stream_block_ {0}, stream_block_used_(0),
-              platform_(std::move(platform))
+        static constexpr uint64_t round(const uint64_t acc, const uint64_t input)
         {
-#    ifdef WITH_LZ4
-            init_lz4();
-#    else
-            file_buffer_.reserve(file_buffer_default_size_);
-#    endif
+            return rotl(acc + input * PRIME2, 31) * PRIME1;
         }
 
-#else
-        explicit tarfile(const std::string& filename, tar_type type = tar_type::unix_v7, std::unique_ptr<Platform> platform = std::make_unique<Platform>())
-            : file_(filename, std::ios::out | std::ios::binary), file_name_(filename), file_buffer_used_(0), callback_(nullptr), mode_(output_mode::file_output), type_(type), stream_block_ {0}, stream_file_header_pos_(-1), stream_block_used_(0), platform_(std::move(platform))
+        // little endian, as all supported platforms
+        template<typename T>
+        static uint64_t read(const char* const data)
         {
-            file_buffer_.reserve(file_buffer_default_size_);
+            T value = 0;
+            std::memcpy(&value, data, sizeof(value));
+            return value;
         }
 
-        explicit tarfile(callback_t&& callback,
-                         tar_type type = tar_type::unix_v7, 
-                         std::unique_ptr<Platform> platform = std::make_unique<Platform>())
-            : file_(), file_name_(), file_buffer_used_(0), callback_(std::move(callback)), mode_(output_mode::stream_output),
-              type_(type), stream_file_header_pos_(-1), stream_block_ {0}, stream_block_used_(0), platform_(std::move(platform))
+        void consume_stripe(const char* const data)
         {
-            file_buffer_.reserve(file_buffer_default_size_);
+            for (auto i = 0U; i < acc_.size(); ++i) acc_[i] = round(acc_[i], read<uint64_t>(data + i * sizeof(uint64_t)));
         }
-#endif
 
-        // delete the copy constructor and copy assignment, as multiple instances to the same file are not supported
-        tarfile(const tarfile&) = delete;
-        tarfile(tarfile&&) = delete;
-        tarfile& operator=(const tarfile& other) = delete;
-        tarfile& operator=(const tarfile&& other) = delete;
+        uint64_t seed_;
+        std::array<uint64_t, 4> acc_;
+        std::array<char, STRIPE_SIZE> buffer_ {};
+        size_t buffered_ = 0;
+        uint64_t length_ = 0;
+    };
 
-        ~tarfile()
+    // Streaming SHA-256 (FIPS 180-4). On x86-64 blocks are processed with the SHA extensions
+    // if the processor supports them, which is several times faster than the portable code.
+    class sha256 {
+    public:
+        static constexpr size_t DIGEST_SIZE = 32;
+
+        void update(const char* data, size_t size)
         {
-            close();
+            length_ += size;
+            if (buffered_ > 0) {
+                const auto fill = std::min(size, BLOCK_LEN - buffered_);
+                std::copy_n(data, fill, buffer_.data() + buffered_);
+                buffered_ += fill;
+                data += fill;
+                size -= fill;
+                if (buffered_ < BLOCK_LEN) return;
+                compress(buffer_.data(), 1);
+                buffered_ = 0;
+            }
+
+            compress(reinterpret_cast<const unsigned char*>(data), size / BLOCK_LEN);
+            std::copy_n(data + size / BLOCK_LEN * BLOCK_LEN, size % BLOCK_LEN, buffer_.data());
+            buffered_ = size % BLOCK_LEN;
         }
 
-        bool is_open()
+        // pads the message, no data may be added afterwards
+        [[nodiscard]] std::array<unsigned char, DIGEST_SIZE> digest()
         {
-            switch (mode_) {
-                case output_mode::file_output:
-                    return file_.is_open();
-                case output_mode::stream_output:
-                    return callback_ != nullptr;
-            }
-            throw std::logic_error("unsupported output mode");
+            const auto bit_length = length_ * 8U;
+            static constexpr std::array<char, BLOCK_LEN> padding {static_cast<char>(0x80)};
+            update(padding.data(), 1 + (2 * BLOCK_LEN - 1 - sizeof(bit_length) - buffered_) % BLOCK_LEN);
+            std::array<char, sizeof(bit_length)> length_field {};
+            for (auto i = 0U; i < length_field.size(); ++i) length_field[i] = static_cast<char>(bit_length >> (56U - 8U * i));
+            update(length_field.data(), length_field.size());
+
+            std::array<unsigned char, DIGEST_SIZE> digest {};
+            for (auto i = 0U; i < digest.size(); ++i) digest[i] = static_cast<unsigned char>(state_[i / 4] >> (24U - 8U * (i % 4)));
+            return digest;
         }
 
-        void close()
+    private:
+        static constexpr size_t BLOCK_LEN = 64;
+
+        static constexpr std::array<uint32_t, 64> K = {
+                0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+                0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+                0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+                0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+                0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+                0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+                0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+                0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+        void compress(const unsigned char* const blocks, const size_t count)
         {
-            try {
-                if (is_open()) {
-                    finish();
-                    file_close();
-                    callback_ = nullptr;
-                }
-            } catch (const std::exception& ex) {
-                // ignore exception in destructor, as they cannot be caught.
+            if (count == 0) return;
+#ifdef TARXX_SHA_EXTENSIONS
+            if (has_sha_extensions()) {
+                compress_sha_extensions(state_.data(), blocks, count);
+                return;
             }
+#endif
+            compress_portable(blocks, count);
         }
 
-        void add_from_filesystem_recursive(const std::string& path, bool read_symlinks = false)
+        static constexpr uint32_t rotr(const uint32_t value, const unsigned bits)
         {
-            if (platform_->type_flag(path) != file_type_flag::DIRECTORY) {
-                add_from_filesystem(path, read_symlinks);
-            } else {
-                platform_->iterateDirectory(path, [&](const std::string& callback_path) {
-                    add_from_filesystem(callback_path, read_symlinks);
-                });
-            }
+            return (value >> bits) | (value << (32U - bits));
         }
 
-        void add_from_filesystem_recursive(const std::string& source_path, std::string target_path, bool read_symlinks = false)
+        void compress_portable(const unsigned char* blocks, size_t count)
         {
-            if (target_path.find("../") != std::string::npos) throw std::invalid_argument("target path can't contain ../");
-            if (target_path.find("/..") != std::string::npos) throw std::invalid_argument("target path can't contain /..");
-            if (target_path == "..") throw std::invalid_argument("target path can't be ..");
-            if (target_path.empty()) throw std::invalid_argument("target path cannot be empty");
-            if (target_path.rfind('/') == target_path.size() - 1) target_path = target_path.substr(0, target_path.size() - 1);
+            std::array<uint32_t, 64> w {};
+            for (; count > 0; --count, blocks += BLOCK_LEN) {
+                for (auto i = 0U; i < 16; ++i) {
+                    w[i] = static_cast<uint32_t>(blocks[4 * i]) << 24U | static_cast<uint32_t>(blocks[4 * i + 1]) << 16U |
+                           static_cast<uint32_t>(blocks[4 * i + 2]) << 8U | static_cast<uint32_t>(blocks[4 * i + 3]);
+                }
+                for (auto i = 16U; i < w.size(); ++i) {
+                    const auto s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3U);
+                    const auto s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10U);
+                    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+                }
 
-            if (platform_->type_flag(source_path) != file_type_flag::DIRECTORY) {
-                add_from_filesystem(source_path, target_path, read_symlinks);
-            } else {
-                platform_->iterateDirectory(source_path, [&](const std::string& callback_path) {
-                    auto target = callback_path;
-                    target.replace(target.begin(), target.begin() + source_path.size(), target_path);
-                    add_from_filesystem(callback_path, target, read_symlinks);
-                });
+                auto [a, b, c, d, e, f, g, h] = state_;
+                for (auto i = 0U; i < w.size(); ++i) {
+                    const auto t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+                    const auto t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                    h = g;
+                    g = f;
+                    f = e;
+                    e = d + t1;
+                    d = c;
+                    c = b;
+                    b = a;
+                    a = t1 + t2;
+                }
+                const std::array<uint32_t, 8> result {a, b, c, d, e, f, g, h};
+                for (auto i = 0U; i < state_.size(); ++i) state_[i] += result[i];
             }
         }
 
-        void add_from_filesystem(const std::string& filename, bool read_symlinks = false)
+#ifdef TARXX_SHA_EXTENSIONS
+        static bool has_sha_extensions()
         {
-            check_state_and_flush();
-            read_from_filesystem_write_to_tar(filename, filename, read_symlinks);
+            static const bool supported = []() {
+                unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+                if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0 || (ecx & bit_SSE4_1) == 0) return false;
+                return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) != 0 && (ebx & bit_SHA) != 0;
+            }();
+            return supported;
         }
 
-        void add_from_filesystem(const std::string& source_path, const std::string& target_path, bool read_symlinks = false)
+        // the state is kept as ABEF and CDGH in two registers, the layout sha256rnds2 works on
+        __attribute__((target("sha,sse4.1"))) static void compress_sha_extensions(uint32_t* const state, const unsigned char* blocks, size_t count)
         {
-            if (target_path.find("../") != std::string::npos) throw std::invalid_argument("target path can't contain ../");
-            if (target_path.find("/..") != std::string::npos) throw std::invalid_argument("target path can't contain /..");
-            if (target_path == "..") throw std::invalid_argument("target path can't be ..");
-            if (target_path.empty()) throw std::invalid_argument("target path cannot be empty");
-
-            if (platform_->type_flag(source_path) != file_type_flag::DIRECTORY && target_path.rfind('/') == target_path.size() - 1) {
-                throw std::invalid_argument("target path can't end with / for non directories");
+            const auto byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+            const auto dcba = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0xB1);
+            const auto hgfe = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4)), 0x1B);
+            auto abef = _mm_alignr_epi8(dcba, hgfe, 8);
+            auto cdgh = _mm_blend_epi16(hgfe, dcba, 0xF0);
+
+            for (; count > 0; --count, blocks += BLOCK_LEN) {
+                const auto abef_before = abef;
+                const auto cdgh_before = cdgh;
+                // the message schedule of the last 16 rounds, no std::array as it drops the attributes of __m128i
+                __m128i w[4] {};
+                for (auto i = 0U; i < 16; ++i) {
+                    if (i < 4) {
+                        w[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + 16 * i)), byte_swap);
+                    } else {
+                        const auto sum = _mm_add_epi32(_mm_sha256msg1_epu32(w[i % 4], w[(i + 1) % 4]), _mm_alignr_epi8(w[(i + 3) % 4], w[(i + 2) % 4], 4));
+                        w[i % 4] = _mm_sha256msg2_epu32(sum, w[(i + 3) % 4]);
+                    }
+                    auto message = _mm_add_epi32(w[i % 4], _mm_loadu_si128(reinterpret_cast<const __m128i*>(K.data() + 4 * i)));
+                    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, message);
+                    message = _mm_shuffle_epi32(message, 0x0E);
+                    abef = _mm_sha256rnds2_epu32(abef, cdgh, message);
+                }
+                abef = _mm_add_epi32(abef, abef_before);
+                cdgh = _mm_add_epi32(cdgh, cdgh_before);
             }
 
-            check_state_and_flush();
-            read_from_filesystem_write_to_tar(source_path, target_path, read_symlinks);
+            const auto feba = _mm_shuffle_epi32(abef, 0x1B);
+            const auto dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_blend_epi16(feba, dchg, 0xF0));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), _mm_alignr_epi8(dchg, feba, 8));
         }
+#endif
 
-        void add_symlink(const std::string& file_name, const std::string& link_name, uid_t uid, gid_t gid, mod_time_t time)
-        {
-            check_state_and_flush();
-            write_header(link_name, static_cast<mode_t>(tarxx::permission_t::all_all), uid, gid, 0U, time,
+        std::array<uint32_t, 8> state_ {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        std::array<unsigned char, BLOCK_LEN> buffer_ {};
+        size_t buffered_ = 0;
+        uint64_t length_ = 0;
+    };
+
+    enum class checksum_algorithm {
+        xxh64,
+        sha256,
+    };
+
+    // Digest of the content of a member, written as lower case hex string in
+    // the byte order of the reference implementation, as xxhsum and sha256sum do.
+    class content_digest {
+    public:
+        explicit content_digest(const checksum_algorithm algorithm) : algorithm_(algorithm) {}
+
+        void update(const char* const data, const size_t size)
+        {
+            if (algorithm_ == checksum_algorithm::xxh64) {
+                xxh64_.update(data, size);
+            } else {
+                sha256_.update(data, size);
+            }
+        }
+
+        void update_zeroes(size_t size)
+        {
+            static const std::array<char, 4096> zeroes {};
+            for (; size > zeroes.size(); size -= zeroes.size()) update(zeroes.data(), zeroes.size());
+            update(zeroes.data(), size);
+        }
+
+        // finishes the digest, no data may be added afterwards
+        [[nodiscard]] std::string hex_digest()
+        {
+            if (algorithm_ == checksum_algorithm::xxh64) {
+                const auto digest = xxh64_.digest();
+                std::array<unsigned char, sizeof(digest)> bytes {};
+                for (auto i = 0U; i < bytes.size(); ++i) bytes[i] = static_cast<unsigned char>(digest >> (56U - 8U * i));
+                return to_hex(bytes.data(), bytes.size());
+            }
+            const auto digest = sha256_.digest();
+            return to_hex(digest.data(), digest.size());
+        }
+
+    private:
+        static std::string to_hex(const unsigned char* const data, const size_t size)
+        {
+            static constexpr std::string_view digits = "0123456789abcdef";
+            std::string hex;
+            hex.reserve(2 * size);
+            for (auto i = 0U; i < size; ++i) {
+                hex.push_back(digits[data[i] >> 4U]);
+                hex.push_back(digits[data[i] & 0xFU]);
+            }
+            return hex;
+        }
+
+        checksum_algorithm algorithm_;
+        xxh64 xxh64_;
+        sha256 sha256_;
+    };
+
+    struct member_checksum {
+        std::string name;
+        std::string digest;
+    };
+
+    // Append only storage for archived paths, stored paths stay valid as long as the arena.
+    class path_arena {
+    public:
+        std::string_view store(const std::string_view path)
+        {
+            if (chunks_.empty() || chunk_used_ + path.size() > chunk_size_) {
+                chunk_size_ = std::max(CHUNK_SIZE, path.size());
+                chunks_.emplace_back(new char[chunk_size_]);
+                chunk_used_ = 0;
+            }
+            auto* const data = chunks_.back().get() + chunk_used_;
+            std::copy_n(path.data(), path.size(), data);
+            chunk_used_ += path.size();
+            return {data, path.size()};
+        }
+
+    private:
+        static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+        std::vector<std::unique_ptr<char[]>> chunks_;
+        size_t chunk_size_ = 0;
+        size_t chunk_used_ = 0;
+    };
+
+    // Open addressing hash table with linear probing, it grows at a load factor of 3/4.
+    // A default constructed Entry marks a free slot, Entry::hash() is used for rehashing.
+    template<typename Entry>
+    class probing_table {
+    public:
+        template<typename Matches>
+        [[nodiscard]] const Entry* find(const uint64_t hash, const Matches& matches) const
+        {
+            if (entries_.empty()) return nullptr;
+            const auto mask = entries_.size() - 1;
+            for (auto pos = hash & mask; !entries_[pos].is_free(); pos = (pos + 1) & mask) {
+                if (matches(entries_[pos])) return &entries_[pos];
+            }
+            return nullptr;
+        }
+
+        // the entry must not be contained yet
+        void insert(const Entry& entry)
+        {
+            if ((size_ + 1) * 4 > entries_.size() * 3) grow();
+            place(entries_, entry);
+            ++size_;
+        }
+
+        [[nodiscard]] bool empty() const
+        {
+            return size_ == 0;
+        }
+
+    private:
+        void grow()
+        {
+            std::vector<Entry> entries(std::max<size_t>(16, entries_.size() * 2));
+            for (const auto& entry : entries_) {
+                if (!entry.is_free()) place(entries, entry);
+            }
+            entries_ = std::move(entries);
+        }
+
+        static void place(std::vector<Entry>& entries, const Entry& entry)
+        {
+            const auto mask = entries.size() - 1;
+            auto pos = entry.hash() & mask;
+            while (!entries[pos].is_free()) pos = (pos + 1) & mask;
+            entries[pos] = entry;
+        }
+
+        std::vector<Entry> entries_;
+        size_t size_ = 0;
+    };
+
+    // Names of archived entries, the names are kept in an arena.
+    // Costs the name length plus 32 to 64 bytes per name (24 byte slots at a load factor between 3/8 and 3/4).
+    class name_set {
+    public:
+        explicit name_set(path_arena& arena) : arena_(arena) {}
+
+        // the stored copy of name, std::nullopt if it's not contained
+        [[nodiscard]] std::optional<std::string_view> find(const std::string_view name) const
+        {
+            return find(name, hash(name));
+        }
+
+        void insert(const std::string_view name)
+        {
+            const auto name_hash = hash(name);
+            if (find(name, name_hash).has_value()) return;
+            const auto stored = arena_.store(name);
+            table_.insert({name_hash, stored.data(), stored.size()});
+        }
+
+        [[nodiscard]] bool empty() const
+        {
+            return table_.empty();
+        }
+
+    private:
+        struct entry {
+            uint64_t name_hash = 0;
+            const char* data = nullptr;
+            size_t size = 0;
+
+            [[nodiscard]] bool is_free() const
+            {
+                return data == nullptr;
+            }
+
+            [[nodiscard]] uint64_t hash() const
+            {
+                return name_hash;
+            }
+        };
+
+        [[nodiscard]] std::optional<std::string_view> find(const std::string_view name, const uint64_t name_hash) const
+        {
+            const auto* const found = table_.find(name_hash, [&](const entry& candidate) {
+                return candidate.name_hash == name_hash && std::string_view(candidate.data, candidate.size) == name;
+            });
+            if (found == nullptr) return std::nullopt;
+            return std::string_view(found->data, found->size);
+        }
+
+        static uint64_t hash(const std::string_view name)
+        {
+            xxh64 hash;
+            hash.update(name.data(), name.size());
+            return hash.digest();
+        }
+
+        path_arena& arena_;
+        probing_table<entry> table_;
+    };
+
+    // Paths of archived files with more than one link, keyed by device and inode.
+    // Files with a single link can't be met again and shouldn't be added.
+    // Costs the path length plus 43 to 86 bytes per file (32 byte slots at a load factor between 3/8 and 3/4).
+    class hardlink_table {
+    public:
+        explicit hardlink_table(path_arena& arena) : arena_(arena) {}
+
+        [[nodiscard]] std::optional<std::string_view> find(const uint64_t dev, const uint64_t ino) const
+        {
+            const auto* const found = table_.find(entry::hash(dev, ino), [&](const entry& candidate) {
+                return candidate.dev == dev && candidate.ino == ino;
+            });
+            if (found == nullptr) return std::nullopt;
+            return std::string_view(found->path, found->size);
+        }
+
+        void insert(const uint64_t dev, const uint64_t ino, const std::string_view path)
+        {
+            if (find(dev, ino).has_value()) return;
+            const auto stored = arena_.store(path);
+            table_.insert({dev, ino, stored.data(), stored.size()});
+        }
+
+    private:
+        struct entry {
+            uint64_t dev = 0;
+            uint64_t ino = 0;
+            const char* path = nullptr;
+            size_t size = 0;
+
+            [[nodiscard]] bool is_free() const
+            {
+                return path == nullptr;
+            }
+
+            [[nodiscard]] uint64_t hash() const
+            {
+                return hash(dev, ino);
+            }
+
+            // splitmix64 finalizer, inode numbers are often sequential
+            static uint64_t hash(const uint64_t dev, const uint64_t ino)
+            {
+                auto value = ino ^ (dev * 0x9E3779B97F4A7C15ULL);
+                value = (value ^ (value >> 30U)) * 0xBF58476D1CE4E5B9ULL;
+                value = (value ^ (value >> 27U)) * 0x94D049BB133111EBULL;
+                return value ^ (value >> 31U);
+            }
+        };
+
+        path_arena& arena_;
+        probing_table<entry> table_;
+    };
+
+    struct Filesystem {
+        virtual void iterateDirectory(const std::string& path, std::function<void(const std::string&)>&& cb) const = 0;
+
+        [[nodiscard]] virtual file_type_flag type_flag(const std::string& path) const = 0;
+        [[nodiscard]] virtual size_t file_size(const std::string& path) const = 0;
+        [[nodiscard]] virtual mod_time_t mod_time(const std::string& path) const = 0;
+        [[nodiscard]] virtual mode_t mode(const std::string& path) const = 0;
+        [[nodiscard]] virtual std::string read_symlink(const std::string& path) const = 0;
+        [[nodiscard]] virtual bool file_exists(const std::string& path) const = 0;
+        // the result views full_path, which has to outlive it
+        [[nodiscard]] virtual std::string_view relative_path(const std::string_view full_path) const
+        {
+            // strip leading separators and parent references until the path is relative
+            std::string_view path = full_path;
+            while (true) {
+                if (path.empty()) return "";
+                if (path == "../") return "./";
+                if (path == "/") throw std::invalid_argument("can't tar the rootfs");
+                if (path.front() == '/') {
+                    path.remove_prefix(1);
+                } else if (path.compare(0, 2, "..") == 0) {
+                    path.remove_prefix(2);
+                } else {
+                    return path;
+                }
+            }
+        };
+
+        static char file_type_to_char(const tarxx::file_type_flag& type)
+        {
+            switch (type) {
+                case tarxx::file_type_flag::SYMBOLIC_LINK:
+                    return 'l';
+                case tarxx::file_type_flag::CHARACTER_SPECIAL_FILE:
+                    return 'c';
+                case tarxx::file_type_flag::BLOCK_SPECIAL_FILE:
+                    return 'b';
+                case tarxx::file_type_flag::DIRECTORY:
+                    return 'd';
+                case tarxx::file_type_flag::FIFO:
+                    return 'p';
+                case tarxx::file_type_flag::REGULAR_FILE:
+                    [[fallthrough]];
+                case tarxx::file_type_flag::HARD_LINK:
+                    [[fallthrough]];
+                case tarxx::file_type_flag::CONTIGUOUS_FILE:
+                    [[fallthrough]];
+                default:
+                    return '-';
+            }
+        }
+
+        [[nodiscard]] std::string permissions_str(const std::string& path) const
+        {
+            const auto permissions = mode(path) & static_cast<unsigned int>(permission_t::mask);
+            constexpr auto permission_bit_count = 9;
+            std::bitset<permission_bit_count> bits(permissions);
+            std::string str = "----------";
+            for (int i = 0; i < bits.size(); i++) {
+                const auto c =
+                        (i % 3 == 2) ? 'r'
+                                     : ((i % 3 == 1)
+                                                ? 'w'
+                                                : 'x');
+                if (static_cast<bool>(bits[i])) {
+                    str[i] = c;
+                }
+            }
+            std::reverse(str.begin(), str.end());
+            const auto type = type_flag(path);
+            str[0] = file_type_to_char(type);
+            return str;
+        }
+    };
+
+    // hints about the future use of file data, passed to OS::advise
+    enum class access_advice {
+        sequential,
+        will_need,
+        dont_need,
+    };
+
+    struct metadata_cache_options {
+        // user and group names are looked up again once they are older
+        std::chrono::steady_clock::duration name_ttl = std::chrono::minutes(10);
+        // Metadata of paths is cached for this long, 0 disables caching it. Files changed within that
+        // time are archived with their previous metadata, so it's only useful for repeated jobs on
+        // trees that don't change in between.
+        std::chrono::steady_clock::duration metadata_ttl = std::chrono::seconds(0);
+        // once reached, expired metadata is dropped and all of it if none has expired
+        std::size_t max_metadata_entries = 100000;
+    };
+
+    // Thread safe cache of user and group names, the ids of passwd entries and optionally of the
+    // metadata of paths. It's meant to be shared by the Platforms of many tarfiles, so short lived
+    // tarfiles don't repeat the lookups of the name service. Entries expire after their time to
+    // live, failed lookups aren't cached.
+    class metadata_cache {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        // user and group id of a passwd entry
+        struct account_ids {
+            uid_t uid;
+            gid_t gid;
+        };
+
+        explicit metadata_cache(const metadata_cache_options& options = {}) : options_(options) {}
+
+        // returns the cached name or the result of lookup(uid), which is called without holding the lock.
+        // lookup returns std::nullopt for unknown ids, which are looked up again next time.
+        template<typename Lookup>
+        std::optional<std::string> user_name(const uid_t uid, Lookup&& lookup)
+        {
+            return find_or_lookup(user_names_, uid, std::forward<Lookup>(lookup));
+        }
+
+        template<typename Lookup>
+        std::optional<std::string> group_name(const gid_t gid, Lookup&& lookup)
+        {
+            return find_or_lookup(group_names_, gid, std::forward<Lookup>(lookup));
+        }
+
+        // ids of the passwd entry of uid, expiring like names
+        template<typename Lookup>
+        std::optional<account_ids> passwd_ids(const uid_t uid, Lookup&& lookup)
+        {
+            return find_or_lookup(passwd_ids_, uid, std::forward<Lookup>(lookup));
+        }
+
+        [[nodiscard]] std::optional<file_metadata> find_metadata(const std::string& path, const bool follow_symlinks) const
+        {
+            if (options_.metadata_ttl == clock::duration::zero()) return std::nullopt;
+            std::lock_guard lock(mutex_);
+            const auto& entries = metadata_[follow_symlinks ? 1 : 0];
+            const auto iter = entries.find(path);
+            if (iter == entries.end() || iter->second.expires <= clock::now()) return std::nullopt;
+            return iter->second.value;
+        }
+
+        void store_metadata(const std::string& path, const bool follow_symlinks, const file_metadata& metadata)
+        {
+            if (options_.metadata_ttl == clock::duration::zero()) return;
+            const auto now = clock::now();
+            std::lock_guard lock(mutex_);
+            if (metadata_[0].size() + metadata_[1].size() >= options_.max_metadata_entries) drop_expired_metadata(now);
+            metadata_[follow_symlinks ? 1 : 0][path] = {metadata, now + options_.metadata_ttl};
+        }
+
+        void clear()
+        {
+            std::lock_guard lock(mutex_);
+            user_names_.clear();
+            group_names_.clear();
+            passwd_ids_.clear();
+            for (auto& entries : metadata_) entries.clear();
+        }
+
+    private:
+        template<typename T>
+        struct entry {
+            T value;
+            clock::time_point expires;
+        };
+
+        template<typename Id, typename T, typename Lookup>
+        std::optional<T> find_or_lookup(std::unordered_map<Id, entry<T>>& entries, const Id id, Lookup&& lookup)
+        {
+            {
+                std::lock_guard lock(mutex_);
+                const auto iter = entries.find(id);
+                if (iter != entries.end() && iter->second.expires > clock::now()) return iter->second.value;
+            }
+
+            std::optional<T> looked_up = lookup(id);
+            if (!looked_up.has_value()) return std::nullopt;
+            std::lock_guard lock(mutex_);
+            entries[id] = {looked_up.value(), clock::now() + options_.name_ttl};
+            return looked_up;
+        }
+
+        void drop_expired_metadata(const clock::time_point now)
+        {
+            for (auto& entries : metadata_) {
+                for (auto iter = entries.begin(); iter != entries.end();) {
+                    iter = iter->second.expires <= now ? entries.erase(iter) : std::next(iter);
+                }
+            }
+            if (metadata_[0].size() + metadata_[1].size() >= options_.max_metadata_entries) {
+                for (auto& entries : metadata_) entries.clear();
+            }
+        }
+
+        const metadata_cache_options options_;
+        mutable std::mutex mutex_;
+        std::unordered_map<uid_t, entry<std::string>> user_names_;
+        std::unordered_map<gid_t, entry<std::string>> group_names_;
+        std::unordered_map<uid_t, entry<account_ids>> passwd_ids_;
+        // without and with following symlinks
+        std::array<std::unordered_map<std::string, entry<file_metadata>>, 2> metadata_;
+    };
+
+    struct OS {
+        [[nodiscard]] virtual uid_t user_id() const = 0;
+        [[nodiscard]] virtual gid_t group_id() const = 0;
+        [[nodiscard]] virtual const std::string& user_name(uid_t uid) = 0;
+        [[nodiscard]] virtual const std::string& group_name(gid_t gid) = 0;
+        [[nodiscard]] virtual uid_t file_owner(const std::string& path) const = 0;
+        [[nodiscard]] virtual gid_t file_group(const std::string& path) const = 0;
+        virtual void major_minor(const std::string& path, major_t& major, minor_t& minor) const = 0;
+        [[nodiscard]] virtual char path_separator() const = 0;
+        [[nodiscard]] virtual int truncate(const std::string& path, long length) const = 0;
+        [[nodiscard]] virtual std::optional<std::string> file_equivalent_present(const std::string& path, const hardlink_table& stored_files) const = 0;
+        [[nodiscard]] virtual std::optional<std::string> file_equivalent_present(const file_metadata& metadata, const hardlink_table& stored_files) const = 0;
+        // returns std::nullopt if the path does not exist
+        [[nodiscard]] virtual std::optional<file_metadata> metadata(const std::string& path, bool follow_symlinks) const = 0;
+        [[nodiscard]] virtual ino_t ino(const std::string& path) const = 0;
+        [[nodiscard]] virtual std::string realpath(const std::string& path) const = 0;
+        [[nodiscard]] virtual size_t copy_file_data(int in_fd, int out_fd, size_t max_size) const = 0;
+        // Calls back for path and everything below it, directories before their content, without following symlinks.
+        // The entries of each directory are reported in inode order if set, in directory order otherwise.
+        // Entries deleted during the walk are left out.
+        virtual void walk_directory(const std::string& path, bool inode_order, const walk_callback_t& callback) const = 0;
+        // Queries the metadata of all requests and reads the content of the selected ones.
+        // Failures are not reported, the request is reset instead.
+        virtual void read_ahead(const std::vector<read_ahead_request*>& requests, const read_ahead_select_t& select) const = 0;
+        [[nodiscard]] virtual std::unique_ptr<output_writer> create_output_writer(int fd) const = 0;
+        // a length of 0 extends the range to the end of the file, failures are ignored
+        virtual void advise(int fd, off_t offset, off_t length, access_advice advice) const = 0;
+        // starts writing back dirty pages of the range and waits for them if wait is set, failures are ignored
+        virtual void write_back(int fd, off_t offset, off_t length, bool wait) const = 0;
+        // reserves disk space for the first length bytes without changing the file size, failures are ignored
+        virtual void preallocate(int fd, off_t length) const = 0;
+        // ranges of the first size bytes containing data, std::nullopt if the filesystem doesn't report holes,
+        // the file offset is left unchanged
+        [[nodiscard]] virtual std::optional<std::vector<sparse_extent>> data_extents(int fd, size_t size) const = 0;
+
+        // used for extraction, existing files are replaced
+        virtual void create_directory(const std::string& path, mode_t mode) const = 0;
+        virtual void create_node(const std::string& path, file_type_flag type, mode_t mode, major_t major, minor_t minor) const = 0;
+        virtual void create_symlink(const std::string& target, const std::string& path) const = 0;
+        virtual void create_hard_link(const std::string& target, const std::string& path) const = 0;
+        virtual void set_owner(const std::string& path, uid_t uid, gid_t gid, bool follow_symlinks) const = 0;
+        virtual void set_mode(const std::string& path, mode_t mode) const = 0;
+        virtual void set_mod_time(const std::string& path, mod_time_t mod_time, bool follow_symlinks) const = 0;
+    };
+
+    struct StdFilesytem : public Filesystem {
+        void iterateDirectory(const std::string& path, std::function<void(const std::string&)>&& cb) const override
+        {
+            if (std::filesystem::is_directory(std::filesystem::path(path))) {
+                cb(path);
+                for (const auto& f : std::filesystem::recursive_directory_iterator(path)) {
+                    cb(f.path().string());
+                }
+            } else {
+                cb(path);
+            }
+        }
+
+        [[nodiscard]] file_type_flag type_flag(const std::string& path) const override
+        {
+            // check symlink first because according to std::filesystem
+            // symlinks are also regular files, even though cppreference states otherwise.
+            if (std::filesystem::is_symlink(path)) {
+                return file_type_flag::SYMBOLIC_LINK;
+            } else if (std::filesystem::is_regular_file(path)) {
+                return file_type_flag::REGULAR_FILE;
+            } else if (std::filesystem::is_directory(path)) {
+                return file_type_flag::DIRECTORY;
+            } else if (std::filesystem::is_block_file(path)) {
+                return file_type_flag::BLOCK_SPECIAL_FILE;
+            } else if (std::filesystem::is_character_file(path)) {
+                return file_type_flag::CHARACTER_SPECIAL_FILE;
+            } else if (std::filesystem::is_fifo(path)) {
+                return file_type_flag::FIFO;
+            } else {
+                throw std::invalid_argument("Path is of an unsupported type or already deleted");
+            }
+        }
+
+        [[nodiscard]] uint64_t file_size(const std::string& path) const override
+        {
+            return std::filesystem::file_size(path);
+        }
+
+        [[nodiscard]] mod_time_t mod_time(const std::string& path) const override
+        {
+            auto file_time = std::filesystem::last_write_time(path);
+            using clock = std::chrono::system_clock;
+            auto system_time = std::chrono::time_point_cast<clock::duration>(
+                    file_time - decltype(file_time)::clock::now() + clock::now());
+            const auto time_t = clock::to_time_t(system_time);
+            return time_t;
+        }
+
+        [[nodiscard]] mode_t mode(const std::string& path) const override
+        {
+            const auto status = std::filesystem::status(path);
+            const auto perms = status.permissions();
+            using std_perms = std::filesystem::perms;
+            mode_t mode = 0;
+
+            if ((perms & std_perms::owner_read) == std_perms::owner_read) {
+                mode |= static_cast<unsigned int>(permission_t::owner_read);
+            }
+            if ((perms & std_perms::owner_write) == std_perms::owner_write) {
+                mode |= static_cast<unsigned int>(permission_t::owner_write);
+            }
+            if ((perms & std_perms::owner_exec) == std_perms::owner_exec) {
+                mode |= static_cast<unsigned int>(permission_t::owner_exec);
+            }
+            if ((perms & std_perms::group_read) == std_perms::group_read) {
+                mode |= static_cast<unsigned int>(permission_t::group_read);
+            }
+            if ((perms & std_perms::group_write) == std_perms::group_write) {
+                mode |= static_cast<unsigned int>(permission_t::group_write);
+            }
+            if ((perms & std_perms::group_exec) == std_perms::group_exec) {
+                mode |= static_cast<unsigned int>(permission_t::group_exec);
+            }
+            if ((perms & std_perms::others_read) == std_perms::others_read) {
+                mode |= static_cast<unsigned int>(permission_t::others_read);
+            }
+            if ((perms & std_perms::others_write) == std_perms::others_write) {
+                mode |= static_cast<unsigned int>(permission_t::others_write);
+            }
+            if ((perms & std_perms::others_exec) == std_perms::others_exec) {
+                mode |= static_cast<unsigned int>(permission_t::others_exec);
+            }
+
+            return mode;
+        }
+
+        [[nodiscard]] std::string read_symlink(const std::string& path) const override
+        {
+            return std::filesystem::read_symlink(path);
+        }
+
+        [[nodiscard]] bool file_exists(const std::string& path) const override
+        {
+            return std::filesystem::exists(path);
+        };
+    };
+
+#if defined(__linux)
+    struct PosixOS : OS {
+        PosixOS() = default;
+
+        // names and optionally metadata are looked up in cache first, which may be shared with other instances
+        explicit PosixOS(std::shared_ptr<metadata_cache> cache) : cache_(std::move(cache)) {}
+
+        [[nodiscard]] const std::string& user_name(uid_t uid) override
+        {
+            return user_name_buffered(uid);
+        }
+
+        [[nodiscard]] const std::string& group_name(gid_t gid) override
+        {
+            return group_name_buffered(gid);
+        }
+
+        [[nodiscard]] uid_t user_id() const override
+        {
+            const auto ids = passwd_ids();
+            return !ids.has_value() ? std::numeric_limits<uid_t>::max() : ids.value().uid;
+        }
+
+        [[nodiscard]] gid_t group_id() const override
+        {
+            const auto ids = passwd_ids();
+            return !ids.has_value() ? std::numeric_limits<gid_t>::max() : ids.value().gid;
+        }
+
+        void major_minor(const std::string& path, major_t& major, minor_t& minor) const override
+        {
+            const auto file_stat = get_stat(path);
+            major = major(file_stat.st_rdev);
+            minor = minor(file_stat.st_rdev);
+        }
+
+        [[nodiscard]] uid_t file_owner(const std::string& path) const override
+        {
+            const auto file_stat = get_stat(path);
+            return file_stat.st_uid;
+        };
+
+        [[nodiscard]] gid_t file_group(const std::string& path) const override
+        {
+            const auto file_stat = get_stat(path);
+            return file_stat.st_gid;
+        };
+
+        [[nodiscard]] char path_separator() const override
+        {
+            return '/';
+        }
+
+        [[nodiscard]] int truncate(const std::string& path, const long length) const override
+        {
+            return ::truncate(path.c_str(), static_cast<off_t>(length));
+        }
+
+        [[nodiscard]] std::optional<std::string> file_equivalent_present(
+                const std::string& path,
+                const hardlink_table& stored_files) const override
+        {
+            const auto stat_info = get_stat(path);
+            if (stat_info.st_nlink > 1) {
+                const auto stored = stored_files.find(stat_info.st_dev, stat_info.st_ino);
+                if (stored.has_value()) {
+                    return std::string(stored.value());
+                }
+            }
+
+            return std::nullopt;
+        }
+
+        [[nodiscard]] std::optional<std::string> file_equivalent_present(
+                const file_metadata& metadata,
+                const hardlink_table& stored_files) const override
+        {
+            if (metadata.nlink > 1) {
+                const auto stored = stored_files.find(metadata.dev, metadata.ino);
+                if (stored.has_value()) {
+                    return std::string(stored.value());
+                }
+            }
+
+            return std::nullopt;
+        }
+
+        [[nodiscard]] std::optional<file_metadata> metadata(const std::string& path, const bool follow_symlinks) const override
+        {
+            if (cache_ != nullptr) {
+                auto cached = cache_->find_metadata(path, follow_symlinks);
+                if (cached.has_value()) return cached;
+            }
+
+            struct ::statx stx {};
+            const auto flags = AT_STATX_SYNC_AS_STAT | (follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW);
+            if (::statx(AT_FDCWD, path.c_str(), flags, STATX_BASIC_STATS, &stx) != 0) {
+                if (errno == ENOENT || errno == ENOTDIR) return std::nullopt;
+                throw errno_exception();
+            }
+
+            const auto metadata = metadata_from_statx(stx);
+            if (cache_ != nullptr) cache_->store_metadata(path, follow_symlinks, metadata);
+            return metadata;
+        }
+
+        [[nodiscard]] static file_metadata metadata_from_statx(const struct ::statx& stx)
+        {
+            file_metadata metadata;
+            metadata.type = type_flag_from_mode(stx.stx_mode);
+            metadata.mode = stx.stx_mode & static_cast<mode_t>(permission_t::all_all);
+            metadata.uid = stx.stx_uid;
+            metadata.gid = stx.stx_gid;
+            metadata.size = stx.stx_size;
+            metadata.mod_time = stx.stx_mtime.tv_sec;
+            metadata.change_time = stx.stx_ctime.tv_sec;
+            metadata.mod_time_nsec = stx.stx_mtime.tv_nsec;
+            metadata.change_time_nsec = stx.stx_ctime.tv_nsec;
+            metadata.dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+            metadata.ino = stx.stx_ino;
+            metadata.nlink = stx.stx_nlink;
+            metadata.dev_major = stx.stx_rdev_major;
+            metadata.dev_minor = stx.stx_rdev_minor;
+            metadata.allocated_size = stx.stx_blocks * 512U;
+            return metadata;
+        }
+
+        [[nodiscard]] ino_t ino(const std::string& path) const override
+        {
+            return get_stat(path).st_ino;
+        }
+
+        [[nodiscard]] std::string realpath(const std::string& path) const override
+        {
+            const auto real_path = ::realpath(path.c_str(), nullptr);
+            std::string string_value(real_path);
+            free(real_path);
+            return string_value;
+        }
+
+        void walk_directory(const std::string& path, const bool inode_order, const walk_callback_t& callback) const override
+        {
+            directory_walker(inode_order, callback).walk(path);
+        }
+
+        void read_ahead(const std::vector<read_ahead_request*>& requests, const read_ahead_select_t& select) const override
+        {
+            for (auto* const request : requests) {
+                try {
+                    request->metadata = metadata(request->source_path, false);
+                    if (!request->metadata.has_value() || !select(*request)) continue;
+
+                    file_descriptor infile(::open(request->source_path.c_str(), O_RDONLY | O_CLOEXEC));
+                    if (!infile.is_open()) continue;
+
+                    const auto size = static_cast<std::size_t>(request->metadata->size);
+                    request->data.resize(size);
+                    std::size_t read_bytes = 0;
+                    while (read_bytes < size) {
+                        const auto result = ::read(infile.get(), request->data.data() + read_bytes, size - read_bytes);
+                        if (result < 0) {
+                            if (errno == EINTR) continue;
+                            throw errno_exception();
+                        }
+                        if (result == 0) break;
+                        read_bytes += result;
+                    }
+                    request->data.resize(read_bytes);
+                    request->infile = std::move(infile);
+                } catch (...) {
+                    request->reset();
+                }
+            }
+        }
+
+        [[nodiscard]] std::unique_ptr<output_writer> create_output_writer(const int fd) const override
+        {
+            return std::make_unique<posix_output_writer>(fd);
+        }
+
+        void advise(const int fd, const off_t offset, const off_t length, const access_advice advice) const override
+        {
+            int posix_advice = POSIX_FADV_NORMAL;
+            switch (advice) {
+                case access_advice::sequential:
+                    posix_advice = POSIX_FADV_SEQUENTIAL;
+                    break;
+                case access_advice::will_need:
+                    posix_advice = POSIX_FADV_WILLNEED;
+                    break;
+                case access_advice::dont_need:
+                    posix_advice = POSIX_FADV_DONTNEED;
+                    break;
+            }
+            ::posix_fadvise(fd, offset, length, posix_advice);
+        }
+
+        void write_back(const int fd, const off_t offset, const off_t length, const bool wait) const override
+        {
+            const auto flags = wait ? SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER : SYNC_FILE_RANGE_WRITE;
+            ::sync_file_range(fd, offset, length, flags);
+        }
+
+        void preallocate(const int fd, const off_t length) const override
+        {
+            if (length > 0) ::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, length);
+        }
+
+        [[nodiscard]] std::optional<std::vector<sparse_extent>> data_extents(const int fd, const size_t size) const override
+        {
+            // the descriptor may already be read from, e.g. by read ahead
+            const auto position = ::lseek(fd, 0, SEEK_CUR);
+            if (position < 0) return std::nullopt;
+
+            std::optional<std::vector<sparse_extent>> extents(std::in_place);
+            off_t offset = 0;
+            while (static_cast<size_t>(offset) < size) {
+                const auto data = ::lseek(fd, offset, SEEK_DATA);
+                if (data < 0) {
+                    // no data behind offset
+                    if (errno != ENXIO) extents.reset();
+                    break;
+                }
+                if (static_cast<size_t>(data) >= size) break;
+                const auto hole = ::lseek(fd, data, SEEK_HOLE);
+                if (hole < 0) {
+                    extents.reset();
+                    break;
+                }
+                const auto end = std::min(static_cast<size_t>(hole), size);
+                extents->push_back({static_cast<size_t>(data), end - static_cast<size_t>(data)});
+                offset = hole;
+            }
+            if (::lseek(fd, position, SEEK_SET) < 0) throw errno_exception();
+            return extents;
+        }
+
+        // Copies up to max_size bytes from the current offset of in_fd to the current
+        // offset of out_fd without passing the data through user space, as far as the
+        // kernel allows it. Stops early at the end of the input and returns the number
+        // of bytes copied.
+        [[nodiscard]] size_t copy_file_data(const int in_fd, const int out_fd, const size_t max_size) const override
+        {
+            // copy_file_range may share extents (reflinks) on filesystems like XFS or btrfs,
+            // sendfile covers kernels and filesystems not supporting it.
+            // Both fall back to the next method if the first call is rejected.
+            enum class copy_method {
+                copy_file_range,
+                sendfile,
+                read_write,
+            };
+
+            auto method = copy_method::copy_file_range;
+            size_t copied = 0;
+            while (copied < max_size) {
+                const auto chunk = static_cast<std::size_t>(std::min<size_t>(max_size - copied, COPY_CHUNK_SIZE));
+                ssize_t result = 0;
+                switch (method) {
+                    case copy_method::copy_file_range:
+                        result = ::copy_file_range(in_fd, nullptr, out_fd, nullptr, chunk, 0);
+                        break;
+                    case copy_method::sendfile:
+                        result = ::sendfile(out_fd, in_fd, nullptr, chunk);
+                        break;
+                    case copy_method::read_write:
+                        result = copy_read_write(in_fd, out_fd, chunk);
+                        break;
+                }
+
+                if (result < 0) {
+                    if (errno == EINTR) continue;
+                    const auto unsupported = errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                                             errno == EOPNOTSUPP || errno == ENOTSUP;
+                    if (unsupported && method == copy_method::copy_file_range) {
+                        method = copy_method::sendfile;
+                        continue;
+                    }
+                    if (unsupported && method == copy_method::sendfile) {
+                        method = copy_method::read_write;
+                        continue;
+                    }
+                    throw errno_exception();
+                }
+
+                if (result == 0) break;
+                copied += static_cast<size_t>(result);
+            }
+
+            return copied;
+        }
+
+        // an existing directory is kept as is
+        void create_directory(const std::string& path, const mode_t mode) const override
+        {
+            if (::mkdir(path.c_str(), mode) == 0) return;
+            if (errno != EEXIST) throw errno_exception();
+
+            struct ::stat file_stat {};
+            if (::lstat(path.c_str(), &file_stat) != 0) throw errno_exception();
+            if (S_ISDIR(file_stat.st_mode)) return;
+            remove_existing(path);
+            if (::mkdir(path.c_str(), mode) != 0) throw errno_exception();
+        }
+
+        void create_node(const std::string& path, const file_type_flag type, const mode_t mode, const major_t major, const minor_t minor) const override
+        {
+            mode_t node_type = 0;
+            switch (type) {
+                case file_type_flag::CHARACTER_SPECIAL_FILE:
+                    node_type = S_IFCHR;
+                    break;
+                case file_type_flag::BLOCK_SPECIAL_FILE:
+                    node_type = S_IFBLK;
+                    break;
+                case file_type_flag::FIFO:
+                    node_type = S_IFIFO;
+                    break;
+                default:
+                    throw std::invalid_argument("create_node only supports fifos and devices");
+            }
+
+            remove_existing(path);
+            if (::mknod(path.c_str(), node_type | mode, makedev(major, minor)) != 0) throw errno_exception();
+        }
+
+        void create_symlink(const std::string& target, const std::string& path) const override
+        {
+            remove_existing(path);
+            if (::symlink(target.c_str(), path.c_str()) != 0) throw errno_exception();
+        }
+
+        void create_hard_link(const std::string& target, const std::string& path) const override
+        {
+            remove_existing(path);
+            if (::link(target.c_str(), path.c_str()) != 0) throw errno_exception();
+        }
+
+        void set_owner(const std::string& path, const uid_t uid, const gid_t gid, const bool follow_symlinks) const override
+        {
+            if (::fchownat(AT_FDCWD, path.c_str(), uid, gid, follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW) != 0) throw errno_exception();
+        }
+
+        void set_mode(const std::string& path, const mode_t mode) const override
+        {
+            if (::chmod(path.c_str(), mode) != 0) throw errno_exception();
+        }
+
+        void set_mod_time(const std::string& path, const mod_time_t mod_time, const bool follow_symlinks) const override
+        {
+            const std::array<struct ::timespec, 2> times = {{{mod_time, 0}, {mod_time, 0}}};
+            if (::utimensat(AT_FDCWD, path.c_str(), times.data(), follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW) != 0) throw errno_exception();
+        }
+
+    protected:
+        static void remove_existing(const std::string& path)
+        {
+            if (::unlink(path.c_str()) == 0 || errno == ENOENT) return;
+            if (errno == EISDIR || errno == EPERM) {
+                if (::rmdir(path.c_str()) == 0) return;
+            }
+            throw errno_exception();
+        }
+
+        static file_type_flag type_flag_from_mode(const unsigned mode)
+        {
+            if (S_ISLNK(mode)) return file_type_flag::SYMBOLIC_LINK;
+            if (S_ISREG(mode)) return file_type_flag::REGULAR_FILE;
+            if (S_ISDIR(mode)) return file_type_flag::DIRECTORY;
+            if (S_ISBLK(mode)) return file_type_flag::BLOCK_SPECIAL_FILE;
+            if (S_ISCHR(mode)) return file_type_flag::CHARACTER_SPECIAL_FILE;
+            if (S_ISFIFO(mode)) return file_type_flag::FIFO;
+            throw std::invalid_argument("Path is of an unsupported type or already deleted");
+        }
+
+        static struct stat get_stat(const std::string& path)
+        {
+            struct stat file_stat {};
+            const auto stat_res = stat(path.c_str(), &file_stat);
+            if (stat_res != 0) throw errno_exception();
+            return file_stat;
+        }
+
+    private:
+        std::shared_ptr<metadata_cache> cache_;
+        // names handed out stay valid and the same as long as this instance, whatever the shared cache does
+        std::unordered_map<gid_t, std::string> grpid_cache_;
+        std::unordered_map<uid_t, std::string> pwuid_cache_;
+
+        const std::string& group_name_buffered(gid_t gid)
+        {
+            const auto iter = grpid_cache_.find(gid);
+            if (iter != grpid_cache_.end()) {
+                return iter->second;
+            }
+
+            auto name = cache_ != nullptr ? cache_->group_name(gid, lookup_group_name) : lookup_group_name(gid);
+            // references to map elements stay valid on insertion
+            return grpid_cache_.emplace(gid, name.has_value() ? std::move(name.value()) : std::to_string(gid)).first->second;
+        }
+
+        static std::optional<std::string> lookup_group_name(const gid_t gid)
+        {
+            struct ::group grp {};
+            struct ::group* result = nullptr;
+            // sysconf(_SC_GETGR_R_SIZE_MAX) should
+            // also return the maximum group name length
+            // but this is broken on some systems.
+            name_buffer_t buffer {};
+            const auto gr_gid_result = getgrgid_r(gid,
+                                                  &grp,
+                                                  buffer.data(),
+                                                  buffer.size(),
+                                                  &result);
+            throw_exception_getpwd_getgrgid_on_error(gr_gid_result);
+
+            if (result == nullptr) return std::nullopt;
+            return grp.gr_name;
+        }
+
+        const std::string& user_name_buffered(uid_t uid)
+        {
+            const auto iter = pwuid_cache_.find(uid);
+            if (iter != pwuid_cache_.end()) {
+                return iter->second;
+            }
+
+            auto name = cache_ != nullptr ? cache_->user_name(uid, lookup_user_name) : lookup_user_name(uid);
+            return pwuid_cache_.emplace(uid, name.has_value() ? std::move(name.value()) : std::to_string(uid)).first->second;
+        }
+
+        // ids of the passwd entry of the effective user
+        [[nodiscard]] std::optional<metadata_cache::account_ids> passwd_ids() const
+        {
+            const auto uid = geteuid();
+            return cache_ != nullptr ? cache_->passwd_ids(uid, lookup_passwd_ids) : lookup_passwd_ids(uid);
+        }
+
+        static std::optional<metadata_cache::account_ids> lookup_passwd_ids(const uid_t uid)
+        {
+            struct ::passwd pwd {};
+            struct ::passwd* result = nullptr;
+            name_buffer_t buffer {};
+            const auto pw_uid_result = getpwuid_r(uid,
+                                                  &pwd,
+                                                  buffer.data(),
+                                                  buffer.size(),
+                                                  &result);
+            throw_exception_getpwd_getgrgid_on_error(pw_uid_result);
+
+            if (result == nullptr) return std::nullopt;
+            return metadata_cache::account_ids {pwd.pw_uid, pwd.pw_gid};
+        }
+
+        static std::optional<std::string> lookup_user_name(const uid_t uid)
+        {
+            struct ::passwd pwd {};
+            struct ::passwd* result = nullptr;
+            // sysconf(_SC_GETPW_R_SIZE_MAX) should
+            // also return the maximum user name length
+            // but this is broken on some systems.
+            name_buffer_t buffer {};
+            const auto pw_uid_result = getpwuid_r(uid,
+                                                  &pwd,
+                                                  buffer.data(),
+                                                  buffer.size(),
+                                                  &result);
+            throw_exception_getpwd_getgrgid_on_error(pw_uid_result);
+
+            if (result == nullptr) return std::nullopt;
+            return pwd.pw_name;
+        }
+
+        static void throw_exception_getpwd_getgrgid_on_error(const int error)
+        {
+            switch (error) {
+                // Errors below are either success
+                // or indicate that the entry was not found
+                case 0:
+                case ENOENT:
+                case ESRCH:
+                case EBADF:
+                case EPERM:
+                    return;
+                default:
+                    throw errno_exception(error);
+            }
+        }
+
+        static ssize_t copy_read_write(const int in_fd, const int out_fd, const std::size_t size)
+        {
+            std::array<char, COPY_BUFFER_SIZE> buffer {};
+            const auto read_bytes = ::read(in_fd, buffer.data(), std::min(size, buffer.size()));
+            if (read_bytes <= 0) return read_bytes;
+
+            ssize_t written = 0;
+            while (written < read_bytes) {
+                const auto result = ::write(out_fd, buffer.data() + written, read_bytes - written);
+                if (result < 0) {
+                    if (errno == EINTR) continue;
+                    throw errno_exception();
+                }
+                written += result;
+            }
+            return written;
+        }
+
+        static constexpr int NAME_BUFFER_SIZE = 8192;
+        using name_buffer_t = std::array<char, NAME_BUFFER_SIZE>;
+
+        // upper bound per copy call, the kernel limits single calls to ~2GB anyway
+        static constexpr size_t COPY_CHUNK_SIZE = 1U << 30U;
+        static constexpr std::size_t COPY_BUFFER_SIZE = 64 * 1024;
+
+        // Walks a tree relative to directory descriptors: entries are read in batches
+        // with getdents64, their metadata is queried with statx on the directory
+        // descriptor and all paths are built in one buffer.
+        class directory_walker {
+        public:
+            directory_walker(const bool inode_order, const walk_callback_t& callback)
+                : inode_order_(inode_order), callback_(callback), buffer_(GETDENTS_BUFFER_SIZE)
+            {
+            }
+
+            void walk(const std::string& path)
+            {
+                struct ::statx stx {};
+                if (::statx(AT_FDCWD, path.c_str(), AT_STATX_SYNC_AS_STAT | AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &stx) != 0) throw errno_exception();
+                path_ = path;
+                const walk_entry entry {path_, metadata_from_statx(stx), AT_FDCWD, path_};
+                callback_(entry);
+                if (entry.metadata.type != file_type_flag::DIRECTORY) return;
+
+                file_descriptor dir(::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+                if (!dir.is_open()) throw errno_exception();
+                if (path_.back() != '/') path_ += '/';
+                walk_directory(dir.get());
+            }
+
+        private:
+            struct listed_entry {
+                uint64_t ino;
+                size_t name_offset;
+                size_t name_size;
+            };
+
+            // path_ ends with a separator
+            void walk_directory(const int dir_fd)
+            {
+                std::string names;
+                std::vector<listed_entry> entries;
+                list_directory(dir_fd, names, entries);
+                if (inode_order_) {
+                    std::sort(entries.begin(), entries.end(), [](const listed_entry& lhs, const listed_entry& rhs) { return lhs.ino < rhs.ino; });
+                }
+
+                const auto base_size = path_.size();
+                for (const auto& listed : entries) {
+                    // null terminated in names
+                    const auto* const name = names.c_str() + listed.name_offset;
+                    struct ::statx stx {};
+                    if (::statx(dir_fd, name, AT_STATX_SYNC_AS_STAT | AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &stx) != 0) {
+                        // deleted in the meantime
+                        if (errno == ENOENT) continue;
+                        throw errno_exception();
+                    }
+
+                    path_.resize(base_size);
+                    path_.append(name, listed.name_size);
+                    const walk_entry entry {path_, metadata_from_statx(stx), dir_fd, std::string_view(name, listed.name_size)};
+                    callback_(entry);
+                    if (entry.metadata.type != file_type_flag::DIRECTORY) continue;
+
+                    file_descriptor dir(::openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+                    if (!dir.is_open()) {
+                        if (errno == ENOENT) continue;
+                        throw errno_exception();
+                    }
+                    path_.resize(base_size + listed.name_size);
+                    path_ += '/';
+                    walk_directory(dir.get());
+                }
+                path_.resize(base_size);
+            }
+
+            void list_directory(const int dir_fd, std::string& names, std::vector<listed_entry>& entries)
+            {
+                while (true) {
+                    const auto result = ::syscall(SYS_getdents64, dir_fd, buffer_.data(), buffer_.size());
+                    if (result < 0) {
+                        if (errno == EINTR) continue;
+                        throw errno_exception();
+                    }
+                    if (result == 0) return;
+
+                    for (long pos = 0; pos < result;) {
+                        // layout of struct linux_dirent64
+                        const auto* const record = buffer_.data() + pos;
+                        uint64_t ino = 0;
+                        uint16_t record_size = 0;
+                        std::memcpy(&ino, record, sizeof(ino));
+                        std::memcpy(&record_size, record + DIRENT_POS_RECORD_SIZE, sizeof(record_size));
+                        const std::string_view name(record + DIRENT_POS_NAME);
+                        pos += record_size;
+
+                        if (name == "." || name == "..") continue;
+                        entries.push_back({ino, names.size(), name.size()});
+                        names.append(name);
+                        names += '\0';
+                    }
+                }
+            }
+
+            static constexpr size_t GETDENTS_BUFFER_SIZE = 32 * 1024;
+            static constexpr size_t DIRENT_POS_RECORD_SIZE = 16;
+            static constexpr size_t DIRENT_POS_NAME = 19;
+
+            bool inode_order_;
+            const walk_callback_t& callback_;
+            std::vector<char> buffer_;
+            std::string path_;
+        };
+    };
+
+#endif
+
+#if defined(__linux)
+    struct Platform : public PosixOS, public StdFilesytem {
+        Platform() = default;
+
+        explicit Platform(std::shared_ptr<metadata_cache> cache) : PosixOS(std::move(cache)) {}
+
+        virtual ~Platform() = default;
+    };
+#else
+#    error "no support for targeted platform"
+#endif
+
+#ifdef WITH_IO_URING
+    // Minimal io_uring submission and completion queue on top of the raw system calls.
+    // Only one thread may use a queue at a time.
+    class io_uring_queue {
+    public:
+        explicit io_uring_queue(const unsigned entries)
+        {
+            io_uring_params params {};
+            ring_fd_ = file_descriptor(static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params)));
+            if (!ring_fd_.is_open()) throw errno_exception();
+            if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0) throw std::runtime_error("io_uring without single mmap is not supported");
+
+            ring_size_ = std::max<std::size_t>(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                               params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+            ring_ = ::mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_.get(), IORING_OFF_SQ_RING);
+            if (ring_ == MAP_FAILED) throw errno_exception();
+            sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+            auto* const sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_.get(), IORING_OFF_SQES);
+            if (sqes == MAP_FAILED) {
+                const auto error = errno;
+                ::munmap(ring_, ring_size_);
+                throw errno_exception(error);
+            }
+
+            sqes_ = static_cast<io_uring_sqe*>(sqes);
+            sq_tail_ = field<unsigned>(params.sq_off.tail);
+            sq_mask_ = *field<unsigned>(params.sq_off.ring_mask);
+            sq_array_ = field<unsigned>(params.sq_off.array);
+            cq_head_ = field<unsigned>(params.cq_off.head);
+            cq_tail_ = field<unsigned>(params.cq_off.tail);
+            cq_mask_ = *field<unsigned>(params.cq_off.ring_mask);
+            cqes_ = field<io_uring_cqe>(params.cq_off.cqes);
+            entries_ = params.sq_entries;
+            local_tail_ = *sq_tail_;
+        }
+
+        // delete copy and move special member functions, the kernel refers to the mapped memory
+        io_uring_queue(const io_uring_queue& other) = delete;
+        io_uring_queue& operator=(const io_uring_queue& other) = delete;
+        io_uring_queue(io_uring_queue&& other) = delete;
+        io_uring_queue& operator=(io_uring_queue&& other) = delete;
+
+        ~io_uring_queue()
+        {
+            ::munmap(sqes_, sqes_size_);
+            ::munmap(ring_, ring_size_);
+        }
+
+        // number of operations which can be queued or in flight at the same time
+        [[nodiscard]] unsigned capacity() const
+        {
+            return entries_;
+        }
+
+        [[nodiscard]] unsigned pending() const
+        {
+            return queued_ + in_flight_;
+        }
+
+        // next free submission entry, nullptr if capacity() operations are pending already
+        io_uring_sqe* next_sqe(const uint64_t user_data)
+        {
+            if (pending() >= entries_) return nullptr;
+            const auto index = local_tail_++ & sq_mask_;
+            auto* const sqe = &sqes_[index];
+            std::memset(sqe, 0, sizeof(*sqe));
+            sqe->user_data = user_data;
+            sq_array_[index] = index;
+            ++queued_;
+            return sqe;
+        }
+
+        static void prep(io_uring_sqe& sqe, const uint8_t opcode, const int fd, const void* const addr, const uint32_t len, const uint64_t offset)
+        {
+            sqe.opcode = opcode;
+            sqe.fd = fd;
+            sqe.addr = reinterpret_cast<uint64_t>(addr);
+            sqe.len = len;
+            sqe.off = offset;
+        }
+
+        // submits all queued operations and waits until at least wait_nr are completed
+        void submit(const unsigned wait_nr)
+        {
+            __atomic_store_n(sq_tail_, local_tail_, __ATOMIC_RELEASE);
+            while (true) {
+                const auto result = ::syscall(__NR_io_uring_enter, ring_fd_.get(), queued_, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0U, nullptr, 0);
+                if (result < 0) {
+                    if (errno == EINTR) continue;
+                    throw errno_exception();
+                }
+                queued_ -= static_cast<unsigned>(result);
+                in_flight_ += static_cast<unsigned>(result);
+                return;
+            }
+        }
+
+        // calls handler(user_data, result) for all available completions
+        template<typename F>
+        void reap(F&& handler)
+        {
+            auto head = *cq_head_;
+            const auto tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head) {
+                const auto& cqe = cqes_[head & cq_mask_];
+                --in_flight_;
+                handler(cqe.user_data, cqe.res);
+            }
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        }
+
+        // waits for at least one completion if operations are pending and handles all available ones
+        template<typename F>
+        void wait(F&& handler)
+        {
+            if (pending() == 0) return;
+            submit(1);
+            reap(std::forward<F>(handler));
+        }
+
+        // the buffers can be used by IORING_OP_READ_FIXED and IORING_OP_WRITE_FIXED afterwards
+        [[nodiscard]] bool register_buffers(const std::vector<iovec>& buffers)
+        {
+            return ::syscall(__NR_io_uring_register, ring_fd_.get(), IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) == 0;
+        }
+
+    private:
+        template<typename T>
+        T* field(const unsigned offset) const
+        {
+            return reinterpret_cast<T*>(static_cast<char*>(ring_) + offset);
+        }
+
+        file_descriptor ring_fd_;
+        void* ring_ = nullptr;
+        std::size_t ring_size_ = 0;
+        io_uring_sqe* sqes_ = nullptr;
+        std::size_t sqes_size_ = 0;
+        unsigned* sq_tail_ = nullptr;
+        unsigned sq_mask_ = 0;
+        unsigned* sq_array_ = nullptr;
+        unsigned* cq_head_ = nullptr;
+        unsigned* cq_tail_ = nullptr;
+        unsigned cq_mask_ = 0;
+        io_uring_cqe* cqes_ = nullptr;
+        unsigned entries_ = 0;
+        unsigned local_tail_ = 0;
+        unsigned queued_ = 0;
+        unsigned in_flight_ = 0;
+    };
+
+    // Copies the data into one of a few registered buffers and submits the write without waiting
+    // for it. Only when all buffers are in flight, write waits for the oldest one.
+    class io_uring_output_writer : public output_writer {
+    public:
+        explicit io_uring_output_writer(const int fd, const std::size_t buffer_size = 256 * 1024, const unsigned buffer_count = 8)
+            : fd_(fd), queue_(buffer_count), buffers_(buffer_count, std::vector<char>(buffer_size)), states_(buffer_count)
+        {
+            std::vector<iovec> iovecs;
+            for (auto& buffer : buffers_) iovecs.push_back({buffer.data(), buffer.size()});
+            // registering is limited by RLIMIT_MEMLOCK on older kernels, plain writes work as well
+            registered_ = queue_.register_buffers(iovecs);
+        }
+
+        // delete copy and move special member functions, the kernel refers to the buffers
+        io_uring_output_writer(const io_uring_output_writer& other) = delete;
+        io_uring_output_writer& operator=(const io_uring_output_writer& other) = delete;
+        io_uring_output_writer(io_uring_output_writer&& other) = delete;
+        io_uring_output_writer& operator=(io_uring_output_writer&& other) = delete;
+
+        ~io_uring_output_writer() override
+        {
+            try {
+                while (queue_.pending() > 0) queue_.wait([this](const uint64_t index, const int result) { complete(index, result); });
+            } catch (...) {
+                // nothing to report to in the destructor, sync reports errors
+            }
+        }
+
+        void write(const char* data, size_t size) override
+        {
+            if (!offset_valid_) {
+                offset_ = ::lseek(fd_, 0, SEEK_CUR);
+                if (offset_ < 0) throw errno_exception();
+                offset_valid_ = true;
+            }
+            while (size > 0) {
+                const auto index = free_buffer();
+                auto& buffer = buffers_[index];
+                const auto chunk_size = std::min(size, buffer.size());
+                std::copy_n(data, chunk_size, buffer.data());
+                states_[index] = {offset_, 0, chunk_size, true};
+                submit(index);
+                offset_ += static_cast<off_t>(chunk_size);
+                data += chunk_size;
+                size -= chunk_size;
+            }
+        }
+
+        void sync() override
+        {
+            while (queue_.pending() > 0) queue_.wait([this](const uint64_t index, const int result) { complete(index, result); });
+            if (error_ != 0) throw errno_exception(std::exchange(error_, 0));
+            if (offset_valid_ && ::lseek(fd_, offset_, SEEK_SET) < 0) throw errno_exception();
+            offset_valid_ = false;
+        }
+
+    private:
+        struct buffer_state {
+            off_t offset = 0;
+            std::size_t written = 0;
+            std::size_t size = 0;
+            bool busy = false;
+        };
+
+        std::size_t free_buffer()
+        {
+            while (true) {
+                if (error_ != 0) throw errno_exception(std::exchange(error_, 0));
+                for (std::size_t i = 0; i < states_.size(); ++i) {
+                    if (!states_[i].busy) return i;
+                }
+                queue_.wait([this](const uint64_t index, const int result) { complete(index, result); });
+            }
+        }
+
+        void submit(const std::size_t index)
+        {
+            const auto& state = states_[index];
+            auto* const sqe = queue_.next_sqe(index);
+            io_uring_queue::prep(*sqe, registered_ ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, fd_, buffers_[index].data() + state.written,
+                                 static_cast<uint32_t>(state.size - state.written), static_cast<uint64_t>(state.offset + static_cast<off_t>(state.written)));
+            sqe->buf_index = static_cast<uint16_t>(index);
+            queue_.submit(0);
+        }
+
+        void complete(const uint64_t index, const int result)
+        {
+            auto& state = states_[index];
+            if (result == -EINTR || result == -EAGAIN) {
+                submit(index);
+                return;
+            }
+            if (result <= 0) {
+                error_ = result < 0 ? -result : EIO;
+                state.busy = false;
+                return;
+            }
+
+            state.written += static_cast<std::size_t>(result);
+            if (state.written < state.size) {
+                submit(index);
+            } else {
+                state.busy = false;
+            }
+        }
+
+        const int fd_;
+        // writes are submitted at explicit offsets, the file position is only updated by sync
+        off_t offset_ = 0;
+        bool offset_valid_ = false;
+        io_uring_queue queue_;
+        std::vector<std::vector<char>> buffers_;
+        std::vector<buffer_state> states_;
+        bool registered_ = false;
+        int error_ = 0;
+    };
+
+    // Platform using io_uring for the read ahead of prefetching and for writing archive files.
+    // The metadata queries, opens and reads of a batch of entries are submitted together, see
+    // tarfile::prefetch_options::read_batch_size. Falls back to the system calls of Platform
+    // if io_uring isn't available, e.g. if it's disabled by a seccomp filter.
+    struct io_uring_platform : public Platform {
+        explicit io_uring_platform(const unsigned queue_depth = 64)
+            : queue_depth_(queue_depth)
+        {
+            try {
+                release_queue(std::make_unique<io_uring_queue>(queue_depth_));
+            } catch (const std::system_error&) {
+                available_ = false;
+            }
+        }
+
+        [[nodiscard]] bool available() const
+        {
+            return available_;
+        }
+
+        void read_ahead(const std::vector<read_ahead_request*>& requests, const read_ahead_select_t& select) const override
+        {
+            if (!available_) {
+                Platform::read_ahead(requests, select);
+                return;
+            }
+
+            auto queue = acquire_queue();
+            for (std::size_t pos = 0; pos < requests.size(); pos += queue->capacity()) {
+                const std::vector<read_ahead_request*> batch(requests.begin() + static_cast<std::ptrdiff_t>(pos),
+                                                             requests.begin() + static_cast<std::ptrdiff_t>(std::min<std::size_t>(requests.size(), pos + queue->capacity())));
+                try {
+                    read_batch(*queue, batch, select);
+                } catch (...) {
+                    // operations may still refer to the batch, the queue is dropped with them
+                    for (auto* const request : batch) request->reset();
+                    queue = std::make_unique<io_uring_queue>(queue_depth_);
+                }
+            }
+            release_queue(std::move(queue));
+        }
+
+        [[nodiscard]] std::unique_ptr<output_writer> create_output_writer(const int fd) const override
+        {
+            if (!available_) return Platform::create_output_writer(fd);
+            return std::make_unique<io_uring_output_writer>(fd);
+        }
+
+    private:
+        // metadata, open and read each take one submission for the whole batch
+        static void read_batch(io_uring_queue& queue, const std::vector<read_ahead_request*>& batch, const read_ahead_select_t& select)
+        {
+            std::vector<struct ::statx> stats(batch.size());
+            std::vector<int> results(batch.size(), 0);
+            const auto store_result = [&results](const uint64_t index, const int result) { results[index] = result; };
+            const auto run = [&queue, &store_result]() {
+                while (queue.pending() > 0) queue.wait(store_result);
+            };
+
+            for (std::size_t i = 0; i < batch.size(); ++i) {
+                auto* const sqe = queue.next_sqe(i);
+                io_uring_queue::prep(*sqe, IORING_OP_STATX, AT_FDCWD, batch[i]->source_path.c_str(), STATX_BASIC_STATS, reinterpret_cast<uint64_t>(&stats[i]));
+                sqe->statx_flags = AT_STATX_SYNC_AS_STAT | AT_SYMLINK_NOFOLLOW;
+            }
+            run();
+
+            std::vector<std::size_t> selected;
+            for (std::size_t i = 0; i < batch.size(); ++i) {
+                auto& request = *batch[i];
+                request.metadata.reset();
+                if (results[i] != 0) continue;
+                request.metadata = metadata_from_statx(stats[i]);
+                try {
+                    if (select(request)) selected.push_back(i);
+                } catch (...) {
+                    request.reset();
+                }
+            }
+
+            for (const auto i : selected) {
+                auto* const sqe = queue.next_sqe(i);
+                io_uring_queue::prep(*sqe, IORING_OP_OPENAT, AT_FDCWD, batch[i]->source_path.c_str(), 0, 0);
+                sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            }
+            run();
+
+            // reads at the current position, so the descriptors are positioned after the data
+            std::vector<std::size_t> read_bytes(batch.size(), 0);
+            const auto submit_read = [&](const std::size_t i) {
+                auto& request = *batch[i];
+                auto* const sqe = queue.next_sqe(i);
+                io_uring_queue::prep(*sqe, IORING_OP_READ, request.infile.get(), request.data.data() + read_bytes[i],
+                                     static_cast<uint32_t>(std::min<std::size_t>(request.data.size() - read_bytes[i], UINT32_MAX)), static_cast<uint64_t>(-1));
+            };
+            for (const auto i : selected) {
+                auto& request = *batch[i];
+                if (results[i] < 0) continue;
+                request.infile = file_descriptor(results[i]);
+                request.data.resize(static_cast<std::size_t>(request.metadata->size));
+                if (request.data.empty()) continue;
+                submit_read(i);
+            }
+            while (queue.pending() > 0) {
+                queue.wait([&](const uint64_t index, const int result) {
+                    auto& request = *batch[index];
+                    if (result == -EINTR || result == -EAGAIN) {
+                        submit_read(index);
+                    } else if (result < 0) {
+                        request.reset();
+                    } else if (result == 0 || (read_bytes[index] += static_cast<std::size_t>(result)) == request.data.size()) {
+                        request.data.resize(read_bytes[index]);
+                    } else {
+                        submit_read(index);
+                    }
+                });
+            }
+        }
+
+        std::unique_ptr<io_uring_queue> acquire_queue() const
+        {
+            {
+                std::lock_guard lock(mutex_);
+                if (!idle_queues_.empty()) {
+                    auto queue = std::move(idle_queues_.back());
+                    idle_queues_.pop_back();
+                    return queue;
+                }
+            }
+            return std::make_unique<io_uring_queue>(queue_depth_);
+        }
+
+        void release_queue(std::unique_ptr<io_uring_queue>&& queue) const
+        {
+            std::lock_guard lock(mutex_);
+            idle_queues_.emplace_back(std::move(queue));
+        }
+
+        const unsigned queue_depth_;
+        bool available_ = true;
+        mutable std::mutex mutex_;
+        mutable std::vector<std::unique_ptr<io_uring_queue>> idle_queues_;
+    };
+#endif
+
+
+#if defined(__linux)
+    // Position of a member as stored in the index written along with an archive.
+    // Compressed archives can be decompressed starting at block_offset, which
+    // corresponds to block_tar_offset in the uncompressed archive. For uncompressed
+    // archives both are the header offset.
+    struct tar_index_entry {
+        std::string name;
+        file_type_flag type = file_type_flag::REGULAR_FILE;
+        size_t header_offset = 0;
+        size_t content_offset = 0;
+        size_t size = 0;
+        size_t block_offset = 0;
+        size_t block_tar_offset = 0;
+    };
+
+    // Little endian numbers of the binary files written next to archives.
+    struct binary_codec {
+        static void append_number(std::string& output, const uint64_t value, const size_t size)
+        {
+            for (auto i = 0U; i < size; ++i) output.push_back(static_cast<char>((value >> (8U * i)) & 0xFFU));
+        }
+
+        // consumes size bytes of data, what names the file in the error of truncated data
+        static uint64_t read_number(std::string_view& data, const size_t size, const char* const what)
+        {
+            if (data.size() < size) throw std::runtime_error(what + " is truncated"s);
+            uint64_t value = 0;
+            for (auto i = 0U; i < size; ++i) value |= static_cast<uint64_t>(static_cast<unsigned char>(data[i])) << (8U * i);
+            data.remove_prefix(size);
+            return value;
+        }
+
+        static std::string_view read_string(std::string_view& data, const size_t size, const char* const what)
+        {
+            if (data.size() < size) throw std::runtime_error(what + " is truncated"s);
+            const auto value = data.substr(0, size);
+            data.remove_prefix(size);
+            return value;
+        }
+
+        // writes the whole output, retrying interrupted and partial writes
+        static void write_file(const std::string& filename, const std::string& output)
+        {
+            const file_descriptor file(::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+            if (!file.is_open()) throw errno_exception();
+            write_all(file.get(), output);
+        }
+
+        static void write_all(const int fd, const std::string& output)
+        {
+            size_t written = 0;
+            while (written < output.size()) {
+                const auto result = ::write(fd, output.data() + written, output.size() - written);
+                if (result < 0) {
+                    if (errno == EINTR) continue;
+                    throw errno_exception();
+                }
+                written += result;
+            }
+        }
+    };
+
+    // Reads an index file written by tarfile::set_index_file. The file starts with a
+    // magic and a version, followed by one record per member with all numbers
+    // stored as little endian and the name prefixed by its length.
+    struct tar_index {
+        explicit tar_index(const std::string& filename)
+        {
+            const mapped_file file(filename);
+            parse({file.data(), file.size()});
+            for (size_t i = 0; i < entries_.size(); ++i) by_name_[entries_[i].name] = i;
+        }
+
+        // members in the order of the archive
+        [[nodiscard]] const std::vector<tar_index_entry>& entries() const
+        {
+            return entries_;
+        }
+
+        // the last member of a name is returned, as tar does on extraction
+        [[nodiscard]] const tar_index_entry* find(const std::string_view name) const
+        {
+            const auto iter = by_name_.find(name);
+            return iter == by_name_.end() ? nullptr : &entries_[iter->second];
+        }
+
+        static void append_header(std::string& output)
+        {
+            output.append(MAGIC);
+            binary_codec::append_number(output, VERSION, sizeof(VERSION));
+        }
+
+        static void append_entry(std::string& output, const tar_index_entry& entry)
+        {
+            output.push_back(static_cast<char>(entry.type));
+            for (const auto value : {entry.header_offset, entry.content_offset, entry.size, entry.block_offset, entry.block_tar_offset}) {
+                binary_codec::append_number(output, value, sizeof(value));
+            }
+            binary_codec::append_number(output, entry.name.size(), NAME_LEN_SIZE);
+            output.append(entry.name);
+        }
+
+    private:
+        static constexpr std::string_view MAGIC = "tarxxidx";
+        static constexpr uint32_t VERSION = 1;
+        static constexpr size_t NAME_LEN_SIZE = 4;
+        static constexpr auto FILE_NAME = "index file";
+
+        void parse(std::string_view data)
+        {
+            const auto read_number = [&data](const size_t size) { return binary_codec::read_number(data, size, FILE_NAME); };
+
+            if (data.substr(0, MAGIC.size()) != MAGIC) throw std::runtime_error("not a tarxx index file");
+            data.remove_prefix(MAGIC.size());
+            if (read_number(sizeof(VERSION)) != VERSION) throw std::runtime_error("unsupported index file version");
+
+            while (!data.empty()) {
+                tar_index_entry entry;
+                entry.type = static_cast<file_type_flag>(read_number(1));
+                for (auto* const value : {&entry.header_offset, &entry.content_offset, &entry.size, &entry.block_offset, &entry.block_tar_offset}) {
+                    *value = read_number(sizeof(*value));
+                }
+                entry.name = binary_codec::read_string(data, read_number(NAME_LEN_SIZE), FILE_NAME);
+                entries_.emplace_back(std::move(entry));
+            }
+        }
+
+        std::vector<tar_index_entry> entries_;
+        // views into the names of entries_, which is not modified after parsing
+        std::unordered_map<std::string_view, size_t> by_name_;
+    };
+
+    // identity and change times of an entry, as compared by incremental archiving
+    struct tar_snapshot_entry {
+        uint64_t dev = 0;
+        uint64_t ino = 0;
+        uint64_t size = 0;
+        // nanoseconds since the epoch
+        int64_t mod_time = 0;
+        int64_t change_time = 0;
+
+        bool operator==(const tar_snapshot_entry& other) const
+        {
+            return dev == other.dev && ino == other.ino && size == other.size && mod_time == other.mod_time && change_time == other.change_time;
+        }
+
+        bool operator!=(const tar_snapshot_entry& other) const
+        {
+            return !(*this == other);
+        }
+    };
+
+    // Entries read from the file system by an archive run, keyed by their name in the archive,
+    // see tarfile::set_incremental. The file is encoded like tar_index, a magic and a version
+    // followed by one record per entry.
+    struct tar_snapshot {
+        tar_snapshot() = default;
+
+        explicit tar_snapshot(const std::string& filename)
+        {
+            const mapped_file file(filename);
+            parse({file.data(), file.size()});
+        }
+
+        void save(const std::string& filename) const
+        {
+            std::string output(MAGIC);
+            binary_codec::append_number(output, VERSION, sizeof(VERSION));
+            for (const auto& [name, entry] : entries_) {
+                for (const auto value : {entry.dev, entry.ino, entry.size}) binary_codec::append_number(output, value, sizeof(value));
+                for (const auto value : {entry.mod_time, entry.change_time}) binary_codec::append_number(output, static_cast<uint64_t>(value), sizeof(value));
+                binary_codec::append_number(output, name.size(), NAME_LEN_SIZE);
+                output.append(name);
+            }
+            binary_codec::write_file(filename, output);
+        }
+
+        static tar_snapshot_entry make_entry(const file_metadata& metadata)
+        {
+            constexpr int64_t nsec_per_sec = 1000 * 1000 * 1000;
+            return {metadata.dev, metadata.ino, metadata.size,
+                    metadata.mod_time * nsec_per_sec + metadata.mod_time_nsec,
+                    metadata.change_time * nsec_per_sec + metadata.change_time_nsec};
+        }
+
+        void record(const std::string& name, const file_metadata& metadata)
+        {
+            entries_[name] = make_entry(metadata);
+        }
+
+        // true if name was recorded with the same identity, size and times
+        [[nodiscard]] bool unchanged(const std::string& name, const file_metadata& metadata) const
+        {
+            const auto iter = entries_.find(name);
+            return iter != entries_.end() && iter->second == make_entry(metadata);
+        }
+
+        [[nodiscard]] const std::unordered_map<std::string, tar_snapshot_entry>& entries() const
+        {
+            return entries_;
+        }
+
+        // names recorded here but not in current, sorted
+        [[nodiscard]] std::vector<std::string> removed_in(const tar_snapshot& current) const
+        {
+            std::vector<std::string> removed;
+            for (const auto& [name, entry] : entries_) {
+                if (current.entries_.find(name) == current.entries_.end()) removed.emplace_back(name);
+            }
+            std::sort(removed.begin(), removed.end());
+            return removed;
+        }
+
+    private:
+        static constexpr std::string_view MAGIC = "tarxxsnp";
+        static constexpr uint32_t VERSION = 1;
+        static constexpr size_t NAME_LEN_SIZE = 4;
+        static constexpr auto FILE_NAME = "snapshot file";
+
+        void parse(std::string_view data)
+        {
+            const auto read_number = [&data](const size_t size) { return binary_codec::read_number(data, size, FILE_NAME); };
+
+            if (data.substr(0, MAGIC.size()) != MAGIC) throw std::runtime_error("not a tarxx snapshot file");
+            data.remove_prefix(MAGIC.size());
+            if (read_number(sizeof(VERSION)) != VERSION) throw std::runtime_error("unsupported snapshot file version");
+
+            while (!data.empty()) {
+                tar_snapshot_entry entry;
+                for (auto* const value : {&entry.dev, &entry.ino, &entry.size}) *value = read_number(sizeof(*value));
+                for (auto* const value : {&entry.mod_time, &entry.change_time}) *value = static_cast<int64_t>(read_number(sizeof(*value)));
+                entries_[std::string(binary_codec::read_string(data, read_number(NAME_LEN_SIZE), FILE_NAME))] = entry;
+            }
+        }
+
+        std::unordered_map<std::string, tar_snapshot_entry> entries_;
+    };
+#endif
+
+#ifdef WITH_COMPRESSION
+    // Compresses the archive written by tarfile and passes the result on to the output.
+    // Headers which may be rewritten in place are passed to add_header, they have to be
+    // stored such that rewriting one results in output of the same size at the same
+    // position. flush passes on all data, so data added afterwards starts at a position
+    // from which the output can be decompressed.
+    class compressor {
+    public:
+        using output_t = std::function<void(const char* data, size_t size)>;
+
+        explicit compressor(output_t&& output) : output_(std::move(output)) {}
+
+        // delete non required special member functions
+        compressor(const compressor& other) = delete;
+        compressor& operator=(const compressor& other) = delete;
+        compressor(compressor&& other) = delete;
+        compressor& operator=(compressor&& other) = delete;
+
+        virtual ~compressor() = default;
+
+        virtual void compress(const char* data, size_t size) = 0;
+        virtual void add_header(const block_t& header) = 0;
+        virtual void flush() = 0;
+        // ends the compressed stream, no data may be added afterwards
+        virtual void end() = 0;
+
+        virtual void configure_threads([[maybe_unused]] const unsigned threads, [[maybe_unused]] const std::size_t max_in_flight)
+        {
+            throw std::logic_error("compression threads are not supported by the compression mode");
+        }
+
+        // called after the header of a member, its payload of size bytes follows padded to whole blocks
+        virtual void begin_member([[maybe_unused]] const std::size_t size) {}
+
+        // called once before anything else is output, writes what precedes the compressed data
+        virtual void start() {}
+
+    protected:
+        void output(const char* const data, const size_t size)
+        {
+            output_(data, size);
+        }
+
+    private:
+        output_t output_;
+    };
+#endif
+
+#ifdef WITH_LZ4
+    template<typename F, typename... Args>
+    auto lz4_call_and_check_error(F&& func, Args&&... args)
+    {
+        const auto lz4_result = func(std::forward<Args>(args)...);
+        if (LZ4F_isError(lz4_result) != 0) {
+            throw std::runtime_error("lz4 function failed: error "s + LZ4F_getErrorName(lz4_result));
+        }
+        return lz4_result;
+    }
+
+    class lz4_ctx {
+    public:
+        lz4_ctx()
+        {
+            LZ4F_createCompressionContext(&ctx_, LZ4F_VERSION);
+        }
+
+        // delete non required special member functions
+        lz4_ctx(const lz4_ctx& other) = delete;
+        lz4_ctx& operator=(const lz4_ctx& other) = delete;
+        lz4_ctx(lz4_ctx&& other) = delete;
+        lz4_ctx& operator=(lz4_ctx&& other) = delete;
+
+        ~lz4_ctx()
+        {
+            LZ4F_freeCompressionContext(ctx_);
+        }
+
+        LZ4F_cctx* get()
+        {
+            return ctx_;
+        }
+
+    private:
+        LZ4F_compressionContext_t ctx_ = nullptr;
+    };
+
+    struct lz4_options {
+        // 0 selects the default fast mode, levels from LZ4HC_CLEVEL_MIN up to LZ4HC_CLEVEL_MAX
+        // use the high compression mode, which is a lot slower
+        int level = 0;
+        // trades ratio for speed in the fast mode, 1 is the default of lz4, requires level 0
+        int acceleration = 1;
+        // Trial compresses the start of the payload of each member, at most probe_size bytes of the
+        // first write. Members whose sample doesn't shrink below max_ratio_percent of its size are
+        // stored in uncompressed blocks, which saves compressing media files and compressed archives.
+        bool adaptive = false;
+        std::size_t probe_size = 64 * 1024;
+        unsigned max_ratio_percent = 95;
+    };
+
+    // Decides for lz4_options::adaptive whether the payload of a member is compressed. The sample
+    // is compressed with the fast mode, whatever the level is, as the ratio of lz4 barely depends on it.
+    class lz4_member_probe {
+    public:
+        void configure(const lz4_options& options)
+        {
+            options_ = options;
+        }
+
+        void begin_member(const std::size_t size)
+        {
+            remaining_ = options_.adaptive ? (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE : 0;
+            decided_ = false;
+        }
+
+        // returns how many of the leading bytes of data are payload which is stored uncompressed
+        std::size_t uncompressed_size(const char* const data, const std::size_t size)
+        {
+            const auto payload_size = std::min(size, remaining_);
+            if (payload_size == 0) return 0;
+            if (!decided_) {
+                store_uncompressed_ = !shrinks(data, std::min(payload_size, options_.probe_size));
+                decided_ = true;
+            }
+            remaining_ -= payload_size;
+            return store_uncompressed_ ? payload_size : 0;
+        }
+
+    private:
+        bool shrinks(const char* const data, const std::size_t size)
+        {
+            const auto input_size = static_cast<int>(size);
+            const auto bound = LZ4_compressBound(input_size);
+            sample_.resize(bound);
+            const auto compressed_size = LZ4_compress_fast(data, sample_.data(), input_size, bound, options_.acceleration);
+            return compressed_size > 0 && static_cast<std::size_t>(compressed_size) * 100 < size * options_.max_ratio_percent;
+        }
+
+        lz4_options options_;
+        std::vector<char> sample_;
+        std::size_t remaining_ = 0;
+        bool decided_ = false;
+        bool store_uncompressed_ = false;
+    };
+
+    // Compresses into an lz4 frame with independent blocks, headers are stored in uncompressed blocks.
+    class lz4_compressor : public compressor {
+    public:
+        static inline constexpr LZ4F_preferences_t prefs = {
+                {LZ4F_max256KB, LZ4F_blockIndependent, LZ4F_noContentChecksum,
+                 LZ4F_frame, 0 /* unknown content size */, 0 /* no dictID */,
+                 LZ4F_noBlockChecksum},
+                0,         /* compression level; 0 == default */
+                0,         /* autoflush */
+                0,         /* favor decompression speed */
+                {0, 0, 0}, /* reserved, must be set to 0 */
+        };
+
+        // the level is no part of the frame header
+        static LZ4F_preferences_t preferences(const lz4_options& options)
+        {
+            auto result = prefs;
+            result.compressionLevel = options.acceleration > 1 ? -options.acceleration : options.level;
+            return result;
+        }
+
+        explicit lz4_compressor(output_t&& output) : compressor(std::move(output)), prefs_(prefs)
+        {
+            out_buf_.resize(lz4_call_and_check_error(LZ4F_compressBound, input_chunk_size_, &prefs));
+        }
+
+        // the frame is begun with the level on start
+        void configure(const lz4_options& options)
+        {
+            if (started_) throw std::logic_error("lz4 options can't be changed after compression started");
+            prefs_ = preferences(options);
+            probe_.configure(options);
+        }
+
+        void start() override
+        {
+            started_ = true;
+            out_buf_pos_ += lz4_call_and_check_error(LZ4F_compressBegin, ctx_.get(), out_buf_.data(), out_buf_.size(), &prefs_);
+            write_out_buf();
+        }
+
+        void begin_member(const std::size_t size) override
+        {
+            probe_.begin_member(size);
+        }
+
+        void compress(const char* const data, const size_t size) override
+        {
+            const auto uncompressed_size = probe_.uncompressed_size(data, size);
+            update(LZ4F_uncompressedUpdate, data, uncompressed_size);
+            update(LZ4F_compressUpdate, data + uncompressed_size, size - uncompressed_size);
+        }
+
+        void add_header(const block_t& header) override
+        {
+            update(LZ4F_uncompressedUpdate, header.data(), header.size());
+            flush();
+        }
+
+        void flush() override
+        {
+            out_buf_pos_ += lz4_call_and_check_error(LZ4F_flush, ctx_.get(), out_buf_.data(), out_buf_.size(), nullptr);
+            write_out_buf();
+        }
+
+        void end() override
+        {
+            out_buf_pos_ += lz4_call_and_check_error(LZ4F_compressEnd, ctx_.get(), out_buf_.data(), out_buf_.size(), nullptr);
+            write_out_buf();
+        }
+
+    private:
+        static constexpr size_t input_chunk_size_ = 16 * 1024;
+
+        template<typename F>
+        void update(F&& func, const char* const data, const size_t size)
+        {
+            // out_buf_ is sized for input_chunk_size_ bytes of input
+            for (size_t pos = 0; pos < size; pos += input_chunk_size_) {
+                const auto chunk_size = std::min(size - pos, input_chunk_size_);
+                out_buf_pos_ += lz4_call_and_check_error(func, ctx_.get(), out_buf_.data(), out_buf_.size(), data + pos, chunk_size, nullptr);
+                write_out_buf();
+            }
+        }
+
+        void write_out_buf()
+        {
+            output(out_buf_.data(), out_buf_pos_);
+            out_buf_pos_ = 0;
+        }
+
+        lz4_ctx ctx_;
+        LZ4F_preferences_t prefs_;
+        std::vector<char> out_buf_;
+        size_t out_buf_pos_ = 0;
+        lz4_member_probe probe_;
+        bool started_ = false;
+    };
+
+    // Creates the blocks of an lz4 frame using LZ4F_blockIndependent with LZ4F_max256KB,
+    // the same preferences as lz4_compressor, on a pool of worker threads.
+    // Blocks are passed to the output in order and the number of blocks
+    // in flight is limited, which limits the memory used.
+    class lz4_parallel_compressor : public compressor {
+    public:
+        explicit lz4_parallel_compressor(output_t&& output)
+            : compressor(std::move(output)), threads_(std::max(1U, std::thread::hardware_concurrency()))
+        {
+            max_in_flight_ = 2 * threads_;
+        }
+
+        // delete non required special member functions
+        lz4_parallel_compressor(const lz4_parallel_compressor& other) = delete;
+        lz4_parallel_compressor& operator=(const lz4_parallel_compressor& other) = delete;
+        lz4_parallel_compressor(lz4_parallel_compressor&& other) = delete;
+        lz4_parallel_compressor& operator=(lz4_parallel_compressor&& other) = delete;
+
+        ~lz4_parallel_compressor() override
+        {
+            {
+                std::lock_guard lock(mutex_);
+                stop_ = true;
+            }
+            work_available_.notify_all();
+            for (auto& worker : workers_) worker.join();
+        }
+
+        void configure_threads(const unsigned threads, const std::size_t max_in_flight) override
+        {
+            if (!workers_.empty()) throw std::logic_error("compression threads can't be changed after compression started");
+            threads_ = std::max(1U, threads);
+            max_in_flight_ = max_in_flight == 0 ? 2 * threads_ : max_in_flight;
+        }
+
+        // the workers only read the options, so they can't be changed once they run
+        void configure(const lz4_options& options)
+        {
+            if (!workers_.empty() || !input_.empty()) throw std::logic_error("lz4 options can't be changed after compression started");
+            options_ = options;
+            probe_.configure(options);
+        }
+
+        void begin_member(const std::size_t size) override
+        {
+            probe_.begin_member(size);
+        }
+
+        void start() override
+        {
+            // the frame header is the same, only the blocks are created differently
+            lz4_ctx ctx;
+            std::array<char, LZ4F_HEADER_SIZE_MAX> header {};
+            const auto header_size = lz4_call_and_check_error(LZ4F_compressBegin, ctx.get(), header.data(), header.size(), &lz4_compressor::prefs);
+            output(header.data(), header_size);
+        }
+
+        void compress(const char* data, size_t size) override
+        {
+            const auto uncompressed_size = probe_.uncompressed_size(data, size);
+            if (uncompressed_size > 0) {
+                add_uncompressed(data, uncompressed_size);
+                data += uncompressed_size;
+                size -= uncompressed_size;
+            }
+            while (size > 0) {
+                const auto copy_size = std::min(size, BLOCK_MAX_SIZE - input_.size());
+                input_.insert(input_.end(), data, data + copy_size);
+                data += copy_size;
+                size -= copy_size;
+                if (input_.size() == BLOCK_MAX_SIZE) submit_input();
+            }
+        }
+
+        // headers get their own uncompressed block, so they can be rewritten in place
+        void add_header(const block_t& header) override
+        {
+            add_uncompressed(header.data(), header.size());
+        }
+
+        void add_uncompressed(const char* data, std::size_t size)
+        {
+            submit_input();
+            while (size > 0) {
+                const auto block_size = std::min(size, BLOCK_MAX_SIZE);
+                auto job = std::make_unique<block_job>();
+                store_uncompressed(job->output, data, block_size);
+                job->done = true;
+                submit(std::move(job));
+                data += block_size;
+                size -= block_size;
+            }
+        }
+
+        // passes all data to the output, the next data starts a new block
+        void flush() override
+        {
+            submit_input();
+            while (!jobs_.empty()) write_front();
+        }
+
+        void end() override
+        {
+            flush();
+            static constexpr std::array<char, BLOCK_SIZE_FIELD_LEN> end_mark {};
+            output(end_mark.data(), end_mark.size());
+        }
+
+    private:
+        static constexpr std::size_t BLOCK_MAX_SIZE = 256 * 1024;
+        static constexpr std::size_t BLOCK_SIZE_FIELD_LEN = 4;
+        static constexpr uint32_t BLOCK_UNCOMPRESSED_FLAG = 0x80000000U;
+
+        struct block_job {
+            std::vector<char> input;
+            std::vector<char> output;
+            std::exception_ptr error;
+            bool done = false;
+        };
+
+        void submit_input()
+        {
+            if (input_.empty()) return;
+
+            auto job = std::make_unique<block_job>();
+            job->input = std::move(input_);
+            input_ = take_buffer();
+            submit(std::move(job));
+        }
+
+        void submit(std::unique_ptr<block_job>&& job)
+        {
+            start_workers();
+            while (jobs_.size() >= max_in_flight_) write_front();
+
+            {
+                std::lock_guard lock(mutex_);
+                if (!job->done) pending_.push_back(job.get());
+                jobs_.emplace_back(std::move(job));
+            }
+            work_available_.notify_one();
+
+            // pass on finished blocks early, without waiting for the others
+            while (!jobs_.empty() && is_front_done()) write_front();
+        }
+
+        bool is_front_done()
+        {
+            std::lock_guard lock(mutex_);
+            return jobs_.front()->done;
+        }
+
+        void write_front()
+        {
+            std::unique_ptr<block_job> job;
+            {
+                std::unique_lock lock(mutex_);
+                job_done_.wait(lock, [this]() { return jobs_.front()->done; });
+                job = std::move(jobs_.front());
+                jobs_.pop_front();
+            }
+
+            if (job->error) std::rethrow_exception(job->error);
+            output(job->output.data(), job->output.size());
+
+            job->input.clear();
+            free_buffers_.emplace_back(std::move(job->input));
+        }
+
+        std::vector<char> take_buffer()
+        {
+            std::vector<char> buffer;
+            if (!free_buffers_.empty()) {
+                buffer = std::move(free_buffers_.back());
+                free_buffers_.pop_back();
+            }
+            buffer.reserve(BLOCK_MAX_SIZE);
+            return buffer;
+        }
+
+        void start_workers()
+        {
+            if (!workers_.empty()) return;
+            for (auto i = 0U; i < threads_; ++i) {
+                workers_.emplace_back([this]() { compress_blocks(); });
+            }
+        }
+
+        void compress_blocks()
+        {
+            while (true) {
+                block_job* job = nullptr;
+                {
+                    std::unique_lock lock(mutex_);
+                    work_available_.wait(lock, [this]() { return stop_ || !pending_.empty(); });
+                    if (stop_) return;
+                    job = pending_.front();
+                    pending_.pop_front();
+                }
+
+                try {
+                    compress_block(*job);
+                } catch (...) {
+                    job->error = std::current_exception();
+                }
+
+                {
+                    std::lock_guard lock(mutex_);
+                    job->done = true;
+                }
+                job_done_.notify_all();
+            }
+        }
+
+        void compress_block(block_job& job) const
+        {
+            const auto input_size = static_cast<int>(job.input.size());
+            const auto bound = LZ4_compressBound(input_size);
+            job.output.resize(BLOCK_SIZE_FIELD_LEN + bound);
+            auto* const block = job.output.data() + BLOCK_SIZE_FIELD_LEN;
+            // the same choice of algorithm as LZ4F_compressUpdate makes for the level
+            const auto compressed_size = options_.level >= LZ4HC_CLEVEL_MIN
+                                                 ? LZ4_compress_HC(job.input.data(), block, input_size, bound, options_.level)
+                                                 : LZ4_compress_fast(job.input.data(), block, input_size, bound, options_.acceleration);
+
+            // blocks which do not shrink are stored as is, as LZ4F_compressUpdate does
+            if (compressed_size <= 0 || compressed_size >= input_size) {
+                store_uncompressed(job.output, job.input.data(), job.input.size());
+                return;
+            }
+
+            write_block_size(job.output, static_cast<uint32_t>(compressed_size));
+            job.output.resize(BLOCK_SIZE_FIELD_LEN + compressed_size);
+        }
+
+        static void store_uncompressed(std::vector<char>& output, const char* const data, const std::size_t size)
+        {
+            output.resize(BLOCK_SIZE_FIELD_LEN + size);
+            write_block_size(output, static_cast<uint32_t>(size) | BLOCK_UNCOMPRESSED_FLAG);
+            std::copy_n(data, size, output.data() + BLOCK_SIZE_FIELD_LEN);
+        }
+
+        static void write_block_size(std::vector<char>& output, const uint32_t size)
+        {
+            // block sizes are stored little endian
+            for (auto i = 0U; i < BLOCK_SIZE_FIELD_LEN; ++i) {
+                output[i] = static_cast<char>((size >> (8U * i)) & 0xFFU);
+            }
+        }
+
+        unsigned threads_;
+        std::size_t max_in_flight_;
+        lz4_options options_;
+        lz4_member_probe probe_;
+
+        std::vector<char> input_;
+        std::vector<std::vector<char>> free_buffers_;
+
+        // jobs_ is only modified by the writing thread, the mutex guards the
+        // done flags and the queue of jobs waiting for a worker.
+        std::mutex mutex_;
+        std::condition_variable work_available_;
+        std::condition_variable job_done_;
+        std::deque<std::unique_ptr<block_job>> jobs_;
+        std::deque<block_job*> pending_;
+        bool stop_ = false;
+        std::vector<std::thread> workers_;
+    };
+
+#endif
+
+#ifdef WITH_ZSTD
+    struct zstd_options {
+        int level = ZSTD_CLEVEL_DEFAULT;
+        // compression threads, 0 selects the number of cores
+        unsigned workers = 0;
+        // log2 of the window size, 0 selects the default of the level
+        int window_log = 0;
+    };
+
+    // Compresses into zstd frames using the multithreaded streaming compression of zstd.
+    // As zstd can't store a block uncompressed on request, headers which may be rewritten
+    // are stored in separate frames consisting of a single raw block, which ends the
+    // current frame. Fixed size headers keep everything in one frame for the best ratio.
+    class zstd_compressor : public compressor {
+    public:
+        explicit zstd_compressor(output_t&& output)
+            : compressor(std::move(output)), ctx_(ZSTD_createCCtx(), &ZSTD_freeCCtx), out_buf_(ZSTD_CStreamOutSize())
+        {
+            if (ctx_ == nullptr) throw std::runtime_error("can't create zstd compression context");
+            configure(zstd_options {});
+        }
+
+        void configure(const zstd_options& options)
+        {
+            if (started_) throw std::logic_error("zstd options can't be changed after compression started");
+            const auto workers = options.workers == 0 ? std::max(1U, std::thread::hardware_concurrency()) : options.workers;
+            check_error(ZSTD_CCtx_setParameter(ctx_.get(), ZSTD_c_compressionLevel, options.level));
+            check_error(ZSTD_CCtx_setParameter(ctx_.get(), ZSTD_c_nbWorkers, static_cast<int>(workers)));
+            check_error(ZSTD_CCtx_setParameter(ctx_.get(), ZSTD_c_windowLog, options.window_log));
+            options_ = options;
+            options_.workers = workers;
+        }
+
+        void configure_threads(const unsigned threads, [[maybe_unused]] const std::size_t max_in_flight) override
+        {
+            auto options = options_;
+            options.workers = threads;
+            configure(options);
+        }
+
+        void compress(const char* const data, const size_t size) override
+        {
+            started_ = true;
+            frame_open_ = true;
+            stream(data, size, ZSTD_e_continue);
+        }
+
+        void add_header(const block_t& header) override
+        {
+            started_ = true;
+            end_frame();
+
+            // magic, frame header descriptor with single segment and a 2 byte content size of
+            // size - 256, followed by a block header marking the last block as raw block
+            static constexpr std::array<unsigned char, raw_frame_header_size_> frame_header {
+                    0x28, 0xB5, 0x2F, 0xFD, 0x60, static_cast<unsigned char>((BLOCK_SIZE - 256) & 0xFFU),
+                    static_cast<unsigned char>((BLOCK_SIZE - 256) >> 8U), static_cast<unsigned char>(((BLOCK_SIZE << 3U) | 1U) & 0xFFU),
+                    static_cast<unsigned char>(((BLOCK_SIZE << 3U) >> 8U) & 0xFFU), static_cast<unsigned char>((BLOCK_SIZE << 3U) >> 16U)};
+            std::array<char, raw_frame_header_size_ + BLOCK_SIZE> frame {};
+            std::copy(frame_header.begin(), frame_header.end(), frame.begin());
+            std::copy(header.begin(), header.end(), frame.begin() + raw_frame_header_size_);
+            output(frame.data(), frame.size());
+        }
+
+        // zstd frames can be decompressed independently, so flushing ends the frame
+        void flush() override
+        {
+            end_frame();
+        }
+
+        void end() override
+        {
+            end_frame();
+        }
+
+    private:
+        static constexpr size_t raw_frame_header_size_ = 10;
+
+        static size_t check_error(const size_t result)
+        {
+            if (ZSTD_isError(result) != 0) throw std::runtime_error("zstd function failed: error "s + ZSTD_getErrorName(result));
+            return result;
+        }
+
+        void end_frame()
+        {
+            if (!frame_open_) return;
+            stream(nullptr, 0, ZSTD_e_end);
+            frame_open_ = false;
+        }
+
+        void stream(const char* const data, const size_t size, const ZSTD_EndDirective mode)
+        {
+            ZSTD_inBuffer input {data, size, 0};
+            auto remaining = size_t {0};
+            do {
+                ZSTD_outBuffer out {out_buf_.data(), out_buf_.size(), 0};
+                remaining = check_error(ZSTD_compressStream2(ctx_.get(), &out, &input, mode));
+                if (out.pos > 0) output(out_buf_.data(), out.pos);
+            } while (mode == ZSTD_e_continue ? input.pos < input.size : remaining != 0);
+        }
+
+        std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> ctx_;
+        std::vector<char> out_buf_;
+        zstd_options options_;
+        bool started_ = false;
+        bool frame_open_ = false;
+    };
+#endif
+
+    // Counters of a tarfile, maintained if built with WITH_STATISTICS. Work done by prefetch
+    // reader threads and compression worker threads is not included in the times.
+    struct tar_statistics {
+        // payload bytes read from files or passed via add_file_streaming_data
+        uint64_t bytes_in = 0;
+        // bytes passed to the archive file or the callback after compression, including rewritten headers
+        uint64_t bytes_out = 0;
+        // tar blocks before compression
+        uint64_t blocks = 0;
+        uint64_t headers = 0;
+        uint64_t entries = 0;
+        uint64_t flushes = 0;
+        uint64_t seeks = 0;
+        // system calls done by tarfile and its Platform calls, without the ones inside of callbacks
+        uint64_t syscalls = 0;
+
+        // time spent per phase, nested phases are not included in the enclosing one
+        uint64_t metadata_ns = 0;
+        uint64_t read_ns = 0;
+        uint64_t compress_ns = 0;
+        uint64_t write_ns = 0;
+        uint64_t callback_ns = 0;
+    };
+
+    // passed to the entry hook of a tarfile once an entry was archived
+    struct tar_entry_event {
+        std::string_view name;
+        size_t size = 0;
+        std::chrono::nanoseconds duration {};
+    };
+
+    // layout of an archive as predicted by tar_planner
+    struct tar_plan {
+        // including the blocks ending the archive
+        size_t size = 0;
+        // in archive order, the offsets are the ones of the uncompressed archive
+        std::vector<tar_index_entry> members;
+    };
+
+    struct header_decoder;
+    struct tarreader;
+    struct tar_stream_parser;
+    class tar_generator;
+    class tar_planner;
+
+    struct tarfile {
+
+        enum class tar_type {
+            unix_v7,
+            ustar,
+        };
+
+        using callback_t = std::function<void(const block_t&, size_t size)>;
+        // receives the archive in contiguous chunks of the configured size, only the last chunk may be smaller
+        using chunk_callback_t = std::function<void(const char* data, size_t size)>;
+
+        static constexpr size_t default_chunk_size = 1024 * 1024;
+
+#ifdef WITH_COMPRESSION
+        enum class compression_mode : unsigned {
+            none,
+#    ifdef WITH_LZ4
+            lz4,
+            // lz4 frame, blocks are compressed on multiple threads
+            lz4_parallel,
+#    endif
+#    ifdef WITH_ZSTD
+            zstd,
+#    endif
+        };
+
+        explicit tarfile(const std::string& filename,
+                         tar_type type = tar_type::unix_v7,
+                         std::unique_ptr<Platform> platform = std::make_unique<Platform>())
+            : tarfile(filename, compression_mode::none, type, std::move(platform))
+        {
+        }
+
+        explicit tarfile(callback_t&& callback,
+                         tar_type type = tar_type::unix_v7,
+                         std::unique_ptr<Platform> platform = std::make_unique<Platform>())
+            : tarfile(std::move(callback), compression_mode::none, type, std::move(platform))
+        {
+        }
+
+        explicit tarfile(const std::string& filename,
+                         compression_mode compression = compression_mode::none,
+                         tar_type type = tar_type::unix_v7,
+                         std::unique_ptr<Platform> platform = std::make_unique<Platform>())
+            : file_(open_archive(filename)),
+              file_name_(filename),
+              file_buffer_used_(0),
+              callback_(nullptr), mode_(output_mode::file_output),
+              compression_(compression),
+              type_(type), stream_file_header_pos_(-1), stream_block_ {0}, stream_block_used_(0),
+              platform_(std::move(platform))
+        {
+            init_compression();
+        }
+
+        explicit tarfile(callback_t&& callback,
+                         compression_mode compression = compression_mode::none,
+                         tar_type type = tar_type::unix_v7,
+                         std::unique_ptr<Platform> platform = std::make_unique<Platform>())
+            : file_(), file_name_(), file_buffer_used_(0), callback_(std::move(callback)), mode_(output_mode::stream_output),
+              compression_(compression),
+              type_(type), stream_file_header_pos_(-1), stream_block_ {0}, stream_block_used_(0),
+              platform_(std::move(platform))
+        {
+            init_compression();
+        }
+
+        explicit tarfile(chunk_callback_t&& callback,
+                         size_t chunk_size,
+                         tar_type type,
+                         std::unique_ptr<Platform> platform = std::make_unique<Platform>())
+            : tarfile(std::move(callback), chunk_size, compression_mode::none, type, std::move(platform))
+        {
+        }
+
+        explicit tarfile(chunk_callback_t&& callback,
+                         size_t chunk_size = default_chunk_size,
+                         compression_mode compression = compression_mode::none,
+                         tar_type type = tar_type::unix_v7,
+                         std::unique_ptr<Platform> platform = std::make_unique<Platform>())
+            : type_(type), mode_(output_mode::chunked_stream_output), file_name_(), file_(), file_buffer_used_(0),
+              callback_(nullptr), chunk_callback_(std::move(callback)), chunk_size_(chunk_size),
+              stream_file_header_pos_(-1), stream_block_ {0}, stream_block_used_(0),
+              platform_(std::move(platform)), compression_(compression)
+        {
+            if (chunk_size_ == 0) throw std::invalid_argument("chunk size must not be 0");
+            file_buffer_.reserve(chunk_size_);
+            init_compression();
+        }
+
+        // The sink is destroyed with the tarfile, so it can be inspected after close.
+        explicit tarfile(std::unique_ptr<output_sink> sink,
+                         compression_mode compression = compression_mode::none,
+                         tar_type type = tar_type::unix_v7,
+                         std::unique_ptr<Platform> platform = std::make_unique<Platform>())
+            : type_(type), mode_(output_mode::sink_output), file_name_(), file_(), file_buffer_used_(0), sink_(std::move(sink)),
+              callback_(nullptr), stream_file_header_pos_(-1), stream_block_ {0}, stream_block_used_(0),
+              platform_(std::move(platform)), compression_(compression)
+        {
+            if (sink_ == nullptr) throw std::invalid_argument("output sink must not be null");
+            file_buffer_.reserve(sink_->buffer().size, sink_->buffer().alignment);
+            init_compression();
+        }
+
+        explicit tarfile(std::unique_ptr<output_sink> sink,
+                         tar_type type,
+                         std::unique_ptr<Platform> platform = std::make_unique<Platform>())
+            : tarfile(std::move(sink), compression_mode::none, type, std::move(platform))
+        {
+        }
+
+#else
+        explicit tarfile(const std::string& filename, tar_type type = tar_type::unix_v7, std::unique_ptr<Platform> platform = std::make_unique<Platform>())
+            : file_(open_archive(filename)), file_name_(filename), file_buffer_used_(0), callback_(nullptr), mode_(output_mode::file_output), type_(type), stream_block_ {0}, stream_file_header_pos_(-1), stream_block_used_(0), platform_(std::move(platform))
+        {
+            file_buffer_.reserve(file_buffer_default_size_);
+        }
+
+        explicit tarfile(callback_t&& callback,
+                         tar_type type = tar_type::unix_v7, 
+                         std::unique_ptr<Platform> platform = std::make_unique<Platform>())
+            : file_(), file_name_(), file_buffer_used_(0), callback_(std::move(callback)), mode_(output_mode::stream_output),
+              type_(type), stream_file_header_pos_(-1), stream_block_ {0}, stream_block_used_(0), platform_(std::move(platform))
+        {
+            file_buffer_.reserve(file_buffer_default_size_);
+        }
+
+        explicit tarfile(chunk_callback_t&& callback,
+                         size_t chunk_size = default_chunk_size,
+                         tar_type type = tar_type::unix_v7,
+                         std::unique_ptr<Platform> platform = std::make_unique<Platform>())
+            : type_(type), mode_(output_mode::chunked_stream_output), file_name_(), file_(), file_buffer_used_(0),
+              callback_(nullptr), chunk_callback_(std::move(callback)), chunk_size_(chunk_size),
+              stream_file_header_pos_(-1), stream_block_ {0}, stream_block_used_(0), platform_(std::move(platform))
+        {
+            if (chunk_size_ == 0) throw std::invalid_argument("chunk size must not be 0");
+            file_buffer_.reserve(chunk_size_);
+        }
+
+        // The sink is destroyed with the tarfile, so it can be inspected after close.
+        explicit tarfile(std::unique_ptr<output_sink> sink,
+                         tar_type type = tar_type::unix_v7,
+                         std::unique_ptr<Platform> platform = std::make_unique<Platform>())
+            : type_(type), mode_(output_mode::sink_output), file_name_(), file_(), file_buffer_used_(0), sink_(std::move(sink)),
+              callback_(nullptr), stream_file_header_pos_(-1), stream_block_ {0}, stream_block_used_(0), platform_(std::move(platform))
+        {
+            if (sink_ == nullptr) throw std::invalid_argument("output sink must not be null");
+            file_buffer_.reserve(sink_->buffer().size, sink_->buffer().alignment);
+        }
+#endif
+
+        // delete the copy constructor and copy assignment, as multiple instances to the same file are not supported
+        tarfile(const tarfile&) = delete;
+        tarfile(tarfile&&) = delete;
+        tarfile& operator=(const tarfile& other) = delete;
+        tarfile& operator=(const tarfile&& other) = delete;
+
+        ~tarfile()
+        {
+            close();
+        }
+
+        bool is_open()
+        {
+            switch (mode_) {
+                case output_mode::file_output:
+                    return file_.is_open();
+                case output_mode::stream_output:
+                    return callback_ != nullptr;
+                case output_mode::chunked_stream_output:
+                    return chunk_callback_ != nullptr;
+                case output_mode::sink_output:
+                    return sink_open_;
+            }
+            throw std::logic_error("unsupported output mode");
+        }
+
+        void close()
+        {
+            try {
+                if (is_open()) {
+                    finish();
+                    file_close();
+                    callback_ = nullptr;
+                    chunk_callback_ = nullptr;
+                    sink_open_ = false;
+                }
+            } catch (const std::exception& ex) {
+                // ignore exception in destructor, as they cannot be caught.
+            }
+        }
+
+        // Reading ahead is disabled by default (reader_threads == 0). If enabled, the recursive
+        // add functions walk the directory tree and read upcoming entries on background threads
+        // while the calling thread keeps writing the archive in the same order as without prefetching.
+        struct prefetch_options {
+            // number of threads reading entries ahead of the writer
+            unsigned reader_threads = 0;
+            // maximum number of entries between the directory walk and the writer
+            std::size_t queue_depth = 64;
+            // maximum number of payload bytes held in memory by read ahead entries.
+            // Files which do not fit are read by the writer when they are archived.
+            std::size_t memory_limit = 64UL * 1024UL * 1024UL;
+            // number of entries a reader thread passes to Platform::read_ahead at once,
+            // larger batches let io_uring_platform submit them together
+            std::size_t read_batch_size = 1;
+        };
+
+        void set_prefetch_options(const prefetch_options& options)
+        {
+            if (options.reader_threads > 0 && options.queue_depth == 0) throw std::invalid_argument("prefetch queue depth must not be 0");
+            prefetch_options_ = options;
+        }
+
+        // The recursive add functions walk directories with std::filesystem by default. With fd_relative
+        // set they use Platform::walk_directory instead, which resolves every entry relative to the
+        // descriptor of its directory and hands out its metadata, so it isn't queried again by path.
+        struct walk_options {
+            bool fd_relative = false;
+            // archive the entries of each directory in inode order, saves seeks on rotating disks
+            bool inode_order = false;
+        };
+
+        void set_walk_options(const walk_options& options)
+        {
+            if (options.inode_order && !options.fd_relative) throw std::invalid_argument("inode order requires the fd relative walk");
+            walk_options_ = options;
+        }
+
+        // Deduplication is disabled by default. If enabled, regular files with the same content
+        // as a file archived before are stored as hard link to it, even if they are separate inodes.
+        // Files are matched by size and the XXH64 hash of their content, which is computed while
+        // archiving them, so their payload doesn't pass the kernel internal copy anymore. A match is
+        // confirmed by comparing the content with the source of the archived file, no link is stored
+        // if that source changed since it was archived.
+        struct dedup_options {
+            bool enabled = false;
+            // smaller files are always stored, a link saves at most their payload
+            std::size_t min_size = BLOCK_SIZE;
+            // files with the size of an archived file are read into memory up to this size,
+            // larger ones are hashed by an additional read before archiving them and read
+            // once more for the comparison if the hash matches
+            std::size_t max_buffered_size = 64UL * 1024UL * 1024UL;
+        };
+
+        void set_dedup_options(const dedup_options& options)
+        {
+            dedup_options_ = options;
+        }
+
+        // Checksums are disabled by default. If enabled, a digest of the content of every regular file
+        // member is computed while its payload is written, so verifying an archive doesn't need another
+        // read of the input. Zero copy writing is skipped then, as the payload has to pass through memory.
+        // Holes of sparse files are hashed as the zeroes they are extracted to. Payloads of a tar_generator
+        // and in-place header rewrites aren't covered.
+        struct checksum_options {
+            bool enabled = false;
+            checksum_algorithm algorithm = checksum_algorithm::sha256;
+        };
+
+        void set_checksum_options(const checksum_options& options)
+        {
+            checksum_options_ = options;
+        }
+
+        // digests of the regular file members archived so far, in archive order
+        [[nodiscard]] const std::vector<member_checksum>& checksums() const
+        {
+            return checksums_;
+        }
+
+        // Adds a regular file listing the checksums of the members archived before in the format of
+        // sha256sum and xxhsum (xxh64), so an extracted archive can be checked with sha256sum -c.
+        void add_checksum_manifest(const std::string& name)
+        {
+            if (!checksum_options_.enabled) throw std::logic_error("a checksum manifest requires checksums to be enabled");
+
+            std::string content;
+            for (const auto& checksum : checksums_) {
+                // as coreutils does, lines of names with a backslash or newline start with a backslash
+                const auto escape = checksum.name.find_first_of("\\\n") != std::string::npos;
+                if (escape) content.push_back('\\');
+                content.append(checksum.digest).append("  ");
+                for (const auto c : checksum.name) {
+                    if (c == '\\') {
+                        content.append("\\\\");
+                    } else if (c == '\n') {
+                        content.append("\\n");
+                    } else {
+                        content.push_back(c);
+                    }
+                }
+                content.push_back('\n');
+            }
+
+            add_file(name, static_cast<mode_t>(permission_t::owner_read) | static_cast<mode_t>(permission_t::owner_write), 0, 0,
+                     static_cast<mod_time_t>(std::time(nullptr)), content.data(), content.size());
+        }
+
+        // Keeps archiving from evicting the page cache of other processes. Input files are read with
+        // sequential and read ahead hints, pages are dropped once they are archived. In file output mode
+        // the archive is written back while it's written and dropped from the page cache as well.
+        struct page_cache_options {
+            bool drop_input_pages = false;
+            bool drop_output_pages = false;
+            // read ahead of input files and write back granularity of the archive
+            std::size_t window_size = 8UL * 1024UL * 1024UL;
+        };
+
+        void set_page_cache_options(const page_cache_options& options)
+        {
+            if ((options.drop_input_pages || options.drop_output_pages) && options.window_size == 0) throw std::invalid_argument("page cache window size must not be 0");
+            page_cache_options_ = options;
+        }
+
+        // Sparse detection is disabled by default. If enabled, regular files with holes are stored as
+        // PAX sparse entries (GNU sparse format 1.0) which only contain the data extents. Holes are
+        // found via SEEK_DATA and SEEK_HOLE, which is only done for files allocating less than their
+        // size. Requires the ustar format.
+        struct sparse_options {
+            bool enabled = false;
+            // scans files for zero blocks if the filesystem doesn't report holes or all files are
+            // allocated completely, i.e. copied without preserving holes. Reads every file twice.
+            bool scan_for_zeros = false;
+            // holes smaller than this are stored as zeroes, rounded up to BLOCK_SIZE
+            std::size_t min_hole_size = 16 * BLOCK_SIZE;
+        };
+
+#ifdef WITH_STATISTICS
+        using entry_hook_t = std::function<void(const tar_entry_event& event)>;
+
+        [[nodiscard]] const tar_statistics& statistics() const
+        {
+            return statistics_;
+        }
+
+        // called on the archiving thread after each entry, so it should return quickly
+        void set_entry_hook(entry_hook_t hook)
+        {
+            entry_hook_ = std::move(hook);
+        }
+
+#endif
+        void set_sparse_options(const sparse_options& options)
+        {
+            if (options.enabled && type_ != tar_type::ustar) throw std::logic_error("sparse files need the ustar format");
+            sparse_options_ = options;
+        }
+
+        // Defines how headers of regular files are written in file output mode.
+        enum class header_mode {
+            // the header is written after the file content with the number of bytes
+            // actually read, which requires flushing and seeking for every file
+            rewrite,
+            // the header is written up front with the size from the file metadata
+            // and only patched if the size changed while reading the file.
+            // Falls back to rewrite for compressed archives.
+            patch,
+            // the header is written up front with the size from the file metadata,
+            // the content is truncated or filled up with zeroes to match it, as for
+            // stream output. Headers are never rewritten, so compressed archives
+            // don't need to end a block for every entry.
+            fixed_size,
+        };
+
+        void set_header_mode(const header_mode mode)
+        {
+            header_mode_ = mode;
+        }
+
+        // Writes an index of all members to index_filename while the archive is written, see tar_index.
+        // Has to be called before the first member is added.
+        void set_index_file(const std::string& index_filename)
+        {
+            if (!stored_files_.empty() || stream_file_header_pos_ >= 0) throw std::logic_error("the index file has to be set before adding members");
+            index_writer_ = std::make_unique<index_writer>(index_filename);
+        }
+
+        // Reserves disk space for an archive of size bytes in file output mode, e.g. as predicted by
+        // tar_planner. Keeps the archive from fragmenting, the file size is not changed.
+        void preallocate(const size_t size)
+        {
+            if (mode_ != output_mode::file_output) throw std::logic_error(__func__ + " only supports output mode file"s);
+            count(&tar_statistics::syscalls);
+            platform_->preallocate(file_.get(), static_cast<off_t>(size));
+        }
+
+        // Enables incremental archiving against the snapshot of a previous run. Entries added from
+        // the file system are left out if their dev, ino, size, mtime and ctime are unchanged,
+        // directories are always added. Has to be called before the first member is added.
+        void set_incremental(tar_snapshot previous)
+        {
+            if (!stored_files_.empty() || stream_file_header_pos_ >= 0) throw std::logic_error("incremental mode has to be set before adding members");
+            previous_snapshot_ = std::move(previous);
+            snapshot_ = tar_snapshot();
+        }
+
+        // all entries read from the file system in incremental mode, the base for the next run
+        [[nodiscard]] const tar_snapshot& snapshot() const
+        {
+            return snapshot_;
+        }
+
+        // names of the previous snapshot which haven't been seen by this run so far
+        [[nodiscard]] std::vector<std::string> deleted_entries() const
+        {
+            if (!previous_snapshot_.has_value()) throw std::logic_error("deleted entries require incremental mode");
+            return previous_snapshot_->removed_in(snapshot_);
+        }
+
+        // Records deleted_entries() as a regular file, each name terminated by a zero byte.
+        // Should be added after all other entries.
+        void add_deletion_list(const std::string& name)
+        {
+            std::string content;
+            for (const auto& deleted : deleted_entries()) {
+                content.append(deleted);
+                content.push_back('\0');
+            }
+
+            add_file(name, static_cast<mode_t>(permission_t::owner_read) | static_cast<mode_t>(permission_t::owner_write), 0, 0,
+                     static_cast<mod_time_t>(std::time(nullptr)), content.data(), content.size());
+        }
+
+#ifdef WITH_COMPRESSION
+        // Configures the threads of compression_mode::lz4_parallel and zstd, must be called before any data is compressed.
+        // max_blocks_in_flight limits the memory of lz4_parallel to roughly 512KB per block, 0 selects 2 * threads.
+        void set_compression_threads(const unsigned threads, const std::size_t max_blocks_in_flight = 0)
+        {
+            if (compressor_ == nullptr) throw std::logic_error("compression threads require compression");
+            compressor_->configure_threads(threads, max_blocks_in_flight);
+        }
+
+#endif
+#ifdef WITH_LZ4
+        // Configures compression_mode::lz4 and lz4_parallel, must be called before any data is compressed.
+        void set_lz4_options(const lz4_options& options)
+        {
+            if (options.level < 0 || options.level > LZ4HC_CLEVEL_MAX) throw std::invalid_argument("invalid lz4 compression level");
+            if (options.acceleration < 1) throw std::invalid_argument("lz4 acceleration must be at least 1");
+            if (options.acceleration > 1 && options.level != 0) throw std::invalid_argument("lz4 acceleration requires level 0");
+            if (options.adaptive && (options.probe_size == 0 || options.max_ratio_percent == 0))
+                throw std::invalid_argument("lz4 probe size and ratio must not be 0");
+
+            switch (compression_) {
+                case compression_mode::lz4:
+                    static_cast<lz4_compressor&>(*compressor_).configure(options);
+                    return;
+                case compression_mode::lz4_parallel:
+                    static_cast<lz4_parallel_compressor&>(*compressor_).configure(options);
+                    return;
+                default:
+                    throw std::logic_error("lz4 options are only supported for the lz4 compression modes");
+            }
+        }
+
+#endif
+#ifdef WITH_ZSTD
+        // Configures compression_mode::zstd, must be called before any data is compressed.
+        void set_zstd_options(const zstd_options& options)
+        {
+            if (compression_ != compression_mode::zstd) throw std::logic_error("zstd options are only supported for compression_mode::zstd");
+            static_cast<zstd_compressor&>(*compressor_).configure(options);
+        }
+
+#endif
+        void add_from_filesystem_recursive(const std::string& path, bool read_symlinks = false)
+        {
+            if (source_metadata(path).type != file_type_flag::DIRECTORY) {
+                add_from_filesystem(path, read_symlinks);
+            } else if (prefetch_options_.reader_threads > 0) {
+                add_prefetched([&](const prefetch_pipeline::push_t& push) {
+                    if (walk_options_.fd_relative) {
+                        platform_->walk_directory(path, walk_options_.inode_order, [&](const walk_entry& entry) {
+                            const std::string entry_path(entry.path);
+                            push(entry_path, entry_path);
+                        });
+                        return;
+                    }
+                    platform_->iterateDirectory(path, [&](const std::string& callback_path) {
+                        push(callback_path, callback_path);
+                    });
+                },
+                               read_symlinks);
+            } else if (walk_options_.fd_relative) {
+                platform_->walk_directory(path, walk_options_.inode_order, [&](const walk_entry& entry) {
+                    add_walked(entry, std::string(entry.path), read_symlinks);
+                });
+            } else {
+                platform_->iterateDirectory(path, [&](const std::string& callback_path) {
+                    add_from_filesystem(callback_path, read_symlinks);
+                });
+            }
+        }
+
+        void add_from_filesystem_recursive(const std::string& source_path, std::string target_path, bool read_symlinks = false)
+        {
+            if (target_path.find("../") != std::string::npos) throw std::invalid_argument("target path can't contain ../");
+            if (target_path.find("/..") != std::string::npos) throw std::invalid_argument("target path can't contain /..");
+            if (target_path == "..") throw std::invalid_argument("target path can't be ..");
+            if (target_path.empty()) throw std::invalid_argument("target path cannot be empty");
+            if (target_path.rfind('/') == target_path.size() - 1) target_path = target_path.substr(0, target_path.size() - 1);
+
+            if (source_metadata(source_path).type != file_type_flag::DIRECTORY) {
+                add_from_filesystem(source_path, target_path, read_symlinks);
+            } else if (prefetch_options_.reader_threads > 0) {
+                add_prefetched([&](const prefetch_pipeline::push_t& push) {
+                    if (walk_options_.fd_relative) {
+                        platform_->walk_directory(source_path, walk_options_.inode_order, [&](const walk_entry& entry) {
+                            push(std::string(entry.path), target_path + std::string(entry.path.substr(source_path.size())));
+                        });
+                        return;
+                    }
+                    platform_->iterateDirectory(source_path, [&](const std::string& callback_path) {
+                        auto target = callback_path;
+                        target.replace(target.begin(), target.begin() + source_path.size(), target_path);
+                        push(callback_path, target);
+                    });
+                },
+                               read_symlinks);
+            } else if (walk_options_.fd_relative) {
+                platform_->walk_directory(source_path, walk_options_.inode_order, [&](const walk_entry& entry) {
+                    add_walked(entry, target_path + std::string(entry.path.substr(source_path.size())), read_symlinks);
+                });
+            } else {
+                platform_->iterateDirectory(source_path, [&](const std::string& callback_path) {
+                    auto target = callback_path;
+                    target.replace(target.begin(), target.begin() + source_path.size(), target_path);
+                    add_from_filesystem(callback_path, target, read_symlinks);
+                });
+            }
+        }
+
+        void add_from_filesystem(const std::string& filename, bool read_symlinks = false)
+        {
+            check_state_and_flush();
+            read_from_filesystem_write_to_tar(filename, filename, source_metadata(filename), read_symlinks);
+        }
+
+        void add_from_filesystem(const std::string& source_path, const std::string& target_path, bool read_symlinks = false)
+        {
+            if (target_path.find("../") != std::string::npos) throw std::invalid_argument("target path can't contain ../");
+            if (target_path.find("/..") != std::string::npos) throw std::invalid_argument("target path can't contain /..");
+            if (target_path == "..") throw std::invalid_argument("target path can't be ..");
+            if (target_path.empty()) throw std::invalid_argument("target path cannot be empty");
+
+            const auto metadata = source_metadata(source_path);
+            if (metadata.type != file_type_flag::DIRECTORY && target_path.rfind('/') == target_path.size() - 1) {
+                throw std::invalid_argument("target path can't end with / for non directories");
+            }
+
+            check_state_and_flush();
+            read_from_filesystem_write_to_tar(source_path, target_path, metadata, read_symlinks);
+        }
+
+        // adds a regular file with the given content, unlike add_file_streaming in all output modes
+        void add_file(const std::string& name, mode_t mode, uid_t uid, gid_t gid, mod_time_t mod_time, const char* const data, const size_t size)
+        {
+            check_state_and_flush();
+            write_header(name, mode, uid, gid, size, mod_time, file_type_flag::REGULAR_FILE);
+            count(&tar_statistics::bytes_in, size);
+            begin_payload_checksum();
+            digest_payload(data, size);
+            const auto aligned_size = size - size % BLOCK_SIZE;
+            if (aligned_size > 0) write(data, aligned_size);
+            if (aligned_size < size) {
+                block_t block {};
+                std::copy_n(data + aligned_size, size - aligned_size, block.begin());
+                write(block);
+            }
+            finish_payload_checksum(name);
+            entry_finished(name, size);
+        }
+
+        void add_symlink(const std::string& file_name, const std::string& link_name, uid_t uid, gid_t gid, mod_time_t time)
+        {
+            check_state_and_flush();
+            write_header(link_name, static_cast<mode_t>(tarxx::permission_t::all_all), uid, gid, 0U, time,
                          file_type_flag::SYMBOLIC_LINK, 0U, 0U, file_name);
+            entry_finished(link_name, 0);
+        }
+
+        void add_hardlink(const std::string& file_name, const std::string& link_name, uid_t uid, gid_t gid,
+                          mod_time_t time)
+        {
+            check_state_and_flush();
+            write_header(link_name, static_cast<mode_t>(tarxx::permission_t::all_all), uid, gid, 0U, time,
+                         file_type_flag::HARD_LINK, 0U, 0U, file_name);
+            entry_finished(link_name, 0);
+        }
+
+        void add_character_special_file(const std::string& name, mode_t mode, uid_t uid, gid_t gid, size_t size,
+                                        mod_time_t time, major_t dev_major, minor_t dev_minor)
+        {
+            check_state_and_flush();
+            write_header(name, mode, uid, gid, size, time, file_type_flag::CHARACTER_SPECIAL_FILE, dev_major,
+                         dev_minor);
+            entry_finished(name, 0);
+        }
+
+        void add_block_special_file(const std::string& name, mode_t mode, uid_t uid, gid_t gid, size_t size, mod_time_t time,
+                                    major_t dev_major, minor_t dev_minor)
+        {
+            check_state_and_flush();
+            write_header(name, mode, uid, gid, size, time, file_type_flag::BLOCK_SPECIAL_FILE, dev_major, dev_minor);
+            entry_finished(name, 0);
+        }
+
+        void add_fifo(const std::string& name, mode_t mode, uid_t uid, gid_t gid, mod_time_t time)
+        {
+            check_state_and_flush();
+            write_header(name, mode, uid, gid, 0, time, file_type_flag::FIFO);
+            entry_finished(name, 0);
+        }
+
+        void add_directory(const std::string& dirname, mode_t mode, uid_t uid, gid_t gid, mod_time_t mod_time)
+        {
+            check_state_and_flush();
+            write_header(dirname, mode, uid, gid, 0, mod_time, file_type_flag::DIRECTORY);
+            entry_finished(dirname, 0);
+        }
+
+        void add_file_streaming()
+        {
+            if (mode_ != output_mode::file_output && mode_ != output_mode::sink_output)
+                throw std::logic_error(__func__ + " only supports output mode file or sink"s);
+            check_state_and_flush();
+            // the header is rewritten in place, no compressed data may be pending
+            flush_compressor();
+
+            // write empty header
+            if (index_writer_ != nullptr) placeholder_position_ = next_index_position();
+            stream_file_header_pos_ = begin_header_rewrite();
+            block_t header {};
+            write(header, true);
+            begin_payload_checksum();
+        }
+
+        void add_file_streaming_data(const char* const data, std::streamsize size)
+        {
+            if (!is_open()) throw std::logic_error("Cannot append file, tar archive is not open");
+            if (stream_file_header_pos_ < 0)
+                throw std::logic_error("Can't stream file data, no file added via add_file_streaming");
+            if (size == 0) return;
+            count(&tar_statistics::bytes_in, static_cast<uint64_t>(size));
+            digest_payload(data, static_cast<size_t>(size));
+
+            unsigned long pos = 0;
+            block_t block;
+
+            // fill a new block with old and new data if enough data
+            // is available to fill a whole block
+            if ((stream_block_used_ + size) >= BLOCK_SIZE) {
+                // copy saved data
+                std::copy_n(stream_block_.data(), stream_block_used_, block.data());
+
+                // copy from new data
+                const auto copy_from_new_data = BLOCK_SIZE - stream_block_used_;
+                std::copy_n(data, copy_from_new_data, block.data() + stream_block_used_);
+
+                // write new complete block
+                write(block);
+
+                pos += copy_from_new_data;
+                size -= copy_from_new_data;
+                stream_block_used_ = 0;
+            }
+
+            // pass all whole blocks at once, without copying them into blocks first
+            const auto aligned_size = size - (size % BLOCK_SIZE);
+            if (aligned_size > 0) {
+                write(data + pos, aligned_size);
+                pos += aligned_size;
+                size -= aligned_size;
+            }
+
+            // store remaining data for next call or stream_file_complete
+            std::copy_n(data + pos, size, stream_block_.data() + stream_block_used_);
+            stream_block_used_ += size;
+        }
+
+        void stream_file_complete(const std::string& filename, mode_t mode, uid_t uid, gid_t gid, size_t size,
+                                  mod_time_t mod_time)
+        {
+            if (stream_file_header_pos_ < 0) throw std::logic_error("Can't finish stream file, none is in progress");
+
+            // create last block, 0 init to ensure correctness if size < block size
+            // but do not create an empty block
+            if (stream_block_used_ > 0) {
+                block_t block {};
+                std::copy_n(stream_block_.data(), stream_block_used_, block.data());
+                stream_block_used_ = 0;
+                write(block);
+            }
+
+            // flush is necessary so seek to the correct positions
+            flush_compressor();
+
+            // seek to header
+            const auto stream_pos = file_tell();
+            file_seek(stream_file_header_pos_);
+            stream_file_header_pos_ = -1;
+            write_header(filename, mode, uid, gid, size, mod_time, file_type_flag::REGULAR_FILE, 0, 0, "", true);
+            file_seek(stream_pos);
+            finish_payload_checksum(filename);
+            entry_finished(filename, size);
+        }
+
+    private:
+        // Offsets
+        static constexpr unsigned int UNIX_V7_USTAR_HEADER_POS_NAME = 0U;
+        static constexpr unsigned int UNIX_V7_USTAR_HEADER_POS_MODE = 100U;
+        static constexpr unsigned int UNIX_V7_USTAR_HEADER_POS_UID = 108U;
+        static constexpr unsigned int UNIX_V7_USTAR_HEADER_POS_GID = 116U;
+        static constexpr unsigned int UNIX_V7_USTAR_HEADER_POS_SIZE = 124U;
+        static constexpr unsigned int UNIX_V7_USTAR_HEADER_POS_MTIM = 136U;
+        static constexpr unsigned int UNIX_V7_USTAR_HEADER_POS_CHECKSUM = 148U;
+        static constexpr unsigned int UNIX_V7_USTAR_HEADER_POS_TYPEFLAG = 156U;
+        static constexpr unsigned int UNIX_V7_USTAR_HEADER_POS_LINKNAME = 157U;
+
+        static constexpr unsigned int USTAR_HEADER_POS_MAGIC = 257U;
+        static constexpr unsigned int USTAR_HEADER_POS_UNAME = 265U;
+        static constexpr unsigned int USTAR_HEADER_POS_GNAME = 297U;
+        static constexpr unsigned int USTAR_HEADER_POS_DEVMAJOR = 329U;
+        static constexpr unsigned int USTAR_HEADER_POS_DEVMINOR = 337U;
+        static constexpr unsigned int USTAR_HEADER_POS_PREFIX = 345U;
+
+        // Lengths
+        static constexpr unsigned int UNIX_V7_USTAR_HEADER_LEN_NAME = 100U;
+        static constexpr unsigned int UNIX_V7_USTAR_HEADER_LEN_MODE = 8U;
+        static constexpr unsigned int UNIX_V7_USTAR_HEADER_LEN_UID = 8U;
+        static constexpr unsigned int UNIX_V7_USTAR_HEADER_LEN_GID = 8U;
+        static constexpr unsigned int UNIX_V7_USTAR_HEADER_LEN_SIZE = 12U;
+        static constexpr unsigned int UNIX_V7_USTAR_HEADER_LEN_MTIM = 12U;
+        static constexpr unsigned int UNIX_V7_USTAR_HEADER_LEN_CHKSUM = 8U;
+        static constexpr unsigned int UNIX_V7_USTAR_HEADER_LEN_TYPEFLAG = 1U;
+        static constexpr unsigned int UNIX_V7_USTAR_HEADER_LEN_LINKNAME = 100U;
+
+        static constexpr unsigned int USTAR_HEADER_LEN_MAGIC = 6U;
+        static constexpr unsigned int USTAR_HEADER_LEN_UNAME = 32U;
+        static constexpr unsigned int USTAR_HEADER_LEN_GNAME = 32U;
+        static constexpr unsigned int USTAR_HEADER_LEN_DEVMAJOR = 8U;
+        static constexpr unsigned int USTAR_HEADER_LEN_DEVMINOR = 8U;
+        static constexpr unsigned int USTAR_HEADER_LEN_PREFIX = 155U;
+
+        // type flag of PAX extended headers, which apply to the next member
+        static constexpr char PAX_EXTENDED_HEADER = 'x';
+        static constexpr char PAX_GLOBAL_HEADER = 'g';
+
+        // the reader parses the header layout written here
+        friend struct header_decoder;
+        friend struct tarreader;
+        friend struct tar_stream_parser;
+        // drives the archiving of single entries and writes the payload of regular files itself
+        friend class tar_generator;
+        friend class tar_planner;
+
+        // Adds the time until destruction to a phase counter and pauses the enclosing phase
+        // meanwhile. Compiles to nothing without WITH_STATISTICS.
+        class phase_timer {
+        public:
+#ifdef WITH_STATISTICS
+            phase_timer(tarfile& tar, uint64_t tar_statistics::*phase)
+                : tar_(tar), outer_phase_(tar.active_phase_)
+            {
+                const auto now = std::chrono::steady_clock::now();
+                if (outer_phase_ != nullptr) tar_.statistics_.*outer_phase_ += elapsed_ns(tar_.phase_start_, now);
+                tar_.active_phase_ = phase;
+                tar_.phase_start_ = now;
+            }
+
+            ~phase_timer()
+            {
+                const auto now = std::chrono::steady_clock::now();
+                tar_.statistics_.*tar_.active_phase_ += elapsed_ns(tar_.phase_start_, now);
+                tar_.active_phase_ = outer_phase_;
+                tar_.phase_start_ = now;
+            }
+#else
+            phase_timer(tarfile&, uint64_t tar_statistics::*) {}
+#endif
+
+            // delete copy and move special member functions
+            phase_timer(const phase_timer& other) = delete;
+            phase_timer& operator=(const phase_timer& other) = delete;
+            phase_timer(phase_timer&& other) = delete;
+            phase_timer& operator=(phase_timer&& other) = delete;
+
+#ifdef WITH_STATISTICS
+        private:
+            tarfile& tar_;
+            uint64_t tar_statistics::*const outer_phase_;
+#endif
+        };
+
+        void count([[maybe_unused]] uint64_t tar_statistics::*counter, [[maybe_unused]] const uint64_t value = 1)
+        {
+#ifdef WITH_STATISTICS
+            statistics_.*counter += value;
+#endif
+        }
+
+        static uint64_t elapsed_ns(const std::chrono::steady_clock::time_point start, const std::chrono::steady_clock::time_point end)
+        {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        }
+
+        void entry_started()
+        {
+#ifdef WITH_STATISTICS
+            entry_start_ = std::chrono::steady_clock::now();
+#endif
+        }
+
+        void entry_finished([[maybe_unused]] const std::string& name, [[maybe_unused]] const size_t size)
+        {
+#ifdef WITH_STATISTICS
+            ++statistics_.entries;
+            if (entry_hook_) entry_hook_({name, size, std::chrono::steady_clock::now() - entry_start_});
+#endif
+        }
+
+        [[nodiscard]] std::optional<file_metadata> query_metadata(const std::string& path, const bool follow_symlinks)
+        {
+            const phase_timer timer(*this, &tar_statistics::metadata_ns);
+            count(&tar_statistics::syscalls);
+            return platform_->metadata(path, follow_symlinks);
+        }
+
+        void invoke_callback(const block_t& block, const size_t size)
+        {
+            const phase_timer timer(*this, &tar_statistics::callback_ns);
+            count(&tar_statistics::bytes_out, size);
+            callback_(block, size);
+        }
+
+        void invoke_chunk_callback(const char* const data, const size_t size)
+        {
+            const phase_timer timer(*this, &tar_statistics::callback_ns);
+            count(&tar_statistics::bytes_out, size);
+            chunk_callback_(data, size);
+        }
+
+        // passes on all compressed data, so the output matches all data written so far
+        void flush_compressor()
+        {
+#ifdef WITH_COMPRESSION
+            if (compressor_ == nullptr) return;
+            const phase_timer timer(*this, &tar_statistics::compress_ns);
+            count(&tar_statistics::flushes);
+            start_compressor();
+            compressor_->flush();
+#endif
+        }
+
+        void begin_payload_checksum()
+        {
+            if (checksum_options_.enabled) payload_checksum_.emplace(checksum_options_.algorithm);
+        }
+
+        void digest_payload(const char* const data, const size_t size)
+        {
+            if (payload_checksum_.has_value()) payload_checksum_->update(data, size);
+        }
+
+        void finish_payload_checksum(const std::string& name)
+        {
+            if (!payload_checksum_.has_value()) return;
+            checksums_.push_back({std::string(platform_->relative_path(name)), payload_checksum_->hex_digest()});
+            payload_checksum_.reset();
+        }
+
+        // lets the compressor adapt to the payload which follows a header
+        void begin_compressed_member([[maybe_unused]] const size_t size)
+        {
+#ifdef WITH_COMPRESSION
+            if (compressor_ != nullptr) compressor_->begin_member(size);
+#endif
+        }
+
+        // Requests the next window of an input file ahead of reading it and drops the consumed part,
+        // the whole file is dropped on destruction.
+        class input_cache_advisor {
+        public:
+            input_cache_advisor(const OS& os, const int fd, const size_t window_size)
+                : os_(os), fd_(fd), window_size_(static_cast<off_t>(window_size))
+            {
+                os_.advise(fd_, 0, 0, access_advice::sequential);
+                os_.advise(fd_, 0, window_size_, access_advice::will_need);
+            }
+
+            // delete copy and move special member functions
+            input_cache_advisor(const input_cache_advisor& other) = delete;
+            input_cache_advisor& operator=(const input_cache_advisor& other) = delete;
+            input_cache_advisor(input_cache_advisor&& other) = delete;
+            input_cache_advisor& operator=(input_cache_advisor&& other) = delete;
+
+            ~input_cache_advisor()
+            {
+                os_.advise(fd_, 0, 0, access_advice::dont_need);
+            }
+
+            void consumed(const size_t size)
+            {
+                position_ += static_cast<off_t>(size);
+                if (position_ - dropped_ < window_size_) return;
+                os_.advise(fd_, dropped_, position_ - dropped_, access_advice::dont_need);
+                os_.advise(fd_, position_, window_size_, access_advice::will_need);
+                dropped_ = position_;
+            }
+
+            [[nodiscard]] size_t window_size() const
+            {
+                return static_cast<size_t>(window_size_);
+            }
+
+        private:
+            const OS& os_;
+            const int fd_;
+            const off_t window_size_;
+            off_t position_ = 0;
+            off_t dropped_ = 0;
+        };
+
+        // reads the content of a regular file, starting with data
+        // which might have been read ahead by the prefetch pipeline
+        class payload_reader {
+        public:
+            // all data read is added to hash, if given
+            explicit payload_reader(const file_descriptor& infile, const std::vector<char>* prefix = nullptr, xxh64* hash = nullptr,
+                                    input_cache_advisor* advisor = nullptr)
+                : infile_(infile), prefix_(prefix), hash_(hash), advisor_(advisor)
+            {
+            }
+
+            size_t read_block(block_t& block)
+            {
+                const auto prefix = take_prefix(block.size());
+                std::copy_n(prefix.data(), prefix.size(), block.data());
+
+                size_t read_bytes = prefix.size();
+                while (read_bytes < block.size()) {
+                    const auto result = ::read(infile_.get(), block.data() + read_bytes, block.size() - read_bytes);
+                    if (result < 0) {
+                        if (errno == EINTR) continue;
+                        throw errno_exception();
+                    }
+                    if (result == 0) break;
+                    read_bytes += result;
+                }
+                if (hash_ != nullptr) hash_->update(block.data(), read_bytes);
+                if (advisor_ != nullptr) advisor_->consumed(read_bytes);
+                return read_bytes;
+            }
+
+            // hands out at most max_size bytes of the not yet consumed read ahead data
+            std::string_view take_prefix(const size_t max_size)
+            {
+                if (prefix_ == nullptr) return {};
+                const auto size = std::min<size_t>(max_size, prefix_->size() - prefix_pos_);
+                const std::string_view prefix(prefix_->data() + prefix_pos_, size);
+                prefix_pos_ += size;
+                return prefix;
+            }
+
+            [[nodiscard]] int fd() const
+            {
+                return infile_.get();
+            }
+
+            [[nodiscard]] input_cache_advisor* advisor() const
+            {
+                return advisor_;
+            }
+
+        private:
+            const file_descriptor& infile_;
+            const std::vector<char>* prefix_;
+            xxh64* hash_;
+            input_cache_advisor* advisor_;
+            size_t prefix_pos_ = 0;
+        };
+
+        size_t read_payload_block(payload_reader& reader, block_t& block)
+        {
+            const phase_timer timer(*this, &tar_statistics::read_ns);
+            count(&tar_statistics::syscalls);
+            const auto read = reader.read_block(block);
+            count(&tar_statistics::bytes_in, read);
+            return read;
+        }
+
+        // fingerprints of archived regular files, grouped by size
+        class fingerprint_table {
+        public:
+            [[nodiscard]] bool has_size(const size_t size) const
+            {
+                return by_size_.find(size) != by_size_.end();
+            }
+
+            // an archived file, its source is kept to compare the content of a match
+            struct fingerprint {
+                uint64_t hash;
+                std::string_view name;
+                std::string source_path;
+                tar_snapshot_entry source;
+            };
+
+            [[nodiscard]] const fingerprint* find(const size_t size, const uint64_t hash) const
+            {
+                const auto iter = by_size_.find(size);
+                if (iter == by_size_.end()) return nullptr;
+                for (const auto& fingerprint : iter->second) {
+                    if (fingerprint.hash == hash) return &fingerprint;
+                }
+                return nullptr;
+            }
+
+            // name has to outlive the table
+            void add(const size_t size, fingerprint&& fingerprint)
+            {
+                if (find(size, fingerprint.hash) == nullptr) by_size_[size].push_back(std::move(fingerprint));
+            }
+
+        private:
+            std::unordered_map<size_t, std::vector<fingerprint>> by_size_;
+        };
+
+        // if the file grew, the writer reads the remainder from infile
+        struct prefetched_entry : read_ahead_request {
+            std::string target_path;
+            // failure of the directory walk, raised when the writer reaches this entry
+            std::exception_ptr error;
+            bool ready = false;
+        };
+
+        // Walks a directory tree on one thread and reads metadata and content of upcoming entries
+        // on a pool of reader threads. Entries are handed to the (single) writer in walk order.
+        // Reader failures are not reported, the writer archives such entries without prefetched
+        // data and runs into the error itself, the same way as without prefetching.
+        class prefetch_pipeline {
+        public:
+            using push_t = std::function<void(const std::string& source_path, const std::string& target_path)>;
+            using walk_t = std::function<void(const push_t&)>;
+
+            // payloads of entries unchanged since previous_snapshot are not read
+            prefetch_pipeline(const Platform& platform, const prefetch_options& options, walk_t&& walk,
+                              const tar_snapshot* previous_snapshot = nullptr)
+                : platform_(platform), options_(options), previous_snapshot_(previous_snapshot)
+            {
+                walker_ = std::thread([this, walk = std::move(walk)]() {
+                    try {
+                        walk([this](const std::string& source_path, const std::string& target_path) {
+                            push(source_path, target_path);
+                        });
+                    } catch (const stopped&) {
+                        // writer gave up, nothing to report
+                    } catch (...) {
+                        push_error(std::current_exception());
+                    }
+
+                    std::lock_guard lock(mutex_);
+                    walk_done_ = true;
+                    entry_ready_.notify_all();
+                });
+
+                for (auto i = 0U; i < options_.reader_threads; ++i) {
+                    readers_.emplace_back([this]() { read_entries(); });
+                }
+            }
+
+            // delete non required special member functions
+            prefetch_pipeline(const prefetch_pipeline& other) = delete;
+            prefetch_pipeline& operator=(const prefetch_pipeline& other) = delete;
+            prefetch_pipeline(prefetch_pipeline&& other) = delete;
+            prefetch_pipeline& operator=(prefetch_pipeline&& other) = delete;
+
+            ~prefetch_pipeline()
+            {
+                {
+                    std::lock_guard lock(mutex_);
+                    stop_ = true;
+                }
+                space_available_.notify_all();
+                work_available_.notify_all();
+                walker_.join();
+                for (auto& reader : readers_) reader.join();
+            }
+
+            // returns the next entry in walk order or nullptr if the walk is complete
+            std::unique_ptr<prefetched_entry> next()
+            {
+                std::unique_lock lock(mutex_);
+                entry_ready_.wait(lock, [this]() {
+                    return (!entries_.empty() && entries_.front()->ready) || (walk_done_ && entries_.empty());
+                });
+                if (entries_.empty()) return nullptr;
+
+                auto entry = std::move(entries_.front());
+                entries_.pop_front();
+                if (next_to_read_ > 0) --next_to_read_;
+                space_available_.notify_one();
+                return entry;
+            }
+
+            // returns the memory of an entry after it has been written
+            void recycle(std::unique_ptr<prefetched_entry>&& entry)
+            {
+                std::lock_guard lock(mutex_);
+                if (buffer_pool_.size() < options_.queue_depth) {
+                    entry->data.clear();
+                    buffer_pool_.emplace_back(std::move(entry->data));
+                } else {
+                    memory_used_ -= entry->data.capacity();
+                }
+            }
+
+        private:
+            struct stopped {};
+
+            void push(const std::string& source_path, const std::string& target_path)
+            {
+                auto entry = std::make_unique<prefetched_entry>();
+                entry->source_path = source_path;
+                entry->target_path = target_path;
+
+                std::unique_lock lock(mutex_);
+                space_available_.wait(lock, [this]() { return stop_ || entries_.size() < options_.queue_depth; });
+                if (stop_) throw stopped();
+                entries_.emplace_back(std::move(entry));
+                work_available_.notify_one();
+            }
+
+            void push_error(std::exception_ptr error)
+            {
+                auto entry = std::make_unique<prefetched_entry>();
+                entry->error = std::move(error);
+                entry->ready = true;
+
+                std::lock_guard lock(mutex_);
+                entries_.emplace_back(std::move(entry));
+                entry_ready_.notify_all();
+            }
+
+            void read_entries()
+            {
+                std::vector<prefetched_entry*> batch;
+                std::vector<read_ahead_request*> requests;
+                while (true) {
+                    batch.clear();
+                    requests.clear();
+                    {
+                        std::unique_lock lock(mutex_);
+                        work_available_.wait(lock, [this]() { return stop_ || next_to_read_ < entries_.size(); });
+                        if (stop_) return;
+                        while (next_to_read_ < entries_.size() && batch.size() < std::max<std::size_t>(options_.read_batch_size, 1)) {
+                            batch.push_back(entries_.at(next_to_read_++).get());
+                        }
+                    }
+
+                    for (auto* const entry : batch) {
+                        if (!entry->error) requests.push_back(entry);
+                    }
+                    platform_.read_ahead(requests, [this](read_ahead_request& request) {
+                        return select_entry(static_cast<prefetched_entry&>(request));
+                    });
+
+                    std::lock_guard lock(mutex_);
+                    for (auto* const entry : batch) entry->ready = true;
+                    entry_ready_.notify_all();
+                }
+            }
+
+            bool select_entry(prefetched_entry& entry)
+            {
+                // hard linked files might be archived as link only, don't read them in vain
+                if (entry.metadata->type != file_type_flag::REGULAR_FILE || entry.metadata->nlink > 1) return false;
+                if (previous_snapshot_ != nullptr && previous_snapshot_->unchanged(std::string(platform_.relative_path(entry.target_path)), entry.metadata.value())) return false;
+                return acquire_buffer(entry.data, static_cast<std::size_t>(entry.metadata->size));
+            }
+
+            // provides data with a capacity of at least size bytes,
+            // fails if that would exceed the memory limit.
+            // The capacity of all buffers, including the pooled ones, counts against the limit.
+            bool acquire_buffer(std::vector<char>& data, const std::size_t size)
+            {
+                std::lock_guard lock(mutex_);
+                if (!buffer_pool_.empty()) {
+                    data = std::move(buffer_pool_.back());
+                    buffer_pool_.pop_back();
+                }
+                if (data.capacity() >= size) return true;
+
+                const auto fits = [&]() { return memory_used_ - data.capacity() + size <= options_.memory_limit; };
+                while (!fits() && !buffer_pool_.empty()) {
+                    memory_used_ -= buffer_pool_.back().capacity();
+                    buffer_pool_.pop_back();
+                }
+                if (!fits()) {
+                    buffer_pool_.emplace_back(std::move(data));
+                    data = std::vector<char>();
+                    return false;
+                }
+
+                const auto old_capacity = data.capacity();
+                data.reserve(size);
+                memory_used_ += data.capacity() - old_capacity;
+                return true;
+            }
+
+            const Platform& platform_;
+            const prefetch_options options_;
+            const tar_snapshot* const previous_snapshot_;
+
+            std::mutex mutex_;
+            std::condition_variable entry_ready_;
+            std::condition_variable work_available_;
+            std::condition_variable space_available_;
+            std::deque<std::unique_ptr<prefetched_entry>> entries_;
+            std::vector<std::vector<char>> buffer_pool_;
+            std::size_t next_to_read_ = 0;
+            std::size_t memory_used_ = 0;
+            bool walk_done_ = false;
+            bool stop_ = false;
+
+            std::thread walker_;
+            std::vector<std::thread> readers_;
+        };
+
+        // regular files are opened relative to their directory
+        void add_walked(const walk_entry& entry, const std::string& target_path, const bool read_symlinks)
+        {
+            check_state_and_flush();
+            prefetched_entry opened;
+            if (entry.metadata.type == file_type_flag::REGULAR_FILE) {
+                count(&tar_statistics::syscalls);
+                // failures are reported when the file is opened by path again
+                opened.infile = file_descriptor(::openat(entry.dir_fd, entry.name.data(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+            }
+            read_from_filesystem_write_to_tar(std::string(entry.path), target_path, entry.metadata, read_symlinks, &opened);
+        }
+
+        void add_prefetched(prefetch_pipeline::walk_t&& walk, const bool read_symlinks)
+        {
+            prefetch_pipeline pipeline(*platform_, prefetch_options_, std::move(walk),
+                                       previous_snapshot_.has_value() ? &previous_snapshot_.value() : nullptr);
+            while (auto entry = pipeline.next()) {
+                if (entry->error) std::rethrow_exception(entry->error);
+
+                check_state_and_flush();
+                const auto metadata = entry->metadata.has_value() ? entry->metadata.value() : source_metadata(entry->source_path);
+                read_from_filesystem_write_to_tar(entry->source_path, entry->target_path, metadata, read_symlinks, entry.get());
+                pipeline.recycle(std::move(entry));
+            }
+        }
+
+        // headers may be rewritten in place later on, so compressed
+        // archives store them in separate uncompressed blocks
+        void write(const block_t& data, [[maybe_unused]] bool is_header = false)
+        {
+            if (!is_open()) return;
+#ifdef WITH_COMPRESSION
+            if (compressor_ != nullptr) {
+                count(&tar_statistics::blocks);
+                const phase_timer timer(*this, &tar_statistics::compress_ns);
+                start_compressor();
+                if (is_header) {
+                    compressor_->add_header(data);
+                } else {
+                    compressor_->compress(data.data(), data.size());
+                }
+                tar_offset_ += data.size();
+                return;
+            }
+#endif
+            // the block can be handed out as is, no need to copy it
+            if (mode_ == output_mode::stream_output && !is_compressed()) {
+                count(&tar_statistics::blocks);
+                invoke_callback(data, data.size());
+                tar_offset_ += data.size();
+                return;
+            }
+
+            write(data.data(), data.size());
+        }
+
+        // writes whole blocks of data in one go, size should be a multiple of BLOCK_SIZE
+        void write(const char* const data, const size_t size)
+        {
+            if (!is_open()) return;
+            tar_offset_ += size;
+            count(&tar_statistics::blocks, size / BLOCK_SIZE);
+#ifdef WITH_COMPRESSION
+            if (compressor_ != nullptr) {
+                const phase_timer timer(*this, &tar_statistics::compress_ns);
+                start_compressor();
+                compressor_->compress(data, size);
+                return;
+            }
+#endif
+            switch (mode_) {
+                case output_mode::stream_output:
+                    for (size_t pos = 0; pos < size; pos += BLOCK_SIZE) {
+                        block_t block {};
+                        const auto copy_size = std::min(size - pos, block.size());
+                        std::copy_n(data + pos, copy_size, block.data());
+                        invoke_callback(block, copy_size);
+                    }
+                    break;
+                case output_mode::file_output:
+                    [[fallthrough]];
+                case output_mode::sink_output:
+                    file_buffered_write(data, size);
+                    break;
+                case output_mode::chunked_stream_output:
+                    chunk_buffered_write(data, size);
+                    break;
+            }
+        }
+
+        void finish()
+        {
+            block_t zeroes {};
+            write(zeroes);
+            write(zeroes);
+
+#ifdef WITH_COMPRESSION
+            if (compressor_ != nullptr) {
+                const phase_timer timer(*this, &tar_statistics::compress_ns);
+                compressor_->end();
+            }
+#endif
+            if (index_writer_ != nullptr) index_writer_->finish();
+        }
+
+        bool is_file_type_supported(const file_type_flag& type_flag)
+        {
+            const auto int_type_flag = static_cast<int>(type_flag);
+            switch (type_) {
+                case tar_type::unix_v7:
+                    return type_flag == file_type_flag::DIRECTORY || int_type_flag <= static_cast<int>(file_type_flag::SYMBOLIC_LINK);
+                case tar_type::ustar:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        void write_regular_file_const_size(payload_reader& reader, const size_t expected_size)
+        {
+            if (is_zero_copy_possible()) {
+                const auto copied = write_regular_file_zero_copy(reader, expected_size);
+                write_zeroes(padded_size(expected_size) - copied);
+                return;
+            }
+
+            block_t block {};
+            size_t processed_bytes = 0;
+            while (processed_bytes < expected_size) {
+                const auto read = read_payload_block(reader, block);
+                if (read == 0) break;
+
+                // the file may have grown, never write more than announced in the header
+                const auto write_size = std::min<size_t>(read, expected_size - processed_bytes);
+                if (write_size < block.size()) std::fill_n(block.begin() + write_size, block.size() - write_size, 0);
+                digest_payload(block.data(), write_size);
+                write(block);
+                processed_bytes += write_size;
+            }
+
+            // the file may have shrunk, fill up with zeroes to match the header
+            if (payload_checksum_.has_value()) payload_checksum_->update_zeroes(expected_size - processed_bytes);
+            std::fill_n(block.begin(), block.size(), 0);
+            while (processed_bytes < expected_size) {
+                write(block);
+                processed_bytes += block.size();
+            }
+        }
+
+        size_t write_regular_file_dynamic_size(payload_reader& reader)
+        {
+            if (is_zero_copy_possible()) {
+                const auto copied = write_regular_file_zero_copy(reader, std::numeric_limits<size_t>::max());
+                write_zeroes(padded_size(copied) - copied);
+                return copied;
+            }
+
+            block_t block {};
+            size_t processed_bytes = 0;
+            while (true) {
+                const auto read = read_payload_block(reader, block);
+                if (read == 0) return processed_bytes;
+                digest_payload(block.data(), read);
+                processed_bytes += read;
+                if (read < block.size())
+                    std::fill_n(block.begin() + read, block.size() - read, 0);
+                write(block);
+            }
+        }
+
+        [[nodiscard]] bool is_compressed() const
+        {
+#ifdef WITH_COMPRESSION
+            return compression_ != compression_mode::none;
+#else
+            return false;
+#endif
+        }
+
+        [[nodiscard]] bool is_header_patching_possible() const
+        {
+            return header_mode_ == header_mode::patch && !is_compressed() && is_rewritable_output();
+        }
+
+        // outputs which allow writing a header again after the content of its member
+        [[nodiscard]] bool is_rewritable_output() const
+        {
+            return mode_ == output_mode::file_output || (mode_ == output_mode::sink_output && sink_->can_patch());
+        }
+
+        // outputs positioned by file_tell, the others are counted by output_offset_
+        [[nodiscard]] bool is_positioned_output() const
+        {
+            return mode_ == output_mode::file_output || mode_ == output_mode::sink_output;
+        }
+
+        [[nodiscard]] bool is_zero_copy_possible() const
+        {
+            return !is_compressed() && mode_ == output_mode::file_output && !dedup_options_.enabled && !checksum_options_.enabled;
+        }
+
+        // Returns the name of an archived file with the same content. The payload is only read if a file
+        // of the same size was archived, it's handed out as data then and the input is positioned after it.
+        std::optional<std::string_view> find_duplicate(const file_descriptor& infile, const std::vector<char>*& data, const size_t size)
+        {
+            if (!fingerprints_.has_size(size)) return std::nullopt;
+
+            xxh64 hash;
+            if (data != nullptr) {
+                // read ahead data is incomplete if the file changed
+                if (data->size() != size) return std::nullopt;
+                hash.update(data->data(), data->size());
+            } else if (size <= dedup_options_.max_buffered_size) {
+                dedup_buffer_.resize(size);
+                const auto read_bytes = read_fully(infile.get(), dedup_buffer_.data(), size, -1);
+                dedup_buffer_.resize(read_bytes);
+                data = &dedup_buffer_;
+                if (read_bytes != size) return std::nullopt;
+                hash.update(dedup_buffer_.data(), dedup_buffer_.size());
+            } else {
+                dedup_buffer_.resize(file_buffer_default_size_);
+                size_t offset = 0;
+                while (offset < size) {
+                    const auto read_bytes = read_fully(infile.get(), dedup_buffer_.data(), std::min(dedup_buffer_.size(), size - offset), static_cast<off_t>(offset));
+                    if (read_bytes == 0) return std::nullopt;
+                    hash.update(dedup_buffer_.data(), read_bytes);
+                    offset += read_bytes;
+                }
+                dedup_buffer_.clear();
+            }
+
+            const auto* const candidate = fingerprints_.find(size, hash.digest());
+            if (candidate == nullptr || !same_content(*candidate, infile, data, size)) return std::nullopt;
+            return candidate->name;
+        }
+
+        // compares the content of an archived file with data or, if there is none, with infile
+        [[nodiscard]] bool same_content(const fingerprint_table::fingerprint& candidate, const file_descriptor& infile, const std::vector<char>* data, const size_t size)
+        {
+            // the archived content is only known while its source is unchanged
+            const auto source = platform_->metadata(candidate.source_path, true);
+            if (!source.has_value() || tar_snapshot::make_entry(source.value()) != candidate.source) return false;
+            count(&tar_statistics::syscalls);
+            const file_descriptor archived(::open(candidate.source_path.c_str(), O_RDONLY | O_CLOEXEC));
+            if (!archived.is_open()) return false;
+
+            const auto chunk_size = std::min<size_t>(size, file_buffer_default_size_);
+            dedup_compare_buffer_.resize(data != nullptr ? chunk_size : 2 * chunk_size);
+            auto* const archived_chunk = dedup_compare_buffer_.data();
+            auto* const input_chunk = archived_chunk + chunk_size;
+            for (size_t offset = 0; offset < size; offset += chunk_size) {
+                const auto length = std::min(chunk_size, size - offset);
+                if (read_fully(archived.get(), archived_chunk, length, static_cast<off_t>(offset)) != length) return false;
+                if (data != nullptr) {
+                    if (std::memcmp(archived_chunk, data->data() + offset, length) != 0) return false;
+                } else {
+                    if (read_fully(infile.get(), input_chunk, length, static_cast<off_t>(offset)) != length) return false;
+                    if (std::memcmp(archived_chunk, input_chunk, length) != 0) return false;
+                }
+            }
+            return true;
+        }
+
+        // reads at offset or the current position for negative offsets until size bytes or the end of the file
+        static size_t read_fully(const int fd, char* const data, const size_t size, const off_t offset)
+        {
+            size_t read_bytes = 0;
+            while (read_bytes < size) {
+                const auto result = offset < 0 ? ::read(fd, data + read_bytes, size - read_bytes)
+                                               : ::pread(fd, data + read_bytes, size - read_bytes, offset + static_cast<off_t>(read_bytes));
+                if (result < 0) {
+                    if (errno == EINTR) continue;
+                    throw errno_exception();
+                }
+                if (result == 0) break;
+                read_bytes += result;
+            }
+            return read_bytes;
+        }
+
+        // moves the file content from the input file to the archive inside the kernel,
+        // the caller is responsible for padding the last block
+        size_t write_regular_file_zero_copy(payload_reader& reader, const size_t max_size)
+        {
+            const auto prefix = reader.take_prefix(max_size);
+            file_buffered_write(prefix.data(), prefix.size());
+
+            // the kernel writes at the current offset of the archive,
+            // so everything buffered so far has to be written first.
+            file_flush();
+            count(&tar_statistics::bytes_in, prefix.size());
+            const phase_timer timer(*this, &tar_statistics::write_ns);
+            auto* const advisor = reader.advisor();
+            if (advisor == nullptr) {
+                count(&tar_statistics::syscalls);
+                const auto copied = platform_->copy_file_data(reader.fd(), file_.get(), max_size - prefix.size());
+                count(&tar_statistics::bytes_in, copied);
+                count(&tar_statistics::bytes_out, copied);
+                file_offset_ += static_cast<off_t>(copied);
+                release_written_pages();
+                return prefix.size() + copied;
+            }
+
+            // copies window by window, so the page cache hints keep up with the copy
+            size_t copied = 0;
+            while (copied < max_size - prefix.size()) {
+                const auto chunk_size = std::min(max_size - prefix.size() - copied, advisor->window_size());
+                count(&tar_statistics::syscalls);
+                const auto chunk_copied = platform_->copy_file_data(reader.fd(), file_.get(), chunk_size);
+                count(&tar_statistics::bytes_in, chunk_copied);
+                count(&tar_statistics::bytes_out, chunk_copied);
+                file_offset_ += static_cast<off_t>(chunk_copied);
+                release_written_pages();
+                advisor->consumed(chunk_copied);
+                copied += chunk_copied;
+                if (chunk_copied < chunk_size) break;
+            }
+            return prefix.size() + copied;
+        }
+
+        void write_zeroes(size_t size)
+        {
+            static const block_t zeroes {};
+            while (size > 0) {
+                const auto write_size = std::min<size_t>(size, zeroes.size());
+                file_buffered_write(zeroes.data(), write_size);
+                size -= write_size;
+            }
+        }
+
+        static constexpr size_t padded_size(const size_t size)
+        {
+            return (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        }
+
+        [[nodiscard]] file_metadata source_metadata(const std::string& path)
+        {
+            const auto metadata = query_metadata(path, false);
+            if (!metadata.has_value()) throw std::invalid_argument(path + " does not exist");
+            return metadata.value();
+        }
+
+        void read_from_filesystem_write_to_tar(const std::string& source_path, const std::string& target_path, file_metadata metadata, bool read_symlinks,
+                                               prefetched_entry* prefetched = nullptr)
+        {
+            if (source_path == file_name_) throw std::invalid_argument("tar cannot be part of itself");
+            entry_started();
+
+            std::string resolved_source_path = source_path;
+            if (metadata.type == file_type_flag::SYMBOLIC_LINK && read_symlinks) {
+                const auto link_target_metadata = query_metadata(source_path, true);
+                if (!link_target_metadata.has_value()) throw std::invalid_argument("source_path " + source_path + " is a symlink pointing to " + platform_->read_symlink(source_path) + " which does not exist");
+                resolved_source_path = platform_->realpath(source_path);
+                metadata = link_target_metadata.value();
+            }
+
+            if (previous_snapshot_.has_value()) {
+                const std::string name(platform_->relative_path(target_path));
+                snapshot_.record(name, metadata);
+                if (metadata.type != file_type_flag::DIRECTORY && previous_snapshot_->unchanged(name, metadata)) return;
+            }
+
+            std::function<void()> write_data;
+            auto file_type = metadata.type;
+            auto mode = metadata.mode;
+            size_t size = 0;
+            major_t dev_major = 0;
+            minor_t dev_minor = 0;
+            std::string link_name;
+            file_descriptor infile;
+            const std::vector<char>* prefetched_data = nullptr;
+            // destroyed before infile
+            std::optional<input_cache_advisor> input_advisor;
+
+            // regular files should only be stored once in the archive
+            // if the same file is added again (i.e. via a hard link)
+            // we only store a new header but not the file again.
+            if (file_type == file_type_flag::REGULAR_FILE) {
+                const auto equivalent = platform_->file_equivalent_present(metadata, stored_inos_);
+                if (equivalent.has_value()) {
+                    link_name = equivalent.value();
+                    file_type = file_type_flag::HARD_LINK;
+                } else if (prefetched != nullptr && prefetched->infile.is_open()) {
+                    infile = std::move(prefetched->infile);
+                    if (!prefetched->data.empty()) prefetched_data = &prefetched->data;
+                } else {
+                    // the descriptor is kept open for writing the payload,
+                    // so the file is opened only once.
+                    count(&tar_statistics::syscalls);
+                    infile = file_descriptor(::open(resolved_source_path.c_str(), O_RDONLY | O_CLOEXEC));
+                    if (!infile.is_open()) throw std::invalid_argument("can't open '" + source_path + "' for reading or file does not exist");
+                }
+                if (infile.is_open() && page_cache_options_.drop_input_pages) input_advisor.emplace(*platform_, infile.get(), page_cache_options_.window_size);
+            }
+
+            // copies of archived content are stored as link as well
+            std::optional<xxh64> payload_hash;
+            if (file_type == file_type_flag::REGULAR_FILE && dedup_options_.enabled && metadata.size >= dedup_options_.min_size) {
+                const auto duplicate = find_duplicate(infile, prefetched_data, metadata.size);
+                if (duplicate.has_value()) {
+                    link_name = duplicate.value();
+                    file_type = file_type_flag::HARD_LINK;
+                    input_advisor.reset();
+                    infile.close();
+                } else {
+                    payload_hash.emplace();
+                }
+            }
+
+            if (file_type == file_type_flag::REGULAR_FILE && sparse_options_.enabled) {
+                const auto extents = sparse_extents(infile, metadata);
+                if (extents.has_value()) {
+                    add_link_candidate(metadata, resolved_source_path);
+                    write_sparse_file(target_path, mode, metadata, extents.value(), infile);
+                    entry_finished(target_path, metadata.size);
+                    return;
+                }
+            }
+
+            const auto patch_header = file_type == file_type_flag::REGULAR_FILE && is_header_patching_possible();
+            const auto defer_header_writing = file_type == file_type_flag::REGULAR_FILE && is_rewritable_output() &&
+                                              !patch_header && header_mode_ != header_mode::fixed_size;
+
+            switch (file_type) {
+                case file_type_flag::REGULAR_FILE:
+                    write_data = [this, &defer_header_writing, &patch_header, &infile, &prefetched_data, &size, &payload_hash, &input_advisor, &target_path]() {
+                        payload_reader reader(infile, prefetched_data, payload_hash.has_value() ? &payload_hash.value() : nullptr,
+                                              input_advisor.has_value() ? &input_advisor.value() : nullptr);
+                        begin_payload_checksum();
+                        if (defer_header_writing || patch_header) {
+                            size = write_regular_file_dynamic_size(reader);
+                        } else {
+                            write_regular_file_const_size(reader, size);
+                        }
+                        finish_payload_checksum(target_path);
+                    };
+                    size = metadata.size;
+                    break;
+                case file_type_flag::CHARACTER_SPECIAL_FILE:
+                    [[fallthrough]];
+                case file_type_flag::BLOCK_SPECIAL_FILE:
+                    dev_major = metadata.dev_major;
+                    dev_minor = metadata.dev_minor;
+                    break;
+                case file_type_flag::SYMBOLIC_LINK:
+                    mode = static_cast<mode_t>(permission_t::all_all);
+                    link_name = platform_->read_symlink(resolved_source_path);
+                    break;
+                case file_type_flag::CONTIGUOUS_FILE:
+                    // won't happen as we would have to set the contiguous flag.
+                    throw std::invalid_argument("contiguous files not supported");
+                case file_type_flag::HARD_LINK:
+                    [[fallthrough]];
+                case file_type_flag::DIRECTORY:
+                    [[fallthrough]];
+                case file_type_flag::FIFO:
+                    break;
+            }
+
+            // ignore unsupported file types.
+            // i.e. directories for tar v7
+            // maybe file is also already deleted
+            if (!is_file_type_supported(file_type)) {
+                return;
+            }
+
+            add_link_candidate(metadata, resolved_source_path);
+
+            const auto write_header_data = [&]() {
+                write_header(
+                        target_path,
+                        mode,
+                        metadata.uid,
+                        metadata.gid,
+                        size,
+                        metadata.mod_time,
+                        file_type,
+                        dev_major,
+                        dev_minor,
+                        link_name,
+                        defer_header_writing);
+            };
+
+            if (defer_header_writing) {
+                flush_compressor();
+                if (index_writer_ != nullptr) placeholder_position_ = next_index_position();
+                auto header_pos = begin_header_rewrite();
+                block_t dummy_header {};
+                write(dummy_header, true);
+                begin_compressed_member(size);
+
+                if (write_data) {
+                    write_data();
+                    flush_compressor();
+                }
+
+                const auto data_pos = file_tell();
+                file_seek(header_pos);
+                write_header_data();
+                file_seek(data_pos);
+            } else if (patch_header) {
+                const auto header_pos = file_tell();
+                const auto header_size = size;
+                write_header_data();
+                write_data();
+
+                // the file changed while reading it
+                if (size != header_size) {
+                    const auto header = encode_header(target_path, mode, metadata.uid, metadata.gid, size, metadata.mod_time,
+                                                      file_type, dev_major, dev_minor, link_name);
+                    file_patch(header_pos, header.data(), header.size());
+                    if (index_writer_ != nullptr) index_writer_->update_pending_size(size);
+                }
+            } else {
+                write_header_data();
+                if (file_type == file_type_flag::REGULAR_FILE && payload_mode_ == payload_mode::defer) {
+                    deferred_payload_ = {std::move(infile), size, target_path};
+                    return;
+                }
+                if (file_type == file_type_flag::REGULAR_FILE && payload_mode_ == payload_mode::skip) {
+                    tar_offset_ += padded_size(size);
+                    entry_finished(target_path, size);
+                    return;
+                }
+                if (write_data) {
+                    write_data();
+                }
+            }
+
+            // the content changed while reading it, if more or less was read than stored
+            if (payload_hash.has_value() && payload_hash->length() == size) {
+                fingerprints_.add(size, {payload_hash->digest(), stored_files_.find(target_path).value(), resolved_source_path, tar_snapshot::make_entry(metadata)});
+            }
+            entry_finished(target_path, size);
+        }
+
+        // only regular files with further links can be met again
+        void add_link_candidate(const file_metadata& metadata, const std::string& path)
+        {
+            if (metadata.type == file_type_flag::REGULAR_FILE && metadata.nlink > 1) stored_inos_.insert(metadata.dev, metadata.ino, path);
+        }
+
+        // Data extents of a file worth storing sparse, std::nullopt if the file has no (large enough) holes.
+        std::optional<std::vector<sparse_extent>> sparse_extents(const file_descriptor& infile, const file_metadata& metadata)
+        {
+            const auto min_hole_size = padded_size(std::max<size_t>(sparse_options_.min_hole_size, 1));
+            if (metadata.size < min_hole_size) return std::nullopt;
+
+            std::optional<std::vector<sparse_extent>> extents;
+            if (metadata.allocated_size < metadata.size) extents = platform_->data_extents(infile.get(), metadata.size);
+            if ((!extents.has_value() || extents->size() == 1) && sparse_options_.scan_for_zeros) extents = scan_data_extents(infile.get(), metadata.size);
+            if (!extents.has_value()) return std::nullopt;
+
+            // merges extents separated by small holes, holes are found in file system blocks,
+            // so the data stored doesn't grow by much
+            std::vector<sparse_extent> merged;
+            for (const auto& extent : extents.value()) {
+                if (!merged.empty() && extent.offset - (merged.back().offset + merged.back().size) < min_hole_size) {
+                    merged.back().size = extent.offset + extent.size - merged.back().offset;
+                } else {
+                    merged.push_back(extent);
+                }
+            }
+
+            size_t data_size = 0;
+            for (const auto& extent : merged) data_size += extent.size;
+            if (metadata.size - data_size < min_hole_size) return std::nullopt;
+            return merged;
+        }
+
+        // data extents at block granularity
+        std::vector<sparse_extent> scan_data_extents(const int fd, const size_t size)
+        {
+            std::vector<sparse_extent> extents;
+            std::vector<char> buffer(file_buffer_default_size_);
+            size_t offset = 0;
+            while (offset < size) {
+                const auto read_bytes = read_fully(fd, buffer.data(), std::min(buffer.size(), size - offset), static_cast<off_t>(offset));
+                if (read_bytes == 0) break;
+                for (size_t pos = 0; pos < read_bytes; pos += BLOCK_SIZE) {
+                    const auto block_size = std::min<size_t>(BLOCK_SIZE, read_bytes - pos);
+                    const auto* const block = buffer.data() + pos;
+                    if (std::all_of(block, block + block_size, [](const char c) { return c == 0; })) continue;
+
+                    const auto block_offset = offset + pos;
+                    if (!extents.empty() && extents.back().offset + extents.back().size == block_offset) {
+                        extents.back().size += block_size;
+                    } else {
+                        extents.push_back({block_offset, block_size});
+                    }
+                }
+                offset += read_bytes;
+            }
+            return extents;
+        }
+
+        // Writes a GNU sparse 1.0 entry: a PAX header with the real name and size, followed by a header
+        // for the map of the data extents and the data. The extents are read at their offsets, if the
+        // file shrank meanwhile, zeroes are stored.
+        void write_sparse_file(const std::string& target_path, const mode_t mode, const file_metadata& metadata,
+                               const std::vector<sparse_extent>& extents, const file_descriptor& infile)
+        {
+            std::string map = std::to_string(extents.size() + 1) + "\n";
+            size_t data_size = 0;
+            for (const auto& extent : extents) {
+                map += std::to_string(extent.offset) + "\n" + std::to_string(extent.size) + "\n";
+                data_size += extent.size;
+            }
+            // terminates the map with an empty extent at the end, so trailing holes are restored
+            map += std::to_string(metadata.size) + "\n0\n";
+            map.resize(padded_size(map.size()), '\0');
+
+            const std::string name(platform_->relative_path(target_path));
+            const auto separator = name.rfind(platform_->path_separator());
+            const auto directory = separator == std::string::npos ? std::string() : name.substr(0, separator + 1);
+            const auto base_name = separator == std::string::npos ? name : name.substr(separator + 1);
+
+            std::string pax_records;
+            add_pax_record(pax_records, "GNU.sparse.major", "1");
+            add_pax_record(pax_records, "GNU.sparse.minor", "0");
+            add_pax_record(pax_records, "GNU.sparse.name", name);
+            add_pax_record(pax_records, "GNU.sparse.realsize", std::to_string(metadata.size));
+            write(encode_header(directory + "PaxHeaders/" + base_name, mode, metadata.uid, metadata.gid, pax_records.size(), metadata.mod_time,
+                                static_cast<file_type_flag>(PAX_EXTENDED_HEADER), 0, 0, ""));
+            count(&tar_statistics::headers);
+            write_padded(pax_records.data(), pax_records.size());
+
+            write_header(target_path, mode, metadata.uid, metadata.gid, map.size() + data_size, metadata.mod_time, file_type_flag::REGULAR_FILE,
+                         0, 0, "", false, directory + "GNUSparseFile.0/" + base_name);
+            write_padded(map.data(), map.size());
+
+            begin_payload_checksum();
+            block_t block {};
+            size_t used = 0;
+            size_t file_offset = 0;
+            for (const auto& extent : extents) {
+                if (payload_checksum_.has_value()) payload_checksum_->update_zeroes(extent.offset - file_offset);
+                file_offset = extent.offset + extent.size;
+                size_t copied = 0;
+                while (copied < extent.size) {
+                    const auto size = std::min<size_t>(extent.size - copied, block.size() - used);
+                    const auto read_bytes = read_sparse_data(infile.get(), block.data() + used, size, static_cast<off_t>(extent.offset + copied));
+                    std::fill_n(block.data() + used + read_bytes, size - read_bytes, 0);
+                    digest_payload(block.data() + used, size);
+                    used += size;
+                    copied += size;
+                    if (used == block.size()) {
+                        write(block);
+                        used = 0;
+                    }
+                }
+            }
+            if (used > 0) {
+                std::fill_n(block.data() + used, block.size() - used, 0);
+                write(block);
+            }
+            if (payload_checksum_.has_value()) payload_checksum_->update_zeroes(metadata.size - file_offset);
+            finish_payload_checksum(target_path);
+        }
+
+        size_t read_sparse_data(const int fd, char* const data, const size_t size, const off_t offset)
+        {
+            const phase_timer timer(*this, &tar_statistics::read_ns);
+            count(&tar_statistics::syscalls);
+            const auto read_bytes = read_fully(fd, data, size, offset);
+            count(&tar_statistics::bytes_in, read_bytes);
+            return read_bytes;
+        }
+
+        // "<length> <key>=<value>\n", where the length includes its own digits
+        static void add_pax_record(std::string& records, const std::string_view key, const std::string_view value)
+        {
+            const auto content_size = key.size() + value.size() + 3;
+            auto size = content_size + 1;
+            while (std::to_string(size).size() + content_size != size) size = std::to_string(size).size() + content_size;
+            records += std::to_string(size);
+            records += ' ';
+            records += key;
+            records += '=';
+            records += value;
+            records += '\n';
+        }
+
+        void write_padded(const char* const data, const size_t size)
+        {
+            block_t block {};
+            for (size_t pos = 0; pos < size; pos += block.size()) {
+                const auto block_size = std::min<size_t>(block.size(), size - pos);
+                std::copy_n(data + pos, block_size, block.data());
+                std::fill_n(block.data() + block_size, block.size() - block_size, 0);
+                write(block);
+            }
+        }
+
+        // stored_name replaces name in the header, if given
+        void write_header(std::string_view name, mode_t mode, uid_t uid, gid_t gid, size_t size, mod_time_t time,
+                          file_type_flag file_type, major_t dev_major = 0, minor_t dev_minor = 0,
+                          const std::string_view link_name = {}, const bool rewrite_in_place = false, const std::string_view stored_name = {})
+        {
+            if (type_ != tar_type::unix_v7 && type_ != tar_type::ustar) throw std::logic_error("unsupported tar format");
+            if (stream_file_header_pos_ > -1) throw std::logic_error("Can't write a header while file streaming is in progress");
+            // allow adding files that consist only of a header multiple times
+            // this is the same behaviour as gnu tar 1.30
+            if (stored_files_.find(name).has_value() && (file_type == file_type_flag::REGULAR_FILE || file_type == file_type_flag::CONTIGUOUS_FILE))
+                throw std::logic_error("Can't add a file with the same name twice");
+            const auto index_type = file_type;
+
+            if (file_type == file_type_flag::DIRECTORY) {
+                // directories are regular files in unix v7
+                if (type_ == tar_type::unix_v7) {
+                    file_type = file_type_flag::REGULAR_FILE;
+                }
+
+                // directories should always be indicated with a trailing /
+                if (name.empty() || name.back() != '/') {
+                    directory_name_.assign(name).push_back('/');
+                    name = directory_name_;
+                }
+            }
+
+            if (type_ == tar_type::unix_v7 && (static_cast<int>(file_type) > static_cast<int>(file_type_flag::SYMBOLIC_LINK)))
+                throw std::logic_error("unsupported file type for unix_v7 format");
+
+            stored_files_.insert(name);
+            if (index_writer_ != nullptr) add_index_entry(name, index_type, size, rewrite_in_place);
+            if (planned_members_ != nullptr) {
+                planned_members_->push_back({std::string(platform_->relative_path(name)), index_type, tar_offset_, tar_offset_ + BLOCK_SIZE, size, tar_offset_, tar_offset_});
+            }
+            count(&tar_statistics::headers);
+
+            // compressed headers can't be rewritten, only fixed size headers never are
+            const auto in_place_header = rewrite_in_place || header_mode_ != header_mode::fixed_size;
+            const auto tar_offset = tar_offset_;
+            write(encode_header(stored_name.empty() ? name : stored_name, mode, uid, gid, size, time, file_type, dev_major, dev_minor, link_name), in_place_header);
+            // the header replaced its placeholder, the archive did not grow
+            if (rewrite_in_place) {
+                tar_offset_ = tar_offset;
+            } else {
+                begin_compressed_member(size);
+            }
+        }
+
+        block_t encode_header(const std::string_view name, mode_t mode, uid_t uid, gid_t gid, size_t size, mod_time_t time,
+                              file_type_flag file_type, major_t dev_major, minor_t dev_minor, const std::string_view link_name)
+        {
+            const auto store_name = platform_->relative_path(name);
+            const auto store_link = file_type == file_type_flag::SYMBOLIC_LINK
+                                             ? link_name
+                                             : platform_->relative_path(link_name);
+
+            block_t header {};
+            write_into_block(header, mode, UNIX_V7_USTAR_HEADER_POS_MODE, UNIX_V7_USTAR_HEADER_LEN_MODE);
+            write_into_block(header, uid, UNIX_V7_USTAR_HEADER_POS_UID, UNIX_V7_USTAR_HEADER_LEN_UID);
+            write_into_block(header, gid, UNIX_V7_USTAR_HEADER_POS_GID, UNIX_V7_USTAR_HEADER_LEN_GID);
+            write_into_block(header, size, UNIX_V7_USTAR_HEADER_POS_SIZE, UNIX_V7_USTAR_HEADER_LEN_SIZE);
+            write_into_block(header, time, UNIX_V7_USTAR_HEADER_POS_MTIM, UNIX_V7_USTAR_HEADER_LEN_MTIM);
+            header[UNIX_V7_USTAR_HEADER_POS_TYPEFLAG] = static_cast<char>(file_type);
+            write_name_and_prefix(header, store_name);
+
+            if (!link_name.empty()) {
+                write_into_block(header, store_link, UNIX_V7_USTAR_HEADER_POS_LINKNAME,
+                                 UNIX_V7_USTAR_HEADER_LEN_LINKNAME);
+            }
+
+            if (type_ == tar_type::ustar) {
+                write_into_block(header, "ustar", USTAR_HEADER_POS_MAGIC, USTAR_HEADER_LEN_MAGIC);
+
+                write_into_block(header, platform_->user_name(uid), USTAR_HEADER_POS_UNAME, USTAR_HEADER_LEN_UNAME);
+                write_into_block(header, platform_->group_name(gid), USTAR_HEADER_POS_GNAME, USTAR_HEADER_LEN_GNAME);
+
+                write_into_block(header, dev_major, USTAR_HEADER_POS_DEVMAJOR, USTAR_HEADER_LEN_DEVMAJOR);
+                write_into_block(header, dev_minor, USTAR_HEADER_POS_DEVMINOR, USTAR_HEADER_LEN_DEVMINOR);
+            }
+
+            calc_and_write_checksum(header);
+            return header;
+        }
+
+        static void write_into_block(block_t& block, const unsigned long long value, const unsigned pos, const unsigned len)
+        {
+            header_encoder::write_octal(block, value, pos, len);
+        }
+
+        static void write_into_block(block_t& block, const std::string_view str, const unsigned pos, const unsigned len)
+        {
+            header_encoder::write_string(block, str, pos, len);
+        }
+
+        static void calc_and_write_checksum(block_t& block)
+        {
+            std::fill_n(block.data() + UNIX_V7_USTAR_HEADER_POS_CHECKSUM, UNIX_V7_USTAR_HEADER_LEN_CHKSUM, ' ');
+            const auto chksum = header_encoder::checksum(block);
+            write_into_block(block, chksum, UNIX_V7_USTAR_HEADER_POS_CHECKSUM, UNIX_V7_USTAR_HEADER_LEN_CHKSUM - 2);
+            block[UNIX_V7_USTAR_HEADER_POS_CHECKSUM + UNIX_V7_USTAR_HEADER_LEN_CHKSUM - 1] = 0;
+        }
+
+        void write_name_and_prefix(block_t& block, const std::string_view name)
+        {
+            const auto write_name_unix_v7_format = [&]() {
+                write_into_block(block, name, UNIX_V7_USTAR_HEADER_POS_NAME, UNIX_V7_USTAR_HEADER_LEN_NAME);
+            };
+
+            if (name.size() <= UNIX_V7_USTAR_HEADER_LEN_NAME || type_ == tar_type::unix_v7) {
+                write_name_unix_v7_format();
+            } else {
+                const auto last_separator_index = name.rfind(platform_->path_separator());
+                if (last_separator_index == std::string::npos) {
+                    write_name_unix_v7_format();
+                } else {
+                    // create the prefix by trimming the name to the prefix length
+                    const auto prefix_trimmed = name.substr(0, USTAR_HEADER_LEN_PREFIX);
+                    const auto last_separator_in_prefix = prefix_trimmed.rfind(platform_->path_separator());
+                    if (last_separator_in_prefix == std::string::npos) {
+                        // no possible delimiter found to splice part
+                        // write name in unix v7 and truncate at the end
+                        write_name_unix_v7_format();
+                    } else {
+                        // create the prefix by cutting at the found delimiter
+                        const auto prefix = name.substr(0, last_separator_in_prefix);
+                        write_into_block(block, prefix, USTAR_HEADER_POS_PREFIX, USTAR_HEADER_LEN_PREFIX);
+
+                        // name is remaining part of the string
+                        const auto split_name = name.substr(last_separator_in_prefix + 1);
+                        write_into_block(block, split_name, UNIX_V7_USTAR_HEADER_POS_NAME, UNIX_V7_USTAR_HEADER_LEN_NAME);
+                    }
+                }
+            }
+        }
+
+        void check_state_and_flush()
+        {
+            if (!is_open()) throw std::logic_error("Cannot add file, tar archive is not open");
+            entry_started();
+            if (stream_file_header_pos_ >= 0)
+                throw std::logic_error("Can't add new file while adding streaming data isn't completed");
+
+            // fixed size headers are never rewritten, so entries can share compressed blocks
+            if (header_mode_ != header_mode::fixed_size) {
+                flush_compressor();
+            }
+        }
+
+        void init_compression()
+        {
+            // sinks configure their own buffer
+            if (mode_ != output_mode::sink_output) file_buffer_.reserve(file_buffer_default_size_);
+#ifdef WITH_COMPRESSION
+            auto output = [this](const char* const data, const std::size_t size) { write_compressed(data, size); };
+            switch (compression_) {
+                case compression_mode::none:
+                    return;
+#    ifdef WITH_LZ4
+                case compression_mode::lz4:
+                    compressor_ = std::make_unique<lz4_compressor>(std::move(output));
+                    break;
+                case compression_mode::lz4_parallel:
+                    compressor_ = std::make_unique<lz4_parallel_compressor>(std::move(output));
+                    break;
+#    endif
+#    ifdef WITH_ZSTD
+                case compression_mode::zstd:
+                    compressor_ = std::make_unique<zstd_compressor>(std::move(output));
+                    break;
+#    endif
+            }
+#endif
+        }
+
+#ifdef WITH_COMPRESSION
+        // compressors start with the first output, so they can be configured after the tarfile is created
+        void start_compressor()
+        {
+            if (compressor_started_) return;
+            compressor_started_ = true;
+            compressor_->start();
+            // the frame header is written, the output can be decompressed from here on
+            index_block_ = {0, output_offset_, 0};
+        }
+#endif
+
+#ifdef WITH_COMPRESSION
+        void write_compressed(const char* const data, size_t size)
+        {
+            output_offset_ += size;
+            unsigned long long offset = 0;
+            switch (mode_) {
+                // guarding that input is not stream is done in add_file_streaming
+                // using a file as input is fine, as we have all data necessary
+                // for compression w/o seeking
+                case output_mode::stream_output:
+                    while (size > 0) {
+                        block_t block {};
+                        const auto copy_size = std::min(size, block.size());
+                        std::copy_n(data + offset, copy_size, block.data());
+                        invoke_callback(block, copy_size);
+                        size -= copy_size;
+                        offset += copy_size;
+                    }
+
+                    break;
+                case output_mode::file_output:
+                    [[fallthrough]];
+                case output_mode::sink_output:
+                    file_buffered_write(data, size);
+                    break;
+                case output_mode::chunked_stream_output:
+                    chunk_buffered_write(data, size);
+                    break;
+            }
+        }
+
+#endif
+        void file_buffered_write(const char* const data, unsigned long size)
+        {
+            // large writes e.g. compressed blocks do not fit into the buffer,
+            // sinks get them together with the buffered data without joining them
+            if (mode_ == output_mode::sink_output && size >= file_buffer_.capacity()) {
+                const auto used = file_buffer_used_;
+                file_buffer_used_ = 0;
+                sink_write(file_buffer_.data(), used, data, size);
+                return;
+            }
+
+            if (file_buffer_used_ + size >= file_buffer_.capacity()) {
+                // no need to flush the file, just make sure it's passed to the ofstream.
+                file_write();
+            }
+
+            if (size >= file_buffer_.capacity()) {
+                file_write(data, size);
+                return;
+            }
+
+            std::copy_n(data, size, file_buffer_.data() + file_buffer_used_);
+            file_buffer_used_ += size;
+        }
+
+        void chunk_buffered_write(const char* data, size_t size)
+        {
+            while (size > 0) {
+                // full chunks are passed on without copying them
+                if (file_buffer_used_ == 0 && size >= chunk_size_) {
+                    invoke_chunk_callback(data, chunk_size_);
+                    data += chunk_size_;
+                    size -= chunk_size_;
+                    continue;
+                }
+
+                const auto copy_size = std::min(size, chunk_size_ - file_buffer_used_);
+                std::copy_n(data, copy_size, file_buffer_.data() + file_buffer_used_);
+                file_buffer_used_ += copy_size;
+                data += copy_size;
+                size -= copy_size;
+                if (file_buffer_used_ == chunk_size_) file_write();
+            }
+        }
+
+        void file_close()
+        {
+            file_flush();
+            if (page_cache_options_.drop_output_pages && file_.is_open()) {
+                platform_->write_back(file_.get(), dropped_offset_, 0, true);
+                platform_->advise(file_.get(), dropped_offset_, 0, access_advice::dont_need);
+            }
+            if (mode_ == output_mode::sink_output) sink_->flush();
+            writer_.reset();
+            file_.close();
+        }
+
+        void file_write()
+        {
+            const auto used = file_buffer_used_;
+            file_buffer_used_ = 0;
+            if (mode_ == output_mode::chunked_stream_output) {
+                if (used > 0) invoke_chunk_callback(file_buffer_.data(), used);
+                return;
+            }
+            file_write(file_buffer_.data(), used);
+        }
+
+        void file_write(const char* const data, const unsigned long size)
+        {
+            if (size == 0) return;
+            if (mode_ == output_mode::sink_output) {
+                sink_write(data, size);
+                return;
+            }
+            const phase_timer timer(*this, &tar_statistics::write_ns);
+            count(&tar_statistics::syscalls);
+            count(&tar_statistics::bytes_out, size);
+            if (writer_ == nullptr) writer_ = platform_->create_output_writer(file_.get());
+            writer_->write(data, size);
+            file_offset_ += static_cast<off_t>(size);
+            release_written_pages();
+        }
+
+        // Writes back the archive once a window was written, the window before is dropped from the
+        // page cache after waiting for it. That way at most two windows of the archive stay cached.
+        void release_written_pages()
+        {
+            if (!page_cache_options_.drop_output_pages) return;
+            const auto window_size = static_cast<off_t>(page_cache_options_.window_size);
+            if (file_offset_ - written_back_offset_ < window_size) return;
+
+            if (writer_ != nullptr) writer_->sync();
+            if (dropped_offset_ < written_back_offset_) {
+                platform_->write_back(file_.get(), dropped_offset_, written_back_offset_ - dropped_offset_, true);
+                platform_->advise(file_.get(), dropped_offset_, written_back_offset_ - dropped_offset_, access_advice::dont_need);
+                dropped_offset_ = written_back_offset_;
+            }
+            platform_->write_back(file_.get(), written_back_offset_, file_offset_ - written_back_offset_, false);
+            written_back_offset_ = file_offset_;
+        }
+
+        // passes all data to the file, the file position matches file_tell afterwards
+        void file_flush()
+        {
+            count(&tar_statistics::flushes);
+            file_write();
+            if (writer_ == nullptr) return;
+            const phase_timer timer(*this, &tar_statistics::write_ns);
+            writer_->sync();
+        }
+
+        void file_seek(const off_t pos)
+        {
+            // flushing before seek and tell operations is required
+            // to prevent mixing between buffered and flushed data
+            file_flush();
+            count(&tar_statistics::seeks);
+            if (mode_ == output_mode::sink_output) {
+                // sinks are written at file_offset_, data before sink_end_ is patched
+                file_offset_ = pos;
+                if (held_back_from_ >= 0 && pos == sink_end_) release_held_back();
+                return;
+            }
+            count(&tar_statistics::syscalls);
+            if (::lseek(file_.get(), pos, SEEK_SET) < 0) throw errno_exception();
+            file_offset_ = pos;
+        }
+
+        // logical position in the archive, including buffered data
+        [[nodiscard]] off_t file_tell() const
+        {
+            return file_offset_ + static_cast<off_t>(file_buffer_used_);
+        }
+
+        // overwrites already written data, whether it's still buffered or not
+        void file_patch(const off_t pos, const char* const data, const size_t size)
+        {
+            const phase_timer timer(*this, &tar_statistics::write_ns);
+            if (pos < file_offset_ && writer_ != nullptr) writer_->sync();
+            size_t patched = 0;
+            if (mode_ == output_mode::sink_output && pos < file_offset_) {
+                patched = std::min<size_t>(size, file_offset_ - pos);
+                sink_patch(pos, data, patched);
+            }
+            while (pos + static_cast<off_t>(patched) < file_offset_ && patched < size) {
+                const auto write_size = std::min<size_t>(size - patched, file_offset_ - pos - patched);
+                count(&tar_statistics::syscalls);
+                const auto result = ::pwrite(file_.get(), data + patched, write_size, pos + static_cast<off_t>(patched));
+                if (result < 0) {
+                    if (errno == EINTR) continue;
+                    throw errno_exception();
+                }
+                patched += result;
+            }
+
+            if (patched < size) {
+                std::copy_n(data + patched, size - patched, file_buffer_.data() + (pos + patched - file_offset_));
+            }
+        }
+
+        // Position of a header which is rewritten once the size of its member is known. Sinks which
+        // can't patch don't get anything from there on until file_seek returns to the end afterwards.
+        off_t begin_header_rewrite()
+        {
+            if (mode_ == output_mode::sink_output && !sink_->can_patch()) {
+                file_flush();
+                held_back_from_ = file_tell();
+            }
+            return file_tell();
+        }
+
+        // writes the data of both buffers at file_offset_
+        void sink_write(const char* const first, const size_t first_size, const char* const second = nullptr, const size_t second_size = 0)
+        {
+            const phase_timer timer(*this, &tar_statistics::write_ns);
+            count(&tar_statistics::bytes_out, first_size + second_size);
+            std::array<iovec, 2> buffers {iovec {const_cast<char*>(first), first_size}, iovec {const_cast<char*>(second), second_size}};
+
+            for (auto& buffer : buffers) {
+                // rewritten data, i.e. a header written again
+                const auto patch_size = file_offset_ < sink_end_ ? std::min<size_t>(buffer.iov_len, sink_end_ - file_offset_) : 0;
+                if (patch_size == 0) continue;
+                sink_patch(file_offset_, static_cast<const char*>(buffer.iov_base), patch_size);
+                buffer.iov_base = static_cast<char*>(buffer.iov_base) + patch_size;
+                buffer.iov_len -= patch_size;
+                file_offset_ += static_cast<off_t>(patch_size);
+            }
+
+            const auto append_size = buffers[0].iov_len + buffers[1].iov_len;
+            if (append_size == 0) return;
+            if (held_back_from_ >= 0) {
+                for (const auto& buffer : buffers) {
+                    held_back_.insert(held_back_.end(), static_cast<const char*>(buffer.iov_base), static_cast<const char*>(buffer.iov_base) + buffer.iov_len);
+                }
+            } else {
+                sink_->writev(buffers.data(), buffers.size());
+            }
+            file_offset_ += static_cast<off_t>(append_size);
+            sink_end_ = file_offset_;
+        }
+
+        void sink_patch(const off_t pos, const char* const data, const size_t size)
+        {
+            if (held_back_from_ >= 0 && pos >= held_back_from_) {
+                std::copy_n(data, size, held_back_.data() + (pos - held_back_from_));
+                return;
+            }
+            sink_->patch(static_cast<size_t>(pos), data, size);
+        }
+
+        void release_held_back()
+        {
+            sink_->write(held_back_.data(), held_back_.size());
+            held_back_.clear();
+            held_back_from_ = -1;
+        }
+
+        static file_descriptor open_archive(const std::string& filename)
+        {
+            return file_descriptor(::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+        }
+
+        enum class output_mode : unsigned {
+            file_output,
+            stream_output,
+            chunked_stream_output,
+            sink_output,
+        };
+
+        struct index_position {
+            size_t header_offset = 0;
+            size_t block_offset = 0;
+            size_t block_tar_offset = 0;
+        };
+
+        // Writes the index file. An entry is held back until the next one starts,
+        // as patching a header may still change the size.
+        class index_writer {
+        public:
+            explicit index_writer(const std::string& filename)
+                : file_(::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666))
+            {
+                if (!file_.is_open()) throw errno_exception();
+                tar_index::append_header(buffer_);
+            }
+
+            void add(tar_index_entry&& entry)
+            {
+                write_pending();
+                pending_ = std::move(entry);
+            }
+
+            void update_pending_size(const size_t size)
+            {
+                if (pending_.has_value()) pending_->size = size;
+            }
+
+            void finish()
+            {
+                write_pending();
+                write_buffer();
+            }
+
+        private:
+            static constexpr size_t buffer_size_ = 64 * 1024;
+
+            void write_pending()
+            {
+                if (!pending_.has_value()) return;
+                tar_index::append_entry(buffer_, pending_.value());
+                pending_.reset();
+                if (buffer_.size() >= buffer_size_) write_buffer();
+            }
+
+            void write_buffer()
+            {
+                binary_codec::write_all(file_.get(), buffer_);
+                buffer_.clear();
+            }
+
+            file_descriptor file_;
+            std::string buffer_;
+            std::optional<tar_index_entry> pending_;
+        };
+
+        // position of the next header. Headers of compressed archives start a new block,
+        // unless they are fixed size. Those are flushed once in a while instead, so members
+        // can be reached without decompressing everything before them.
+        [[nodiscard]] index_position next_index_position()
+        {
+            const auto tar_offset = is_zero_copy_possible() ? static_cast<size_t>(file_tell()) : tar_offset_;
+#ifdef WITH_COMPRESSION
+            if (compressor_ != nullptr) {
+                start_compressor();
+                const auto output_offset = is_positioned_output() ? static_cast<size_t>(file_tell()) : output_offset_;
+                if (header_mode_ != header_mode::fixed_size) return {tar_offset, output_offset, tar_offset};
+
+                if (tar_offset - index_block_.block_tar_offset >= index_block_interval_) {
+                    compressor_->flush();
+                    const auto flushed_offset = is_positioned_output() ? static_cast<size_t>(file_tell()) : output_offset_;
+                    index_block_ = {tar_offset, flushed_offset, tar_offset};
+                }
+                return {tar_offset, index_block_.block_offset, index_block_.block_tar_offset};
+            }
+#endif
+            return {tar_offset, tar_offset, tar_offset};
         }
 
-        void add_hardlink(const std::string& file_name, const std::string& link_name, uid_t uid, gid_t gid,
-                          mod_time_t time)
+        void add_index_entry(const std::string_view name, const file_type_flag file_type, const size_t size, const bool rewrite_in_place)
         {
-            check_state_and_flush();
-            write_header(link_name, static_cast<mode_t>(tarxx::permission_t::all_all), uid, gid, 0U, time,
-                         file_type_flag::HARD_LINK, 0U, 0U, file_name);
+            const auto position = rewrite_in_place ? placeholder_position_ : next_index_position();
+            index_writer_->add({std::string(platform_->relative_path(name)), file_type, position.header_offset, position.header_offset + BLOCK_SIZE,
+                                size, position.block_offset, position.block_tar_offset});
         }
 
-        void add_character_special_file(const std::string& name, mode_t mode, uid_t uid, gid_t gid, size_t size,
-                                        mod_time_t time, major_t dev_major, minor_t dev_minor)
+        static constexpr size_t index_block_interval_ = 4 * 1024 * 1024;
+
+
+        tar_type type_;
+        output_mode mode_;
+
+        std::string file_name_;
+        file_descriptor file_;
+        // created on the first write, destroyed before file_ is closed
+        std::unique_ptr<output_writer> writer_;
+
+        aligned_buffer file_buffer_;
+        unsigned long file_buffer_used_;
+        // bytes passed to the file so far, the offset of the first buffered byte
+        off_t file_offset_ = 0;
+
+        // reserve 256KB buffer. A larger buffer
+        // does not improve performance significantly
+        static constexpr unsigned long file_buffer_default_size_ = 512 * BLOCK_SIZE;
+
+        std::unique_ptr<output_sink> sink_;
+        bool sink_open_ = true;
+        // end of the data passed to the sink, file_offset_ is before it while a header is rewritten
+        off_t sink_end_ = 0;
+        // start of the data held back for sinks which can't patch, negative if nothing is held back
+        off_t held_back_from_ = -1;
+        std::vector<char> held_back_;
+
+        callback_t callback_;
+        chunk_callback_t chunk_callback_;
+        size_t chunk_size_ = 0;
+        long stream_file_header_pos_;
+        block_t stream_block_;
+        size_t stream_block_used_;
+
+        std::unique_ptr<Platform> platform_;
+        prefetch_options prefetch_options_;
+        walk_options walk_options_;
+        header_mode header_mode_ = header_mode::rewrite;
+        // backs the names of stored_files_ and stored_inos_
+        path_arena paths_;
+        hardlink_table stored_inos_ {paths_};
+        name_set stored_files_ {paths_};
+        dedup_options dedup_options_;
+        fingerprint_table fingerprints_;
+        checksum_options checksum_options_;
+        // digest of the payload being written, if checksums are enabled
+        std::optional<content_digest> payload_checksum_;
+        std::vector<member_checksum> checksums_;
+        page_cache_options page_cache_options_;
+        sparse_options sparse_options_;
+#ifdef WITH_STATISTICS
+        tar_statistics statistics_;
+        entry_hook_t entry_hook_;
+        std::chrono::steady_clock::time_point entry_start_;
+        // phase of the innermost phase_timer and when it was started or resumed
+        uint64_t tar_statistics::*active_phase_ = nullptr;
+        std::chrono::steady_clock::time_point phase_start_;
+#endif
+        // archive ranges handled by release_written_pages
+        off_t written_back_offset_ = 0;
+        off_t dropped_offset_ = 0;
+        std::vector<char> dedup_buffer_;
+        std::vector<char> dedup_compare_buffer_;
+        // how regular files added from the file system are completed after their header
+        enum class payload_mode {
+            write,
+            // left to tar_generator in deferred_payload_
+            defer,
+            // only counted in tar_offset_, for tar_planner
+            skip,
+        };
+        struct deferred_payload {
+            file_descriptor infile;
+            size_t size = 0;
+            std::string name;
+        };
+        payload_mode payload_mode_ = payload_mode::write;
+        std::optional<deferred_payload> deferred_payload_;
+        // all members, set by tar_planner
+        std::vector<tar_index_entry>* planned_members_ = nullptr;
+        // set in incremental mode
+        std::optional<tar_snapshot> previous_snapshot_;
+        tar_snapshot snapshot_;
+
+        // positions in the uncompressed archive and in the output
+        size_t tar_offset_ = 0;
+        size_t output_offset_ = 0;
+        std::unique_ptr<index_writer> index_writer_;
+        // position of a header which is written after its content
+        index_position placeholder_position_;
+        // last position known to start a compressed block
+        index_position index_block_;
+        // directory name with the trailing /, reused to avoid allocations
+        std::string directory_name_;
+
+#ifdef WITH_COMPRESSION
+        compression_mode compression_ = compression_mode::none;
+        std::unique_ptr<compressor> compressor_;
+        bool compressor_started_ = false;
+#endif
+
+    };
+
+    // Unbounded lock free queue for any number of producers and a single consumer (Vyukov's
+    // intrusive MPSC queue). push may be called from any thread, pop and empty only from the consumer.
+    template <typename T>
+    class mpsc_queue {
+    public:
+        mpsc_queue() : head_(new node), tail_(head_.load()) {}
+
+        // delete copy and move special member functions, nodes are owned by the queue
+        mpsc_queue(const mpsc_queue& other) = delete;
+        mpsc_queue& operator=(const mpsc_queue& other) = delete;
+        mpsc_queue(mpsc_queue&& other) = delete;
+        mpsc_queue& operator=(mpsc_queue&& other) = delete;
+
+        ~mpsc_queue()
         {
-            check_state_and_flush();
-            write_header(name, mode, uid, gid, size, time, file_type_flag::CHARACTER_SPECIAL_FILE, dev_major,
-                         dev_minor);
+            while (pop().has_value()) {}
+            delete tail_;
         }
 
-        void add_block_special_file(const std::string& name, mode_t mode, uid_t uid, gid_t gid, size_t size, mod_time_t time,
-                                    major_t dev_major, minor_t dev_minor)
+        void push(T value)
         {
-            check_state_and_flush();
-            write_header(name, mode, uid, gid, size, time, file_type_flag::BLOCK_SPECIAL_FILE, dev_major, dev_minor);
+            auto* const added = new node;
+            added->value.emplace(std::move(value));
+            // the queue is broken until the link is stored, the consumer sees it as empty meanwhile
+            auto* const previous = head_.exchange(added);
+            previous->next.store(added);
         }
 
-        void add_fifo(const std::string& name, mode_t mode, uid_t uid, gid_t gid, mod_time_t time)
+        std::optional<T> pop()
         {
-            check_state_and_flush();
-            write_header(name, mode, uid, gid, 0, time, file_type_flag::FIFO);
+            auto* const next = tail_->next.load();
+            if (next == nullptr) return std::nullopt;
+            // next becomes the new stub, its value is moved out
+            std::optional<T> value(std::move(next->value));
+            next->value.reset();
+            delete tail_;
+            tail_ = next;
+            return value;
         }
 
-        void add_directory(const std::string& dirname, mode_t mode, uid_t uid, gid_t gid, mod_time_t mod_time)
+        [[nodiscard]] bool empty() const
         {
-            check_state_and_flush();
-            write_header(dirname, mode, uid, gid, 0, mod_time, file_type_flag::DIRECTORY);
+            return tail_->next.load() == nullptr;
         }
 
-        void add_file_streaming()
+    private:
+        struct node {
+            std::atomic<node*> next {nullptr};
+            std::optional<T> value;
+        };
+
+        std::atomic<node*> head_;
+        node* tail_;
+    };
+
+    // regular file passed to concurrent_tarfile, the content is owned by the entry
+    struct memory_file {
+        std::string name;
+        mode_t mode = static_cast<mode_t>(permission_t::owner_read) | static_cast<mode_t>(permission_t::owner_write);
+        uid_t uid = 0;
+        gid_t gid = 0;
+        mod_time_t mod_time = 0;
+        std::vector<char> data;
+    };
+
+    // Lets any number of threads add in memory files to one tarfile. Producers push the files into a
+    // lock free queue, a writer thread drains it into the tarfile. Producers only block if the limits
+    // of pending files are reached. Files of one producer are archived in the order they were added.
+    // The tarfile must not be used otherwise until close returns.
+    class concurrent_tarfile {
+    public:
+        struct options {
+            // maximum number of files added but not archived yet
+            std::size_t max_pending_files = 1024;
+            // maximum content bytes of files added but not archived yet, a larger
+            // file is accepted if nothing else is pending
+            std::size_t max_pending_bytes = 64UL * 1024UL * 1024UL;
+            // files archived before waiting producers are woken up
+            std::size_t batch_size = 64;
+        };
+
+        explicit concurrent_tarfile(tarfile& tar) : concurrent_tarfile(tar, options {}) {}
+
+        concurrent_tarfile(tarfile& tar, const options& options)
+            : tar_(tar), options_(options)
         {
-            if (mode_ != output_mode::file_output)
-                throw std::logic_error(__func__ + " only supports output mode file"s);
-            check_state_and_flush();
+            if (options_.max_pending_files == 0) throw std::invalid_argument("max pending files must not be 0");
+            if (options_.batch_size == 0) throw std::invalid_argument("batch size must not be 0");
+            writer_ = std::thread([this]() { write_pending(); });
+        }
 
-            // write empty header
-            stream_file_header_pos_ = file_tellg();
-            block_t header {};
-            write(header, true);
+        // delete copy and move special member functions, the writer thread refers to the instance
+        concurrent_tarfile(const concurrent_tarfile& other) = delete;
+        concurrent_tarfile& operator=(const concurrent_tarfile& other) = delete;
+        concurrent_tarfile(concurrent_tarfile&& other) = delete;
+        concurrent_tarfile& operator=(concurrent_tarfile&& other) = delete;
+
+        ~concurrent_tarfile()
+        {
+            try {
+                close();
+            } catch (const std::exception& ex) {
+                // ignore exception in destructor, as they cannot be caught.
+            }
         }
 
-        void add_file_streaming_data(const char* const data, std::streamsize size)
+        // Blocks while the limits of pending files are reached. Errors of the writer are
+        // rethrown by the next call of add_file, flush or close.
+        void add_file(memory_file file)
         {
-            if (!is_open()) throw std::logic_error("Cannot append file, tar archive is not open");
-            if (stream_file_header_pos_ < 0)
-                throw std::logic_error("Can't stream file data, no file added via add_file_streaming");
-            if (size == 0) return;
+            if (closed_) throw std::logic_error("Cannot add file, concurrent tarfile is closed");
+            rethrow_writer_error();
+            reserve(file.data.size());
+            push({std::move(file), nullptr, false});
+        }
 
-            unsigned long pos = 0;
-            block_t block;
+        // Returns once all files added before by any thread are archived.
+        void flush()
+        {
+            if (closed_) return;
+            wait_for_barrier(false);
+        }
 
-            // fill a new block with old and new data if enough data
-            // is available to fill a whole block
-            if ((stream_block_used_ + size) >= BLOCK_SIZE) {
-                // copy saved data
-                std::copy_n(stream_block_.data(), stream_block_used_, block.data());
+        // Archives all pending files, stops the writer thread and closes the tarfile.
+        void close()
+        {
+            if (closed_.exchange(true)) return;
+            const auto barrier_error = wait_for_barrier(true);
+            writer_.join();
+            tar_.close();
+            if (barrier_error) std::rethrow_exception(barrier_error);
+        }
 
-                // copy from new data
-                const auto copy_from_new_data = BLOCK_SIZE - stream_block_used_;
-                std::copy_n(data, copy_from_new_data, block.data() + stream_block_used_);
+    private:
+        struct item {
+            std::optional<memory_file> file;
+            // set once all items before are processed
+            std::promise<void>* barrier = nullptr;
+            bool stop = false;
+        };
 
-                // write new complete block
-                write(block);
+        void push(item&& pushed)
+        {
+            queue_.push(std::move(pushed));
+            if (writer_waiting_) {
+                const std::lock_guard lock(mutex_);
+                work_available_.notify_one();
+            }
+        }
 
-                pos += copy_from_new_data;
-                size -= copy_from_new_data;
-                stream_block_used_ = 0;
+        std::exception_ptr wait_for_barrier(const bool stop)
+        {
+            std::promise<void> barrier;
+            auto done = barrier.get_future();
+            push({std::nullopt, &barrier, stop});
+            try {
+                done.get();
+            } catch (...) {
+                if (stop) return std::current_exception();
+                throw;
+            }
+            return nullptr;
+        }
+
+        [[nodiscard]] bool try_reserve(const std::size_t size)
+        {
+            const auto files = pending_files_.fetch_add(1);
+            const auto bytes = pending_bytes_.fetch_add(size);
+            if (files < options_.max_pending_files && (bytes == 0 || bytes + size <= options_.max_pending_bytes)) return true;
+            pending_files_ -= 1;
+            pending_bytes_ -= size;
+            return false;
+        }
+
+        void reserve(const std::size_t size)
+        {
+            if (try_reserve(size)) return;
+            // the failed attempt may have kept a waiting producer from reserving. Waiting
+            // producers reserve one after another while holding the mutex, so they don't need this.
+            notify_waiting_producers();
+
+            std::unique_lock lock(mutex_);
+            ++waiting_producers_;
+            space_available_.wait(lock, [this, size]() { return try_reserve(size); });
+            --waiting_producers_;
+        }
+
+        void release(const std::size_t files, const std::size_t bytes)
+        {
+            pending_files_ -= files;
+            pending_bytes_ -= bytes;
+            notify_waiting_producers();
+        }
+
+        void notify_waiting_producers()
+        {
+            if (waiting_producers_ == 0) return;
+            const std::lock_guard lock(mutex_);
+            space_available_.notify_all();
+        }
+
+        void rethrow_writer_error()
+        {
+            if (!failed_) return;
+            const std::lock_guard lock(mutex_);
+            std::rethrow_exception(error_);
+        }
+
+        void wait_for_work()
+        {
+            std::unique_lock lock(mutex_);
+            writer_waiting_ = true;
+            work_available_.wait(lock, [this]() { return !queue_.empty(); });
+            writer_waiting_ = false;
+        }
+
+        void write_pending()
+        {
+            std::size_t batch_files = 0;
+            std::size_t batch_bytes = 0;
+            const auto release_batch = [&]() {
+                if (batch_files == 0) return;
+                release(batch_files, batch_bytes);
+                batch_files = 0;
+                batch_bytes = 0;
+            };
+
+            while (true) {
+                auto next = queue_.pop();
+                if (!next.has_value()) {
+                    release_batch();
+                    wait_for_work();
+                    continue;
+                }
+
+                if (next->file.has_value()) {
+                    write_file(next->file.value());
+                    ++batch_files;
+                    batch_bytes += next->file->data.size();
+                    if (batch_files == options_.batch_size) release_batch();
+                    continue;
+                }
+
+                release_batch();
+                if (failed_) {
+                    const std::lock_guard lock(mutex_);
+                    next->barrier->set_exception(error_);
+                } else {
+                    next->barrier->set_value();
+                }
+                if (next->stop) return;
+            }
+        }
+
+        void write_file(const memory_file& file)
+        {
+            // after an error files are dropped, so producers don't block forever
+            if (failed_) return;
+            try {
+                tar_.add_file(file.name, file.mode, file.uid, file.gid, file.mod_time, file.data.data(), file.data.size());
+            } catch (...) {
+                const std::lock_guard lock(mutex_);
+                error_ = std::current_exception();
+                failed_ = true;
+            }
+        }
+
+        tarfile& tar_;
+        const options options_;
+        mpsc_queue<item> queue_;
+        std::atomic<std::size_t> pending_files_ {0};
+        std::atomic<std::size_t> pending_bytes_ {0};
+        std::atomic<std::size_t> waiting_producers_ {0};
+        std::atomic<bool> writer_waiting_ {false};
+        std::atomic<bool> failed_ {false};
+        std::atomic<bool> closed_ {false};
+        // only guards waiting and error_, the queue is lock free
+        std::mutex mutex_;
+        std::condition_variable space_available_;
+        std::condition_variable work_available_;
+        std::exception_ptr error_;
+        std::thread writer_;
+    };
+
+    // Produces an uncompressed archive on demand instead of pushing it to an output, e.g. for
+    // serving downloads from an event loop. Entries are read from the file system as the consumer
+    // asks for more data and file contents are read straight into the consumer's buffer, so only
+    // headers are held in memory. The contents are truncated or filled up with zeroes to the size
+    // found when their header was written, as for header_mode::fixed_size.
+    class tar_generator {
+    public:
+        explicit tar_generator(tarfile::tar_type type = tarfile::tar_type::unix_v7,
+                               std::unique_ptr<Platform> platform = std::make_unique<Platform>())
+            : tar_(std::make_unique<callback_output_sink>([this](const char* const data, const size_t size) { pending_.append(data, size); },
+                                                          output_buffer_options {header_buffer_size_}),
+                   type, std::move(platform))
+        {
+            tar_.set_header_mode(tarfile::header_mode::fixed_size);
+            tar_.payload_mode_ = tarfile::payload_mode::defer;
+        }
+
+        // delete copy and move special member functions, the archive refers to the instance
+        tar_generator(const tar_generator& other) = delete;
+        tar_generator& operator=(const tar_generator& other) = delete;
+        tar_generator(tar_generator&& other) = delete;
+        tar_generator& operator=(tar_generator&& other) = delete;
+
+        ~tar_generator() = default;
+
+        // The entries are archived in the order they are added, directories are walked once they are reached.
+        // Must not be called once next_chunk returned 0.
+        void add_from_filesystem_recursive(const std::string& path, const bool read_symlinks = false)
+        {
+            if (finished_) throw std::logic_error("Cannot add files, the archive is complete");
+            sources_.push_back({path, std::nullopt, read_symlinks});
+        }
+
+        void add_from_filesystem_recursive(const std::string& source_path, std::string target_path, const bool read_symlinks = false)
+        {
+            if (finished_) throw std::logic_error("Cannot add files, the archive is complete");
+            if (!target_path.empty() && target_path.rfind('/') == target_path.size() - 1) target_path.pop_back();
+            sources_.push_back({source_path, std::move(target_path), read_symlinks});
+        }
+
+        // Fills buffer with up to size bytes of the archive, less only at its end. Returns 0 once the
+        // archive is complete. Exceptions of archiving an entry are passed on, the archive can't be
+        // continued afterwards.
+        size_t next_chunk(char* const buffer, const size_t size)
+        {
+            size_t used = 0;
+            while (used < size) {
+                if (pending_pos_ < pending_.size()) {
+                    const auto copy_size = std::min(size - used, pending_.size() - pending_pos_);
+                    std::copy_n(pending_.data() + pending_pos_, copy_size, buffer + used);
+                    pending_pos_ += copy_size;
+                    used += copy_size;
+                    continue;
+                }
+                pending_.clear();
+                pending_pos_ = 0;
+
+                if (payload_.has_value()) {
+                    used += read_payload(buffer + used, size - used);
+                    continue;
+                }
+                if (!next_entry()) break;
+            }
+            return used;
+        }
+
+        [[nodiscard]] bool done() const
+        {
+            return finished_ && pending_pos_ == pending_.size() && !payload_.has_value();
+        }
+
+    private:
+        struct source {
+            std::string path;
+            // the source path is stored if not set
+            std::optional<std::string> target_path;
+            bool read_symlinks = false;
+        };
+
+        // remaining content of the regular file whose header was passed on last
+        struct payload {
+            file_descriptor infile;
+            std::string name;
+            size_t size = 0;
+            size_t remaining = 0;
+            size_t padding = 0;
+            // set once the file shrank, zeroes are passed on instead
+            bool truncated = false;
+        };
+
+        // archives the next entry into pending_ or prepares its payload, false at the end of the archive
+        bool next_entry()
+        {
+            if (walk_.has_value() && walk_.value() != std::filesystem::recursive_directory_iterator()) {
+                const auto path = walk_.value()->path().string();
+                ++walk_.value();
+                add_entry(path);
+                return true;
+            }
+            walk_.reset();
+
+            if (!sources_.empty()) {
+                current_ = std::move(sources_.front());
+                sources_.pop_front();
+                // the directory itself comes first, as for tarfile::add_from_filesystem_recursive
+                if (tar_.source_metadata(current_.path).type == file_type_flag::DIRECTORY) walk_.emplace(current_.path);
+                add_entry(current_.path);
+                return true;
+            }
+
+            if (finished_) return false;
+            finished_ = true;
+            tar_.close();
+            return true;
+        }
+
+        void add_entry(const std::string& path)
+        {
+            if (current_.target_path.has_value()) {
+                auto target = path;
+                target.replace(0, current_.path.size(), current_.target_path.value());
+                tar_.add_from_filesystem(path, target, current_.read_symlinks);
+            } else {
+                tar_.add_from_filesystem(path, current_.read_symlinks);
+            }
+            tar_.file_flush();
+
+            if (!tar_.deferred_payload_.has_value()) return;
+            auto deferred = std::move(tar_.deferred_payload_.value());
+            tar_.deferred_payload_.reset();
+            const auto padded_size = tarfile::padded_size(deferred.size);
+            payload_ = payload {std::move(deferred.infile), std::move(deferred.name), deferred.size, deferred.size, padded_size - deferred.size};
+        }
+
+        size_t read_payload(char* const buffer, const size_t size)
+        {
+            auto& current = payload_.value();
+            size_t used = 0;
+            if (current.remaining > 0) {
+                const auto read_size = std::min(size, current.remaining);
+                if (!current.truncated) used = read_content(current.infile.get(), buffer, read_size);
+                // the file shrank, fill up with zeroes to match the header
+                if (used < read_size) {
+                    current.truncated = true;
+                    std::fill_n(buffer + used, read_size - used, 0);
+                    used = read_size;
+                }
+                current.remaining -= used;
+            }
+
+            const auto padding = std::min(size - used, current.padding);
+            std::fill_n(buffer + used, padding, 0);
+            used += padding;
+            current.padding -= padding;
+
+            if (current.remaining == 0 && current.padding == 0) {
+                tar_.tar_offset_ += tarfile::padded_size(current.size);
+                tar_.entry_finished(current.name, current.size);
+                payload_.reset();
+            }
+            return used;
+        }
+
+        size_t read_content(const int fd, char* const buffer, const size_t size)
+        {
+            const tarfile::phase_timer timer(tar_, &tar_statistics::read_ns);
+            tar_.count(&tar_statistics::syscalls);
+            const auto read_bytes = tarfile::read_fully(fd, buffer, size, -1);
+            tar_.count(&tar_statistics::bytes_in, read_bytes);
+            return read_bytes;
+        }
+
+        // holds a header and the small writes around it, file contents bypass it
+        static constexpr size_t header_buffer_size_ = 16 * BLOCK_SIZE;
+
+        std::string pending_;
+        size_t pending_pos_ = 0;
+        tarfile tar_;
+        std::deque<source> sources_;
+        source current_;
+        std::optional<std::filesystem::recursive_directory_iterator> walk_;
+        std::optional<payload> payload_;
+        bool finished_ = false;
+    };
+
+    // Predicts the layout of an uncompressed archive without reading any file contents, e.g. to announce
+    // its size before streaming it or to preallocate the archive file. Entries are added as to a tarfile
+    // and pass the same checks, unsupported types and hard links are found the same way. The prediction
+    // holds as long as the files don't change until they are archived.
+    class tar_planner {
+    public:
+        explicit tar_planner(tarfile::tar_type type = tarfile::tar_type::unix_v7,
+                             std::unique_ptr<Platform> platform = std::make_unique<Platform>())
+            : tar_(std::make_unique<callback_output_sink>([](const char*, size_t) {}), type, std::move(platform))
+        {
+            tar_.payload_mode_ = tarfile::payload_mode::skip;
+            tar_.planned_members_ = &plan_.members;
+        }
+
+        // delete copy and move special member functions, the archive refers to the instance
+        tar_planner(const tar_planner& other) = delete;
+        tar_planner& operator=(const tar_planner& other) = delete;
+        tar_planner(tar_planner&& other) = delete;
+        tar_planner& operator=(tar_planner&& other) = delete;
+
+        ~tar_planner() = default;
+
+        // has to match the walk options of the tarfile writing the archive
+        void set_walk_options(const tarfile::walk_options& options)
+        {
+            tar_.set_walk_options(options);
+        }
+
+        void add_from_filesystem_recursive(const std::string& path, const bool read_symlinks = false)
+        {
+            tar_.add_from_filesystem_recursive(path, read_symlinks);
+        }
+
+        void add_from_filesystem_recursive(const std::string& source_path, std::string target_path, const bool read_symlinks = false)
+        {
+            tar_.add_from_filesystem_recursive(source_path, std::move(target_path), read_symlinks);
+        }
+
+        void add_from_filesystem(const std::string& filename, const bool read_symlinks = false)
+        {
+            tar_.add_from_filesystem(filename, read_symlinks);
+        }
+
+        void add_from_filesystem(const std::string& source_path, const std::string& target_path, const bool read_symlinks = false)
+        {
+            tar_.add_from_filesystem(source_path, target_path, read_symlinks);
+        }
+
+        // completes the archive, no entries can be added afterwards
+        [[nodiscard]] const tar_plan& plan()
+        {
+            if (tar_.is_open()) {
+                tar_.close();
+                plan_.size = tar_.tar_offset_;
+            }
+            return plan_;
+        }
+
+    private:
+        tar_plan plan_;
+        tarfile tar_;
+    };
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+    // Yields the archive of a tar_generator in chunks of at most chunk_size bytes. Each chunk is valid
+    // until the coroutine is resumed, the generator has to outlive it.
+    class tar_chunk_generator {
+    public:
+        struct promise_type {
+            std::string_view chunk;
+            std::exception_ptr error;
+
+            tar_chunk_generator get_return_object()
+            {
+                return tar_chunk_generator(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            std::suspend_always initial_suspend() noexcept
+            {
+                return {};
+            }
+
+            std::suspend_always final_suspend() noexcept
+            {
+                return {};
+            }
+
+            std::suspend_always yield_value(const std::string_view value) noexcept
+            {
+                chunk = value;
+                return {};
+            }
+
+            void return_void() noexcept {}
+
+            void unhandled_exception() noexcept
+            {
+                error = std::current_exception();
+            }
+        };
+
+        class iterator {
+        public:
+            using iterator_category = std::input_iterator_tag;
+            using value_type = std::string_view;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const std::string_view*;
+            using reference = const std::string_view&;
+
+            iterator() = default;
+            explicit iterator(const std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+            reference operator*() const
+            {
+                return handle_.promise().chunk;
+            }
+
+            iterator& operator++()
+            {
+                resume(handle_);
+                return *this;
             }
 
-            // write new block as long as we have enough data to fill a whole block
-            while (size >= BLOCK_SIZE) {
-                std::copy_n(data + pos, BLOCK_SIZE, block.data());
-                pos += BLOCK_SIZE;
-                size -= BLOCK_SIZE;
-                write(block);
+            void operator++(int)
+            {
+                ++*this;
             }
 
-            // store remaining data for next call or stream_file_complete
-            std::copy_n(data + pos, size, stream_block_.data() + stream_block_used_);
-            stream_block_used_ += size;
-        }
-
-        void stream_file_complete(const std::string& filename, mode_t mode, uid_t uid, gid_t gid, size_t size,
-                                  mod_time_t mod_time)
-        {
-            if (stream_file_header_pos_ < 0) throw std::logic_error("Can't finish stream file, none is in progress");
+            bool operator==(const iterator& other) const
+            {
+                return is_done() == other.is_done();
+            }
 
-            // create last block, 0 init to ensure correctness if size < block size
-            // but do not create an empty block
-            if (stream_block_used_ > 0) {
-                block_t block {};
-                std::copy_n(stream_block_.data(), stream_block_used_, block.data());
-                stream_block_used_ = 0;
-                write(block);
+            bool operator!=(const iterator& other) const
+            {
+                return !(*this == other);
             }
 
-            // flush is necessary so seek to the correct positions
-#ifdef WITH_LZ4
-            if (compression_ == compression_mode::lz4) {
-                lz4_flush();
+        private:
+            [[nodiscard]] bool is_done() const
+            {
+                return handle_ == nullptr || handle_.done();
             }
-#endif
 
-            // seek to header
-            const auto stream_pos = file_tellp();
-            file_seekp(stream_file_header_pos_);
-            stream_file_header_pos_ = -1;
-            write_header(filename, mode, uid, gid, size, mod_time, file_type_flag::REGULAR_FILE);
-            file_seekp(stream_pos);
-        }
+            std::coroutine_handle<promise_type> handle_;
+        };
 
-    private:
-        // Offsets
-        static constexpr unsigned int UNIX_V7_USTAR_HEADER_POS_NAME = 0U;
-        static constexpr unsigned int UNIX_V7_USTAR_HEADER_POS_MODE = 100U;
-        static constexpr unsigned int UNIX_V7_USTAR_HEADER_POS_UID = 108U;
-        static constexpr unsigned int UNIX_V7_USTAR_HEADER_POS_GID = 116U;
-        static constexpr unsigned int UNIX_V7_USTAR_HEADER_POS_SIZE = 124U;
-        static constexpr unsigned int UNIX_V7_USTAR_HEADER_POS_MTIM = 136U;
-        static constexpr unsigned int UNIX_V7_USTAR_HEADER_POS_CHECKSUM = 148U;
-        static constexpr unsigned int UNIX_V7_USTAR_HEADER_POS_TYPEFLAG = 156U;
-        static constexpr unsigned int UNIX_V7_USTAR_HEADER_POS_LINKNAME = 157U;
+        // delete copy special member functions, the coroutine is owned exclusively
+        tar_chunk_generator(const tar_chunk_generator& other) = delete;
+        tar_chunk_generator& operator=(const tar_chunk_generator& other) = delete;
 
-        static constexpr unsigned int USTAR_HEADER_POS_MAGIC = 257U;
-        static constexpr unsigned int USTAR_HEADER_POS_UNAME = 265U;
-        static constexpr unsigned int USTAR_HEADER_POS_GNAME = 297U;
-        static constexpr unsigned int USTAR_HEADER_POS_DEVMAJOR = 329U;
-        static constexpr unsigned int USTAR_HEADER_POS_DEVMINOR = 337U;
-        static constexpr unsigned int USTAR_HEADER_POS_PREFIX = 345U;
+        tar_chunk_generator(tar_chunk_generator&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+        tar_chunk_generator& operator=(tar_chunk_generator&& other) noexcept
+        {
+            if (this != &other) {
+                destroy();
+                handle_ = std::exchange(other.handle_, nullptr);
+            }
+            return *this;
+        }
 
-        // Lengths
-        static constexpr unsigned int UNIX_V7_USTAR_HEADER_LEN_NAME = 100U;
-        static constexpr unsigned int UNIX_V7_USTAR_HEADER_LEN_MODE = 8U;
-        static constexpr unsigned int UNIX_V7_USTAR_HEADER_LEN_UID = 8U;
-        static constexpr unsigned int UNIX_V7_USTAR_HEADER_LEN_GID = 8U;
-        static constexpr unsigned int UNIX_V7_USTAR_HEADER_LEN_SIZE = 12U;
-        static constexpr unsigned int UNIX_V7_USTAR_HEADER_LEN_MTIM = 12U;
-        static constexpr unsigned int UNIX_V7_USTAR_HEADER_LEN_CHKSUM = 8U;
-        static constexpr unsigned int UNIX_V7_USTAR_HEADER_LEN_TYPEFLAG = 1U;
-        static constexpr unsigned int UNIX_V7_USTAR_HEADER_LEN_LINKNAME = 100U;
+        ~tar_chunk_generator()
+        {
+            destroy();
+        }
 
-        static constexpr unsigned int USTAR_HEADER_LEN_MAGIC = 6U;
-        static constexpr unsigned int USTAR_HEADER_LEN_UNAME = 32U;
-        static constexpr unsigned int USTAR_HEADER_LEN_GNAME = 32U;
-        static constexpr unsigned int USTAR_HEADER_LEN_DEVMAJOR = 8U;
-        static constexpr unsigned int USTAR_HEADER_LEN_DEVMINOR = 8U;
-        static constexpr unsigned int USTAR_HEADER_LEN_PREFIX = 155U;
+        iterator begin()
+        {
+            resume(handle_);
+            return iterator(handle_);
+        }
 
-#ifdef WITH_LZ4
+        iterator end()
+        {
+            return iterator();
+        }
+
+    private:
+        explicit tar_chunk_generator(const std::coroutine_handle<promise_type> handle) : handle_(handle) {}
 
-        template<typename F, typename... Args>
-        auto lz4_call_and_check_error(F&& func, Args&&... args)
+        static void resume(const std::coroutine_handle<promise_type> handle)
         {
-            const auto lz4_result = func(std::forward<Args>(args)...);
-            if (LZ4F_isError(lz4_result) != 0) {
-                throw std::runtime_error("lz4 function failed: error "s + LZ4F_getErrorName(lz4_result));
-            }
-            return lz4_result;
+            handle.resume();
+            if (handle.promise().error) std::rethrow_exception(std::exchange(handle.promise().error, nullptr));
         }
 
-        void lz4_flush()
+        void destroy()
         {
-            lz4_out_buf_pos_ += lz4_call_and_check_error(LZ4F_flush, lz4_ctx_->get(), lz4_out_buf_.data(),
-                                                         lz4_out_buf_.capacity(), nullptr);
-            const auto lz4_result = lz4_call_and_check_error(LZ4F_flush, lz4_ctx_->get(), lz4_out_buf_.data(),
-                                                             lz4_out_buf_.capacity(), nullptr);
-            lz4_out_buf_pos_ += lz4_result;
-            write_lz4_data();
+            if (handle_) handle_.destroy();
+            handle_ = nullptr;
         }
 
+        std::coroutine_handle<promise_type> handle_;
+    };
+
+    inline tar_chunk_generator chunks(tar_generator& generator, const size_t chunk_size = tarfile::default_chunk_size)
+    {
+        std::vector<char> buffer(chunk_size);
+        while (true) {
+            const auto size = generator.next_chunk(buffer.data(), buffer.size());
+            if (size == 0) co_return;
+            co_yield std::string_view(buffer.data(), size);
+        }
+    }
 #endif
 
-        void write(const block_t& data, [[maybe_unused]] bool is_header = false)
+    // Member of an archive as seen by a reader. All views point into the archive
+    // and stay valid as long as the reader exists.
+    struct tar_member {
+        std::string_view name;
+        std::string_view link_name;
+        // only set for ustar archives
+        std::string_view user_name;
+        std::string_view group_name;
+        file_type_flag type = file_type_flag::REGULAR_FILE;
+        mode_t mode = 0;
+        uid_t uid = 0;
+        gid_t gid = 0;
+        size_t size = 0;
+        mod_time_t mod_time = 0;
+        major_t dev_major = 0;
+        minor_t dev_minor = 0;
+        // position of the content in the archive
+        size_t offset = 0;
+        // for sparse files size is the size including holes, content only contains
+        // the data extents, stored back to back
+        bool sparse = false;
+        std::vector<sparse_extent> sparse_extents;
+    };
+
+    // Decodes the fields of unix_v7 and ustar headers, views point into the header.
+    struct header_decoder {
+        // gnu tar stores names and link names which do not fit into the header with extra entries
+        static constexpr char GNU_LONG_NAME = 'L';
+        static constexpr char GNU_LONG_LINK_NAME = 'K';
+
+        // the archive ends with (at least) one empty block
+        static bool is_end_of_archive(const char* const header)
         {
-            if (!is_open()) return;
-#ifdef WITH_LZ4
-            if (compression_ == compression_mode::lz4) {
-                if (is_header) {
-                    const auto lz4_result = lz4_call_and_check_error(LZ4F_uncompressedUpdate, lz4_ctx_->get(),
-                                                                     lz4_out_buf_.data(), lz4_out_buf_.capacity(),
-                                                                     data.data(), data.size(), nullptr);
+            return std::all_of(header, header + BLOCK_SIZE, [](const char c) { return c == 0; });
+        }
 
-                    lz4_out_buf_pos_ += lz4_result;
-                    // flush is necessary to keep lz4_out_buf_pos_ consistent
-                    lz4_flush();
-                } else {
-                    const auto lz4_result = lz4_call_and_check_error(LZ4F_compressUpdate, lz4_ctx_->get(),
-                                                                     lz4_out_buf_.data(), lz4_out_buf_.capacity(),
-                                                                     data.data(), data.size(), nullptr);
-                    lz4_out_buf_pos_ += lz4_result;
-                }
-                write_lz4_data();
-            } else {
-#endif
-                switch (mode_) {
-                    case output_mode::stream_output:
-                        callback_(data, data.size());
-                        break;
-                    case output_mode::file_output:
-                        file_buffered_write(data.data(), data.size());
-                        break;
-                }
-#ifdef WITH_LZ4
-            }
-#endif
+        static bool is_checksum_valid(const char* const header)
+        {
+            block_t block;
+            std::copy_n(header, BLOCK_SIZE, block.begin());
+            const auto stored = parse_number(block.data() + format::UNIX_V7_USTAR_HEADER_POS_CHECKSUM, format::UNIX_V7_USTAR_HEADER_LEN_CHKSUM);
+            std::fill_n(block.data() + format::UNIX_V7_USTAR_HEADER_POS_CHECKSUM, format::UNIX_V7_USTAR_HEADER_LEN_CHKSUM, ' ');
+            return header_encoder::checksum(block) == stored;
         }
 
-        void finish()
+        static char type_flag(const char* const header)
         {
-            block_t zeroes {};
-            write(zeroes);
-            write(zeroes);
+            return header[format::UNIX_V7_USTAR_HEADER_POS_TYPEFLAG];
+        }
 
-#ifdef WITH_LZ4
-            if (compression_ == compression_mode::lz4 && lz4_ctx_ != nullptr) {
-                const auto lz4_result = lz4_call_and_check_error(LZ4F_compressEnd,
-                                                                 lz4_ctx_->get(), lz4_out_buf_.data(),
-                                                                 lz4_out_buf_.capacity(), nullptr);
+        static size_t size(const char* const header)
+        {
+            return parse_number(header + format::UNIX_V7_USTAR_HEADER_POS_SIZE, format::UNIX_V7_USTAR_HEADER_LEN_SIZE);
+        }
 
-                lz4_out_buf_pos_ += lz4_result;
-                write_lz4_data();
+        // decodes all fields but the offset. The ustar name prefix is returned
+        // separately, as joining it with the name requires a copy.
+        static void decode(const char* const header, tar_member& member, std::string_view& prefix)
+        {
+            const auto flag = type_flag(header);
+            member.type = flag == 0 ? file_type_flag::REGULAR_FILE : static_cast<file_type_flag>(flag);
+            member.size = size(header);
+            member.mode = static_cast<mode_t>(parse_number(header + format::UNIX_V7_USTAR_HEADER_POS_MODE, format::UNIX_V7_USTAR_HEADER_LEN_MODE));
+            member.uid = static_cast<uid_t>(parse_number(header + format::UNIX_V7_USTAR_HEADER_POS_UID, format::UNIX_V7_USTAR_HEADER_LEN_UID));
+            member.gid = static_cast<gid_t>(parse_number(header + format::UNIX_V7_USTAR_HEADER_POS_GID, format::UNIX_V7_USTAR_HEADER_LEN_GID));
+            member.mod_time = static_cast<mod_time_t>(parse_number(header + format::UNIX_V7_USTAR_HEADER_POS_MTIM, format::UNIX_V7_USTAR_HEADER_LEN_MTIM));
+            member.link_name = field(header, format::UNIX_V7_USTAR_HEADER_POS_LINKNAME, format::UNIX_V7_USTAR_HEADER_LEN_LINKNAME);
+            member.name = field(header, format::UNIX_V7_USTAR_HEADER_POS_NAME, format::UNIX_V7_USTAR_HEADER_LEN_NAME);
+            prefix = {};
+
+            if (is_ustar(header)) {
+                member.user_name = field(header, format::USTAR_HEADER_POS_UNAME, format::USTAR_HEADER_LEN_UNAME);
+                member.group_name = field(header, format::USTAR_HEADER_POS_GNAME, format::USTAR_HEADER_LEN_GNAME);
+                member.dev_major = static_cast<major_t>(parse_number(header + format::USTAR_HEADER_POS_DEVMAJOR, format::USTAR_HEADER_LEN_DEVMAJOR));
+                member.dev_minor = static_cast<minor_t>(parse_number(header + format::USTAR_HEADER_POS_DEVMINOR, format::USTAR_HEADER_LEN_DEVMINOR));
+                prefix = field(header, format::USTAR_HEADER_POS_PREFIX, format::USTAR_HEADER_LEN_PREFIX);
             }
-#endif
         }
 
-        bool is_file_type_supported(const file_type_flag& type_flag)
+        // directories are stored as regular files with a trailing / in unix v7
+        static void detect_directory(tar_member& member)
         {
-            const auto int_type_flag = static_cast<int>(type_flag);
-            switch (type_) {
-                case tar_type::unix_v7:
-                    return type_flag == file_type_flag::DIRECTORY || int_type_flag <= static_cast<int>(file_type_flag::SYMBOLIC_LINK);
-                case tar_type::ustar:
-                    return true;
-                default:
-                    return false;
+            if (member.type == file_type_flag::REGULAR_FILE && !member.name.empty() && member.name.back() == '/') {
+                member.type = file_type_flag::DIRECTORY;
             }
         }
 
-        void write_regular_file_const_size(const std::string& name, const size_t expected_size)
+        // gnu long names are terminated by NUL
+        static std::string_view long_field(const std::string_view content)
         {
-            block_t block {};
-            std::fstream infile(name, std::ios::in | std::ios::binary);
-            if (!infile.is_open()) throw std::runtime_error("Can't find input file " + name);
-            size_t processed_bytes = 0;
-            while (infile.good() && processed_bytes < expected_size) {
-                infile.read(block.data(), block.size());
-                const auto read = infile.gcount();
-                processed_bytes += read;
-                const auto write_size = processed_bytes < expected_size ? read : processed_bytes - expected_size;
+            return content.substr(0, content.find('\0'));
+        }
 
-                if (write_size < block.size()) std::fill_n(block.begin() + write_size, block.size() - write_size, 0);
-                write(block);
+        // calls handler(key, value) for all "<length> <key>=<value>\n" records of a PAX extended header
+        template<typename F>
+        static void pax_records(std::string_view content, F&& handler)
+        {
+            while (!content.empty() && content.front() != '\0') {
+                const auto space = content.find(' ');
+                size_t length = 0;
+                if (space == std::string_view::npos || !parse_decimal(content.substr(0, space), length) || length <= space || length > content.size())
+                    throw std::runtime_error("invalid pax header record");
+
+                const auto record = content.substr(space + 1, length - space - 2);
+                const auto equals = record.find('=');
+                if (equals == std::string_view::npos || content[length - 1] != '\n') throw std::runtime_error("invalid pax header record");
+                handler(record.substr(0, equals), record.substr(equals + 1));
+                content.remove_prefix(length);
             }
+        }
 
-            std::fill_n(block.begin(), block.size(), 0);
-            while (processed_bytes < expected_size) {
-                write(block);
-                processed_bytes += block.size();
+        // PAX attributes of the next member which are supported
+        struct pax_attributes {
+            std::string_view path;
+            std::string_view sparse_name;
+            std::string_view sparse_major;
+            std::string_view sparse_real_size;
+
+            void add(const std::string_view key, const std::string_view value)
+            {
+                if (key == "path") path = value;
+                if (key == "GNU.sparse.name") sparse_name = value;
+                if (key == "GNU.sparse.major") sparse_major = value;
+                if (key == "GNU.sparse.realsize") sparse_real_size = value;
             }
-        }
 
-        size_t write_regular_file_dynamic_size(const std::string& name)
-        {
-            block_t block {};
-            std::fstream infile(name, std::ios::in | std::ios::binary);
-            if (!infile.is_open()) throw std::runtime_error("Can't find input file " + name);
-            long processed_bytes = 0;
-            int i = 0;
-            while (infile.good()) {
-                infile.read(block.data(), block.size());
-                const auto read = infile.gcount();
-                if (read == 0) return processed_bytes;
-                processed_bytes += read;
-                if (read < block.size())
-                    std::fill_n(block.begin() + read, block.size() - read, 0);
-                write(block);
+            [[nodiscard]] bool is_sparse() const
+            {
+                return sparse_major == "1";
             }
+        };
 
-            return processed_bytes;
+        // applies the names of the attributes, the sparse map is decoded separately
+        static void apply(const pax_attributes& attributes, tar_member& member)
+        {
+            if (!attributes.path.empty()) member.name = attributes.path;
+            if (attributes.is_sparse() && !attributes.sparse_name.empty()) member.name = attributes.sparse_name;
         }
 
-        void read_from_filesystem_write_to_tar(const std::string& source_path, const std::string& target_path, bool read_symlinks)
+        // Decodes the map of a GNU 1.0 sparse file in front of its content. Returns the size of the map
+        // including its padding, 0 if the content doesn't contain the whole map yet.
+        static size_t decode_sparse_map(const std::string_view content, std::vector<sparse_extent>& extents)
         {
-            if (!platform_->file_exists(source_path)) throw std::invalid_argument(source_path + " does not exist");
-            if (source_path == file_name_) throw std::invalid_argument("tar cannot be part of itself");
+            size_t map_size = 0;
+            const auto next_number = [&content, &map_size](size_t& value) {
+                const auto end = content.find('\n', map_size);
+                if (end == std::string_view::npos) return false;
+                if (!parse_decimal(content.substr(map_size, end - map_size), value)) throw std::runtime_error("invalid sparse map");
+                map_size = end + 1;
+                return true;
+            };
 
-            std::function<void()> write_data;
-            auto file_type = platform_->type_flag(source_path);
-            std::string resolved_source_path;
-            if (file_type == file_type_flag::SYMBOLIC_LINK && read_symlinks) {
-                resolved_source_path = platform_->realpath(source_path);
-                if (!platform_->file_exists(resolved_source_path)) throw std::invalid_argument("source_path " + source_path + " is a symlink pointing to " + resolved_source_path + " which does not exist");
-                file_type = platform_->type_flag(resolved_source_path);
-            } else {
-                resolved_source_path = source_path;
+            extents.clear();
+            size_t count = 0;
+            if (!next_number(count)) return 0;
+            for (size_t i = 0; i < count; ++i) {
+                sparse_extent extent;
+                if (!next_number(extent.offset) || !next_number(extent.size)) return 0;
+                if (extent.size > 0) extents.push_back(extent);
             }
+            return tarfile::padded_size(map_size);
+        }
 
-            size_t size = 0;
-            major_t dev_major = 0;
-            minor_t dev_minor = 0;
-            std::string link_name;
-            const auto file_uid = platform_->file_owner(resolved_source_path);
-            const auto file_gid = platform_->file_group(resolved_source_path);
-            auto mode = platform_->mode(resolved_source_path);
-
-            const auto defer_header_writing = file_type == file_type_flag::REGULAR_FILE && mode_ == output_mode::file_output;
+        // the content of the member starts after the map then and only contains data extents
+        static void apply_sparse_map(const pax_attributes& attributes, const size_t map_size, std::vector<sparse_extent>&& extents, tar_member& member)
+        {
+            size_t data_size = 0;
+            for (const auto& extent : extents) data_size += extent.size;
+            if (map_size > member.size || data_size > member.size - map_size) throw std::runtime_error("invalid sparse map");
+
+            member.offset += map_size;
+            member.sparse = true;
+            member.sparse_extents = std::move(extents);
+            if (!parse_decimal(attributes.sparse_real_size, member.size)) throw std::runtime_error("invalid sparse file size");
+        }
 
-            // regular files should only be stored once in the archive
-            // if the same file is added again (i.e. via a hard link)
-            // we only store a new header but not the file again.
-            if ((file_type == file_type_flag::REGULAR_FILE) || (file_type == file_type_flag::HARD_LINK)) {
-                if (!std::ifstream(source_path).good()) throw std::invalid_argument("can't open '" + source_path + "' for reading or file does not exist");
+    private:
+        using format = tarfile;
 
-                const auto equivalent = platform_->file_equivalent_present(resolved_source_path, stored_inos_);
-                if (equivalent.has_value()) {
-                    link_name = equivalent.value();
-                    file_type = file_type_flag::HARD_LINK;
-                }
+        static bool parse_decimal(const std::string_view str, size_t& value)
+        {
+            if (str.empty()) return false;
+            value = 0;
+            for (const auto c : str) {
+                if (c < '0' || c > '9') return false;
+                value = value * 10 + static_cast<size_t>(c - '0');
             }
+            return true;
+        }
 
-            switch (file_type) {
-                case file_type_flag::REGULAR_FILE:
-                    write_data = [this, &defer_header_writing, &resolved_source_path, &size]() {
-                        if (defer_header_writing) {
-                            size = write_regular_file_dynamic_size(resolved_source_path);
-                        } else {
-                            write_regular_file_const_size(resolved_source_path, size);
-                        }
-                    };
-                    size = platform_->file_size(resolved_source_path);
-                    break;
-                case file_type_flag::CHARACTER_SPECIAL_FILE:
-                    [[fallthrough]];
-                case file_type_flag::BLOCK_SPECIAL_FILE:
-                    platform_->major_minor(resolved_source_path, dev_major, dev_minor);
-                    break;
-                case file_type_flag::SYMBOLIC_LINK:
-                    mode = static_cast<mode_t>(permission_t::all_all);
-                    link_name = platform_->read_symlink(resolved_source_path);
-                    break;
-                case file_type_flag::CONTIGUOUS_FILE:
-                    // won't happen as we would have to set the contiguous flag.
-                    throw std::invalid_argument("contiguous files not supported");
-                case file_type_flag::HARD_LINK:
-                    [[fallthrough]];
-                case file_type_flag::DIRECTORY:
-                    [[fallthrough]];
-                case file_type_flag::FIFO:
-                    break;
-            }
+        static std::string_view field(const char* const header, const unsigned pos, const unsigned len)
+        {
+            const auto* const begin = header + pos;
+            return {begin, static_cast<size_t>(std::find(begin, begin + len, '\0') - begin)};
+        }
 
-            // ignore unsupported file types.
-            // i.e. directories for tar v7
-            // maybe file is also already deleted
-            if (!is_file_type_supported(file_type)) {
-                return;
+        static bool is_ustar(const char* const header)
+        {
+            return std::string_view(header + format::USTAR_HEADER_POS_MAGIC, 5) == "ustar";
+        }
+
+        // octal numbers may be terminated by a space or NUL or fill the whole field.
+        // gnu tar stores values which do not fit as base-256 with the highest bit set.
+        static unsigned long long parse_number(const char* const field, const unsigned len)
+        {
+            constexpr unsigned char base256_flag = 0x80U;
+            unsigned long long value = 0;
+            if ((static_cast<unsigned char>(field[0]) & base256_flag) != 0) {
+                value = static_cast<unsigned char>(field[0]) & static_cast<unsigned char>(~base256_flag);
+                for (auto i = 1U; i < len; ++i) value = (value << 8U) | static_cast<unsigned char>(field[i]);
+                return value;
             }
 
-            stored_inos_.insert({platform_->ino(resolved_source_path), resolved_source_path});
+            auto i = 0U;
+            while (i < len && field[i] == ' ') ++i;
+            for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i) value = (value << 3U) | static_cast<unsigned>(field[i] - '0');
+            return value;
+        }
+    };
 
-            const auto write_header_data = [&]() {
-                write_header(
-                        target_path,
-                        mode,
-                        file_uid,
-                        file_gid,
-                        size,
-                        platform_->mod_time(resolved_source_path),
-                        file_type,
-                        dev_major,
-                        dev_minor,
-                        link_name);
-            };
+    // Reads uncompressed unix_v7 and ustar archives via a memory mapping.
+    // All headers are parsed once when opening the archive, members are then
+    // found via a hash index and their content is returned without copying.
+    struct tarreader {
+        explicit tarreader(const std::string& filename) : archive_(filename)
+        {
+            archive_.advise(MADV_SEQUENTIAL);
+            parse_headers();
+            build_index();
+            archive_.advise(MADV_RANDOM);
+        }
 
-            if (defer_header_writing) {
-#ifdef WITH_LZ4
-                if (compression_ == compression_mode::lz4) {
-                    lz4_flush();
-                }
-#endif
-                auto header_pos = file_tellg();
-                block_t dummy_header {};
-                write(dummy_header, true);
+        // delete the copy constructor and copy assignment, members point into the mapping
+        tarreader(const tarreader&) = delete;
+        tarreader(tarreader&&) = delete;
+        tarreader& operator=(const tarreader& other) = delete;
+        tarreader& operator=(const tarreader&& other) = delete;
 
-                if (write_data) {
-                    write_data();
-#ifdef WITH_LZ4
-                    if (compression_ == compression_mode::lz4) {
-                        lz4_flush();
-                    }
-#endif
-                }
+        ~tarreader() = default;
 
-                const auto data_pos = file_tellp();
-                file_seekp(header_pos);
-                write_header_data();
-                file_seekp(data_pos);
-            } else {
-                write_header_data();
-                if (write_data) {
-                    write_data();
-                }
+        // members in the order of the archive
+        [[nodiscard]] const std::vector<tar_member>& members() const
+        {
+            return members_;
+        }
+
+        // finds a member by its name as stored in the archive, i.e. relative and
+        // with a trailing / for directories. If a name was added multiple times,
+        // the last member with that name is returned, as tar does on extraction.
+        [[nodiscard]] const tar_member* find(const std::string_view name) const
+        {
+            if (index_.empty()) return nullptr;
+            const auto mask = index_.size() - 1;
+            for (auto slot = std::hash<std::string_view> {}(name) & mask;; slot = (slot + 1) & mask) {
+                const auto member_index = index_[slot];
+                if (member_index == empty_slot_) return nullptr;
+                if (members_[member_index].name == name) return &members_[member_index];
             }
         }
 
-        void write_header(std::string name, mode_t mode, uid_t uid, gid_t gid, size_t size, mod_time_t time,
-                          file_type_flag file_type, major_t dev_major = 0, minor_t dev_minor = 0,
-                          const std::string& link_name = "")
+        // the data extents only for sparse members
+        [[nodiscard]] std::string_view content(const tar_member& member) const
         {
-            if (type_ != tar_type::unix_v7 && type_ != tar_type::ustar) throw std::logic_error("unsupported tar format");
-            if (stream_file_header_pos_ > -1) throw std::logic_error("Can't write a header while file streaming is in progress");
-            // allow adding files that consist only of a header multiple times
-            // this is the same behaviour as gnu tar 1.30
-            if (stored_files_.find(name) != stored_files_.end() && (file_type == file_type_flag::REGULAR_FILE || file_type == file_type_flag::CONTIGUOUS_FILE))
-                throw std::logic_error("Can't add a file with the same name twice");
+            if (!member.sparse) return {archive_.data() + member.offset, member.size};
+            size_t size = 0;
+            for (const auto& extent : member.sparse_extents) size += extent.size;
+            return {archive_.data() + member.offset, size};
+        }
 
-            if (file_type == file_type_flag::DIRECTORY) {
-                // directories are regular files in unix v7
-                if (type_ == tar_type::unix_v7) {
-                    file_type = file_type_flag::REGULAR_FILE;
+        [[nodiscard]] std::string_view content(const std::string_view name) const
+        {
+            const auto* const member = find(name);
+            if (member == nullptr) throw std::invalid_argument(std::string(name) + " is not part of the archive");
+            return content(*member);
+        }
+
+    private:
+        void parse_headers()
+        {
+            const auto* const data = archive_.data();
+            const auto archive_size = archive_.size();
+            std::string_view long_name;
+            std::string_view long_link_name;
+            std::optional<header_decoder::pax_attributes> pax_attributes;
+
+            size_t pos = 0;
+            while (pos + BLOCK_SIZE <= archive_size) {
+                const auto* const header = data + pos;
+                if (header_decoder::is_end_of_archive(header)) return;
+                if (!header_decoder::is_checksum_valid(header)) throw std::runtime_error("invalid header checksum at offset " + std::to_string(pos));
+
+                tar_member member;
+                const auto type_flag = header_decoder::type_flag(header);
+                member.size = header_decoder::size(header);
+                member.offset = pos + BLOCK_SIZE;
+                // base-256 sizes reach 2^64 - 1, so neither the end of the member nor its padding may overflow
+                if (member.size > std::numeric_limits<size_t>::max() - (BLOCK_SIZE - 1) || member.size > archive_size - member.offset)
+                    throw std::runtime_error("archive is truncated at offset " + std::to_string(pos));
+                pos = member.offset + tarfile::padded_size(member.size);
+
+                if (type_flag == header_decoder::GNU_LONG_NAME || type_flag == header_decoder::GNU_LONG_LINK_NAME) {
+                    const auto long_field = header_decoder::long_field(std::string_view(data + member.offset, member.size));
+                    (type_flag == header_decoder::GNU_LONG_NAME ? long_name : long_link_name) = long_field;
+                    continue;
+                }
+                if (type_flag == tarfile::PAX_EXTENDED_HEADER) {
+                    auto& attributes = pax_attributes.emplace();
+                    header_decoder::pax_records(std::string_view(data + member.offset, member.size),
+                                                [&attributes](const std::string_view key, const std::string_view value) { attributes.add(key, value); });
+                    continue;
+                }
+                if (type_flag == tarfile::PAX_GLOBAL_HEADER) continue;
+
+                std::string_view prefix;
+                header_decoder::decode(header, member, prefix);
+                if (!long_link_name.empty()) member.link_name = long_link_name;
+                if (!long_name.empty()) {
+                    member.name = long_name;
+                } else if (!prefix.empty()) {
+                    // names split into prefix and name are the only ones which need a copy
+                    member.name = joined_names_.emplace_back(std::string(prefix) + "/" + std::string(member.name));
+                }
+                if (pax_attributes.has_value()) {
+                    header_decoder::apply(pax_attributes.value(), member);
+                    if (pax_attributes->is_sparse()) {
+                        std::vector<sparse_extent> extents;
+                        const auto map_size = header_decoder::decode_sparse_map(std::string_view(data + member.offset, member.size), extents);
+                        if (map_size == 0) throw std::runtime_error("invalid sparse map at offset " + std::to_string(member.offset));
+                        header_decoder::apply_sparse_map(pax_attributes.value(), map_size, std::move(extents), member);
+                    }
                 }
+                header_decoder::detect_directory(member);
 
-                // directories should always be indicated with a trailing /
-                if (name.at(name.size() - 1) != '/') {
-                    name += "/";
-                }
+                long_name = {};
+                long_link_name = {};
+                pax_attributes.reset();
+                members_.emplace_back(std::move(member));
             }
 
-            if (type_ == tar_type::unix_v7 && (static_cast<int>(file_type) > static_cast<int>(file_type_flag::SYMBOLIC_LINK)))
-                throw std::logic_error("unsupported file type for unix_v7 format");
+            if (pos != archive_size) throw std::runtime_error("archive is truncated at offset " + std::to_string(pos));
+        }
 
-            stored_files_.insert(name);
+        void build_index()
+        {
+            if (members_.size() >= empty_slot_) throw std::runtime_error("too many members in archive");
+
+            // open addressing with linear probing, kept at most half full
+            auto slots = size_t {1};
+            while (slots < 2 * members_.size()) slots <<= 1U;
+            index_.assign(slots, empty_slot_);
+
+            const auto mask = slots - 1;
+            for (uint32_t member_index = 0; member_index < members_.size(); ++member_index) {
+                const auto& name = members_[member_index].name;
+                auto slot = std::hash<std::string_view> {}(name) & mask;
+                while (index_[slot] != empty_slot_ && members_[index_[slot]].name != name) slot = (slot + 1) & mask;
+                index_[slot] = member_index;
+            }
+        }
 
-            const auto store_name = platform_->relative_path(name);
-            const auto& store_link = file_type == file_type_flag::SYMBOLIC_LINK
-                                             ? link_name
-                                             : platform_->relative_path(link_name);
+        static constexpr uint32_t empty_slot_ = std::numeric_limits<uint32_t>::max();
 
-            block_t header {};
-            write_into_block(header, mode, UNIX_V7_USTAR_HEADER_POS_MODE, UNIX_V7_USTAR_HEADER_LEN_MODE);
-            write_into_block(header, uid, UNIX_V7_USTAR_HEADER_POS_UID, UNIX_V7_USTAR_HEADER_LEN_UID);
-            write_into_block(header, gid, UNIX_V7_USTAR_HEADER_POS_GID, UNIX_V7_USTAR_HEADER_LEN_GID);
-            write_into_block(header, size, UNIX_V7_USTAR_HEADER_POS_SIZE, UNIX_V7_USTAR_HEADER_LEN_SIZE);
-            write_into_block(header, time, UNIX_V7_USTAR_HEADER_POS_MTIM, UNIX_V7_USTAR_HEADER_LEN_MTIM);
-            write_into_block(header, static_cast<char>(file_type), UNIX_V7_USTAR_HEADER_POS_TYPEFLAG,
-                             UNIX_V7_USTAR_HEADER_LEN_TYPEFLAG);
-            write_name_and_prefix(header, store_name);
+        mapped_file archive_;
+        std::vector<tar_member> members_;
+        std::deque<std::string> joined_names_;
+        std::vector<uint32_t> index_;
+    };
 
-            if (!link_name.empty()) {
-                write_into_block(header, store_link, UNIX_V7_USTAR_HEADER_POS_LINKNAME,
-                                 UNIX_V7_USTAR_HEADER_LEN_LINKNAME);
-            }
+    // Extracts the members of a tarreader. Headers are processed in archive order,
+    // regular file contents are written by a pool of threads. Links are created
+    // after all files are written, directory metadata is restored last, so writing
+    // files does not change the modification time or fail on read only directories.
+    struct tarextractor {
+        struct extract_options {
+            // number of threads writing file contents, 0 selects the number of cores
+            unsigned writer_threads = 0;
+            // restoring the owner usually requires root privileges
+            bool restore_owner = false;
+        };
 
-            if (type_ == tar_type::ustar) {
-                write_into_block(header, "ustar", USTAR_HEADER_POS_MAGIC, USTAR_HEADER_LEN_MAGIC);
+        explicit tarextractor(const tarreader& reader, std::unique_ptr<Platform> platform = std::make_unique<Platform>())
+            : reader_(reader), platform_(std::move(platform))
+        {
+        }
 
-                write_into_block(header, platform_->user_name(uid), USTAR_HEADER_POS_UNAME, USTAR_HEADER_LEN_UNAME);
-                write_into_block(header, platform_->group_name(gid), USTAR_HEADER_POS_GNAME, USTAR_HEADER_LEN_GNAME);
+        void set_options(const extract_options& options)
+        {
+            options_ = options;
+        }
 
-                write_into_block(header, to_octal_ascii(dev_major, USTAR_HEADER_LEN_DEVMAJOR),
-                                 USTAR_HEADER_POS_DEVMAJOR, USTAR_HEADER_LEN_DEVMAJOR);
-                write_into_block(header, to_octal_ascii(dev_minor, USTAR_HEADER_LEN_DEVMAJOR),
-                                 USTAR_HEADER_POS_DEVMINOR, USTAR_HEADER_LEN_DEVMINOR);
+        void extract_to(const std::string& target_dir)
+        {
+            platform_->create_directory(target_dir, DIRECTORY_CREATION_MODE);
+            std::vector<std::pair<const tar_member*, std::string>> files;
+            std::vector<std::pair<const tar_member*, std::string>> links;
+            std::vector<std::pair<const tar_member*, std::string>> directories;
+            std::unordered_set<std::string> created_directories;
+
+            for (const auto& member : reader_.members()) {
+                // the last member of a name wins, as with tar
+                if (reader_.find(member.name) != &member) continue;
+
+                auto path = target_path(target_dir, member.name);
+                if (path.empty()) continue;
+                create_parent_directories(target_dir, path, created_directories);
+
+                switch (member.type) {
+                    case file_type_flag::DIRECTORY:
+                        // writable until all content is extracted
+                        platform_->create_directory(path, DIRECTORY_CREATION_MODE);
+                        created_directories.insert(path);
+                        directories.emplace_back(&member, std::move(path));
+                        break;
+                    case file_type_flag::REGULAR_FILE:
+                        [[fallthrough]];
+                    case file_type_flag::CONTIGUOUS_FILE:
+                        files.emplace_back(&member, std::move(path));
+                        break;
+                    case file_type_flag::HARD_LINK:
+                        [[fallthrough]];
+                    case file_type_flag::SYMBOLIC_LINK:
+                        links.emplace_back(&member, std::move(path));
+                        break;
+                    case file_type_flag::CHARACTER_SPECIAL_FILE:
+                        [[fallthrough]];
+                    case file_type_flag::BLOCK_SPECIAL_FILE:
+                        [[fallthrough]];
+                    case file_type_flag::FIFO:
+                        platform_->create_node(path, member.type, member.mode & MODE_MASK, member.dev_major, member.dev_minor);
+                        restore_metadata(member, path);
+                        break;
+                    default:
+                        // unknown types are skipped, as tar does
+                        break;
+                }
             }
 
-            calc_and_write_checksum(header);
+            write_files(files);
 
-            write(header, true);
+            // hard links can only be created once their target exists, symlinks are created
+            // last, so no file is written through a symlink contained in the archive
+            for (const auto& [member, path] : links) {
+                if (member->type != file_type_flag::HARD_LINK) continue;
+                platform_->create_hard_link(target_path(target_dir, member->link_name), path);
+            }
+            for (const auto& [member, path] : links) {
+                if (member->type != file_type_flag::SYMBOLIC_LINK) continue;
+                platform_->create_symlink(std::string(member->link_name), path);
+                if (options_.restore_owner) platform_->set_owner(path, member->uid, member->gid, false);
+                platform_->set_mod_time(path, member->mod_time, false);
+            }
+
+            // children before their parents
+            for (auto iter = directories.rbegin(); iter != directories.rend(); ++iter) {
+                restore_metadata(*iter->first, iter->second);
+            }
         }
 
-        static void write_into_block(block_t& block, const unsigned long long value, const unsigned pos, const unsigned len)
+    private:
+        static constexpr mode_t DIRECTORY_CREATION_MODE = 0700;
+        static constexpr mode_t FILE_CREATION_MODE = 0600;
+        static constexpr mode_t MODE_MASK = 07777;
+        static constexpr size_t WRITE_CHUNK_SIZE = 8 * 1024 * 1024;
+
+        // member names are relative to the target directory, names leaving it are rejected
+        static std::string target_path(const std::string& target_dir, const std::string_view name)
         {
-            return write_into_block(block, to_octal_ascii(value, len), pos, len);
+            std::string path;
+            std::string_view rest = name;
+            while (!rest.empty()) {
+                const auto separator = rest.find('/');
+                const auto component = rest.substr(0, separator);
+                rest = separator == std::string_view::npos ? std::string_view() : rest.substr(separator + 1);
+
+                if (component.empty() || component == ".") continue;
+                if (component == "..") throw std::invalid_argument("member " + std::string(name) + " points outside of the target directory");
+                path += '/';
+                path += component;
+            }
+            return path.empty() ? path : target_dir + path;
         }
 
-        static void write_into_block(block_t& block, const std::string& str, const unsigned pos, const unsigned len)
+        void create_parent_directories(const std::string& target_dir, const std::string& path, std::unordered_set<std::string>& created_directories) const
         {
-            const auto copylen = str.size() < len ? str.size() : len;
-            std::copy_n(str.c_str(), copylen, block.data() + pos);
+            const auto separator = path.rfind('/');
+            if (separator == std::string::npos || separator <= target_dir.size()) return;
+            const auto parent = path.substr(0, separator);
+            if (created_directories.find(parent) != created_directories.end()) return;
+
+            create_parent_directories(target_dir, parent, created_directories);
+            platform_->create_directory(parent, DIRECTORY_CREATION_MODE);
+            created_directories.insert(parent);
         }
 
-        static void calc_and_write_checksum(block_t& block)
+        void restore_metadata(const tar_member& member, const std::string& path) const
         {
-            std::fill_n(block.data() + UNIX_V7_USTAR_HEADER_POS_CHECKSUM, UNIX_V7_USTAR_HEADER_LEN_CHKSUM, ' ');
-            unsigned chksum = 0;
-            constexpr int checksum_mask = 0xFF;
-            for (unsigned char c : block) chksum += (c & checksum_mask);
-            write_into_block(block, chksum, UNIX_V7_USTAR_HEADER_POS_CHECKSUM, UNIX_V7_USTAR_HEADER_LEN_CHKSUM - 2);
-            block[UNIX_V7_USTAR_HEADER_POS_CHECKSUM + UNIX_V7_USTAR_HEADER_LEN_CHKSUM - 1] = 0;
+            if (options_.restore_owner) platform_->set_owner(path, member.uid, member.gid, true);
+            platform_->set_mode(path, member.mode & MODE_MASK);
+            platform_->set_mod_time(path, member.mod_time, true);
         }
 
-        static std::string to_octal_ascii(unsigned long long value, unsigned width)
+        void write_files(const std::vector<std::pair<const tar_member*, std::string>>& files) const
         {
-            std::stringstream sstr;
-            sstr << std::oct << std::ios::right << std::setfill('0') << std::setw(static_cast<int>(width)) << value;
-            auto str = sstr.str();
-            if (str.size() > width) str = str.substr(str.size() - width);
-            return str;
+            const auto threads = std::min<size_t>(files.size(), options_.writer_threads == 0
+                                                                        ? std::max(1U, std::thread::hardware_concurrency())
+                                                                        : options_.writer_threads);
+
+            std::atomic<size_t> next_file {0};
+            std::mutex error_mutex;
+            std::exception_ptr error;
+            const auto write_next_files = [&]() {
+                for (auto index = next_file++; index < files.size(); index = next_file++) {
+                    try {
+                        write_file(*files[index].first, files[index].second);
+                    } catch (...) {
+                        std::lock_guard lock(error_mutex);
+                        if (!error) error = std::current_exception();
+                        // let the other threads stop as well
+                        next_file = files.size();
+                    }
+                }
+            };
+
+            std::vector<std::thread> writers;
+            for (auto i = 1U; i < threads; ++i) writers.emplace_back(write_next_files);
+            write_next_files();
+            for (auto& writer : writers) writer.join();
+            if (error) std::rethrow_exception(error);
         }
 
-        void write_name_and_prefix(block_t& block, const std::string& name)
+        void write_file(const tar_member& member, const std::string& path) const
         {
-            const auto write_name_unix_v7_format = [&]() {
-                write_into_block(block, name, UNIX_V7_USTAR_HEADER_POS_NAME, UNIX_V7_USTAR_HEADER_LEN_NAME);
-            };
+            {
+                ::unlink(path.c_str());
+                const file_descriptor outfile(::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, FILE_CREATION_MODE));
+                if (!outfile.is_open()) throw errno_exception();
 
-            if (name.size() <= UNIX_V7_USTAR_HEADER_LEN_NAME || type_ == tar_type::unix_v7) {
-                write_name_unix_v7_format();
-            } else {
-                const auto last_separator_index = name.rfind(platform_->path_separator());
-                if (last_separator_index == std::string::npos) {
-                    write_name_unix_v7_format();
+                const auto content = reader_.content(member);
+                if (!member.sparse) {
+                    write_at(outfile, content, 0);
                 } else {
-                    // create the prefix by trimming the name to the prefix length
-                    const auto prefix_trimmed = name.substr(0, USTAR_HEADER_LEN_PREFIX);
-                    const auto last_separator_in_prefix = prefix_trimmed.rfind(platform_->path_separator());
-                    if (last_separator_in_prefix == std::string::npos) {
-                        // no possible delimiter found to splice part
-                        // write name in unix v7 and truncate at the end
-                        write_name_unix_v7_format();
-                    } else {
-                        // create the prefix by cutting at the found delimiter
-                        const auto prefix = std::string(name.begin(), name.begin() + last_separator_in_prefix);
-                        write_into_block(block, prefix, USTAR_HEADER_POS_PREFIX, USTAR_HEADER_LEN_PREFIX);
-
-                        // name is remaining part of the string
-                        const auto split_name = std::string(name.begin() + last_separator_in_prefix + 1, name.end());
-                        write_into_block(block, split_name, UNIX_V7_USTAR_HEADER_POS_NAME, UNIX_V7_USTAR_HEADER_LEN_NAME);
+                    // holes are restored by not writing them
+                    if (::ftruncate(outfile.get(), static_cast<off_t>(member.size)) < 0) throw errno_exception();
+                    size_t content_offset = 0;
+                    for (const auto& extent : member.sparse_extents) {
+                        write_at(outfile, content.substr(content_offset, extent.size), extent.offset);
+                        content_offset += extent.size;
                     }
                 }
             }
+            restore_metadata(member, path);
         }
 
-        void check_state_and_flush()
+        static void write_at(const file_descriptor& outfile, const std::string_view content, const size_t offset)
         {
-            if (!is_open()) throw std::logic_error("Cannot add file, tar archive is not open");
-            if (stream_file_header_pos_ >= 0)
-                throw std::logic_error("Can't add new file while adding streaming data isn't completed");
-
-#ifdef WITH_LZ4
-            if (compression_ == compression_mode::lz4) {
-                lz4_flush();
+            size_t written = 0;
+            while (written < content.size()) {
+                const auto write_size = std::min(content.size() - written, WRITE_CHUNK_SIZE);
+                const auto result = ::pwrite(outfile.get(), content.data() + written, write_size, static_cast<off_t>(offset + written));
+                if (result < 0) {
+                    if (errno == EINTR) continue;
+                    throw errno_exception();
+                }
+                written += result;
             }
-#endif
         }
 
-#ifdef WITH_LZ4
+        const tarreader& reader_;
+        std::unique_ptr<Platform> platform_;
+        extract_options options_;
+    };
+
+    // Parses an uncompressed archive which is passed in pieces of any size, i.e. while
+    // it is decompressed. Members are passed on as soon as their header is parsed,
+    // followed by their content. The views of a member are only valid until the
+    // content of the member has been passed on. Only the data extents of sparse members are passed on.
+    struct tar_stream_parser {
+        using member_callback_t = std::function<void(const tar_member& member)>;
+        using data_callback_t = std::function<void(const tar_member& member, const char* data, size_t size)>;
 
-        void init_lz4()
+        tar_stream_parser(member_callback_t on_member, data_callback_t on_data)
+            : on_member_(std::move(on_member)), on_data_(std::move(on_data))
         {
-            if (compression_ != compression_mode::lz4) {
-                file_buffer_.reserve(file_buffer_default_size_);
-                return;
+        }
+
+        void parse(const char* data, size_t size)
+        {
+            while (size > 0 && state_ != state::end) {
+                size_t used = 0;
+                switch (state_) {
+                    case state::header:
+                        used = std::min(size, BLOCK_SIZE - header_used_);
+                        std::copy_n(data, used, header_.data() + header_used_);
+                        header_used_ += used;
+                        pos_ += used;
+                        if (header_used_ == BLOCK_SIZE) {
+                            header_used_ = 0;
+                            parse_header();
+                        }
+                        break;
+                    case state::content:
+                        used = std::min(size, remaining_);
+                        on_data_(member_, data, used);
+                        content_used(used);
+                        break;
+                    case state::long_field:
+                        used = std::min(size, remaining_);
+                        long_field_->append(data, used);
+                        content_used(used);
+                        break;
+                    case state::sparse_map:
+                        // the map is padded to blocks, it's complete at the end of one
+                        used = std::min({size, remaining_, BLOCK_SIZE - sparse_map_.size() % BLOCK_SIZE});
+                        sparse_map_.append(data, used);
+                        pos_ += used;
+                        remaining_ -= used;
+                        if (sparse_map_.size() % BLOCK_SIZE == 0 || remaining_ == 0) parse_sparse_map();
+                        break;
+                    case state::padding:
+                        used = std::min(size, remaining_);
+                        pos_ += used;
+                        remaining_ -= used;
+                        if (remaining_ == 0) state_ = state::header;
+                        break;
+                    case state::end:
+                        break;
+                }
+                data += used;
+                size -= used;
             }
+        }
 
-            lz4_ctx_ = std::make_unique<lz4_ctx>();
-            const auto outbuf_size = lz4_call_and_check_error(LZ4F_compressBound, 16 * 1024, &lz4_prefs_);
+        // to be called after all data was parsed, throws if the archive is truncated
+        void finish() const
+        {
+            if (state_ != state::end && (state_ != state::header || header_used_ != 0)) {
+                throw std::runtime_error("archive is truncated at offset " + std::to_string(pos_));
+            }
+        }
 
-            lz4_out_buf_.reserve(outbuf_size);
-            file_buffer_.reserve(outbuf_size);
-            const auto headerSize = lz4_call_and_check_error(LZ4F_compressBegin, lz4_ctx_->get(), lz4_out_buf_.data(),
-                                                             lz4_out_buf_.capacity(), &lz4_prefs_);
-            lz4_out_buf_pos_ += headerSize;
-            write_lz4_data();
+        // true once the empty block at the end of the archive was parsed
+        [[nodiscard]] bool is_complete() const
+        {
+            return state_ == state::end;
         }
 
-        void write_lz4_data()
+    private:
+        enum class state {
+            header,
+            content,
+            long_field,
+            sparse_map,
+            padding,
+            end
+        };
+
+        void parse_header()
         {
-            unsigned long long offset = 0;
-            switch (mode_) {
-                // guarding that input is not stream is done in add_file_streaming
-                // using a file as input is fine, as we have all data necessary
-                // for compression w/o seeking
-                case output_mode::stream_output:
-                    while (lz4_out_buf_pos_ > 0) {
-                        block_t block {};
-                        const auto copy_size = std::min(lz4_out_buf_pos_, block.size());
-                        std::copy_n(lz4_out_buf_.begin() + offset, copy_size, block.data());
-                        callback_(block, copy_size);
-                        lz4_out_buf_pos_ -= copy_size;
-                        offset += copy_size;
-                    }
+            // long names and PAX headers only apply to the member following them
+            if (long_names_used_) {
+                long_name_.clear();
+                long_link_name_.clear();
+                pax_header_.clear();
+                pax_attributes_.reset();
+                long_names_used_ = false;
+            }
 
-                    break;
-                case output_mode::file_output:
-                    file_buffered_write(lz4_out_buf_.data(), lz4_out_buf_pos_);
-                    lz4_out_buf_pos_ = 0;
-                    break;
+            const auto* const header = header_.data();
+            const auto header_offset = pos_ - BLOCK_SIZE;
+            if (header_decoder::is_end_of_archive(header)) {
+                state_ = state::end;
+                return;
             }
-        }
+            if (!header_decoder::is_checksum_valid(header)) throw std::runtime_error("invalid header checksum at offset " + std::to_string(header_offset));
 
-#endif
-        void file_buffered_write(const char* const data, unsigned long size)
-        {
-            if (file_buffer_used_ + size >= file_buffer_.capacity()) {
-                // no need to flush the file, just make sure it's passed to the ofstream.
-                file_write();
+            const auto type_flag = header_decoder::type_flag(header);
+            remaining_ = header_decoder::size(header);
+            padding_ = tarfile::padded_size(remaining_) - remaining_;
+
+            if (type_flag == header_decoder::GNU_LONG_NAME || type_flag == header_decoder::GNU_LONG_LINK_NAME) {
+                long_field_ = type_flag == header_decoder::GNU_LONG_NAME ? &long_name_ : &long_link_name_;
+                long_field_->clear();
+                state_ = state::long_field;
+                if (remaining_ == 0) content_used(0);
+                return;
+            }
+            if (type_flag == tarfile::PAX_EXTENDED_HEADER || type_flag == tarfile::PAX_GLOBAL_HEADER) {
+                // global attributes are not supported
+                long_field_ = type_flag == tarfile::PAX_EXTENDED_HEADER ? &pax_header_ : &ignored_field_;
+                long_field_->clear();
+                state_ = state::long_field;
+                if (remaining_ == 0) content_used(0);
+                return;
             }
 
-            std::copy_n(data, size, file_buffer_.data() + file_buffer_used_);
-            file_buffer_used_ += size;
+            if (!pax_header_.empty()) {
+                auto& attributes = pax_attributes_.emplace();
+                header_decoder::pax_records(pax_header_, [&attributes](const std::string_view key, const std::string_view value) { attributes.add(key, value); });
+            }
+
+            member_ = {};
+            std::string_view prefix;
+            header_decoder::decode(header, member_, prefix);
+            member_.offset = pos_;
+            if (!long_link_name_.empty()) member_.link_name = header_decoder::long_field(long_link_name_);
+            if (!long_name_.empty()) {
+                member_.name = header_decoder::long_field(long_name_);
+            } else if (!prefix.empty()) {
+                joined_name_.assign(prefix).append("/").append(member_.name);
+                member_.name = joined_name_;
+            }
+            if (pax_attributes_.has_value()) header_decoder::apply(pax_attributes_.value(), member_);
+            header_decoder::detect_directory(member_);
+            long_names_used_ = true;
+
+            if (pax_attributes_.has_value() && pax_attributes_->is_sparse()) {
+                sparse_map_.clear();
+                state_ = state::sparse_map;
+                if (remaining_ == 0) throw std::runtime_error("invalid sparse map at offset " + std::to_string(member_.offset));
+                return;
+            }
+
+            on_member_(member_);
+            state_ = state::content;
+            if (remaining_ == 0) content_used(0);
         }
 
-        void file_close()
+        void parse_sparse_map()
         {
-            file_flush();
-            file_.close();
+            std::vector<sparse_extent> extents;
+            const auto map_size = header_decoder::decode_sparse_map(sparse_map_, extents);
+            if (map_size == 0) {
+                if (remaining_ == 0) throw std::runtime_error("invalid sparse map at offset " + std::to_string(member_.offset));
+                return;
+            }
+
+            header_decoder::apply_sparse_map(pax_attributes_.value(), map_size, std::move(extents), member_);
+            on_member_(member_);
+            state_ = state::content;
+            if (remaining_ == 0) content_used(0);
         }
 
-        void file_write()
+        void content_used(const size_t size)
         {
-            file_.write(file_buffer_.data(), file_buffer_used_);
-            file_buffer_used_ = 0;
+            pos_ += size;
+            remaining_ -= size;
+            if (remaining_ > 0) return;
+            remaining_ = padding_;
+            state_ = remaining_ == 0 ? state::header : state::padding;
         }
 
-        void file_flush()
+        member_callback_t on_member_;
+        data_callback_t on_data_;
+
+        state state_ = state::header;
+        block_t header_ {};
+        size_t header_used_ = 0;
+        // position in the archive
+        size_t pos_ = 0;
+        size_t remaining_ = 0;
+        size_t padding_ = 0;
+
+        tar_member member_;
+        std::string joined_name_;
+        std::string long_name_;
+        std::string long_link_name_;
+        std::string* long_field_ = nullptr;
+        bool long_names_used_ = false;
+        std::string pax_header_;
+        std::string ignored_field_;
+        std::optional<header_decoder::pax_attributes> pax_attributes_;
+        std::string sparse_map_;
+    };
+
+#ifdef WITH_LZ4
+    // Decompresses a file of lz4 frames via a memory mapping. Frames with independent blocks,
+    // as written by tarfile, are decompressed by a pool of threads, other frames sequentially.
+    // The data is passed on in order, in large buffers which are reused once the callback
+    // returned. Block and content checksums are not verified.
+    struct lz4_frame_reader {
+        using chunk_callback_t = tarfile::chunk_callback_t;
+
+        explicit lz4_frame_reader(const std::string& filename, const unsigned threads = 0)
+            : file_(filename), threads_(threads == 0 ? std::max(1U, std::thread::hardware_concurrency()) : threads)
         {
-            file_write();
-            file_.flush();
+            file_.advise(MADV_SEQUENTIAL);
         }
 
-        void file_seekp(const std::streampos& pos)
+        // delete the copy constructor and copy assignment
+        lz4_frame_reader(const lz4_frame_reader&) = delete;
+        lz4_frame_reader(lz4_frame_reader&&) = delete;
+        lz4_frame_reader& operator=(const lz4_frame_reader& other) = delete;
+        lz4_frame_reader& operator=(const lz4_frame_reader&& other) = delete;
+
+        ~lz4_frame_reader() = default;
+
+        void read(const chunk_callback_t& callback) const
         {
-            // flushing before seek and tell operations is required
-            // to prevent mixing between buffered and flushed data
-            file_flush();
-            file_.seekp(pos);
+            size_t pos = 0;
+            while (pos < file_.size()) {
+                const auto magic = read_le32(pos);
+                if ((magic & SKIPPABLE_MAGIC_MASK) == SKIPPABLE_MAGIC) {
+                    const auto frame_size = read_le32(pos + FIELD_LEN);
+                    check_available(pos, 2 * FIELD_LEN + frame_size);
+                    pos += 2 * FIELD_LEN + frame_size;
+                    continue;
+                }
+                if (magic != FRAME_MAGIC) throw std::runtime_error("no lz4 frame at offset " + std::to_string(pos));
+                pos = read_frame(pos, callback);
+            }
         }
 
-        std::ostream::pos_type file_tellg()
+        // parses the decompressed data as tar archive
+        void read(tar_stream_parser& parser) const
         {
-            file_flush();
-            return file_.tellg();
+            read([&](const char* data, const size_t size) { parser.parse(data, size); });
+            parser.finish();
         }
 
-        std::istream::pos_type file_tellp()
+        // Passes on the content of a member of an indexed archive, only the blocks
+        // containing it are decompressed.
+        void read_member(const tar_index_entry& entry, const chunk_callback_t& callback) const
         {
-            file_flush();
-            return file_.tellp();
+            if (entry.size == 0) return;
+            if (read_le32(0) != FRAME_MAGIC) throw std::runtime_error("no lz4 frame at offset 0");
+            const auto descriptor = read_frame_descriptor(0);
+            if ((descriptor.flags & FLAG_BLOCK_INDEPENDENT) == 0) throw std::runtime_error("reading members requires independent lz4 blocks");
+            if (entry.block_offset < descriptor.header_size || entry.block_tar_offset > entry.content_offset) throw std::invalid_argument("invalid index entry for " + entry.name);
+
+            const auto checksum_size = (descriptor.flags & FLAG_BLOCK_CHECKSUM) != 0 ? FIELD_LEN : 0;
+            const auto content_end = entry.content_offset + entry.size;
+            std::vector<char> output(descriptor.block_max_size);
+            auto pos = static_cast<size_t>(entry.block_offset);
+            auto tar_pos = static_cast<size_t>(entry.block_tar_offset);
+            while (tar_pos < content_end) {
+                const auto size_field = read_le32(pos);
+                pos += FIELD_LEN;
+                if (size_field == 0) throw std::runtime_error("lz4 frame ends within " + entry.name);
+
+                const auto block_size = static_cast<size_t>(size_field & ~BLOCK_UNCOMPRESSED_FLAG);
+                if (block_size > descriptor.block_max_size) throw std::runtime_error("invalid lz4 block size at offset " + std::to_string(pos - FIELD_LEN));
+                check_available(pos, block_size + checksum_size);
+
+                // compressed blocks in front of the content are decompressed as well,
+                // as their decompressed size is not stored
+                const char* block = file_.data() + pos;
+                auto output_size = block_size;
+                if ((size_field & BLOCK_UNCOMPRESSED_FLAG) == 0) {
+                    const auto result = LZ4_decompress_safe(block, output.data(), static_cast<int>(block_size), static_cast<int>(output.size()));
+                    if (result < 0) throw std::runtime_error("corrupted lz4 block at offset " + std::to_string(pos));
+                    block = output.data();
+                    output_size = static_cast<size_t>(result);
+                }
+
+                const auto begin = std::max(tar_pos, static_cast<size_t>(entry.content_offset));
+                const auto end = std::min(tar_pos + output_size, content_end);
+                if (begin < end) callback(block + (begin - tar_pos), end - begin);
+                tar_pos += output_size;
+                pos += block_size + checksum_size;
+            }
         }
 
-        enum class output_mode : unsigned {
-            file_output,
-            stream_output
+    private:
+        static constexpr uint32_t FRAME_MAGIC = 0x184D2204U;
+        static constexpr uint32_t SKIPPABLE_MAGIC = 0x184D2A50U;
+        static constexpr uint32_t SKIPPABLE_MAGIC_MASK = 0xFFFFFFF0U;
+        static constexpr uint32_t BLOCK_UNCOMPRESSED_FLAG = 0x80000000U;
+        static constexpr size_t FIELD_LEN = 4;
+        static constexpr size_t CONTENT_SIZE_LEN = 8;
+        static constexpr unsigned char FLAG_VERSION_MASK = 0xC0U;
+        static constexpr unsigned char FLAG_VERSION = 0x40U;
+        static constexpr unsigned char FLAG_BLOCK_INDEPENDENT = 0x20U;
+        static constexpr unsigned char FLAG_BLOCK_CHECKSUM = 0x10U;
+        static constexpr unsigned char FLAG_CONTENT_SIZE = 0x08U;
+        static constexpr unsigned char FLAG_CONTENT_CHECKSUM = 0x04U;
+        static constexpr unsigned char FLAG_DICT_ID = 0x01U;
+        // blocks are decompressed in batches filling buffers of at least this size
+        static constexpr size_t BATCH_SIZE = 4 * 1024 * 1024;
+
+        struct frame_descriptor {
+            unsigned char flags = 0;
+            size_t block_max_size = 0;
+            size_t header_size = 0;
         };
 
+        struct batch_job {
+            // offsets and size fields of the blocks
+            std::vector<std::pair<size_t, uint32_t>> blocks;
+            std::vector<char> output;
+            size_t output_size = 0;
+            std::exception_ptr error;
+            bool done = false;
+        };
 
-        tar_type type_;
-        output_mode mode_;
+        // Decompresses batches on worker threads, the threads are stopped when leaving the frame.
+        class decompression_pool {
+        public:
+            decompression_pool(const char* const data, const size_t block_max_size, const unsigned threads)
+                : data_(data), block_max_size_(block_max_size)
+            {
+                for (auto i = 0U; i < threads; ++i) {
+                    workers_.emplace_back([this]() { decompress_batches(); });
+                }
+            }
 
-        std::string file_name_;
-        std::fstream file_;
+            // delete non required special member functions
+            decompression_pool(const decompression_pool& other) = delete;
+            decompression_pool& operator=(const decompression_pool& other) = delete;
+            decompression_pool(decompression_pool&& other) = delete;
+            decompression_pool& operator=(decompression_pool&& other) = delete;
 
-        std::vector<char> file_buffer_;
-        unsigned long file_buffer_used_;
+            ~decompression_pool()
+            {
+                {
+                    std::lock_guard lock(mutex_);
+                    stop_ = true;
+                }
+                work_available_.notify_all();
+                for (auto& worker : workers_) worker.join();
+            }
 
-        // reserve 256KB buffer. A larger buffer
-        // does not improve performance significantly
-        static constexpr unsigned long file_buffer_default_size_ = 512 * BLOCK_SIZE;
+            void submit(batch_job* job)
+            {
+                {
+                    std::lock_guard lock(mutex_);
+                    pending_.push_back(job);
+                }
+                work_available_.notify_one();
+            }
 
-        callback_t callback_;
-        long stream_file_header_pos_;
-        block_t stream_block_;
-        size_t stream_block_used_;
+            void wait(const batch_job& job)
+            {
+                std::unique_lock lock(mutex_);
+                job_done_.wait(lock, [&job]() { return job.done; });
+            }
 
-        std::unique_ptr<Platform> platform_;
-        std::unordered_map<ino_t, std::string> stored_inos_;
-        std::unordered_set<std::string> stored_files_;
+            bool is_done(const batch_job& job)
+            {
+                std::lock_guard lock(mutex_);
+                return job.done;
+            }
 
-#ifdef WITH_COMPRESSION
-        compression_mode compression_ = compression_mode::none;
-#endif
+        private:
+            void decompress_batches()
+            {
+                while (true) {
+                    batch_job* job = nullptr;
+                    {
+                        std::unique_lock lock(mutex_);
+                        work_available_.wait(lock, [this]() { return stop_ || !pending_.empty(); });
+                        if (stop_) return;
+                        job = pending_.front();
+                        pending_.pop_front();
+                    }
 
-#ifdef WITH_LZ4
+                    try {
+                        decompress_batch(*job);
+                    } catch (...) {
+                        job->error = std::current_exception();
+                    }
 
-        class lz4_ctx {
-        public:
-            lz4_ctx()
+                    {
+                        std::lock_guard lock(mutex_);
+                        job->done = true;
+                    }
+                    job_done_.notify_all();
+                }
+            }
+
+            void decompress_batch(batch_job& job) const
             {
-                LZ4F_createCompressionContext(&ctx_, LZ4F_VERSION);
+                auto* const output = job.output.data();
+                const auto capacity = job.output.size();
+                for (const auto& [offset, size_field] : job.blocks) {
+                    const auto block_size = size_field & ~BLOCK_UNCOMPRESSED_FLAG;
+                    if ((size_field & BLOCK_UNCOMPRESSED_FLAG) != 0) {
+                        std::copy_n(data_ + offset, block_size, output + job.output_size);
+                        job.output_size += block_size;
+                        continue;
+                    }
+
+                    const auto max_size = std::min(capacity - job.output_size, block_max_size_);
+                    const auto result = LZ4_decompress_safe(data_ + offset, output + job.output_size, static_cast<int>(block_size), static_cast<int>(max_size));
+                    if (result < 0) throw std::runtime_error("corrupted lz4 block at offset " + std::to_string(offset));
+                    job.output_size += static_cast<size_t>(result);
+                }
             }
 
-            // delete non required special member functions
-            lz4_ctx(const lz4_ctx& other) = delete;
-            lz4_ctx& operator=(const lz4_ctx& other) = delete;
-            lz4_ctx(lz4_ctx&& other) = delete;
-            lz4_ctx& operator=(lz4_ctx&& other) = delete;
+            const char* const data_;
+            const size_t block_max_size_;
 
+            std::mutex mutex_;
+            std::condition_variable work_available_;
+            std::condition_variable job_done_;
+            std::deque<batch_job*> pending_;
+            bool stop_ = false;
+            std::vector<std::thread> workers_;
+        };
 
-            ~lz4_ctx()
-            {
-                LZ4F_freeCompressionContext(ctx_);
+        [[nodiscard]] size_t read_frame(const size_t frame_pos, const chunk_callback_t& callback) const
+        {
+            const auto descriptor = read_frame_descriptor(frame_pos);
+            if ((descriptor.flags & FLAG_BLOCK_INDEPENDENT) == 0) return read_frame_sequential(frame_pos, callback);
+
+            const auto capacity = std::max(BATCH_SIZE, descriptor.block_max_size);
+            const auto max_in_flight = 2 * static_cast<size_t>(threads_);
+            std::deque<std::unique_ptr<batch_job>> jobs;
+            std::vector<std::unique_ptr<batch_job>> free_jobs;
+            // destroyed first, so no worker uses a job after it was freed
+            decompression_pool pool(file_.data(), descriptor.block_max_size, threads_);
+
+            const auto deliver_front = [&]() {
+                auto job = std::move(jobs.front());
+                jobs.pop_front();
+                pool.wait(*job);
+                if (job->error) std::rethrow_exception(job->error);
+                if (job->output_size > 0) callback(job->output.data(), job->output_size);
+                job->blocks.clear();
+                job->output_size = 0;
+                job->done = false;
+                free_jobs.emplace_back(std::move(job));
+            };
+            const auto take_job = [&]() {
+                if (free_jobs.empty()) {
+                    auto job = std::make_unique<batch_job>();
+                    job->output.resize(capacity);
+                    return job;
+                }
+                auto job = std::move(free_jobs.back());
+                free_jobs.pop_back();
+                return job;
+            };
+            const auto submit = [&](std::unique_ptr<batch_job>&& job) {
+                while (jobs.size() >= max_in_flight) deliver_front();
+                pool.submit(job.get());
+                jobs.emplace_back(std::move(job));
+                // pass on finished batches early, without waiting for the others
+                while (!jobs.empty() && pool.is_done(*jobs.front())) deliver_front();
+            };
+
+            const auto checksum_size = (descriptor.flags & FLAG_BLOCK_CHECKSUM) != 0 ? FIELD_LEN : 0;
+            auto pos = frame_pos + descriptor.header_size;
+            auto job = take_job();
+            size_t reserved = 0;
+            while (true) {
+                const auto size_field = read_le32(pos);
+                pos += FIELD_LEN;
+                if (size_field == 0) break;
+
+                const auto is_uncompressed = (size_field & BLOCK_UNCOMPRESSED_FLAG) != 0;
+                const auto block_size = static_cast<size_t>(size_field & ~BLOCK_UNCOMPRESSED_FLAG);
+                if (block_size > descriptor.block_max_size) throw std::runtime_error("invalid lz4 block size at offset " + std::to_string(pos - FIELD_LEN));
+                check_available(pos, block_size + checksum_size);
+
+                // the decompressed size of a block is only known after decompressing it
+                const auto output_size = is_uncompressed ? block_size : descriptor.block_max_size;
+                if (reserved + output_size > capacity) {
+                    submit(std::move(job));
+                    job = take_job();
+                    reserved = 0;
+                }
+                job->blocks.emplace_back(pos, size_field);
+                reserved += output_size;
+                pos += block_size + checksum_size;
             }
+            if (!job->blocks.empty()) submit(std::move(job));
+            while (!jobs.empty()) deliver_front();
 
-            LZ4F_cctx* get()
-            {
-                return ctx_;
+            if ((descriptor.flags & FLAG_CONTENT_CHECKSUM) != 0) pos += FIELD_LEN;
+            check_available(pos, 0);
+            return pos;
+        }
+
+        // frames with linked blocks are decompressed by lz4 itself
+        [[nodiscard]] size_t read_frame_sequential(const size_t frame_pos, const chunk_callback_t& callback) const
+        {
+            LZ4F_dctx* ctx = nullptr;
+            if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)) != 0) throw std::runtime_error("can't create lz4 decompression context");
+            const std::unique_ptr<LZ4F_dctx, decltype(&LZ4F_freeDecompressionContext)> ctx_guard(ctx, &LZ4F_freeDecompressionContext);
+
+            std::vector<char> output(BATCH_SIZE);
+            auto pos = frame_pos;
+            while (true) {
+                auto src_size = file_.size() - pos;
+                auto dst_size = output.size();
+                const auto result = LZ4F_decompress(ctx, output.data(), &dst_size, file_.data() + pos, &src_size, nullptr);
+                if (LZ4F_isError(result) != 0) throw std::runtime_error("lz4 function failed: error "s + LZ4F_getErrorName(result));
+                pos += src_size;
+                if (dst_size > 0) callback(output.data(), dst_size);
+                if (result == 0) return pos;
+                if (src_size == 0 && dst_size == 0) throw std::runtime_error("lz4 frame is truncated at offset " + std::to_string(pos));
             }
+        }
 
-        private:
-            LZ4F_compressionContext_t ctx_ = nullptr;
-        };
+        [[nodiscard]] frame_descriptor read_frame_descriptor(const size_t frame_pos) const
+        {
+            // magic, flags, block descriptor and header checksum
+            constexpr size_t min_header_size = FIELD_LEN + 3;
+            check_available(frame_pos, min_header_size);
+            const auto* const header = reinterpret_cast<const unsigned char*>(file_.data() + frame_pos);
+
+            frame_descriptor descriptor;
+            descriptor.flags = header[FIELD_LEN];
+            if ((descriptor.flags & FLAG_VERSION_MASK) != FLAG_VERSION) throw std::runtime_error("unsupported lz4 frame version at offset " + std::to_string(frame_pos));
+
+            // 4: 64KB, 5: 256KB, 6: 1MB, 7: 4MB
+            constexpr unsigned block_size_shift = 4;
+            constexpr unsigned block_size_mask = 0x07U;
+            const auto block_size_id = (header[FIELD_LEN + 1] >> block_size_shift) & block_size_mask;
+            if (block_size_id < 4) throw std::runtime_error("invalid lz4 block size at offset " + std::to_string(frame_pos));
+            descriptor.block_max_size = size_t {1} << (2 * block_size_id + 8);
+
+            descriptor.header_size = min_header_size;
+            if ((descriptor.flags & FLAG_CONTENT_SIZE) != 0) descriptor.header_size += CONTENT_SIZE_LEN;
+            if ((descriptor.flags & FLAG_DICT_ID) != 0) descriptor.header_size += FIELD_LEN;
+            check_available(frame_pos, descriptor.header_size);
+            return descriptor;
+        }
 
-        std::unique_ptr<lz4_ctx> lz4_ctx_;
-        std::vector<char> lz4_out_buf_;
-        size_t lz4_out_buf_pos_ = 0;
-        static inline constexpr LZ4F_preferences_t lz4_prefs_ = {
-                {LZ4F_max256KB, LZ4F_blockIndependent, LZ4F_noContentChecksum,
-                 LZ4F_frame, 0 /* unknown content size */, 0 /* no dictID */,
-                 LZ4F_noBlockChecksum},
-                0,         /* compression level; 0 == default */
-                0,         /* autoflush */
-                0,         /* favor decompression speed */
-                {0, 0, 0}, /* reserved, must be set to 0 */
-        };
-#endif
+        void check_available(const size_t pos, const size_t size) const
+        {
+            if (pos > file_.size() || file_.size() - pos < size) throw std::runtime_error("lz4 frame is truncated at offset " + std::to_string(pos));
+        }
+
+        [[nodiscard]] uint32_t read_le32(const size_t pos) const
+        {
+            check_available(pos, FIELD_LEN);
+            const auto* const data = reinterpret_cast<const unsigned char*>(file_.data() + pos);
+            return static_cast<uint32_t>(data[0]) | (static_cast<uint32_t>(data[1]) << 8U) |
+                   (static_cast<uint32_t>(data[2]) << 16U) | (static_cast<uint32_t>(data[3]) << 24U);
+        }
+
+        mapped_file file_;
+        unsigned threads_;
     };
+#endif
 
 } // namespace tarxx
 
@@ -0,0 +1,412 @@
+// tarxx - modern C++ tar library
+// Copyright (c) 2022-2023, Thilo Schmitt, Alexander Mohr
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include <tarxx.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Usage: tarxx-benchmarks [name filter] [scale]
+// The scale multiplies the number and size of the generated files.
+
+static std::atomic<unsigned long long> allocation_count {0};
+
+void* operator new(std::size_t size)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (size == 0) size = 1;
+    if (auto* const ptr = std::malloc(size)) return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+namespace {
+    namespace fs = std::filesystem;
+
+    struct workload {
+        std::string name;
+        fs::path path;
+        unsigned long long files = 0;
+        unsigned long long bytes = 0;
+    };
+
+    struct variant {
+        std::string name;
+        tarxx::tarfile::tar_type type;
+        bool stream_output;
+#ifdef WITH_COMPRESSION
+        tarxx::tarfile::compression_mode compression;
+#endif
+    };
+
+    const fs::path benchmark_dir = fs::temp_directory_path() / "tarxx-benchmarks";
+    const fs::path archive_path = benchmark_dir / "archive.tar";
+
+    void create_file(const fs::path& path, const unsigned long long size)
+    {
+        static const auto content = []() {
+            std::string data(1024 * 1024, '\0');
+            // compressible, but not trivially
+            for (auto i = 0U; i < data.size(); ++i) data[i] = static_cast<char>("tarxx benchmark "[i % 16] + (i / 4096) % 7);
+            return data;
+        }();
+
+        std::ofstream ofs(path, std::ios::binary);
+        for (unsigned long long written = 0; written < size;) {
+            const auto write_size = std::min<unsigned long long>(size - written, content.size());
+            ofs.write(content.data(), static_cast<std::streamsize>(write_size));
+            written += write_size;
+        }
+    }
+
+    workload create_tiny_files(const unsigned scale)
+    {
+        workload w {"tiny_files", benchmark_dir / "tiny_files"};
+        for (auto dir = 0U; dir < 10 * scale; ++dir) {
+            const auto dir_path = w.path / ("dir_" + std::to_string(dir));
+            fs::create_directories(dir_path);
+            for (auto file = 0U; file < 500; ++file) {
+                const auto size = 10 + (file * 37) % 2000;
+                create_file(dir_path / ("file_" + std::to_string(file)), size);
+                ++w.files;
+                w.bytes += size;
+            }
+        }
+        return w;
+    }
+
+    workload create_huge_files(const unsigned scale)
+    {
+        workload w {"huge_files", benchmark_dir / "huge_files"};
+        fs::create_directories(w.path);
+        for (auto file = 0U; file < 2; ++file) {
+            const auto size = 128ULL * 1024 * 1024 * scale + 123;
+            create_file(w.path / ("file_" + std::to_string(file)), size);
+            ++w.files;
+            w.bytes += size;
+        }
+        return w;
+    }
+
+    workload create_deep_tree(const unsigned scale)
+    {
+        workload w {"deep_tree", benchmark_dir / "deep_tree"};
+        for (auto tree = 0U; tree < 4 * scale; ++tree) {
+            auto dir_path = w.path / ("tree_" + std::to_string(tree));
+            for (auto depth = 0U; depth < 40; ++depth) {
+                dir_path /= "level_" + std::to_string(depth);
+                fs::create_directories(dir_path);
+                for (auto file = 0U; file < 5; ++file) {
+                    create_file(dir_path / ("file_" + std::to_string(file)), 4096);
+                    ++w.files;
+                    w.bytes += 4096;
+                }
+            }
+        }
+        return w;
+    }
+
+    workload create_hard_links(const unsigned scale)
+    {
+        workload w {"hard_links", benchmark_dir / "hard_links"};
+        const auto originals = w.path / "originals";
+        const auto links = w.path / "links";
+        fs::create_directories(originals);
+        fs::create_directories(links);
+        for (auto file = 0U; file < 100 * scale; ++file) {
+            const auto original = originals / ("file_" + std::to_string(file));
+            create_file(original, 16 * 1024);
+            ++w.files;
+            w.bytes += 16 * 1024;
+            for (auto link = 0U; link < 20; ++link) {
+                fs::create_hard_link(original, links / ("link_" + std::to_string(file) + "_" + std::to_string(link)));
+                ++w.files;
+            }
+        }
+        return w;
+    }
+
+    std::unique_ptr<tarxx::tarfile> open_archive(const variant& v, unsigned long long& output_bytes)
+    {
+        if (v.stream_output) {
+            auto callback = [&output_bytes](const tarxx::block_t&, const size_t size) { output_bytes += size; };
+#ifdef WITH_COMPRESSION
+            return std::make_unique<tarxx::tarfile>(std::move(callback), v.compression, v.type);
+#else
+            return std::make_unique<tarxx::tarfile>(std::move(callback), v.type);
+#endif
+        }
+
+#ifdef WITH_COMPRESSION
+        return std::make_unique<tarxx::tarfile>(archive_path.string(), v.compression, v.type);
+#else
+        return std::make_unique<tarxx::tarfile>(archive_path.string(), v.type);
+#endif
+    }
+
+    void report(const std::string& name, const double seconds, const unsigned long long bytes, const unsigned long long files,
+                const unsigned long long allocations)
+    {
+        const auto mb_per_second = static_cast<double>(bytes) / (1024.0 * 1024.0) / seconds;
+        const auto files_per_second = static_cast<double>(files) / seconds;
+        const auto allocations_per_file = files == 0 ? 0.0 : static_cast<double>(allocations) / static_cast<double>(files);
+        std::cout << std::left << std::setw(48) << name << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(10) << mb_per_second << " MB/s"
+                  << std::setw(12) << files_per_second << " files/s"
+                  << std::setw(10) << allocations_per_file << " allocs/file" << std::endl;
+    }
+
+    template<typename Fn>
+    void measure(const std::string& name, const unsigned long long bytes, const unsigned long long files, Fn&& fn)
+    {
+        const auto allocations_before = allocation_count.load();
+        const auto start = std::chrono::steady_clock::now();
+        fn();
+        const auto end = std::chrono::steady_clock::now();
+        const auto allocations = allocation_count.load() - allocations_before;
+        report(name, std::chrono::duration<double>(end - start).count(), bytes, files, allocations);
+    }
+
+    void bench_workload(const workload& w, const variant& v)
+    {
+        unsigned long long output_bytes = 0;
+        measure(w.name + "/" + v.name, w.bytes, w.files, [&]() {
+            auto tar = open_archive(v, output_bytes);
+            tar->add_from_filesystem_recursive(w.path.string());
+            tar->close();
+        });
+    }
+
+    void bench_streaming_data(const variant& v, const unsigned scale)
+    {
+        const std::vector<std::size_t> chunk_sizes = {100, tarxx::BLOCK_SIZE, 64 * 1024, 1024 * 1024};
+        const std::string data(1024 * 1024, 'x');
+        const auto total_size = 256ULL * 1024 * 1024 * scale;
+        const tarxx::Platform platform;
+
+        for (const auto chunk_size : chunk_sizes) {
+            unsigned long long output_bytes = 0;
+            measure("streaming_data_" + std::to_string(chunk_size) + "/" + v.name, total_size, 1, [&]() {
+                auto tar = open_archive(v, output_bytes);
+                tar->add_file_streaming();
+                for (unsigned long long written = 0; written < total_size;) {
+                    const auto size = std::min<unsigned long long>(chunk_size, total_size - written);
+                    tar->add_file_streaming_data(data.data(), static_cast<std::streamsize>(size));
+                    written += size;
+                }
+                tar->stream_file_complete("streamed_file", 0644, platform.user_id(), platform.group_id(), total_size, 0);
+                tar->close();
+            });
+        }
+    }
+
+    void bench_headers(const variant& v, const unsigned scale)
+    {
+        const auto entries = 100000ULL * scale;
+        const tarxx::Platform platform;
+        unsigned long long output_bytes = 0;
+        measure("headers/" + v.name, entries * tarxx::BLOCK_SIZE, entries, [&]() {
+            auto tar = open_archive(v, output_bytes);
+            for (unsigned long long entry = 0; entry < entries; ++entry) {
+                tar->add_directory("some/directory/path/" + std::to_string(entry), 0755, platform.user_id(), platform.group_id(), 1700000000);
+            }
+            tar->close();
+        });
+    }
+
+    // the encoding used before header_encoder, kept as baseline
+    namespace legacy_header {
+        void write_string(tarxx::block_t& block, const std::string& str, const unsigned pos, const unsigned len)
+        {
+            const auto copylen = str.size() < len ? str.size() : len;
+            std::copy_n(str.c_str(), copylen, block.data() + pos);
+        }
+
+        void write_octal(tarxx::block_t& block, const unsigned long long value, const unsigned pos, const unsigned len)
+        {
+            std::stringstream sstr;
+            sstr << std::oct << std::ios::right << std::setfill('0') << std::setw(static_cast<int>(len)) << value;
+            auto str = sstr.str();
+            if (str.size() > len) str = str.substr(str.size() - len);
+            write_string(block, str, pos, len);
+        }
+
+        unsigned checksum(const tarxx::block_t& block)
+        {
+            unsigned chksum = 0;
+            for (const unsigned char c : block) chksum += c;
+            return chksum;
+        }
+    } // namespace legacy_header
+
+    // encodes the numeric fields, the name and the checksum of a ustar header
+    template<typename WriteString, typename WriteOctal, typename Checksum>
+    unsigned long long encode_headers(const std::vector<std::string>& names, WriteString&& write_string, WriteOctal&& write_octal, Checksum&& checksum)
+    {
+        unsigned long long checksums = 0;
+        for (unsigned long long i = 0; i < names.size(); ++i) {
+            tarxx::block_t block {};
+            write_string(block, names[i], 0, 100);
+            write_octal(block, 0644, 100, 7);
+            write_octal(block, 1000, 108, 7);
+            write_octal(block, 1000, 116, 7);
+            write_octal(block, i, 124, 11);
+            write_octal(block, 1700000000, 136, 11);
+            std::fill_n(block.data() + 148, 8, ' ');
+            const auto chksum = checksum(block);
+            write_octal(block, chksum, 148, 6);
+            checksums += chksum;
+        }
+        return checksums;
+    }
+
+    // header encoding without any output, compared to the previous implementation
+    void bench_header_encoding(const unsigned scale)
+    {
+        const auto entries = 1000000ULL * scale;
+        std::vector<std::string> names;
+        names.reserve(entries);
+        for (unsigned long long entry = 0; entry < entries; ++entry) {
+            names.push_back("some/directory/path/file_" + std::to_string(entry));
+        }
+
+        unsigned long long legacy_checksums = 0;
+        measure("header_encoding/legacy", entries * tarxx::BLOCK_SIZE, entries, [&]() {
+            legacy_checksums = encode_headers(names, legacy_header::write_string, legacy_header::write_octal, legacy_header::checksum);
+        });
+
+        unsigned long long checksums = 0;
+        measure("header_encoding/header_encoder", entries * tarxx::BLOCK_SIZE, entries, [&]() {
+            checksums = encode_headers(names, tarxx::header_encoder::write_string, tarxx::header_encoder::write_octal, tarxx::header_encoder::checksum);
+        });
+
+        if (checksums != legacy_checksums) throw std::runtime_error("header encodings differ");
+    }
+
+#ifdef WITH_LZ4
+    void bench_lz4_read(const workload& w)
+    {
+        {
+            tarxx::tarfile tar(archive_path.string(), tarxx::tarfile::compression_mode::lz4_parallel, tarxx::tarfile::tar_type::ustar);
+            tar.add_from_filesystem_recursive(w.path.string());
+        }
+
+        std::vector<unsigned> thread_counts = {1U};
+        if (std::thread::hardware_concurrency() > 1) thread_counts.push_back(std::thread::hardware_concurrency());
+        for (const auto threads : thread_counts) {
+            unsigned long long content_bytes = 0;
+            tarxx::tar_stream_parser parser([](const tarxx::tar_member&) {},
+                                            [&content_bytes](const tarxx::tar_member&, const char*, const size_t size) { content_bytes += size; });
+            measure("read_lz4/" + w.name + "/threads_" + std::to_string(threads), w.bytes, w.files, [&]() {
+                const tarxx::lz4_frame_reader reader(archive_path.string(), threads);
+                reader.read(parser);
+            });
+        }
+    }
+#endif
+
+    std::vector<variant> create_variants()
+    {
+        std::vector<variant> variants;
+        for (const auto type : {tarxx::tarfile::tar_type::unix_v7, tarxx::tarfile::tar_type::ustar}) {
+            const std::string type_name = type == tarxx::tarfile::tar_type::unix_v7 ? "unix_v7" : "ustar";
+            for (const auto stream_output : {false, true}) {
+                const auto name = type_name + (stream_output ? "/stream" : "/file");
+#ifdef WITH_COMPRESSION
+                variants.push_back({name, type, stream_output, tarxx::tarfile::compression_mode::none});
+#    ifdef WITH_LZ4
+                variants.push_back({name + "/lz4", type, stream_output, tarxx::tarfile::compression_mode::lz4});
+                variants.push_back({name + "/lz4_parallel", type, stream_output, tarxx::tarfile::compression_mode::lz4_parallel});
+#    endif
+#else
+                variants.push_back({name, type, stream_output});
+#endif
+            }
+        }
+        return variants;
+    }
+} // namespace
+
+int main(int argc, char** argv)
+{
+    const std::string filter = argc > 1 ? argv[1] : "";
+    const auto scale = argc > 2 ? static_cast<unsigned>(std::max(1, std::atoi(argv[2]))) : 1U;
+    const auto selected = [&](const std::string& name) { return name.find(filter) != std::string::npos; };
+
+    fs::remove_all(benchmark_dir);
+    fs::create_directories(benchmark_dir);
+
+    const std::vector<std::function<workload(unsigned)>> workload_factories = {
+            create_tiny_files, create_huge_files, create_deep_tree, create_hard_links};
+    const auto variants = create_variants();
+
+    try {
+        for (const auto& factory : workload_factories) {
+            const auto w = factory(scale);
+            for (const auto& v : variants) {
+                if (selected(w.name + "/" + v.name)) bench_workload(w, v);
+            }
+#ifdef WITH_LZ4
+            if (selected("read_lz4/" + w.name)) bench_lz4_read(w);
+#endif
+            fs::remove_all(w.path);
+        }
+
+        for (const auto& v : variants) {
+            // streaming data is only supported for file output
+            if (!v.stream_output && selected("streaming_data/" + v.name)) bench_streaming_data(v, scale);
+            if (selected("headers/" + v.name)) bench_headers(v, scale);
+        }
+        if (selected("header_encoding")) bench_header_encoding(scale);
+    } catch (const std::exception& ex) {
+        std::cerr << "benchmark failed: " << ex.what() << std::endl;
+        fs::remove_all(benchmark_dir);
+        return 1;
+    }
+
+    fs::remove_all(benchmark_dir);
+    return 0;
+}
@@ -0,0 +1,241 @@
+// tarxx - modern C++ tar library
+// Copyright (c) 2022-2023, Thilo Schmitt, Alexander Mohr
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "util/util.h"
+#include <gtest/gtest.h>
+#include <tarxx.h>
+
+#include <sys/stat.h>
+
+using std::string_literals::operator""s;
+
+class extractor_tests : public ::testing::TestWithParam<tarxx::tarfile::tar_type> {};
+
+namespace {
+    struct ::stat lstat_path(const std::filesystem::path& path)
+    {
+        struct ::stat file_stat {};
+        EXPECT_EQ(::lstat(path.c_str(), &file_stat), 0) << path;
+        return file_stat;
+    }
+} // namespace
+
+TEST_P(extractor_tests, extract_files_written_by_tarfile)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto dir = std::filesystem::temp_directory_path() / "extractor_test";
+    const auto out_dir = std::filesystem::temp_directory_path() / "extractor_test_out";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(dir);
+    util::remove_if_exists(out_dir);
+    std::filesystem::create_directories(dir / "sub_folder" / "nested");
+
+    std::vector<std::pair<std::filesystem::path, std::string>> files;
+    for (auto i = 0; i < 50; ++i) {
+        const auto folder = i % 2 == 0 ? dir / "sub_folder" : dir / "sub_folder" / "nested";
+        files.emplace_back(folder / ("file_" + std::to_string(i)), util::create_binary_input_data(i * 1000 + i));
+        static_cast<void>(util::create_test_file(tar_type, files.back().first, files.back().second));
+    }
+    std::filesystem::permissions(files.front().first, std::filesystem::perms::owner_read | std::filesystem::perms::group_exec);
+    std::filesystem::create_hard_link(files.front().first, dir / "hard_link");
+    std::filesystem::create_symlink("sub_folder/file_0", dir / "symlink");
+
+    {
+        tarxx::tarfile f(tar_filename, tar_type);
+        f.add_from_filesystem_recursive(dir);
+    }
+
+    const tarxx::tarreader reader(tar_filename);
+    tarxx::tarextractor extractor(reader);
+    extractor.set_options({.writer_threads = 4});
+    extractor.extract_to(out_dir);
+
+    const tarxx::Platform platform;
+    const auto extracted = [&](const std::filesystem::path& path) {
+        return out_dir / platform.relative_path(path.string());
+    };
+    for (const auto& [path, content] : files) {
+        EXPECT_EQ(util::read_file(extracted(path)), content) << path;
+        const auto original = lstat_path(path);
+        const auto copy = lstat_path(extracted(path));
+        EXPECT_EQ(copy.st_mode, original.st_mode) << path;
+        EXPECT_EQ(copy.st_mtim.tv_sec, original.st_mtim.tv_sec) << path;
+    }
+
+    EXPECT_EQ(lstat_path(extracted(dir / "hard_link")).st_ino, lstat_path(extracted(files.front().first)).st_ino);
+    EXPECT_TRUE(std::filesystem::is_symlink(extracted(dir / "symlink")));
+    EXPECT_EQ(std::filesystem::read_symlink(extracted(dir / "symlink")), "sub_folder/file_0");
+    EXPECT_EQ(lstat_path(extracted(dir / "sub_folder")).st_mtim.tv_sec, lstat_path(dir / "sub_folder").st_mtim.tv_sec);
+    util::remove_if_exists(dir);
+    util::remove_if_exists(out_dir);
+}
+
+TEST_P(extractor_tests, restore_directory_mode_after_content)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto dir = std::filesystem::temp_directory_path() / "extractor_test";
+    const auto out_dir = std::filesystem::temp_directory_path() / "extractor_test_out";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(dir);
+    util::remove_if_exists(out_dir);
+    std::filesystem::create_directories(dir / "read_only");
+    static_cast<void>(util::create_test_file(tar_type, dir / "read_only" / "file", "content"));
+    std::filesystem::permissions(dir / "read_only", std::filesystem::perms::owner_read | std::filesystem::perms::owner_exec);
+
+    {
+        tarxx::tarfile f(tar_filename, tar_type);
+        f.add_from_filesystem_recursive(dir);
+    }
+
+    const tarxx::tarreader reader(tar_filename);
+    tarxx::tarextractor extractor(reader);
+    extractor.extract_to(out_dir);
+
+    const tarxx::Platform platform;
+    const auto extracted_dir = out_dir / platform.relative_path((dir / "read_only").string());
+    EXPECT_EQ(util::read_file(extracted_dir / "file"), "content");
+    EXPECT_EQ(lstat_path(extracted_dir).st_mode & 07777, 0500);
+
+    std::filesystem::permissions(dir / "read_only", std::filesystem::perms::owner_all);
+    std::filesystem::permissions(extracted_dir, std::filesystem::perms::owner_all);
+    util::remove_if_exists(dir);
+    util::remove_if_exists(out_dir);
+}
+
+TEST_P(extractor_tests, last_member_of_a_name_wins)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto out_dir = std::filesystem::temp_directory_path() / "extractor_test_out";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(out_dir);
+    std::filesystem::create_directories(out_dir);
+    static_cast<void>(util::create_test_file(tar_type, out_dir / "file", "existing content"));
+
+    const auto dir = std::filesystem::temp_directory_path() / "extractor_test";
+    util::remove_if_exists(dir);
+    std::filesystem::create_directories(dir);
+    const auto format = tar_type == tarxx::tarfile::tar_type::ustar ? "ustar"s : "v7"s;
+    std::string output;
+    static_cast<void>(util::create_test_file(tar_type, dir / "file", "first"));
+    ASSERT_EQ(util::execute_with_output("tar --format=" + format + " -cf " + tar_filename + " -C " + dir.string() + " file", output), 0) << output;
+    static_cast<void>(util::create_test_file(tar_type, dir / "file", "second"));
+    ASSERT_EQ(util::execute_with_output("touch -d @1234567 " + (dir / "file").string(), output), 0) << output;
+    ASSERT_EQ(util::execute_with_output("tar --format=" + format + " -rf " + tar_filename + " -C " + dir.string() + " file", output), 0) << output;
+
+    const tarxx::tarreader reader(tar_filename);
+    tarxx::tarextractor extractor(reader);
+    extractor.extract_to(out_dir);
+    EXPECT_EQ(util::read_file(out_dir / "file"), "second");
+    EXPECT_EQ(lstat_path(out_dir / "file").st_mtim.tv_sec, 1234567);
+    util::remove_if_exists(dir);
+    util::remove_if_exists(out_dir);
+}
+
+TEST_P(extractor_tests, reject_members_outside_of_target)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto out_dir = std::filesystem::temp_directory_path() / "extractor_test_out";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(out_dir);
+
+    {
+        const tarxx::Platform platform;
+        tarxx::tarfile f(tar_filename, tar_type);
+        f.add_file_streaming();
+        f.add_file_streaming_data("escape", 6);
+        f.stream_file_complete("folder/../../escaped_file", 0644, platform.user_id(), platform.group_id(), 6, 1234567);
+    }
+    std::filesystem::create_directories(out_dir / "target");
+
+    const tarxx::tarreader reader(tar_filename);
+    tarxx::tarextractor extractor(reader);
+    EXPECT_THROW(extractor.extract_to(out_dir / "target"), std::invalid_argument);
+    EXPECT_FALSE(std::filesystem::exists(out_dir / "escaped_file"));
+    util::remove_if_exists(out_dir);
+}
+
+TEST_P(extractor_tests, extract_archive_created_by_tar)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto dir = std::filesystem::temp_directory_path() / "extractor_test";
+    const auto out_dir = std::filesystem::temp_directory_path() / "extractor_test_out";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(dir);
+    util::remove_if_exists(out_dir);
+    std::filesystem::create_directories(dir / "folder");
+    const auto content = util::create_binary_input_data(100000);
+    static_cast<void>(util::create_test_file(tar_type, dir / "folder" / "file", content));
+    std::filesystem::create_symlink("folder/file", dir / "symlink");
+
+    const auto format = tar_type == tarxx::tarfile::tar_type::ustar ? "ustar"s : "v7"s;
+    std::string output;
+    ASSERT_EQ(util::execute_with_output("tar --format=" + format + " -cf " + tar_filename + " -C " + dir.string() + " folder symlink", output), 0) << output;
+
+    const tarxx::tarreader reader(tar_filename);
+    tarxx::tarextractor extractor(reader);
+    extractor.extract_to(out_dir);
+    EXPECT_EQ(util::read_file(out_dir / "folder" / "file"), content);
+    EXPECT_EQ(std::filesystem::read_symlink(out_dir / "symlink"), "folder/file");
+    util::remove_if_exists(dir);
+    util::remove_if_exists(out_dir);
+}
+
+TEST(extractor_tests, extract_sparse_files_with_holes)
+{
+    const auto tar_filename = util::tar_file_name();
+    const auto dir = std::filesystem::temp_directory_path() / "extractor_test";
+    const auto out_dir = std::filesystem::temp_directory_path() / "extractor_test_out";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(dir);
+    util::remove_if_exists(out_dir);
+    const auto content = util::create_sparse_file(dir / "sparse_file", 6 * 1024 * 1024,
+                                                  {{0, util::create_binary_input_data(5000)}, {4 * 1024 * 1024, util::create_binary_input_data(10000)}});
+
+    {
+        tarxx::tarfile f(tar_filename, tarxx::tarfile::tar_type::ustar);
+        tarxx::tarfile::sparse_options options;
+        options.enabled = true;
+        f.set_sparse_options(options);
+        f.add_from_filesystem(dir / "sparse_file");
+    }
+
+    const tarxx::tarreader reader(tar_filename);
+    tarxx::tarextractor extractor(reader);
+    extractor.extract_to(out_dir);
+    const tarxx::Platform platform;
+    const auto extracted = out_dir / platform.relative_path((dir / "sparse_file").string());
+    EXPECT_EQ(util::read_file(extracted), content);
+    if (util::allocated_size(dir / "sparse_file") < content.size()) {
+        EXPECT_LT(util::allocated_size(extracted), content.size());
+    }
+    util::remove_if_exists(dir);
+    util::remove_if_exists(out_dir);
+}
+
+INSTANTIATE_TEST_SUITE_P(tar_type_dependent, extractor_tests, ::testing::Values(tarxx::tarfile::tar_type::unix_v7, tarxx::tarfile::tar_type::ustar));
@@ -25,6 +25,7 @@
 #include "util/util.h"
 #include <gtest/gtest.h>
 #include <iostream>
+#include <random>
 #include <tarxx.h>
 
 using std::string_literals::operator""s;
@@ -68,6 +69,215 @@ TEST_P(lz4_tests, add_multiple_files_recursive_success)
     util::remove_if_exists(dir);
 }
 
+TEST_P(lz4_tests, add_multiple_files_recursive_prefetching)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto lz4_filename = tar_filename + ".lz4";
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(lz4_filename);
+
+    tarxx::tarfile tar_file(lz4_filename, tarxx::tarfile::compression_mode::lz4, tar_type);
+    tarxx::tarfile::prefetch_options options;
+    options.reader_threads = 2;
+    tar_file.set_prefetch_options(options);
+    tar_file.add_from_filesystem_recursive(dir);
+    tar_file.close();
+
+    util::append_folders_from_test_files(test_files, tar_type);
+
+    util::decompress_lz4(lz4_filename, tar_filename);
+    util::expect_files_in_tar(tar_filename, test_files, tar_type);
+    util::remove_if_exists(dir);
+}
+
+TEST_P(lz4_tests, add_multiple_files_recursive_parallel_compression)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto lz4_filename = tar_filename + ".lz4";
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(lz4_filename);
+
+    tarxx::tarfile tar_file(lz4_filename, tarxx::tarfile::compression_mode::lz4_parallel, tar_type);
+    tar_file.set_compression_threads(3, 2);
+    tar_file.add_from_filesystem_recursive(dir);
+    tar_file.close();
+
+    util::append_folders_from_test_files(test_files, tar_type);
+
+    util::decompress_lz4(lz4_filename, tar_filename);
+    util::expect_files_in_tar(tar_filename, test_files, tar_type);
+    util::remove_if_exists(dir);
+}
+
+TEST_P(lz4_tests, add_file_parallel_compression_content_matches)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto lz4_filename = tar_filename + ".lz4";
+    const auto input_data = util::create_binary_input_data(3 * 1024 * 1024 + 123);
+    const auto test_file = util::create_test_file(tar_type, std::filesystem::temp_directory_path() / "content_file", input_data);
+    const auto out_dir = std::filesystem::temp_directory_path() / "content_out";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(lz4_filename);
+    util::remove_if_exists(out_dir);
+    std::filesystem::create_directories(out_dir);
+
+    tarxx::tarfile f(lz4_filename, tarxx::tarfile::compression_mode::lz4_parallel, tar_type);
+    f.set_compression_threads(4);
+    f.add_from_filesystem(test_file.path);
+    f.close();
+
+    util::decompress_lz4(lz4_filename, tar_filename);
+    util::extract_tar(tar_filename, out_dir);
+    const tarxx::Platform platform;
+    EXPECT_EQ(util::read_file(out_dir / platform.relative_path(test_file.path)), input_data);
+    util::remove_if_exists(out_dir);
+}
+
+TEST_P(lz4_tests, add_file_parallel_compression_stream_output)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto lz4_filename = tar_filename + ".lz4";
+    const auto test_file = util::create_test_file(tar_type, std::filesystem::temp_directory_path() / "test_file", util::create_input_data(600 * 1024));
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(lz4_filename);
+
+    std::ofstream lz4_file(lz4_filename, std::ios::binary);
+    tarxx::tarfile f([&](const tarxx::block_t& data, size_t size) {
+        lz4_file.write(data.data(), static_cast<std::streamsize>(size));
+    },
+                     tarxx::tarfile::compression_mode::lz4_parallel, tar_type);
+    f.add_from_filesystem(test_file.path);
+    f.close();
+    lz4_file.close();
+
+    util::decompress_lz4(lz4_filename, tar_filename);
+    util::tar_first_files_matches_original(tar_filename, test_file, tar_type);
+}
+
+TEST_P(lz4_tests, add_multiple_files_recursive_chunked_stream_output)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto lz4_filename = tar_filename + ".lz4";
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(lz4_filename);
+
+    std::ofstream lz4_file(lz4_filename, std::ios::binary);
+    tarxx::tarfile tar_file([&](const char* data, size_t size) {
+        lz4_file.write(data, static_cast<std::streamsize>(size));
+    },
+                            64 * 1024, tarxx::tarfile::compression_mode::lz4, tar_type);
+    tar_file.add_from_filesystem_recursive(dir);
+    tar_file.close();
+    lz4_file.close();
+
+    util::append_folders_from_test_files(test_files, tar_type);
+
+    util::decompress_lz4(lz4_filename, tar_filename);
+    util::expect_files_in_tar(tar_filename, test_files, tar_type);
+    util::remove_if_exists(dir);
+}
+
+void lz4_validate_fixed_size_headers(const tarxx::tarfile::tar_type& tar_type, const tarxx::tarfile::compression_mode compression)
+{
+    const auto tar_filename = util::tar_file_name();
+    const auto lz4_filename = tar_filename + ".lz4";
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(lz4_filename);
+
+    tarxx::tarfile tar_file(lz4_filename, compression, tar_type);
+    tar_file.set_header_mode(tarxx::tarfile::header_mode::fixed_size);
+    tar_file.add_from_filesystem_recursive(dir);
+    tar_file.close();
+
+    util::append_folders_from_test_files(test_files, tar_type);
+
+    util::decompress_lz4(lz4_filename, tar_filename);
+    util::expect_files_in_tar(tar_filename, test_files, tar_type);
+    util::remove_if_exists(dir);
+}
+
+TEST_P(lz4_tests, header_mode_fixed_size_multiple_files_recursive)
+{
+    lz4_validate_fixed_size_headers(GetParam(), tarxx::tarfile::compression_mode::lz4);
+}
+
+TEST_P(lz4_tests, header_mode_fixed_size_multiple_files_recursive_parallel)
+{
+    lz4_validate_fixed_size_headers(GetParam(), tarxx::tarfile::compression_mode::lz4_parallel);
+}
+
+TEST_P(lz4_tests, header_mode_fixed_size_shares_blocks_between_entries)
+{
+    const auto tar_type = GetParam();
+    const auto dir = std::filesystem::temp_directory_path() / "many_small_files";
+    util::remove_if_exists(dir);
+    std::filesystem::create_directories(dir);
+    for (auto i = 0; i < 200; ++i) {
+        util::create_test_file(tar_type, dir / ("file_" + std::to_string(i)), "small file content " + std::to_string(i));
+    }
+
+    const auto compressed_size = [&](const tarxx::tarfile::header_mode header_mode) {
+        const auto lz4_filename = util::tar_file_name() + ".lz4";
+        util::remove_if_exists(lz4_filename);
+        tarxx::tarfile tar_file(lz4_filename, tarxx::tarfile::compression_mode::lz4, tar_type);
+        tar_file.set_header_mode(header_mode);
+        tar_file.add_from_filesystem_recursive(dir);
+        tar_file.close();
+        return std::filesystem::file_size(lz4_filename);
+    };
+
+    EXPECT_LT(compressed_size(tarxx::tarfile::header_mode::fixed_size) * 4, compressed_size(tarxx::tarfile::header_mode::rewrite));
+    util::remove_if_exists(dir);
+}
+
+TEST_P(lz4_tests, header_mode_fixed_size_with_streaming_data)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto lz4_filename = tar_filename + ".lz4";
+    const auto test_file = util::create_test_file(tar_type);
+    const auto input_data = util::create_input_data(tarxx::BLOCK_SIZE * 3 + 17);
+    const auto stream_file = util::create_test_file(tar_type, std::filesystem::temp_directory_path() / "test_stream_file", input_data);
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(lz4_filename);
+
+    tarxx::tarfile tar_file(lz4_filename, tarxx::tarfile::compression_mode::lz4, tar_type);
+    tar_file.set_header_mode(tarxx::tarfile::header_mode::fixed_size);
+    tar_file.add_from_filesystem(test_file.path);
+    util::add_streaming_data(input_data, stream_file, tar_file);
+    tar_file.close();
+
+    util::decompress_lz4(lz4_filename, tar_filename);
+    std::vector<util::file_info> expected_files = {test_file, stream_file};
+    util::expect_files_in_tar(tar_filename, expected_files, tar_type);
+}
+
+TEST(lz4_tests, set_compression_threads_requires_parallel_mode)
+{
+    const auto lz4_filename = util::tar_file_name() + ".lz4";
+    tarxx::tarfile f(lz4_filename, tarxx::tarfile::compression_mode::lz4);
+    EXPECT_THROW(f.set_compression_threads(2), std::logic_error);
+}
+
+TEST(lz4_tests, set_compression_threads_after_compression_started)
+{
+    const auto tar_type = tarxx::tarfile::tar_type::ustar;
+    const auto lz4_filename = util::tar_file_name() + ".lz4";
+    const auto test_file = util::create_test_file(tar_type);
+    tarxx::tarfile f(lz4_filename, tarxx::tarfile::compression_mode::lz4_parallel, tar_type);
+    f.add_from_filesystem(test_file.path);
+    EXPECT_THROW(f.set_compression_threads(2), std::logic_error);
+}
+
 void lz4_validate_streaming_data(const unsigned int size, const tarxx::tarfile::tar_type& tar_type)
 {
     const auto tar_filename = util::tar_file_name();
@@ -86,6 +296,30 @@ void lz4_validate_streaming_data(const unsigned int size, const tarxx::tarfile::
     util::tar_has_one_file_and_matches(tar_filename, reference_file, tar_type);
 }
 
+TEST_P(lz4_tests, add_file_streaming_data_in_pieces_content_matches)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto lz4_filename = tar_filename + ".lz4";
+    const auto input_data = util::create_binary_input_data(5 * 1024 * 1024 + 77);
+    const auto test_file = util::create_test_file(tar_type, std::filesystem::temp_directory_path() / "content_file", input_data);
+    const auto out_dir = std::filesystem::temp_directory_path() / "content_out";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(lz4_filename);
+    util::remove_if_exists(out_dir);
+    std::filesystem::create_directories(out_dir);
+
+    tarxx::tarfile tar_file(lz4_filename, tarxx::tarfile::compression_mode::lz4, tar_type);
+    util::add_streaming_data_in_pieces(input_data, test_file, tar_file);
+    tar_file.close();
+
+    util::decompress_lz4(lz4_filename, tar_filename);
+    util::extract_tar(tar_filename, out_dir);
+    const tarxx::Platform platform;
+    EXPECT_EQ(util::read_file(out_dir / platform.relative_path(test_file.path)), input_data);
+    util::remove_if_exists(out_dir);
+}
+
 TEST_P(lz4_tests, add_file_stream_data_smaller_than_block_size)
 {
     const auto tar_type = GetParam();
@@ -227,4 +461,253 @@ TEST(lz4_tests, add_fifo_via_streaming)
 }
 #endif
 
+static void lz4_frame_reader_matches_tar(const std::string& lz4_filename, const std::string& tar_filename, const unsigned threads)
+{
+    std::vector<util::streamed_member> members;
+    auto parser = util::create_collecting_parser(members);
+    const tarxx::lz4_frame_reader lz4_reader(lz4_filename, threads);
+    lz4_reader.read(parser);
+    EXPECT_TRUE(parser.is_complete());
+
+    util::decompress_lz4(lz4_filename, tar_filename);
+    const tarxx::tarreader reader(tar_filename);
+    util::streamed_members_match_reader(members, reader);
+}
+
+TEST_P(lz4_tests, lz4_frame_reader_reads_archives_written_by_tarfile)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto lz4_filename = tar_filename + ".lz4";
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    const auto large_file = util::create_test_file(tar_type, dir / "large_file", util::create_binary_input_data(5 * 1024 * 1024 + 3));
+
+    for (const auto compression : {tarxx::tarfile::compression_mode::lz4, tarxx::tarfile::compression_mode::lz4_parallel}) {
+        util::remove_if_exists(tar_filename);
+        util::remove_if_exists(lz4_filename);
+        {
+            tarxx::tarfile f(lz4_filename, compression, tar_type);
+            f.add_from_filesystem_recursive(dir);
+        }
+
+        for (const auto threads : {1U, 4U}) {
+            lz4_frame_reader_matches_tar(lz4_filename, tar_filename, threads);
+        }
+    }
+    util::remove_if_exists(dir);
+}
+
+TEST_P(lz4_tests, lz4_frame_reader_reads_frames_written_by_lz4)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto lz4_filename = tar_filename + ".lz4";
+    const auto input_filename = tar_filename + ".in";
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    const auto large_file = util::create_test_file(tar_type, dir / "large_file", util::create_binary_input_data(3 * 1024 * 1024 + 3));
+    util::remove_if_exists(input_filename);
+
+    {
+        tarxx::tarfile f(input_filename, tar_type);
+        f.add_from_filesystem_recursive(dir);
+    }
+
+    // linked blocks are decompressed sequentially, the others with all options of the frame format
+    for (const auto* const options : {"-BD", "-B4 -BX --content-size", "-B7 --no-frame-crc"}) {
+        util::remove_if_exists(lz4_filename);
+        std::string output;
+        ASSERT_EQ(util::execute_with_output("lz4 -q "s + options + " " + input_filename + " " + lz4_filename, output), 0) << output;
+        lz4_frame_reader_matches_tar(lz4_filename, tar_filename, 3);
+    }
+    util::remove_if_exists(input_filename);
+    util::remove_if_exists(dir);
+}
+
+TEST(lz4_tests, lz4_frame_reader_invalid_data)
+{
+    const auto tar_filename = util::tar_file_name();
+    const auto lz4_filename = tar_filename + ".lz4";
+    {
+        std::ofstream file(lz4_filename, std::ios::binary | std::ios::trunc);
+        file << "not an lz4 frame";
+    }
+    const tarxx::lz4_frame_reader reader(lz4_filename);
+    EXPECT_THROW(reader.read([](const char*, tarxx::size_t) {}), std::runtime_error);
+
+    {
+        tarxx::tarfile f(lz4_filename, tarxx::tarfile::compression_mode::lz4, tarxx::tarfile::tar_type::ustar);
+        const auto content = util::create_binary_input_data(1024 * 1024);
+        const tarxx::Platform platform;
+        f.add_file_streaming();
+        f.add_file_streaming_data(content.data(), static_cast<std::streamsize>(content.size()));
+        f.stream_file_complete("file", 0644, platform.user_id(), platform.group_id(), content.size(), 0);
+    }
+    std::filesystem::resize_file(lz4_filename, std::filesystem::file_size(lz4_filename) - 100);
+    const tarxx::lz4_frame_reader truncated_reader(lz4_filename);
+    EXPECT_THROW(truncated_reader.read([](const char*, tarxx::size_t) {}), std::runtime_error);
+}
+
+TEST_P(lz4_tests, index_file_allows_reading_single_members)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto lz4_filename = tar_filename + ".lz4";
+    const auto index_filename = tar_filename + ".idx";
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    // large enough to let fixed size headers flush in between
+    const auto large_dir = std::filesystem::temp_directory_path() / "index_test";
+    util::remove_if_exists(large_dir);
+    std::filesystem::create_directories(large_dir);
+    const auto large_file = util::create_test_file(tar_type, large_dir / "large_file", util::create_binary_input_data(9 * 1024 * 1024 + 5));
+    const auto after_large_file = util::create_test_file(tar_type, large_dir / "after_large_file", "after");
+
+    for (const auto compression : {tarxx::tarfile::compression_mode::lz4, tarxx::tarfile::compression_mode::lz4_parallel}) {
+        for (const auto header_mode : {tarxx::tarfile::header_mode::rewrite, tarxx::tarfile::header_mode::fixed_size}) {
+            util::remove_if_exists(tar_filename);
+            util::remove_if_exists(lz4_filename);
+            util::remove_if_exists(index_filename);
+            {
+                tarxx::tarfile f(lz4_filename, compression, tar_type);
+                f.set_header_mode(header_mode);
+                f.set_index_file(index_filename);
+                f.add_from_filesystem_recursive(dir);
+                f.add_from_filesystem(large_file.path);
+                f.add_from_filesystem(after_large_file.path);
+            }
+
+            util::decompress_lz4(lz4_filename, tar_filename);
+            const tarxx::tarreader reader(tar_filename);
+            const tarxx::tar_index index(index_filename);
+            util::index_matches_reader(index, reader);
+
+            const tarxx::lz4_frame_reader lz4_reader(lz4_filename);
+            for (const auto& entry : index.entries()) {
+                std::string content;
+                lz4_reader.read_member(entry, [&content](const char* data, const tarxx::size_t size) { content.append(data, size); });
+                EXPECT_EQ(content, reader.content(entry.name)) << entry.name;
+                if (header_mode == tarxx::tarfile::header_mode::rewrite) {
+                    EXPECT_EQ(entry.block_tar_offset, entry.header_offset);
+                }
+            }
+
+            // members behind the large file can be reached without decompressing it
+            const auto* const after_large_file_entry = index.find(tarxx::Platform().relative_path(after_large_file.path));
+            ASSERT_NE(after_large_file_entry, nullptr);
+            EXPECT_GT(after_large_file_entry->block_tar_offset, 9 * 1024 * 1024);
+        }
+    }
+    util::remove_if_exists(index_filename);
+    util::remove_if_exists(large_dir);
+    util::remove_if_exists(dir);
+}
+
+TEST_P(lz4_tests, adaptive_mode_stores_incompressible_members_uncompressed)
+{
+    const auto tar_type = GetParam();
+    const auto lz4_filename = util::tar_file_name() + ".lz4";
+    const auto dir = std::filesystem::temp_directory_path() / "adaptive_test";
+    util::remove_if_exists(dir);
+    std::filesystem::create_directories(dir);
+
+    // the probe only sees the random start of the mixed file, so all of it is stored uncompressed
+    std::mt19937 random(42);
+    std::string random_start(64 * 1024, '\0');
+    std::generate(random_start.begin(), random_start.end(), [&random]() { return static_cast<char>(random()); });
+    const auto compressible = util::create_test_file(tar_type, dir / "compressible", std::string(1024 * 1024, 'a'));
+    const auto mixed = util::create_test_file(tar_type, dir / "mixed", random_start + std::string(1024 * 1024, 'a'));
+
+    for (const auto compression : {tarxx::tarfile::compression_mode::lz4, tarxx::tarfile::compression_mode::lz4_parallel}) {
+        for (const auto header_mode : {tarxx::tarfile::header_mode::rewrite, tarxx::tarfile::header_mode::fixed_size}) {
+            const auto compressed_size = [&](const bool adaptive) {
+                util::remove_if_exists(lz4_filename);
+                {
+                    tarxx::tarfile f(lz4_filename, compression, tar_type);
+                    f.set_header_mode(header_mode);
+                    tarxx::lz4_options options;
+                    options.adaptive = adaptive;
+                    f.set_lz4_options(options);
+                    f.add_from_filesystem(compressible.path);
+                    f.add_from_filesystem(mixed.path);
+                }
+
+                std::vector<util::streamed_member> members;
+                auto parser = util::create_collecting_parser(members);
+                tarxx::lz4_frame_reader(lz4_filename).read(parser);
+                EXPECT_TRUE(parser.is_complete());
+                EXPECT_EQ(members.size(), 2);
+                for (const auto& member : members) {
+                    EXPECT_EQ(member.content, util::read_file("/" + member.name)) << member.name;
+                }
+                return std::filesystem::file_size(lz4_filename);
+            };
+
+            const auto size = compressed_size(false);
+            const auto adaptive_size = compressed_size(true);
+            EXPECT_LT(size, 128 * 1024);
+            EXPECT_GT(adaptive_size, 1024 * 1024);
+        }
+    }
+    util::remove_if_exists(dir);
+}
+
+TEST_P(lz4_tests, lz4_options_select_level_and_acceleration)
+{
+    const auto tar_type = GetParam();
+    const auto lz4_filename = util::tar_file_name() + ".lz4";
+    std::string content;
+    for (auto i = 0; content.size() < 2 * 1024 * 1024; ++i) {
+        content += "line " + std::to_string(i) + " of " + std::to_string(i * 7919 % 1000) + " words\n";
+    }
+
+    for (const auto compression : {tarxx::tarfile::compression_mode::lz4, tarxx::tarfile::compression_mode::lz4_parallel}) {
+        const auto compressed_size = [&](const int level, const int acceleration) {
+            util::remove_if_exists(lz4_filename);
+            {
+                tarxx::tarfile f(lz4_filename, compression, tar_type);
+                tarxx::lz4_options options;
+                options.level = level;
+                options.acceleration = acceleration;
+                f.set_lz4_options(options);
+                f.add_file("file", 0644, 0, 0, 0, content.data(), content.size());
+            }
+
+            std::vector<util::streamed_member> members;
+            auto parser = util::create_collecting_parser(members);
+            tarxx::lz4_frame_reader(lz4_filename).read(parser);
+            EXPECT_EQ(members.size(), 1);
+            if (!members.empty()) {
+                EXPECT_EQ(members.front().content, content);
+            }
+            return std::filesystem::file_size(lz4_filename);
+        };
+
+        const auto default_size = compressed_size(0, 1);
+        EXPECT_LT(compressed_size(9, 1), default_size);
+        EXPECT_GT(compressed_size(0, 64), default_size);
+    }
+}
+
+TEST(lz4_tests, lz4_options_are_checked)
+{
+    const auto lz4_filename = util::tar_file_name() + ".lz4";
+    const auto options = [](const int level, const int acceleration) {
+        tarxx::lz4_options options;
+        options.level = level;
+        options.acceleration = acceleration;
+        return options;
+    };
+
+    {
+        tarxx::tarfile f(lz4_filename, tarxx::tarfile::compression_mode::lz4);
+        EXPECT_THROW(f.set_lz4_options(options(-1, 1)), std::invalid_argument);
+        EXPECT_THROW(f.set_lz4_options(options(13, 1)), std::invalid_argument);
+        EXPECT_THROW(f.set_lz4_options(options(0, 0)), std::invalid_argument);
+        EXPECT_THROW(f.set_lz4_options(options(9, 2)), std::invalid_argument);
+        f.add_file("file", 0644, 0, 0, 0, "content", 7);
+        EXPECT_THROW(f.set_lz4_options(options(9, 1)), std::logic_error);
+    }
+    tarxx::tarfile f(util::tar_file_name(), tarxx::tarfile::compression_mode::none);
+    EXPECT_THROW(f.set_lz4_options(options(9, 1)), std::logic_error);
+}
+
 INSTANTIATE_TEST_SUITE_P(tar_type_dependent, lz4_tests, ::testing::Values(tarxx::tarfile::tar_type::unix_v7, tarxx::tarfile::tar_type::ustar));
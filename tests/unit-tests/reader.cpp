@@ -0,0 +1,350 @@
+// tarxx - modern C++ tar library
+// Copyright (c) 2022-2023, Thilo Schmitt, Alexander Mohr
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "util/util.h"
+#include <cstdio>
+#include <gtest/gtest.h>
+#include <tarxx.h>
+
+using std::string_literals::operator""s;
+
+class reader_tests : public ::testing::TestWithParam<tarxx::tarfile::tar_type> {};
+
+TEST_P(reader_tests, read_files_written_by_tarfile)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto dir = std::filesystem::temp_directory_path() / "reader_test";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(dir);
+    std::filesystem::create_directories(dir / "sub_folder");
+
+    const auto large_content = util::create_binary_input_data(3 * 1024 * 1024 + 123);
+    const auto large_file = util::create_test_file(tar_type, dir / "large_file", large_content);
+    const auto small_file = util::create_test_file(tar_type, dir / "sub_folder" / "small_file", "small content");
+    const auto empty_file = util::create_test_file(tar_type, dir / "empty_file", "");
+    const auto streamed_content = util::create_binary_input_data(5000);
+
+    {
+        tarxx::tarfile f(tar_filename, tar_type);
+        f.add_from_filesystem_recursive(dir);
+        const tarxx::Platform platform;
+        f.add_file_streaming();
+        f.add_file_streaming_data(streamed_content.data(), static_cast<std::streamsize>(streamed_content.size()));
+        f.stream_file_complete("streamed_file", 0640, platform.user_id(), platform.group_id(), streamed_content.size(), 1234567);
+    }
+
+    const tarxx::Platform platform;
+    const tarxx::tarreader reader(tar_filename);
+    EXPECT_EQ(reader.content(platform.relative_path(large_file.path)), large_content);
+    EXPECT_EQ(reader.content(platform.relative_path(small_file.path)), "small content");
+    EXPECT_EQ(reader.content(platform.relative_path(empty_file.path)), "");
+
+    const auto* const streamed = reader.find("streamed_file");
+    ASSERT_NE(streamed, nullptr);
+    EXPECT_EQ(reader.content(*streamed), streamed_content);
+    EXPECT_EQ(streamed->type, tarxx::file_type_flag::REGULAR_FILE);
+    EXPECT_EQ(streamed->mode, 0640);
+    EXPECT_EQ(streamed->uid, platform.user_id());
+    EXPECT_EQ(streamed->gid, platform.group_id());
+    EXPECT_EQ(streamed->mod_time, 1234567);
+    EXPECT_EQ(streamed, &reader.members().back());
+
+    const auto* const sub_folder = reader.find(std::string(platform.relative_path((dir / "sub_folder").string())) + "/");
+    ASSERT_NE(sub_folder, nullptr);
+    EXPECT_EQ(sub_folder->type, tarxx::file_type_flag::DIRECTORY);
+
+    const auto* const small = reader.find(platform.relative_path(small_file.path));
+    ASSERT_NE(small, nullptr);
+    EXPECT_EQ(small->mode, small_file.mode);
+    EXPECT_EQ(small->mod_time, small_file.mtime.tv_sec);
+    if (tar_type == tarxx::tarfile::tar_type::ustar) {
+        EXPECT_EQ(small->user_name, small_file.owner);
+        EXPECT_EQ(small->group_name, small_file.group);
+    } else {
+        EXPECT_TRUE(small->user_name.empty());
+    }
+
+    EXPECT_EQ(reader.find("not_in_archive"), nullptr);
+    EXPECT_THROW(static_cast<void>(reader.content("not_in_archive")), std::invalid_argument);
+    util::remove_if_exists(dir);
+}
+
+TEST_P(reader_tests, read_links)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto dir = std::filesystem::temp_directory_path() / "reader_test";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(dir);
+    std::filesystem::create_directories(dir);
+
+    const auto file = util::create_test_file(tar_type, dir / "file", "linked content");
+    std::filesystem::create_hard_link(dir / "file", dir / "hard_link");
+    std::filesystem::create_symlink("file", dir / "symlink");
+
+    {
+        tarxx::tarfile f(tar_filename, tar_type);
+        f.add_from_filesystem(file.path);
+        f.add_from_filesystem(dir / "hard_link");
+        f.add_from_filesystem(dir / "symlink");
+    }
+
+    const tarxx::Platform platform;
+    const tarxx::tarreader reader(tar_filename);
+    ASSERT_EQ(reader.members().size(), 3);
+
+    const auto* const hard_link = reader.find(platform.relative_path((dir / "hard_link").string()));
+    ASSERT_NE(hard_link, nullptr);
+    EXPECT_EQ(hard_link->type, tarxx::file_type_flag::HARD_LINK);
+    EXPECT_EQ(hard_link->link_name, platform.relative_path(file.path));
+    EXPECT_EQ(hard_link->size, 0);
+
+    const auto* const symlink = reader.find(platform.relative_path((dir / "symlink").string()));
+    ASSERT_NE(symlink, nullptr);
+    EXPECT_EQ(symlink->type, tarxx::file_type_flag::SYMBOLIC_LINK);
+    EXPECT_EQ(symlink->link_name, "file");
+    util::remove_if_exists(dir);
+}
+
+TEST_P(reader_tests, index_many_members)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    util::remove_if_exists(tar_filename);
+    constexpr auto member_count = 20000U;
+
+    {
+        const tarxx::Platform platform;
+        tarxx::tarfile f(tar_filename, tar_type);
+        for (auto i = 0U; i < member_count; ++i) {
+            const auto content = std::to_string(i);
+            f.add_file_streaming();
+            f.add_file_streaming_data(content.data(), static_cast<std::streamsize>(content.size()));
+            f.stream_file_complete("dir_" + std::to_string(i % 100) + "/file_" + content, 0644, platform.user_id(), platform.group_id(), content.size(), 0);
+        }
+    }
+
+    const tarxx::tarreader reader(tar_filename);
+    ASSERT_EQ(reader.members().size(), member_count);
+    for (auto i = 0U; i < member_count; i += 7) {
+        EXPECT_EQ(reader.content("dir_" + std::to_string(i % 100) + "/file_" + std::to_string(i)), std::to_string(i));
+    }
+}
+
+TEST(reader_tests, ustar_prefix_is_joined)
+{
+    const auto tar_type = tarxx::tarfile::tar_type::ustar;
+    const auto tar_filename = util::tar_file_name();
+    const auto dir = std::filesystem::temp_directory_path() / "reader_test";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(dir);
+
+    auto long_path = dir;
+    for (auto i = 0; i < 4; ++i) long_path /= "sub_folder_with_a_long_name_" + std::to_string(i);
+    const auto file = util::create_test_file(tar_type, long_path / "file", "deep content");
+    ASSERT_GT(file.path.size(), 100);
+
+    {
+        tarxx::tarfile f(tar_filename, tar_type);
+        f.add_from_filesystem(file.path);
+    }
+
+    const tarxx::Platform platform;
+    const tarxx::tarreader reader(tar_filename);
+    ASSERT_EQ(reader.members().size(), 1);
+    EXPECT_EQ(reader.members().front().name, platform.relative_path(file.path));
+    EXPECT_EQ(reader.content(platform.relative_path(file.path)), "deep content");
+    util::remove_if_exists(dir);
+}
+
+TEST(reader_tests, read_gnu_tar_long_names)
+{
+    const auto tar_filename = util::tar_file_name();
+    const auto dir = std::filesystem::temp_directory_path() / "reader_test";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(dir);
+
+    const auto long_name = std::string(180, 'n');
+    util::create_test_file(tarxx::tarfile::tar_type::ustar, dir / long_name, "long name content");
+
+    std::string output;
+    ASSERT_EQ(util::execute_with_output("tar --format=gnu -cf " + tar_filename + " -C " + dir.string() + " " + long_name, output), 0) << output;
+
+    const tarxx::tarreader reader(tar_filename);
+    ASSERT_EQ(reader.members().size(), 1);
+    EXPECT_EQ(reader.members().front().name, long_name);
+    EXPECT_EQ(reader.content(long_name), "long name content");
+    util::remove_if_exists(dir);
+}
+
+TEST(reader_tests, read_gnu_tar_sparse_files)
+{
+    const auto tar_filename = util::tar_file_name();
+    const auto dir = std::filesystem::temp_directory_path() / "reader_test";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(dir);
+    const auto first = util::create_binary_input_data(3000);
+    const auto second = util::create_binary_input_data(600);
+    const auto content = util::create_sparse_file(dir / "sparse_file", 4 * 1024 * 1024, {{4096, first}, {3 * 1024 * 1024, second}});
+    static_cast<void>(util::create_test_file(tarxx::tarfile::tar_type::ustar, dir / "other_file", "other content"));
+
+    std::string output;
+    ASSERT_EQ(util::execute_with_output("tar --format=posix --sparse --sparse-version=1.0 -cf " + tar_filename + " -C " + dir.string() + " sparse_file other_file", output), 0) << output;
+
+    const tarxx::tarreader reader(tar_filename);
+    ASSERT_EQ(reader.members().size(), 2);
+    const auto* const member = reader.find("sparse_file");
+    ASSERT_NE(member, nullptr);
+    EXPECT_TRUE(member->sparse);
+    EXPECT_EQ(member->size, content.size());
+    std::string expanded(member->size, '\0');
+    size_t pos = 0;
+    for (const auto& extent : member->sparse_extents) {
+        reader.content(*member).copy(expanded.data() + extent.offset, extent.size, pos);
+        pos += extent.size;
+    }
+    EXPECT_EQ(pos, reader.content(*member).size());
+    EXPECT_EQ(expanded, content);
+    EXPECT_EQ(reader.content("other_file"), "other content");
+
+    const auto archive = util::read_file(tar_filename);
+    for (const auto piece_size : {1UL, 512UL, 1000UL, archive.size()}) {
+        std::vector<util::streamed_member> members;
+        auto parser = util::create_collecting_parser(members);
+        for (tarxx::size_t offset = 0; offset < archive.size(); offset += piece_size) {
+            parser.parse(archive.data() + offset, std::min(piece_size, archive.size() - offset));
+        }
+        parser.finish();
+        util::streamed_members_match_reader(members, reader);
+    }
+    util::remove_if_exists(dir);
+}
+
+TEST(reader_tests, invalid_archives_throw)
+{
+    const auto tar_filename = util::tar_file_name();
+    util::remove_if_exists(tar_filename);
+    EXPECT_THROW(tarxx::tarreader reader(tar_filename), std::system_error);
+
+    {
+        tarxx::tarfile f(tar_filename, tarxx::tarfile::tar_type::ustar);
+        const tarxx::Platform platform;
+        const auto content = util::create_input_data(2000);
+        f.add_file_streaming();
+        f.add_file_streaming_data(content.data(), static_cast<std::streamsize>(content.size()));
+        f.stream_file_complete("file", 0644, platform.user_id(), platform.group_id(), content.size(), 0);
+    }
+    auto archive = util::read_file(tar_filename);
+
+    const auto write_archive = [&](const std::string& data) {
+        std::ofstream ofs(tar_filename, std::ios::binary | std::ios::trunc);
+        ofs.write(data.data(), static_cast<std::streamsize>(data.size()));
+    };
+
+    write_archive(archive.substr(0, 1024));
+    EXPECT_THROW(tarxx::tarreader reader(tar_filename), std::runtime_error);
+
+    archive[10] = 'x';
+    write_archive(archive);
+    EXPECT_THROW(tarxx::tarreader reader(tar_filename), std::runtime_error);
+
+    // base-256 size of 2^64 - 512, the end of the member wraps around to 0
+    const std::string huge_size = {'\x80', '\0', '\0', '\0', '\xff', '\xff', '\xff', '\xff', '\xff', '\xff', '\xfe', '\0'};
+    archive.replace(124, huge_size.size(), huge_size);
+    archive.replace(148, 8, 8, ' ');
+    unsigned checksum = 0;
+    for (auto i = 0; i < tarxx::BLOCK_SIZE; ++i) checksum += static_cast<unsigned char>(archive[i]);
+    std::snprintf(archive.data() + 148, 7, "%06o", checksum);
+    write_archive(archive);
+    EXPECT_THROW(tarxx::tarreader reader(tar_filename), std::runtime_error);
+
+    write_archive("");
+    const tarxx::tarreader reader(tar_filename);
+    EXPECT_TRUE(reader.members().empty());
+}
+
+TEST_P(reader_tests, stream_parser_matches_reader)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto dir = std::filesystem::temp_directory_path() / "reader_test";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(dir);
+    std::filesystem::create_directories(dir / "sub_folder");
+    static_cast<void>(util::create_test_file(tar_type, dir / "sub_folder" / "large_file", util::create_binary_input_data(1024 * 1024 + 17)));
+    static_cast<void>(util::create_test_file(tar_type, dir / "small_file", "small content"));
+    static_cast<void>(util::create_test_file(tar_type, dir / "empty_file", ""));
+    const auto long_name = "long_name_"s + std::string(150, 'x');
+    static_cast<void>(util::create_test_file(tar_type, dir / long_name, "long name content"));
+    std::filesystem::create_symlink(long_name, dir / "symlink");
+
+    std::string output;
+    ASSERT_EQ(util::execute_with_output("tar --format=gnu -cf " + tar_filename + " -C " + dir.string() + " .", output), 0) << output;
+    const auto archive = util::read_file(tar_filename);
+    const tarxx::tarreader reader(tar_filename);
+
+    for (const auto piece_size : {1UL, 7UL, 511UL, 512UL, 100000UL, archive.size()}) {
+        std::vector<util::streamed_member> members;
+        auto parser = util::create_collecting_parser(members);
+        for (tarxx::size_t pos = 0; pos < archive.size(); pos += piece_size) {
+            parser.parse(archive.data() + pos, std::min(piece_size, archive.size() - pos));
+        }
+        parser.finish();
+        EXPECT_TRUE(parser.is_complete());
+        util::streamed_members_match_reader(members, reader);
+    }
+    util::remove_if_exists(dir);
+}
+
+TEST_P(reader_tests, stream_parser_truncated_archive)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    util::remove_if_exists(tar_filename);
+    const auto content = util::create_binary_input_data(5000);
+
+    {
+        const tarxx::Platform platform;
+        tarxx::tarfile f(tar_filename, tar_type);
+        f.add_file_streaming();
+        f.add_file_streaming_data(content.data(), static_cast<std::streamsize>(content.size()));
+        f.stream_file_complete("file", 0644, platform.user_id(), platform.group_id(), content.size(), 0);
+    }
+
+    const auto archive = util::read_file(tar_filename);
+    std::vector<util::streamed_member> members;
+    auto parser = util::create_collecting_parser(members);
+    parser.parse(archive.data(), tarxx::BLOCK_SIZE + 1000);
+    EXPECT_THROW(parser.finish(), std::runtime_error);
+    ASSERT_EQ(members.size(), 1);
+    EXPECT_EQ(members.front().content, content.substr(0, 1000));
+
+    auto corrupted = archive;
+    corrupted[0] = static_cast<char>(corrupted[0] + 1);
+    auto corrupted_parser = util::create_collecting_parser(members);
+    EXPECT_THROW(corrupted_parser.parse(corrupted.data(), corrupted.size()), std::runtime_error);
+}
+
+INSTANTIATE_TEST_SUITE_P(tar_type_dependent, reader_tests, ::testing::Values(tarxx::tarfile::tar_type::unix_v7, tarxx::tarfile::tar_type::ustar));
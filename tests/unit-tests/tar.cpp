@@ -30,6 +30,7 @@
 #include <util/util.h>
 
 #if defined(__linux)
+#    include <poll.h>
 #    include <sys/socket.h>
 #    include <sys/un.h>
 #    include <thread>
@@ -261,6 +262,100 @@ TEST_P(tar_tests, add_multiple_files_recursive_success)
     std::filesystem::remove_all(dir);
 }
 
+TEST_P(tar_tests, add_multiple_files_recursive_fd_relative_walk)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    util::remove_if_exists(tar_filename);
+
+    tarxx::tarfile tar_file(tar_filename, tar_type);
+    tar_file.set_walk_options({true, false});
+    tar_file.add_from_filesystem_recursive(dir);
+    tar_file.close();
+
+    util::append_folders_from_test_files(test_files, tar_type);
+    util::expect_files_in_tar(tar_filename, test_files, tar_type);
+    std::filesystem::remove_all(dir);
+}
+
+TEST_P(tar_tests, add_multiple_files_recursive_fd_relative_walk_new_name)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    util::remove_if_exists(tar_filename);
+    const std::string new_name = "new_root/with_subfolder";
+
+    tarxx::tarfile tar_file(tar_filename, tar_type);
+    tar_file.set_walk_options({true, true});
+    tar_file.add_from_filesystem_recursive(dir, new_name + "/");
+    tar_file.close();
+
+    util::append_folders_from_test_files(test_files, tar_type);
+    for (auto& file : test_files) file.path.replace(file.path.begin(), file.path.begin() + dir.string().size(), new_name);
+    util::expect_files_in_tar(tar_filename, test_files, tar_type);
+    std::filesystem::remove_all(dir);
+}
+
+TEST_P(tar_tests, fd_relative_walk_in_inode_order)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    util::remove_if_exists(tar_filename);
+
+    tarxx::tarfile tar_file(tar_filename, tar_type);
+    tar_file.set_walk_options({true, true});
+    tar_file.add_from_filesystem_recursive(dir);
+    tar_file.close();
+
+    // the entries of a directory follow each other, its sub directories are walked in between
+    const tarxx::Platform platform;
+    const tarxx::tarreader reader(tar_filename);
+    std::unordered_map<std::string, ino_t> last_ino;
+    for (const auto& member : reader.members()) {
+        std::string name(member.name);
+        if (name.back() == '/') name.pop_back();
+        const auto parent = std::filesystem::path(name).parent_path().string();
+        const auto ino = platform.ino("/" + name);
+        EXPECT_LT(last_ino[parent], ino) << name;
+        last_ino[parent] = ino;
+    }
+    std::filesystem::remove_all(dir);
+}
+
+TEST(tar_tests, walk_directory_matches_iterate_directory)
+{
+    const auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tarxx::tarfile::tar_type::ustar);
+    std::filesystem::create_symlink(test_files.front().path, dir / "symlink");
+    const tarxx::Platform platform;
+
+    std::vector<std::string> iterated;
+    platform.iterateDirectory(dir, [&](const std::string& path) { iterated.push_back(path); });
+
+    std::vector<std::string> walked;
+    platform.walk_directory(dir, false, [&](const tarxx::walk_entry& entry) {
+        walked.emplace_back(entry.path);
+        const auto metadata = platform.metadata(walked.back(), false);
+        ASSERT_TRUE(metadata.has_value());
+        EXPECT_EQ(entry.metadata.type, metadata->type);
+        EXPECT_EQ(entry.metadata.ino, metadata->ino);
+        EXPECT_EQ(entry.metadata.size, metadata->size);
+        if (entry.dir_fd != AT_FDCWD) {
+            EXPECT_EQ(entry.name, std::filesystem::path(walked.back()).filename().string());
+        }
+    });
+    EXPECT_EQ(walked, iterated);
+    std::filesystem::remove_all(dir);
+}
+
+TEST(tar_tests, walk_options_inode_order_requires_fd_relative_walk)
+{
+    tarxx::tarfile f(util::tar_file_name(), tarxx::tarfile::tar_type::ustar);
+    EXPECT_THROW(f.set_walk_options({false, true}), std::invalid_argument);
+}
+
 TEST_P(tar_tests, add_multiple_files_recursive_new_name)
 {
     std::vector<std::string> new_names = {
@@ -294,6 +389,129 @@ TEST_P(tar_tests, add_multiple_files_recursive_new_name)
     }
 }
 
+void tar_validate_prefetched_tree(const tarxx::tarfile::tar_type& tar_type, const tarxx::tarfile::prefetch_options& options, const bool stream_output,
+                                  std::unique_ptr<tarxx::Platform> platform = std::make_unique<tarxx::Platform>(),
+                                  const tarxx::tarfile::header_mode header_mode = tarxx::tarfile::header_mode::rewrite)
+{
+    const auto tar_filename = util::tar_file_name();
+    const auto out_dir = std::filesystem::temp_directory_path() / "prefetch_out";
+    const std::filesystem::path dir(std::filesystem::temp_directory_path() / "prefetch");
+    util::remove_if_exists(dir);
+    util::remove_if_exists(out_dir);
+    util::remove_if_exists(tar_filename);
+    std::filesystem::create_directories(out_dir);
+
+    std::vector<util::file_info> test_files;
+    std::vector<std::string> contents;
+    for (auto i = 0U; i < 40; ++i) {
+        const auto path = dir / ("sub_" + std::to_string(i % 4)) / ("file_" + std::to_string(i));
+        contents.emplace_back(util::create_binary_input_data(i * 1021U));
+        test_files.emplace_back(util::create_test_file(tar_type, path, contents.back()));
+    }
+
+    {
+        std::ofstream ofs(tar_filename, std::ios::binary);
+        auto tar_file = stream_output
+                                ? std::make_unique<tarxx::tarfile>([&ofs](const tarxx::block_t& block, const size_t size) {
+                                      ofs.write(block.data(), size);
+                                  },
+                                                                   tar_type, std::move(platform))
+                                : std::make_unique<tarxx::tarfile>(tar_filename, tar_type, std::move(platform));
+        tar_file->set_prefetch_options(options);
+        tar_file->set_header_mode(header_mode);
+        tar_file->add_from_filesystem_recursive(dir);
+        tar_file->close();
+    }
+
+    util::append_folders_from_test_files(test_files, tar_type);
+    util::file_info root;
+    root.path = dir;
+    util::file_info_set_stat(root, tar_type);
+    test_files.push_back(root);
+    util::expect_files_in_tar(tar_filename, test_files, tar_type);
+
+    util::extract_tar(tar_filename, out_dir);
+    const tarxx::Platform posix_platform;
+    for (auto i = 0U; i < contents.size(); ++i) {
+        EXPECT_EQ(util::read_file(out_dir / posix_platform.relative_path(test_files.at(i).path)), contents.at(i));
+    }
+    util::remove_if_exists(dir);
+    util::remove_if_exists(out_dir);
+}
+
+TEST_P(tar_tests, add_from_filesystem_recursive_prefetching)
+{
+    tarxx::tarfile::prefetch_options options;
+    options.reader_threads = 3;
+    options.queue_depth = 8;
+    tar_validate_prefetched_tree(GetParam(), options, false);
+}
+
+TEST_P(tar_tests, add_from_filesystem_recursive_prefetching_stream_output)
+{
+    tarxx::tarfile::prefetch_options options;
+    options.reader_threads = 2;
+    tar_validate_prefetched_tree(GetParam(), options, true);
+}
+
+TEST_P(tar_tests, add_from_filesystem_recursive_prefetching_memory_limit)
+{
+    tarxx::tarfile::prefetch_options options;
+    options.reader_threads = 4;
+    options.queue_depth = 2;
+    options.memory_limit = 16 * 1024;
+    tar_validate_prefetched_tree(GetParam(), options, false);
+}
+
+#ifdef WITH_IO_URING
+TEST_P(tar_tests, add_from_filesystem_recursive_prefetching_io_uring)
+{
+    for (const auto header_mode : {tarxx::tarfile::header_mode::rewrite, tarxx::tarfile::header_mode::patch, tarxx::tarfile::header_mode::fixed_size}) {
+        for (const auto batch_size : {1U, 7U, 64U}) {
+            tarxx::tarfile::prefetch_options options;
+            options.reader_threads = 2;
+            options.queue_depth = 16;
+            options.read_batch_size = batch_size;
+            tar_validate_prefetched_tree(GetParam(), options, false, std::make_unique<tarxx::io_uring_platform>(4), header_mode);
+        }
+    }
+}
+
+TEST_P(tar_tests, add_from_filesystem_recursive_prefetching_io_uring_stream_output)
+{
+    tarxx::tarfile::prefetch_options options;
+    options.reader_threads = 1;
+    options.read_batch_size = 16;
+    options.memory_limit = 16 * 1024;
+    tar_validate_prefetched_tree(GetParam(), options, true, std::make_unique<tarxx::io_uring_platform>());
+}
+
+TEST(tar_tests, io_uring_output_writer_appends_at_file_position)
+{
+    const auto filename = std::filesystem::temp_directory_path() / "io_uring_output";
+    util::remove_if_exists(filename);
+    const auto prefix = "prefix"s;
+    const auto data = util::create_binary_input_data(1024 * 1024 + 123);
+    {
+        tarxx::file_descriptor fd(::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+        ASSERT_TRUE(fd.is_open());
+        ASSERT_EQ(::write(fd.get(), prefix.data(), prefix.size()), static_cast<ssize_t>(prefix.size()));
+
+        tarxx::io_uring_output_writer writer(fd.get(), 4096, 3);
+        // mixes writes smaller and larger than a buffer
+        for (std::size_t pos = 0; pos < data.size();) {
+            const auto size = std::min<std::size_t>(data.size() - pos, pos % 3 == 0 ? 100 : 10000);
+            writer.write(data.data() + pos, size);
+            pos += size;
+        }
+        writer.sync();
+        EXPECT_EQ(::lseek(fd.get(), 0, SEEK_CUR), static_cast<off_t>(prefix.size() + data.size()));
+    }
+    EXPECT_EQ(util::read_file(filename), prefix + data);
+    util::remove_if_exists(filename);
+}
+#endif
+
 void tar_validate_streaming_data(const unsigned int size, const tarxx::tarfile::tar_type& tar_type)
 {
     const auto tar_filename = util::tar_file_name();
@@ -308,6 +526,27 @@ void tar_validate_streaming_data(const unsigned int size, const tarxx::tarfile::
     util::tar_has_one_file_and_matches(tar_filename, test_file, tar_type);
 }
 
+TEST_P(tar_tests, add_file_streaming_data_in_pieces_content_matches)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto input_data = util::create_binary_input_data(5 * 1024 * 1024 + 77);
+    const auto test_file = util::create_test_file(tar_type, std::filesystem::temp_directory_path() / "content_file", input_data);
+    const auto out_dir = std::filesystem::temp_directory_path() / "content_out";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(out_dir);
+    std::filesystem::create_directories(out_dir);
+
+    tarxx::tarfile tar_file(tar_filename, tar_type);
+    util::add_streaming_data_in_pieces(input_data, test_file, tar_file);
+    tar_file.close();
+
+    util::extract_tar(tar_filename, out_dir);
+    const tarxx::Platform platform;
+    EXPECT_EQ(util::read_file(out_dir / platform.relative_path(test_file.path)), input_data);
+    util::remove_if_exists(out_dir);
+}
+
 TEST_P(tar_tests, add_from_filesystem_different_name)
 {
     const std::vector<std::string> new_names = {
@@ -812,6 +1051,122 @@ TEST_P(tar_tests, add_from_filesystem_file_grows_while_reading)
     expect_disk_file_ge_file_in_tar_and_tar_valid(tar_filename, test_file, tar_type);
 }
 
+// reports a wrong size for regular files, as if the file changed after querying the metadata
+struct size_changing_platform : tarxx::Platform {
+    explicit size_changing_platform(const int64_t size_difference) : size_difference_(size_difference) {}
+
+    [[nodiscard]] std::optional<tarxx::file_metadata> metadata(const std::string& path, bool follow_symlinks) const override
+    {
+        auto metadata = tarxx::Platform::metadata(path, follow_symlinks);
+        if (metadata.has_value() && metadata->type == tarxx::file_type_flag::REGULAR_FILE) {
+            metadata->size = static_cast<tarxx::size_t>(static_cast<int64_t>(metadata->size) + size_difference_);
+        }
+        return metadata;
+    }
+
+private:
+    int64_t size_difference_;
+};
+
+void tar_validate_patched_header(const tarxx::tarfile::tar_type& tar_type, const unsigned long file_size, const int64_t size_difference)
+{
+    const auto tar_filename = util::tar_file_name();
+    const auto input_data = util::create_binary_input_data(file_size);
+    const auto test_file = util::create_test_file(tar_type, std::filesystem::temp_directory_path() / "content_file", input_data);
+    const auto out_dir = std::filesystem::temp_directory_path() / "content_out";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(out_dir);
+    std::filesystem::create_directories(out_dir);
+
+    tarxx::tarfile f(tar_filename, tar_type, std::make_unique<size_changing_platform>(size_difference));
+    f.set_header_mode(tarxx::tarfile::header_mode::patch);
+    f.add_from_filesystem(test_file.path);
+    f.close();
+
+    util::tar_has_one_file_and_matches(tar_filename, test_file, tar_type);
+    util::extract_tar(tar_filename, out_dir);
+    const tarxx::Platform platform;
+    EXPECT_EQ(util::read_file(out_dir / platform.relative_path(test_file.path)), input_data);
+    util::remove_if_exists(out_dir);
+}
+
+TEST_P(tar_tests, header_mode_patch_size_unchanged)
+{
+    tar_validate_patched_header(GetParam(), 10 * 1024 + 3, 0);
+}
+
+TEST_P(tar_tests, header_mode_patch_buffered_header)
+{
+    tar_validate_patched_header(GetParam(), 10 * 1024 + 3, 1000);
+    tar_validate_patched_header(GetParam(), 10 * 1024 + 3, -1000);
+}
+
+TEST_P(tar_tests, header_mode_patch_written_header)
+{
+    tar_validate_patched_header(GetParam(), 3 * 1024 * 1024 + 123, 4096);
+    tar_validate_patched_header(GetParam(), 3 * 1024 * 1024 + 123, -4096);
+}
+
+TEST_P(tar_tests, header_mode_patch_multiple_files_recursive)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    util::remove_if_exists(tar_filename);
+
+    tarxx::tarfile tar_file(tar_filename, tar_type);
+    tar_file.set_header_mode(tarxx::tarfile::header_mode::patch);
+    tar_file.add_from_filesystem_recursive(dir);
+    tar_file.close();
+
+    util::append_folders_from_test_files(test_files, tar_type);
+
+    util::expect_files_in_tar(tar_filename, test_files, tar_type);
+    std::filesystem::remove_all(dir);
+}
+
+TEST_P(tar_tests, header_mode_fixed_size_multiple_files_recursive)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    util::remove_if_exists(tar_filename);
+
+    tarxx::tarfile tar_file(tar_filename, tar_type);
+    tar_file.set_header_mode(tarxx::tarfile::header_mode::fixed_size);
+    tar_file.add_from_filesystem_recursive(dir);
+    tar_file.close();
+
+    util::append_folders_from_test_files(test_files, tar_type);
+
+    util::expect_files_in_tar(tar_filename, test_files, tar_type);
+    std::filesystem::remove_all(dir);
+}
+
+TEST_P(tar_tests, header_mode_fixed_size_file_shrinks_while_reading)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    util::remove_if_exists(tar_filename);
+
+    tarxx::tarfile tar_file(tar_filename, tar_type);
+    tar_file.set_header_mode(tarxx::tarfile::header_mode::fixed_size);
+    const auto test_file = util::shrink_source_file_during_tar_creation(tar_file, tar_type);
+    expect_disk_file_le_file_in_tar_and_tar_valid(tar_filename, test_file, tar_type);
+}
+
+TEST_P(tar_tests, header_mode_patch_file_grows_while_reading)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    util::remove_if_exists(tar_filename);
+
+    tarxx::tarfile tar_file(tar_filename, tar_type);
+    tar_file.set_header_mode(tarxx::tarfile::header_mode::patch);
+    const auto test_file = util::grow_source_file_during_tar_creation(tar_file, tar_type);
+    expect_disk_file_ge_file_in_tar_and_tar_valid(tar_filename, test_file, tar_type);
+}
+
 TEST_P(tar_tests, add_from_filesystem_file_grows_while_reading_streaming_output)
 {
     const auto tar_type = GetParam();
@@ -953,6 +1308,183 @@ TEST_P(tar_tests, add_mutliple_of_block_size_from_filesystem)
     util::expect_files_in_tar(tar_filename, {test_file0, test_file1}, tar_type);
 }
 
+TEST_P(tar_tests, add_from_filesystem_content_matches_after_extraction)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto input_data = util::create_binary_input_data(3 * 1024 * 1024 + 123);
+    const auto test_file = util::create_test_file(tar_type, std::filesystem::temp_directory_path() / "content_file", input_data);
+    const auto out_dir = std::filesystem::temp_directory_path() / "content_out";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(out_dir);
+    std::filesystem::create_directories(out_dir);
+
+    tarxx::tarfile f(tar_filename, tar_type);
+    f.add_from_filesystem(test_file.path);
+    f.close();
+
+    EXPECT_EQ(std::filesystem::file_size(tar_filename) % tarxx::BLOCK_SIZE, 0);
+    util::extract_tar(tar_filename, out_dir);
+    const tarxx::Platform platform;
+    EXPECT_EQ(util::read_file(out_dir / platform.relative_path(test_file.path)), input_data);
+    util::remove_if_exists(out_dir);
+}
+
+TEST_P(tar_tests, add_from_filesystem_chunked_stream_output)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto input_data = util::create_binary_input_data(3 * 1024 * 1024 + 123);
+    const auto test_file = util::create_test_file(tar_type, std::filesystem::temp_directory_path() / "content_file", input_data);
+    const auto out_dir = std::filesystem::temp_directory_path() / "content_out";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(out_dir);
+    std::filesystem::create_directories(out_dir);
+
+    constexpr size_t chunk_size = 256 * 1024;
+    std::vector<size_t> chunk_sizes;
+    std::ofstream ofs(tar_filename, std::ios::binary);
+    tarxx::tarfile f([&](const char* data, size_t size) {
+        chunk_sizes.emplace_back(size);
+        ofs.write(data, static_cast<std::streamsize>(size));
+    },
+                     chunk_size, tar_type);
+    f.add_from_filesystem(test_file.path);
+    f.close();
+    ofs.close();
+
+    ASSERT_FALSE(chunk_sizes.empty());
+    for (auto i = 0U; i + 1 < chunk_sizes.size(); ++i) {
+        EXPECT_EQ(chunk_sizes[i], chunk_size);
+    }
+    EXPECT_GT(chunk_sizes.back(), 0);
+    EXPECT_LE(chunk_sizes.back(), chunk_size);
+
+    util::extract_tar(tar_filename, out_dir);
+    const tarxx::Platform platform;
+    EXPECT_EQ(util::read_file(out_dir / platform.relative_path(test_file.path)), input_data);
+    util::remove_if_exists(out_dir);
+}
+
+TEST_P(tar_tests, chunked_stream_output_zero_chunk_size_throws)
+{
+    const auto tar_type = GetParam();
+    EXPECT_THROW(tarxx::tarfile f([](const char*, size_t) {}, 0, tar_type), std::invalid_argument);
+}
+
+TEST_P(tar_tests, output_sinks_write_the_same_archive_as_file_output)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto sink_filename = tar_filename + ".sink";
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    const auto large_file = util::create_test_file(tar_type, dir / "large_file", util::create_binary_input_data(3 * 1024 * 1024 + 123));
+    const auto streamed_content = util::create_binary_input_data(700 * 1024 + 17);
+    const tarxx::Platform platform;
+
+    const auto add_members = [&](tarxx::tarfile& f) {
+        f.add_from_filesystem_recursive(dir);
+        f.add_file_streaming();
+        f.add_file_streaming_data(streamed_content.data(), static_cast<std::streamsize>(streamed_content.size()));
+        f.stream_file_complete("streamed_file", 0644, platform.user_id(), platform.group_id(), streamed_content.size(), 0);
+    };
+
+    for (const auto header_mode : {tarxx::tarfile::header_mode::rewrite, tarxx::tarfile::header_mode::patch, tarxx::tarfile::header_mode::fixed_size}) {
+        util::remove_if_exists(tar_filename);
+        {
+            tarxx::tarfile f(tar_filename, tar_type);
+            f.set_header_mode(header_mode);
+            add_members(f);
+        }
+        const auto expected = util::read_file(tar_filename);
+
+        std::vector<char> memory(expected.size());
+        std::string callback_archive;
+        std::vector<std::unique_ptr<tarxx::output_sink>> sinks;
+        sinks.emplace_back(std::make_unique<tarxx::fd_output_sink>(tarxx::file_descriptor(::open(sink_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644))));
+        sinks.emplace_back(std::make_unique<tarxx::memory_output_sink>(memory.data(), memory.size(), tarxx::output_buffer_options {4096, 4096}));
+        sinks.emplace_back(std::make_unique<tarxx::callback_output_sink>([&callback_archive](const char* data, const tarxx::size_t size) {
+            callback_archive.append(data, size);
+        }));
+
+        for (auto& sink : sinks) {
+            const auto* const memory_sink = dynamic_cast<const tarxx::memory_output_sink*>(sink.get());
+            const auto can_patch = sink->can_patch();
+            tarxx::tarfile f(std::move(sink), tar_type);
+            f.set_header_mode(header_mode);
+            add_members(f);
+            f.close();
+
+            if (memory_sink != nullptr) {
+                EXPECT_EQ(memory_sink->size(), expected.size());
+                EXPECT_EQ(std::string(memory.data(), memory.size()), expected);
+            } else if (can_patch) {
+                EXPECT_EQ(util::read_file(sink_filename), expected);
+            } else if (header_mode == tarxx::tarfile::header_mode::fixed_size) {
+                EXPECT_EQ(callback_archive, expected);
+            } else {
+                // sinks which can't patch store headers of files with the size from their metadata
+                std::ofstream(sink_filename, std::ios::binary | std::ios::trunc) << callback_archive;
+                const tarxx::tarreader reader(sink_filename);
+                EXPECT_EQ(reader.content(platform.relative_path(large_file.path)), util::read_file(large_file.path));
+                EXPECT_EQ(reader.content("streamed_file"), streamed_content);
+            }
+        }
+    }
+    util::remove_if_exists(sink_filename);
+    util::remove_if_exists(dir);
+}
+
+TEST_P(tar_tests, output_sink_holds_back_streamed_files_if_it_cant_patch)
+{
+    const auto tar_type = GetParam();
+    const auto streamed_content = util::create_binary_input_data(5000);
+    int pipe_fds[2];
+    ASSERT_EQ(::pipe(pipe_fds), 0);
+    const tarxx::file_descriptor read_end(pipe_fds[0]);
+    ::fcntl(pipe_fds[1], F_SETPIPE_SZ, 1024 * 1024);
+
+    auto sink = std::make_unique<tarxx::fd_output_sink>(tarxx::file_descriptor(pipe_fds[1]));
+    EXPECT_FALSE(sink->can_patch());
+    {
+        tarxx::tarfile f(std::move(sink), tar_type);
+        f.add_file_streaming();
+        f.add_file_streaming_data(streamed_content.data(), static_cast<std::streamsize>(streamed_content.size()));
+        // nothing is passed on until the size of the member is known
+        pollfd poll_fd {pipe_fds[0], POLLIN, 0};
+        EXPECT_EQ(::poll(&poll_fd, 1, 0), 0);
+        f.stream_file_complete("streamed_file", 0644, 0, 0, streamed_content.size(), 0);
+    }
+
+    std::string archive(tarxx::BLOCK_SIZE * 16, '\0');
+    size_t read_bytes = 0;
+    while (read_bytes < archive.size()) {
+        const auto result = ::read(read_end.get(), archive.data() + read_bytes, archive.size() - read_bytes);
+        if (result <= 0) break;
+        read_bytes += result;
+    }
+    // header, 10 content blocks and the two end of archive blocks
+    ASSERT_EQ(read_bytes, 13 * tarxx::BLOCK_SIZE);
+    archive.resize(read_bytes);
+    std::string content;
+    tarxx::tar_stream_parser parser([](const tarxx::tar_member& member) { EXPECT_EQ(member.name, "streamed_file"); },
+                                    [&content](const tarxx::tar_member&, const char* data, const tarxx::size_t size) { content.append(data, size); });
+    parser.parse(archive.data(), archive.size());
+    EXPECT_TRUE(parser.is_complete());
+    EXPECT_EQ(content, streamed_content);
+}
+
+TEST_P(tar_tests, memory_output_sink_overflow_throws)
+{
+    const auto tar_type = GetParam();
+    std::vector<char> memory(tarxx::BLOCK_SIZE);
+    tarxx::tarfile f(std::make_unique<tarxx::memory_output_sink>(memory.data(), memory.size(), tarxx::output_buffer_options {tarxx::BLOCK_SIZE}), tar_type);
+    f.add_directory("folder", 0755, 0, 0, 0);
+    EXPECT_THROW(f.add_directory("second_folder", 0755, 0, 0, 0), std::length_error);
+    EXPECT_THROW(tarxx::tarfile(std::unique_ptr<tarxx::output_sink>(), tar_type), std::invalid_argument);
+    EXPECT_THROW(tarxx::callback_output_sink(nullptr), std::invalid_argument);
+}
+
 TEST_P(tar_tests, add_directory_via_streaming)
 {
     const auto tar_type = GetParam();
@@ -1103,16 +1635,85 @@ TEST(tar_tests, errno_exception)
     EXPECT_EQ(e.code().message(), msg);
 }
 
-TEST(tar_tests, add_char_special_device_from_filesystem)
+TEST(tar_tests, header_encoder_octal_matches_stream_formatting)
 {
-    if (util::tar_version() != util::tar_version::gnu) {
-        return;
+    const auto reference = [](const unsigned long long value, const unsigned width) {
+        std::stringstream sstr;
+        sstr << std::oct << std::setfill('0') << std::setw(static_cast<int>(width)) << value;
+        auto str = sstr.str();
+        if (str.size() > width) str = str.substr(str.size() - width);
+        return str;
+    };
+
+    const std::vector<unsigned long long> values = {0, 1, 7, 8, 0755, 01777, 0777777, 07777777, 077777777777, 0100000000000, 1700000000, std::numeric_limits<unsigned long long>::max()};
+    for (const auto value : values) {
+        for (const auto width : {1U, 2U, 6U, 7U, 8U, 11U, 12U}) {
+            tarxx::block_t block {};
+            tarxx::header_encoder::write_octal(block, value, 3, width);
+            EXPECT_EQ(std::string(block.data() + 3, width), reference(value, width)) << value << " width " << width;
+            EXPECT_EQ(block[3 + width], 0);
+        }
     }
-    const auto tar_type = tarxx::tarfile::tar_type::ustar;
-    const auto tar_filename = util::tar_file_name();
-    tarxx::tarfile f(tar_filename, tar_type);
-    util::file_info test_file {
-            .path = "/dev/random"};
+}
+
+TEST(tar_tests, header_encoder_checksum_matches_byte_sum)
+{
+    tarxx::block_t block {};
+    for (auto i = 0U; i < block.size(); ++i) {
+        block[i] = static_cast<char>((i * 7919U) % 256U);
+    }
+
+    unsigned expected = 0;
+    for (const unsigned char c : block) expected += c;
+    EXPECT_EQ(tarxx::header_encoder::checksum(block), expected);
+
+    block.fill(static_cast<char>(0xFF));
+    EXPECT_EQ(tarxx::header_encoder::checksum(block), 0xFFU * tarxx::BLOCK_SIZE);
+}
+
+TEST(tar_tests, metadata_matches_single_queries)
+{
+    const auto tar_type = tarxx::tarfile::tar_type::ustar;
+    const auto test_file = util::create_test_file(tar_type);
+    const tarxx::Platform platform;
+
+    const auto metadata = platform.metadata(test_file.path, false);
+    ASSERT_TRUE(metadata.has_value());
+    EXPECT_EQ(metadata->type, platform.type_flag(test_file.path));
+    EXPECT_EQ(metadata->mode, platform.mode(test_file.path));
+    EXPECT_EQ(metadata->uid, platform.file_owner(test_file.path));
+    EXPECT_EQ(metadata->gid, platform.file_group(test_file.path));
+    EXPECT_EQ(metadata->size, platform.file_size(test_file.path));
+    EXPECT_EQ(metadata->ino, platform.ino(test_file.path));
+    EXPECT_NEAR(metadata->mod_time, platform.mod_time(test_file.path), 1);
+
+    EXPECT_FALSE(platform.metadata(test_file.path + "-does-not-exist", false).has_value());
+}
+
+TEST(tar_tests, metadata_of_symlink)
+{
+    const auto tar_type = tarxx::tarfile::tar_type::ustar;
+    const auto test_file = util::create_test_file(tar_type);
+    const auto link_location = std::filesystem::temp_directory_path() / "metadata_symlink";
+    util::remove_if_exists(link_location);
+    std::filesystem::create_symlink(test_file.path, link_location);
+    const tarxx::Platform platform;
+
+    EXPECT_EQ(platform.metadata(link_location, false)->type, tarxx::file_type_flag::SYMBOLIC_LINK);
+    EXPECT_EQ(platform.metadata(link_location, true)->type, tarxx::file_type_flag::REGULAR_FILE);
+    util::remove_if_exists(link_location);
+}
+
+TEST(tar_tests, add_char_special_device_from_filesystem)
+{
+    if (util::tar_version() != util::tar_version::gnu) {
+        return;
+    }
+    const auto tar_type = tarxx::tarfile::tar_type::ustar;
+    const auto tar_filename = util::tar_file_name();
+    tarxx::tarfile f(tar_filename, tar_type);
+    util::file_info test_file {
+            .path = "/dev/random"};
     util::file_info_set_stat(test_file, tar_type);
     std::vector<util::file_info> expected_files = {
             test_file};
@@ -1220,4 +1821,951 @@ TEST_P(tar_tests, add_socket)
 
 #endif
 
+TEST_P(tar_tests, index_file_matches_archive)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto index_filename = tar_filename + ".idx";
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    const auto streamed_content = util::create_binary_input_data(3000);
+    const tarxx::Platform platform;
+
+    for (const auto header_mode : {tarxx::tarfile::header_mode::rewrite, tarxx::tarfile::header_mode::patch, tarxx::tarfile::header_mode::fixed_size}) {
+        util::remove_if_exists(tar_filename);
+        util::remove_if_exists(index_filename);
+        {
+            tarxx::tarfile f(tar_filename, tar_type);
+            f.set_header_mode(header_mode);
+            f.set_index_file(index_filename);
+            f.add_from_filesystem_recursive(dir);
+            f.add_file_streaming();
+            f.add_file_streaming_data(streamed_content.data(), static_cast<std::streamsize>(streamed_content.size()));
+            f.stream_file_complete("streamed_file", 0644, platform.user_id(), platform.group_id(), streamed_content.size(), 0);
+            f.add_symlink("streamed_file", "symlink", platform.user_id(), platform.group_id(), 0);
+        }
+
+        const tarxx::tarreader reader(tar_filename);
+        const tarxx::tar_index index(index_filename);
+        util::index_matches_reader(index, reader);
+        for (const auto& entry : index.entries()) {
+            EXPECT_EQ(entry.block_offset, entry.header_offset);
+            EXPECT_EQ(entry.block_tar_offset, entry.header_offset);
+        }
+        ASSERT_NE(index.find("streamed_file"), nullptr);
+        EXPECT_EQ(index.find("streamed_file")->size, streamed_content.size());
+    }
+    util::remove_if_exists(index_filename);
+    util::remove_if_exists(dir);
+}
+
+TEST_P(tar_tests, index_file_with_stream_output)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto index_filename = tar_filename + ".idx";
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(index_filename);
+
+    {
+        std::ofstream ofs(tar_filename, std::ios::binary);
+        tarxx::tarfile f([&ofs](const tarxx::block_t& data, const tarxx::size_t size) {
+            ofs.write(data.data(), static_cast<std::streamsize>(size));
+        },
+                         tar_type);
+        f.set_index_file(index_filename);
+        f.add_from_filesystem_recursive(dir);
+        f.close();
+    }
+
+    const tarxx::tarreader reader(tar_filename);
+    const tarxx::tar_index index(index_filename);
+    util::index_matches_reader(index, reader);
+    EXPECT_EQ(index.find("not_in_archive"), nullptr);
+    util::remove_if_exists(index_filename);
+    util::remove_if_exists(dir);
+}
+
+TEST_P(tar_tests, index_file_set_after_adding_members_throws)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto index_filename = tar_filename + ".idx";
+    const auto test_file = util::create_test_file(tar_type);
+    util::remove_if_exists(tar_filename);
+
+    tarxx::tarfile f(tar_filename, tar_type);
+    f.add_from_filesystem(test_file.path);
+    EXPECT_THROW(f.set_index_file(index_filename), std::logic_error);
+    EXPECT_THROW(tarxx::tar_index(test_file.path), std::runtime_error);
+}
+
+TEST_P(tar_tests, tar_generator_matches_fixed_size_file_output)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    util::create_test_file(tar_type, dir / "large_file", util::create_binary_input_data(1024 * 1024 + 3));
+    const auto single_file = util::create_test_file(tar_type, std::filesystem::temp_directory_path() / "single_file", util::create_binary_input_data(700));
+    util::remove_if_exists(tar_filename);
+    {
+        tarxx::tarfile f(tar_filename, tar_type);
+        f.set_header_mode(tarxx::tarfile::header_mode::fixed_size);
+        f.add_from_filesystem_recursive(dir);
+        f.add_from_filesystem_recursive(dir, std::string("renamed/"));
+        f.add_from_filesystem_recursive(single_file.path);
+    }
+    const auto expected = util::read_file(tar_filename);
+
+    for (const auto chunk_size : {tarxx::size_t {1}, tarxx::size_t {tarxx::BLOCK_SIZE}, tarxx::size_t {100003}, tarxx::size_t {4 * 1024 * 1024}}) {
+        tarxx::tar_generator generator(tar_type);
+        generator.add_from_filesystem_recursive(dir);
+        generator.add_from_filesystem_recursive(dir, std::string("renamed/"));
+        generator.add_from_filesystem_recursive(single_file.path);
+
+        std::string archive;
+        std::vector<char> buffer(chunk_size);
+        while (true) {
+            const auto size = generator.next_chunk(buffer.data(), buffer.size());
+            if (size == 0) break;
+            // only the last chunk may be smaller
+            EXPECT_TRUE(size == chunk_size || archive.size() + size == expected.size());
+            archive.append(buffer.data(), size);
+        }
+        EXPECT_TRUE(generator.done());
+        EXPECT_EQ(generator.next_chunk(buffer.data(), buffer.size()), 0);
+        EXPECT_THROW(generator.add_from_filesystem_recursive(dir), std::logic_error);
+        EXPECT_EQ(archive, expected);
+    }
+    util::remove_if_exists(single_file.path);
+    util::remove_if_exists(dir);
+}
+
+TEST_P(tar_tests, tar_generator_fills_up_files_which_shrank)
+{
+    const auto tar_type = GetParam();
+    const auto test_file = util::create_test_file(tar_type, std::filesystem::temp_directory_path() / "shrinking_file", util::create_binary_input_data(5000));
+    tarxx::tar_generator generator(tar_type);
+    generator.add_from_filesystem_recursive(test_file.path);
+
+    // the header is passed on before the content is read
+    std::vector<char> buffer(tarxx::BLOCK_SIZE);
+    ASSERT_EQ(generator.next_chunk(buffer.data(), buffer.size()), tarxx::BLOCK_SIZE);
+    std::filesystem::resize_file(test_file.path, 1000);
+
+    std::string content;
+    while (true) {
+        const auto size = generator.next_chunk(buffer.data(), buffer.size());
+        if (size == 0) break;
+        content.append(buffer.data(), size);
+    }
+    ASSERT_EQ(content.size(), 10 * tarxx::BLOCK_SIZE + 2 * tarxx::BLOCK_SIZE);
+    EXPECT_EQ(content.substr(0, 1000), util::read_file(test_file.path));
+    EXPECT_EQ(content.find_first_not_of('\0', 1000), std::string::npos);
+    util::remove_if_exists(test_file.path);
+}
+
+TEST_P(tar_tests, tar_planner_predicts_the_archive_layout)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    util::create_test_file(tar_type, dir / "large_file", util::create_binary_input_data(1024 * 1024 + 3));
+    std::filesystem::create_hard_link(dir / "large_file", dir / "sub_folder" / "hard_link");
+    std::filesystem::create_symlink("large_file", dir / "symlink");
+    // left out of unix v7 archives
+    mkfifo((dir / "fifo").c_str(), 0666);
+    util::remove_if_exists(tar_filename);
+
+    tarxx::tar_planner planner(tar_type);
+    planner.add_from_filesystem_recursive(dir);
+    planner.add_from_filesystem_recursive(dir, std::string("renamed"));
+    const auto& plan = planner.plan();
+    EXPECT_THROW(planner.add_from_filesystem(dir), std::logic_error);
+
+    {
+        tarxx::tarfile f(tar_filename, tar_type);
+        f.preallocate(plan.size);
+        EXPECT_GE(util::allocated_size(tar_filename), plan.size);
+        EXPECT_EQ(std::filesystem::file_size(tar_filename), 0);
+        f.add_from_filesystem_recursive(dir);
+        f.add_from_filesystem_recursive(dir, std::string("renamed"));
+    }
+
+    EXPECT_EQ(std::filesystem::file_size(tar_filename), plan.size);
+    const tarxx::tarreader reader(tar_filename);
+    ASSERT_EQ(plan.members.size(), reader.members().size());
+    for (auto i = 0U; i < plan.members.size(); ++i) {
+        const auto& planned = plan.members[i];
+        const auto& member = reader.members()[i];
+        EXPECT_EQ(planned.header_offset + tarxx::BLOCK_SIZE, member.offset);
+        EXPECT_EQ(planned.content_offset, member.offset);
+        EXPECT_EQ(planned.size, member.size);
+        EXPECT_EQ(planned.name, member.name);
+    }
+    util::remove_if_exists(dir);
+}
+
+TEST_P(tar_tests, checksums_are_computed_while_writing)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    util::create_test_file(tar_type, dir / "large_file", util::create_binary_input_data(1024 * 1024 + 3));
+    const auto abc = util::create_test_file(tar_type, dir / "abc", "abc");
+
+    for (const auto algorithm : {tarxx::checksum_algorithm::sha256, tarxx::checksum_algorithm::xxh64}) {
+        for (const auto header_mode : {tarxx::tarfile::header_mode::rewrite, tarxx::tarfile::header_mode::patch, tarxx::tarfile::header_mode::fixed_size}) {
+            util::remove_if_exists(tar_filename);
+            std::vector<tarxx::member_checksum> checksums;
+            {
+                tarxx::tarfile f(tar_filename, tar_type);
+                f.set_header_mode(header_mode);
+                EXPECT_THROW(f.add_checksum_manifest("MANIFEST"), std::logic_error);
+                f.set_checksum_options({true, algorithm});
+                f.add_from_filesystem_recursive(dir);
+                const std::string content = "in memory";
+                f.add_file("in_memory", 0644, 0, 0, 0, content.data(), content.size());
+                f.add_file_streaming();
+                f.add_file_streaming_data(content.data(), static_cast<std::streamsize>(content.size()));
+                f.stream_file_complete("streamed", 0644, 0, 0, content.size(), 0);
+                checksums = f.checksums();
+                f.add_checksum_manifest("MANIFEST");
+            }
+
+            const tarxx::tarreader reader(tar_filename);
+            std::string manifest;
+            size_t index = 0;
+            for (const auto& member : reader.members()) {
+                if (member.type != tarxx::file_type_flag::REGULAR_FILE || member.name == "MANIFEST") continue;
+                ASSERT_LT(index, checksums.size()) << member.name;
+                const auto& checksum = checksums[index++];
+                const auto content = reader.content(member);
+                tarxx::content_digest digest(algorithm);
+                digest.update(content.data(), content.size());
+                EXPECT_EQ(checksum.name, member.name);
+                EXPECT_EQ(checksum.digest, digest.hex_digest()) << member.name;
+                manifest += checksum.digest + "  " + checksum.name + "\n";
+            }
+            EXPECT_EQ(index, checksums.size());
+            EXPECT_EQ(reader.content("MANIFEST"), manifest);
+
+            const std::string abc_name(tarxx::Platform().relative_path(abc.path));
+            const auto abc_digest = algorithm == tarxx::checksum_algorithm::sha256
+                                            ? "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"
+                                            : "44bc2cf5ad770999";
+            EXPECT_NE(manifest.find(abc_digest + "  "s + abc_name + "\n"), std::string::npos);
+        }
+    }
+    util::remove_if_exists(dir);
+}
+
+TEST(tar_tests, metadata_cache_is_shared_between_platforms)
+{
+    auto cache = std::make_shared<tarxx::metadata_cache>();
+    auto lookups = 0;
+    const auto lookup = [&lookups](const uid_t uid) -> std::optional<std::string> {
+        ++lookups;
+        return "user_" + std::to_string(uid);
+    };
+    EXPECT_EQ(cache->user_name(12345, lookup), "user_12345");
+    EXPECT_EQ(cache->user_name(12345, lookup), "user_12345");
+    EXPECT_EQ(lookups, 1);
+
+    tarxx::Platform first(cache);
+    tarxx::Platform second(cache);
+    EXPECT_EQ(first.user_name(12345), "user_12345");
+    EXPECT_EQ(second.user_name(12345), "user_12345");
+    EXPECT_EQ(first.group_name(second.group_id()), tarxx::Platform().group_name(second.group_id()));
+
+    tarxx::metadata_cache_options options;
+    options.name_ttl = std::chrono::seconds(0);
+    tarxx::metadata_cache expiring(options);
+    EXPECT_EQ(expiring.user_name(12345, lookup), "user_12345");
+    EXPECT_EQ(expiring.user_name(12345, lookup), "user_12345");
+    EXPECT_EQ(lookups, 3);
+
+    // unknown ids aren't cached, they may be added to the name service
+    auto unknown_lookups = 0;
+    const auto unknown = [&unknown_lookups](const gid_t) -> std::optional<std::string> {
+        ++unknown_lookups;
+        return std::nullopt;
+    };
+    EXPECT_EQ(cache->group_name(54321, unknown), std::nullopt);
+    EXPECT_EQ(cache->group_name(54321, unknown), std::nullopt);
+    EXPECT_EQ(unknown_lookups, 2);
+}
+
+TEST(tar_tests, metadata_cache_serves_passwd_ids)
+{
+    auto cache = std::make_shared<tarxx::metadata_cache>();
+    const tarxx::Platform uncached;
+    const tarxx::Platform platform(cache);
+    EXPECT_EQ(platform.user_id(), uncached.user_id());
+    EXPECT_EQ(platform.group_id(), uncached.group_id());
+
+    // the ids of the passwd entry of the effective user, not the effective ids
+    const auto* const pwd = getpwuid(geteuid());
+    EXPECT_EQ(uncached.user_id(), pwd != nullptr ? pwd->pw_uid : std::numeric_limits<uid_t>::max());
+    EXPECT_EQ(uncached.group_id(), pwd != nullptr ? pwd->pw_gid : std::numeric_limits<gid_t>::max());
+
+    auto lookups = 0;
+    const auto lookup = [&lookups](const uid_t uid) -> std::optional<tarxx::metadata_cache::account_ids> {
+        ++lookups;
+        return tarxx::metadata_cache::account_ids {uid, 4321};
+    };
+    EXPECT_EQ(cache->passwd_ids(1234, lookup)->gid, 4321);
+    EXPECT_EQ(cache->passwd_ids(1234, lookup)->uid, 1234);
+    EXPECT_EQ(lookups, 1);
+}
+
+TEST(tar_tests, metadata_cache_keeps_metadata_within_its_ttl)
+{
+    const auto tar_type = tarxx::tarfile::tar_type::ustar;
+    const auto test_file = util::create_test_file(tar_type);
+    const auto size = std::filesystem::file_size(test_file.path);
+
+    tarxx::metadata_cache_options options;
+    options.metadata_ttl = std::chrono::hours(1);
+    auto cache = std::make_shared<tarxx::metadata_cache>(options);
+    const tarxx::Platform platform(cache);
+    EXPECT_EQ(platform.metadata(test_file.path, false)->size, size);
+
+    std::ofstream(test_file.path, std::ios::app) << "appended";
+    EXPECT_EQ(platform.metadata(test_file.path, false)->size, size);
+    EXPECT_EQ(tarxx::Platform(std::make_shared<tarxx::metadata_cache>()).metadata(test_file.path, false)->size, size + 8);
+    cache->clear();
+    EXPECT_EQ(platform.metadata(test_file.path, false)->size, size + 8);
+
+    // tarfiles using the cache archive the metadata it hands out, fixed size headers keep its size
+    const auto tar_filename = util::tar_file_name();
+    util::remove_if_exists(tar_filename);
+    std::ofstream(test_file.path, std::ios::app) << "appended";
+    {
+        tarxx::tarfile f(tar_filename, tar_type, std::make_unique<tarxx::Platform>(cache));
+        f.set_header_mode(tarxx::tarfile::header_mode::fixed_size);
+        f.add_from_filesystem(test_file.path);
+    }
+    const tarxx::tarreader reader(tar_filename);
+    ASSERT_EQ(reader.members().size(), 1);
+    EXPECT_EQ(reader.members().front().size, size + 8);
+    util::remove_if_exists(test_file.path);
+}
+
+TEST_P(tar_tests, concurrent_producers_add_files)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    util::remove_if_exists(tar_filename);
+    constexpr auto producer_count = 8;
+    constexpr auto files_per_producer = 200;
+    const auto content = [](const int producer, const int file) {
+        return util::create_binary_input_data(static_cast<unsigned long>(producer * 1000 + file * 37 % 3000));
+    };
+
+    {
+        tarxx::tarfile f(tar_filename, tar_type);
+        tarxx::concurrent_tarfile concurrent(f, {16, 64 * 1024, 4});
+        std::vector<std::thread> producers;
+        for (auto producer = 0; producer < producer_count; ++producer) {
+            producers.emplace_back([&, producer]() {
+                for (auto file = 0; file < files_per_producer; ++file) {
+                    const auto data = content(producer, file);
+                    tarxx::memory_file added {"producer_" + std::to_string(producer) + "/file_" + std::to_string(file), 0644, 0, 0, 0, {data.begin(), data.end()}};
+                    concurrent.add_file(std::move(added));
+                    if (file == files_per_producer / 2) concurrent.flush();
+                }
+            });
+        }
+        for (auto& producer : producers) producer.join();
+        concurrent.close();
+        EXPECT_FALSE(f.is_open());
+        EXPECT_THROW(concurrent.add_file({"too_late"}), std::logic_error);
+    }
+
+    const tarxx::tarreader reader(tar_filename);
+    ASSERT_EQ(reader.members().size(), producer_count * files_per_producer);
+    std::vector<int> next_file(producer_count, 0);
+    for (const auto& member : reader.members()) {
+        const auto name = std::string(member.name);
+        const auto producer = std::stoi(name.substr(name.find('_') + 1));
+        const auto file = std::stoi(name.substr(name.rfind('_') + 1));
+        // files of one producer keep their order
+        EXPECT_EQ(file, next_file[producer]++);
+        EXPECT_EQ(reader.content(member), content(producer, file));
+    }
+}
+
+TEST_P(tar_tests, concurrent_tarfile_flush_waits_for_files_added_before)
+{
+    const auto tar_type = GetParam();
+    tarxx::size_t archived = 0;
+    tarxx::tarfile f([&archived](const tarxx::block_t&, const tarxx::size_t size) { archived += size; }, tar_type);
+    tarxx::concurrent_tarfile concurrent(f);
+    for (auto i = 0; i < 10; ++i) {
+        concurrent.add_file({"file_" + std::to_string(i), 0644, 0, 0, 0, std::vector<char>(1000, 'x')});
+    }
+    concurrent.flush();
+    // each file has a header and two content blocks
+    EXPECT_EQ(archived, 10 * 3 * tarxx::BLOCK_SIZE);
+    concurrent.close();
+    EXPECT_EQ(archived, 32 * tarxx::BLOCK_SIZE);
+}
+
+TEST_P(tar_tests, concurrent_tarfile_rethrows_errors_of_the_writer)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    tarxx::tarfile f(tar_filename, tar_type);
+    tarxx::concurrent_tarfile concurrent(f);
+    concurrent.add_file({"file"});
+    concurrent.add_file({"file"});
+    EXPECT_THROW(concurrent.flush(), std::logic_error);
+    EXPECT_THROW(concurrent.add_file({"other_file"}), std::logic_error);
+    EXPECT_THROW(concurrent.close(), std::logic_error);
+    EXPECT_THROW(tarxx::concurrent_tarfile(f, {0}), std::invalid_argument);
+}
+
+TEST_P(tar_tests, incremental_archive_contains_only_changed_entries)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto snapshot_filename = tar_filename + ".snap";
+    const auto dir = std::filesystem::temp_directory_path() / "incremental";
+    const tarxx::Platform platform;
+    util::remove_if_exists(dir);
+    std::filesystem::create_directories(dir / "sub");
+    const auto unchanged = util::create_test_file(tar_type, dir / "unchanged", "unchanged content");
+    const auto changed = util::create_test_file(tar_type, dir / "sub" / "changed", "old content");
+    const auto removed = util::create_test_file(tar_type, dir / "removed", "removed content");
+
+    {
+        tarxx::tarfile f(tar_filename, tar_type);
+        f.set_incremental({});
+        f.add_from_filesystem_recursive(dir);
+        f.close();
+        f.snapshot().save(snapshot_filename);
+        EXPECT_TRUE(f.deleted_entries().empty());
+        EXPECT_NE(tarxx::tarreader(tar_filename).find(platform.relative_path(unchanged.path)), nullptr);
+    }
+
+    util::create_test_file(tar_type, changed.path, "new and longer content");
+    const auto added = util::create_test_file(tar_type, dir / "added", "added content");
+    std::filesystem::remove(removed.path);
+
+    tarxx::tarfile f(tar_filename, tar_type);
+    f.set_incremental(tarxx::tar_snapshot(snapshot_filename));
+    f.add_from_filesystem_recursive(dir);
+    const std::vector<std::string> expected_deleted = {std::string(platform.relative_path(removed.path))};
+    EXPECT_EQ(f.deleted_entries(), expected_deleted);
+    f.add_deletion_list("deleted");
+    f.close();
+
+    const tarxx::tarreader reader(tar_filename);
+    EXPECT_EQ(reader.find(platform.relative_path(unchanged.path)), nullptr);
+    EXPECT_EQ(reader.content(platform.relative_path(changed.path)), "new and longer content");
+    EXPECT_EQ(reader.content(platform.relative_path(added.path)), "added content");
+    EXPECT_EQ(reader.content("deleted"), std::string(platform.relative_path(removed.path)) + '\0');
+    if (tar_type == tarxx::tarfile::tar_type::ustar) {
+        EXPECT_NE(reader.find(std::string(platform.relative_path((dir / "sub").string())) + "/"), nullptr);
+    }
+    EXPECT_EQ(f.snapshot().entries().size(), 5U);
+    EXPECT_FALSE(f.snapshot().entries().count(std::string(platform.relative_path(removed.path))));
+    util::remove_if_exists(snapshot_filename);
+    util::remove_if_exists(dir);
+}
+
+TEST_P(tar_tests, incremental_archive_with_prefetching_skips_unchanged_files)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    const tarxx::Platform platform;
+    tarxx::tarfile::prefetch_options options;
+    options.reader_threads = 2;
+
+    tarxx::tar_snapshot snapshot;
+    {
+        tarxx::tarfile f(tar_filename, tar_type);
+        f.set_incremental({});
+        f.add_from_filesystem_recursive(dir);
+        snapshot = f.snapshot();
+    }
+
+    const auto& changed = test_files.front();
+    util::create_test_file(tar_type, changed.path, "changed content");
+    {
+        tarxx::tarfile f(tar_filename, tar_type);
+        f.set_prefetch_options(options);
+        f.set_incremental(snapshot);
+        f.add_from_filesystem_recursive(dir);
+        EXPECT_TRUE(f.deleted_entries().empty());
+    }
+
+    const tarxx::tarreader reader(tar_filename);
+    for (const auto& member : reader.members()) {
+        EXPECT_TRUE(member.type == tarxx::file_type_flag::DIRECTORY || member.name.back() == '/' || member.name == platform.relative_path(changed.path)) << member.name;
+    }
+    EXPECT_EQ(reader.content(platform.relative_path(changed.path)), "changed content");
+    util::remove_if_exists(dir);
+}
+
+TEST(tar_tests, incremental_mode_errors)
+{
+    const auto tar_type = tarxx::tarfile::tar_type::ustar;
+    const auto tar_filename = util::tar_file_name();
+    const auto test_file = util::create_test_file(tar_type);
+    tarxx::tarfile f(tar_filename, tar_type);
+    EXPECT_THROW(static_cast<void>(f.deleted_entries()), std::logic_error);
+    f.add_from_filesystem(test_file.path);
+    EXPECT_THROW(f.set_incremental({}), std::logic_error);
+    EXPECT_THROW(tarxx::tar_snapshot(test_file.path), std::runtime_error);
+}
+
+TEST(tar_tests, xxh64_matches_reference)
+{
+    const auto hash = [](const std::string& data, const size_t piece_size) {
+        tarxx::xxh64 xxh;
+        for (size_t pos = 0; pos < data.size(); pos += piece_size) xxh.update(data.data() + pos, std::min(piece_size, data.size() - pos));
+        return xxh.digest();
+    };
+
+    std::string data(1000, '\0');
+    for (size_t i = 0; i < data.size(); ++i) data[i] = static_cast<char>((i * 7 + 3) & 0xFFU);
+
+    EXPECT_EQ(tarxx::xxh64().digest(), 0xEF46DB3751D8E999ULL);
+    EXPECT_EQ(hash("a", 1), 0xD24EC4F1A98C6E5BULL);
+    EXPECT_EQ(hash("abc", 1), 0x44BC2CF5AD770999ULL);
+    EXPECT_EQ(hash(data.substr(0, 37), 37), 0xE32EF63802F5A3FDULL);
+    for (const auto piece_size : {1UL, 5UL, 32UL, 333UL, 1000UL}) {
+        EXPECT_EQ(hash(data, piece_size), 0x5F235FA033F1A3FBULL) << piece_size;
+    }
+}
+
+TEST_P(tar_tests, dedup_stores_copies_as_hard_links)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto dir = std::filesystem::temp_directory_path() / "dedup";
+    const auto out_dir = std::filesystem::temp_directory_path() / "dedup_out";
+    const tarxx::Platform platform;
+    const auto content = util::create_binary_input_data(5000);
+    auto other_content = content;
+    other_content.back() = static_cast<char>(other_content.back() + 1);
+
+    util::remove_if_exists(dir);
+    std::filesystem::create_directories(dir / "sub");
+    const auto original = util::create_test_file(tar_type, dir / "original", content);
+    const auto copy = util::create_test_file(tar_type, dir / "sub" / "copy", content);
+    const auto other = util::create_test_file(tar_type, dir / "other", other_content);
+    const auto small = util::create_test_file(tar_type, dir / "small", "small");
+    const auto small_copy = util::create_test_file(tar_type, dir / "small_copy", "small");
+
+    for (const auto max_buffered_size : {content.size(), content.size() - 1}) {
+        for (const auto header_mode : {tarxx::tarfile::header_mode::rewrite, tarxx::tarfile::header_mode::patch, tarxx::tarfile::header_mode::fixed_size}) {
+            util::remove_if_exists(tar_filename);
+            {
+                tarxx::tarfile f(tar_filename, tar_type);
+                tarxx::tarfile::dedup_options options;
+                options.enabled = true;
+                options.max_buffered_size = max_buffered_size;
+                f.set_dedup_options(options);
+                f.set_header_mode(header_mode);
+                f.add_from_filesystem_recursive(dir);
+            }
+
+            const tarxx::tarreader reader(tar_filename);
+            const auto* const original_member = reader.find(platform.relative_path(original.path));
+            const auto* const copy_member = reader.find(platform.relative_path(copy.path));
+            ASSERT_NE(original_member, nullptr);
+            ASSERT_NE(copy_member, nullptr);
+            const auto* const link = original_member->type == tarxx::file_type_flag::HARD_LINK ? original_member : copy_member;
+            const auto* const target = link == original_member ? copy_member : original_member;
+            EXPECT_EQ(link->type, tarxx::file_type_flag::HARD_LINK);
+            EXPECT_EQ(link->link_name, target->name);
+            EXPECT_EQ(reader.content(*target), content);
+            EXPECT_EQ(reader.content(platform.relative_path(other.path)), other_content);
+            EXPECT_EQ(reader.find(platform.relative_path(small_copy.path))->type, tarxx::file_type_flag::REGULAR_FILE);
+
+            util::remove_if_exists(out_dir);
+            std::filesystem::create_directories(out_dir);
+            util::extract_tar(tar_filename, out_dir);
+            EXPECT_EQ(util::read_file(out_dir / platform.relative_path(original.path)), content);
+            EXPECT_EQ(util::read_file(out_dir / platform.relative_path(copy.path)), content);
+        }
+    }
+    util::remove_if_exists(out_dir);
+    util::remove_if_exists(dir);
+}
+
+TEST_P(tar_tests, dedup_compares_with_the_archived_source)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto dir = std::filesystem::temp_directory_path() / "dedup";
+    const tarxx::Platform platform;
+    const auto content = util::create_binary_input_data(5000);
+    auto other_content = content;
+    other_content.back() = static_cast<char>(other_content.back() + 1);
+
+    util::remove_if_exists(dir);
+    util::remove_if_exists(tar_filename);
+    std::filesystem::create_directories(dir);
+    const auto original = util::create_test_file(tar_type, dir / "original", content);
+    const auto copy = util::create_test_file(tar_type, dir / "copy", content);
+
+    {
+        tarxx::tarfile f(tar_filename, tar_type);
+        tarxx::tarfile::dedup_options options;
+        options.enabled = true;
+        f.set_dedup_options(options);
+        f.add_from_filesystem(original.path);
+        // the archived content is gone from the file system, the copy can't be verified against it
+        std::ofstream(original.path, std::ios::binary | std::ios::trunc) << other_content;
+        f.add_from_filesystem(copy.path);
+    }
+
+    const tarxx::tarreader reader(tar_filename);
+    const auto* const copy_member = reader.find(platform.relative_path(copy.path));
+    ASSERT_NE(copy_member, nullptr);
+    EXPECT_EQ(copy_member->type, tarxx::file_type_flag::REGULAR_FILE);
+    EXPECT_EQ(reader.content(*copy_member), content);
+    EXPECT_EQ(reader.content(platform.relative_path(original.path)), content);
+    util::remove_if_exists(dir);
+}
+
+// records the page cache hints given while archiving
+struct advice_recording_platform : tarxx::Platform {
+    struct call {
+        int fd;
+        off_t offset;
+        off_t length;
+        std::optional<tarxx::access_advice> advice;
+        bool wait;
+    };
+
+    explicit advice_recording_platform(std::vector<call>& calls) : calls_(calls) {}
+
+    void advise(const int fd, const off_t offset, const off_t length, const tarxx::access_advice advice) const override
+    {
+        calls_.push_back({fd, offset, length, advice, false});
+        tarxx::Platform::advise(fd, offset, length, advice);
+    }
+
+    void write_back(const int fd, const off_t offset, const off_t length, const bool wait) const override
+    {
+        calls_.push_back({fd, offset, length, std::nullopt, wait});
+        tarxx::Platform::write_back(fd, offset, length, wait);
+    }
+
+private:
+    std::vector<call>& calls_;
+};
+
+TEST_P(tar_tests, page_cache_hints_for_input_and_output)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto dir = std::filesystem::temp_directory_path() / "page_cache";
+    const tarxx::Platform platform;
+    util::remove_if_exists(dir);
+    std::vector<util::file_info> test_files;
+    std::vector<std::string> contents;
+    for (const auto size : {0UL, 1000UL, 64UL * 1024UL, 300UL * 1024UL + 17UL}) {
+        contents.emplace_back(util::create_binary_input_data(size));
+        test_files.emplace_back(util::create_test_file(tar_type, dir / ("file_" + std::to_string(size)), contents.back()));
+    }
+
+    for (const auto header_mode : {tarxx::tarfile::header_mode::rewrite, tarxx::tarfile::header_mode::patch, tarxx::tarfile::header_mode::fixed_size}) {
+        for (const auto dedup : {false, true}) {
+            util::remove_if_exists(tar_filename);
+            std::vector<advice_recording_platform::call> calls;
+            {
+                tarxx::tarfile f(tar_filename, tar_type, std::make_unique<advice_recording_platform>(calls));
+                f.set_header_mode(header_mode);
+                tarxx::tarfile::dedup_options dedup_options;
+                dedup_options.enabled = dedup;
+                f.set_dedup_options(dedup_options);
+                tarxx::tarfile::page_cache_options options;
+                options.drop_input_pages = true;
+                options.drop_output_pages = true;
+                options.window_size = 32 * 1024;
+                f.set_page_cache_options(options);
+                for (const auto& file : test_files) f.add_from_filesystem(file.path);
+                f.close();
+            }
+
+            const tarxx::tarreader reader(tar_filename);
+            for (auto i = 0U; i < test_files.size(); ++i) {
+                EXPECT_EQ(reader.content(platform.relative_path(test_files.at(i).path)), contents.at(i));
+            }
+
+            const auto count = [&calls](const std::function<bool(const advice_recording_platform::call&)>& predicate) {
+                return std::count_if(calls.begin(), calls.end(), predicate);
+            };
+            // every input file is hinted and dropped, the archive is dropped on closing
+            EXPECT_EQ(count([](const auto& c) { return c.advice == tarxx::access_advice::sequential; }), test_files.size());
+            EXPECT_EQ(count([](const auto& c) { return c.advice == tarxx::access_advice::dont_need && c.length == 0; }), test_files.size() + 1);
+            // the largest input file spans multiple windows, so does the archive
+            EXPECT_GT(count([](const auto& c) { return c.advice == tarxx::access_advice::dont_need && c.length > 0; }), 0);
+            EXPECT_GT(count([](const auto& c) { return !c.advice.has_value() && !c.wait; }), 0);
+            EXPECT_GT(count([](const auto& c) { return !c.advice.has_value() && c.wait; }), 1);
+        }
+    }
+    util::remove_if_exists(dir);
+}
+
+TEST(tar_tests, page_cache_zero_window_size_throws)
+{
+    const auto tar_filename = util::tar_file_name();
+    tarxx::tarfile f(tar_filename, tarxx::tarfile::tar_type::unix_v7);
+    tarxx::tarfile::page_cache_options options;
+    options.drop_input_pages = true;
+    options.window_size = 0;
+    EXPECT_THROW(f.set_page_cache_options(options), std::invalid_argument);
+}
+
+TEST_P(tar_tests, sparse_files_store_only_data_extents)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto dir = std::filesystem::temp_directory_path() / "sparse";
+    const auto out_dir = std::filesystem::temp_directory_path() / "sparse_out";
+    const tarxx::Platform platform;
+    tarxx::tarfile::sparse_options options;
+    options.enabled = true;
+    if (tar_type == tarxx::tarfile::tar_type::unix_v7) {
+        tarxx::tarfile f(tar_filename, tar_type);
+        EXPECT_THROW(f.set_sparse_options(options), std::logic_error);
+        return;
+    }
+
+    util::remove_if_exists(dir);
+    const auto disk_content = util::create_sparse_file(dir / "disk.img", 8 * 1024 * 1024,
+                                                       {{0, util::create_binary_input_data(1000)},
+                                                        {1024 * 1024 + 100, util::create_binary_input_data(70000)},
+                                                        {5 * 1024 * 1024, util::create_binary_input_data(4096)}});
+    const auto empty_content = util::create_sparse_file(dir / "empty.img", 2 * 1024 * 1024, {});
+    // written completely, without holes the filesystem could report
+    auto zeros_content = std::string(3 * 1024 * 1024, '\0');
+    std::fill_n(zeros_content.begin(), 3000, 'a');
+    std::fill_n(zeros_content.begin() + 2 * 1024 * 1024, 3000, 'b');
+    static_cast<void>(util::create_test_file(tar_type, dir / "zeros.img", zeros_content));
+    const auto dense_content = util::create_binary_input_data(50000);
+    static_cast<void>(util::create_test_file(tar_type, dir / "dense", dense_content));
+    if (util::allocated_size(dir / "disk.img") >= disk_content.size()) GTEST_SKIP() << "filesystem does not support sparse files";
+
+    for (const auto scan_for_zeros : {false, true}) {
+        for (const auto header_mode : {tarxx::tarfile::header_mode::rewrite, tarxx::tarfile::header_mode::fixed_size}) {
+            util::remove_if_exists(tar_filename);
+            util::remove_if_exists(out_dir);
+            std::filesystem::create_directories(out_dir);
+            {
+                tarxx::tarfile f(tar_filename, tar_type);
+                options.scan_for_zeros = scan_for_zeros;
+                f.set_sparse_options(options);
+                f.set_header_mode(header_mode);
+                f.add_from_filesystem_recursive(dir);
+                f.close();
+            }
+
+            const tarxx::tarreader reader(tar_filename);
+            const auto* const disk = reader.find(platform.relative_path((dir / "disk.img").string()));
+            ASSERT_NE(disk, nullptr);
+            EXPECT_TRUE(disk->sparse);
+            EXPECT_EQ(disk->size, disk_content.size());
+            EXPECT_EQ(disk->sparse_extents.size(), 3);
+            EXPECT_LT(reader.content(*disk).size(), 100 * 1024);
+            const auto* const empty = reader.find(platform.relative_path((dir / "empty.img").string()));
+            ASSERT_NE(empty, nullptr);
+            EXPECT_TRUE(empty->sparse);
+            EXPECT_TRUE(empty->sparse_extents.empty());
+            EXPECT_EQ(reader.find(platform.relative_path((dir / "zeros.img").string()))->sparse, scan_for_zeros);
+            EXPECT_FALSE(reader.find(platform.relative_path((dir / "dense").string()))->sparse);
+            EXPECT_EQ(reader.content(platform.relative_path((dir / "dense").string())), dense_content);
+
+            // gnu tar restores the holes
+            util::extract_tar(tar_filename, out_dir);
+            const auto extracted = out_dir / platform.relative_path(dir.string());
+            EXPECT_EQ(util::read_file(extracted / "disk.img"), disk_content);
+            EXPECT_LT(util::allocated_size(extracted / "disk.img"), disk_content.size());
+            EXPECT_EQ(util::read_file(extracted / "empty.img"), empty_content);
+            EXPECT_EQ(util::read_file(extracted / "zeros.img"), zeros_content);
+            EXPECT_EQ(util::read_file(extracted / "dense"), dense_content);
+        }
+    }
+    util::remove_if_exists(dir);
+    util::remove_if_exists(out_dir);
+}
+
+TEST_P(tar_tests, sparse_files_with_small_holes_keep_already_read_content)
+{
+    const auto tar_type = GetParam();
+    if (tar_type == tarxx::tarfile::tar_type::unix_v7) GTEST_SKIP() << "sparse files need ustar";
+    const auto tar_filename = util::tar_file_name();
+    const auto dir = std::filesystem::temp_directory_path() / "sparse_small_holes";
+    const auto out_dir = std::filesystem::temp_directory_path() / "sparse_small_holes_out";
+    const tarxx::Platform platform;
+
+    util::remove_if_exists(dir);
+    // the hole is below min_hole_size, the file is stored dense
+    const auto content = util::create_sparse_file(dir / "holes.img", 3 * 4096, {{0, util::create_binary_input_data(4096)}, {2 * 4096, util::create_binary_input_data(4096)}});
+    // an archived file of the same size makes dedup read the file before it is archived
+    const auto same_size_content = util::create_binary_input_data(content.size());
+    static_cast<void>(util::create_test_file(tar_type, dir / "a_same_size", same_size_content));
+    if (util::allocated_size(dir / "holes.img") >= content.size()) GTEST_SKIP() << "filesystem does not support sparse files";
+
+    for (const auto dedup : {false, true}) {
+        for (const auto header_mode : {tarxx::tarfile::header_mode::rewrite, tarxx::tarfile::header_mode::patch}) {
+            util::remove_if_exists(tar_filename);
+            {
+                tarxx::tarfile f(tar_filename, tar_type);
+                tarxx::tarfile::sparse_options sparse_options;
+                sparse_options.enabled = true;
+                f.set_sparse_options(sparse_options);
+                f.set_header_mode(header_mode);
+                if (dedup) {
+                    tarxx::tarfile::dedup_options dedup_options;
+                    dedup_options.enabled = true;
+                    f.set_dedup_options(dedup_options);
+                    f.add_from_filesystem(dir / "a_same_size");
+                    f.add_from_filesystem(dir / "holes.img");
+                } else {
+                    tarxx::tarfile::prefetch_options prefetch_options;
+                    prefetch_options.reader_threads = 2;
+                    f.set_prefetch_options(prefetch_options);
+                    f.add_from_filesystem_recursive(dir);
+                }
+            }
+
+            const tarxx::tarreader reader(tar_filename);
+            const auto* const holes = reader.find(platform.relative_path((dir / "holes.img").string()));
+            ASSERT_NE(holes, nullptr);
+            EXPECT_FALSE(holes->sparse);
+            EXPECT_EQ(holes->size, content.size());
+            EXPECT_EQ(reader.content(*holes), content);
+
+            util::remove_if_exists(out_dir);
+            std::filesystem::create_directories(out_dir);
+            util::extract_tar(tar_filename, out_dir);
+            EXPECT_EQ(util::read_file(out_dir / platform.relative_path(dir.string()) / "holes.img"), content);
+        }
+    }
+    util::remove_if_exists(dir);
+    util::remove_if_exists(out_dir);
+}
+
+TEST_P(tar_tests, hard_links_and_names_are_found_after_table_growth)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto dir = std::filesystem::temp_directory_path() / "link_table";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(dir);
+    std::filesystem::create_directories(dir);
+
+    constexpr auto file_count = 100;
+    for (auto i = 0; i < file_count; ++i) {
+        const auto file = dir / ("file_" + std::to_string(i));
+        util::create_test_file(tar_type, file, std::to_string(i));
+        std::filesystem::create_hard_link(file, dir / ("link_" + std::to_string(i)));
+    }
+
+    {
+        tarxx::tarfile f(tar_filename, tar_type);
+        for (auto i = 0; i < file_count; ++i) f.add_from_filesystem(dir / ("file_" + std::to_string(i)));
+        for (auto i = 0; i < file_count; ++i) f.add_from_filesystem(dir / ("link_" + std::to_string(i)));
+    }
+
+    const tarxx::Platform platform;
+    const tarxx::tarreader reader(tar_filename);
+    ASSERT_EQ(reader.members().size(), 2 * file_count);
+    for (auto i = 0; i < file_count; ++i) {
+        const auto* const link = reader.find(platform.relative_path((dir / ("link_" + std::to_string(i))).string()));
+        ASSERT_NE(link, nullptr);
+        EXPECT_EQ(link->type, tarxx::file_type_flag::HARD_LINK);
+        EXPECT_EQ(link->link_name, platform.relative_path((dir / ("file_" + std::to_string(i))).string()));
+    }
+    util::remove_if_exists(dir);
+}
+
+TEST_P(tar_tests, add_single_link_file_twice_after_table_growth_throws)
+{
+    const auto tar_type = GetParam();
+    const auto dir = std::filesystem::temp_directory_path() / "name_table";
+    util::remove_if_exists(dir);
+    std::filesystem::create_directories(dir);
+
+    constexpr auto file_count = 100;
+    for (auto i = 0; i < file_count; ++i) util::create_test_file(tar_type, dir / ("file_" + std::to_string(i)), std::to_string(i));
+
+    tarxx::tarfile f(util::tar_file_name(), tar_type);
+    f.add_from_filesystem_recursive(dir);
+    // only files with further links are stored as hard link when added again
+    EXPECT_THROW(f.add_from_filesystem(dir / ("file_" + std::to_string(file_count / 2)));, std::logic_error);
+    f.close();
+    util::remove_if_exists(dir);
+}
+
+#ifdef WITH_STATISTICS
+TEST_P(tar_tests, statistics_count_archived_data)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto dir = std::filesystem::temp_directory_path() / "statistics";
+    const tarxx::Platform platform;
+    util::remove_if_exists(dir);
+    const auto first = util::create_test_file(tar_type, dir / "first", util::create_binary_input_data(100000));
+    const auto second = util::create_test_file(tar_type, dir / "second", util::create_binary_input_data(1000));
+
+    for (const auto header_mode : {tarxx::tarfile::header_mode::rewrite, tarxx::tarfile::header_mode::fixed_size}) {
+        for (const auto stream_output : {false, true}) {
+            util::remove_if_exists(tar_filename);
+            std::vector<std::pair<std::string, tarxx::size_t>> events;
+            uint64_t callback_bytes = 0;
+            tarxx::tar_statistics statistics;
+            {
+                std::ofstream ofs(tar_filename, std::ios::binary);
+                auto f = stream_output ? std::make_unique<tarxx::tarfile>([&](const tarxx::block_t& block, const size_t size) {
+                    ofs.write(block.data(), static_cast<std::streamsize>(size));
+                    callback_bytes += size;
+                },
+                                                                           tar_type)
+                                       : std::make_unique<tarxx::tarfile>(tar_filename, tar_type);
+                f->set_header_mode(header_mode);
+                f->set_entry_hook([&events](const tarxx::tar_entry_event& event) {
+                    events.emplace_back(std::string(event.name), event.size);
+                    EXPECT_GE(event.duration.count(), 0);
+                });
+                f->add_from_filesystem(first.path);
+                f->add_from_filesystem(second.path);
+                f->add_directory("folder", 0755, platform.user_id(), platform.group_id(), 0);
+                f->close();
+                statistics = f->statistics();
+            }
+
+            const auto archive_size = std::filesystem::file_size(tar_filename);
+            ASSERT_EQ(events.size(), 3);
+            EXPECT_EQ(events[0], std::make_pair(first.path, tarxx::size_t {100000}));
+            EXPECT_EQ(events[1], std::make_pair(second.path, tarxx::size_t {1000}));
+            EXPECT_EQ(events[2].first, "folder");
+            EXPECT_EQ(statistics.entries, 3);
+            EXPECT_EQ(statistics.headers, 3);
+            EXPECT_EQ(statistics.bytes_in, 101000);
+            // rewritten headers are written twice
+            const auto rewritten = !stream_output && header_mode == tarxx::tarfile::header_mode::rewrite ? 2 * tarxx::BLOCK_SIZE : 0;
+            EXPECT_EQ(statistics.bytes_out, archive_size + rewritten);
+            if (stream_output) {
+                EXPECT_EQ(callback_bytes, archive_size);
+            }
+            EXPECT_EQ(stream_output || header_mode == tarxx::tarfile::header_mode::fixed_size, statistics.seeks == 0);
+            EXPECT_GE(statistics.syscalls, 2);
+            EXPECT_GT(statistics.metadata_ns, 0);
+            EXPECT_GT(stream_output ? statistics.callback_ns : statistics.write_ns, 0);
+        }
+    }
+    util::remove_if_exists(dir);
+}
+#endif
+
 INSTANTIATE_TEST_SUITE_P(tar_type_dependent, tar_tests, ::testing::Values(tarxx::tarfile::tar_type::unix_v7, tarxx::tarfile::tar_type::ustar));
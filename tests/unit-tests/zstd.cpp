@@ -0,0 +1,230 @@
+// tarxx - modern C++ tar library
+// Copyright (c) 2022-2023, Thilo Schmitt, Alexander Mohr
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "util/util.h"
+#include <gtest/gtest.h>
+#include <iostream>
+#include <tarxx.h>
+
+using std::string_literals::operator""s;
+
+class zstd_tests : public ::testing::TestWithParam<tarxx::tarfile::tar_type> {};
+
+TEST_P(zstd_tests, add_file_success)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto zstd_filename = tar_filename + ".zst";
+    const auto test_file = util::create_test_file(tar_type);
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(zstd_filename);
+
+    tarxx::tarfile f(zstd_filename, tarxx::tarfile::compression_mode::zstd, tar_type);
+    f.add_from_filesystem(test_file.path);
+    f.close();
+
+    util::decompress_zstd(zstd_filename, tar_filename);
+    util::tar_first_files_matches_original(tar_filename, test_file, tar_type);
+}
+
+TEST_P(zstd_tests, add_multiple_files_recursive_success)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto zstd_filename = tar_filename + ".zst";
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(zstd_filename);
+
+    tarxx::tarfile tar_file(zstd_filename, tarxx::tarfile::compression_mode::zstd, tar_type);
+    tar_file.add_from_filesystem_recursive(dir);
+    tar_file.close();
+
+    util::append_folders_from_test_files(test_files, tar_type);
+
+    util::decompress_zstd(zstd_filename, tar_filename);
+    util::expect_files_in_tar(tar_filename, test_files, tar_type);
+    util::remove_if_exists(dir);
+}
+
+TEST_P(zstd_tests, add_file_content_matches_with_workers)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto zstd_filename = tar_filename + ".zst";
+    const auto input_data = util::create_binary_input_data(3 * 1024 * 1024 + 123);
+    const auto test_file = util::create_test_file(tar_type, std::filesystem::temp_directory_path() / "content_file", input_data);
+    const auto out_dir = std::filesystem::temp_directory_path() / "content_out";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(zstd_filename);
+    util::remove_if_exists(out_dir);
+    std::filesystem::create_directories(out_dir);
+
+    tarxx::tarfile f(zstd_filename, tarxx::tarfile::compression_mode::zstd, tar_type);
+    f.set_compression_threads(2);
+    f.add_from_filesystem(test_file.path);
+    f.close();
+
+    util::decompress_zstd(zstd_filename, tar_filename);
+    util::extract_tar(tar_filename, out_dir);
+    const tarxx::Platform platform;
+    EXPECT_EQ(util::read_file(out_dir / platform.relative_path(test_file.path)), input_data);
+    util::remove_if_exists(out_dir);
+}
+
+TEST_P(zstd_tests, add_multiple_files_recursive_stream_output)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto zstd_filename = tar_filename + ".zst";
+    auto [dir, test_files] = util::create_multiple_test_files_with_sub_folders(tar_type);
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(zstd_filename);
+
+    std::ofstream zstd_file(zstd_filename, std::ios::binary);
+    tarxx::tarfile tar_file([&](const tarxx::block_t& data, size_t size) {
+        zstd_file.write(data.data(), static_cast<std::streamsize>(size));
+    },
+                            tarxx::tarfile::compression_mode::zstd, tar_type);
+    tar_file.add_from_filesystem_recursive(dir);
+    tar_file.close();
+    zstd_file.close();
+
+    util::append_folders_from_test_files(test_files, tar_type);
+
+    util::decompress_zstd(zstd_filename, tar_filename);
+    util::expect_files_in_tar(tar_filename, test_files, tar_type);
+    util::remove_if_exists(dir);
+}
+
+TEST_P(zstd_tests, add_file_streaming_data_in_pieces_content_matches)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto zstd_filename = tar_filename + ".zst";
+    const auto input_data = util::create_binary_input_data(5 * 1024 * 1024 + 77);
+    const auto test_file = util::create_test_file(tar_type, std::filesystem::temp_directory_path() / "content_file", input_data);
+    const auto out_dir = std::filesystem::temp_directory_path() / "content_out";
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(zstd_filename);
+    util::remove_if_exists(out_dir);
+    std::filesystem::create_directories(out_dir);
+
+    tarxx::tarfile tar_file(zstd_filename, tarxx::tarfile::compression_mode::zstd, tar_type);
+    util::add_streaming_data_in_pieces(input_data, test_file, tar_file);
+    tar_file.close();
+
+    util::decompress_zstd(zstd_filename, tar_filename);
+    util::extract_tar(tar_filename, out_dir);
+    const tarxx::Platform platform;
+    EXPECT_EQ(util::read_file(out_dir / platform.relative_path(test_file.path)), input_data);
+    util::remove_if_exists(out_dir);
+}
+
+TEST_P(zstd_tests, header_mode_fixed_size_with_streaming_data)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto zstd_filename = tar_filename + ".zst";
+    const auto test_file = util::create_test_file(tar_type);
+    const auto input_data = util::create_input_data(tarxx::BLOCK_SIZE * 3 + 17);
+    const auto stream_file = util::create_test_file(tar_type, std::filesystem::temp_directory_path() / "test_stream_file", input_data);
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(zstd_filename);
+
+    tarxx::tarfile tar_file(zstd_filename, tarxx::tarfile::compression_mode::zstd, tar_type);
+    tar_file.set_header_mode(tarxx::tarfile::header_mode::fixed_size);
+    tar_file.add_from_filesystem(test_file.path);
+    util::add_streaming_data(input_data, stream_file, tar_file);
+    tar_file.close();
+
+    util::decompress_zstd(zstd_filename, tar_filename);
+    std::vector<util::file_info> expected_files = {test_file, stream_file};
+    util::expect_files_in_tar(tar_filename, expected_files, tar_type);
+}
+
+TEST_P(zstd_tests, header_mode_fixed_size_compresses_better)
+{
+    const auto tar_type = GetParam();
+    const auto dir = std::filesystem::temp_directory_path() / "many_small_files";
+    util::remove_if_exists(dir);
+    std::filesystem::create_directories(dir);
+    for (auto i = 0; i < 200; ++i) {
+        util::create_test_file(tar_type, dir / ("file_" + std::to_string(i)), "small file content " + std::to_string(i));
+    }
+
+    const auto compressed_size = [&](const tarxx::tarfile::header_mode header_mode) {
+        const auto zstd_filename = util::tar_file_name() + ".zst";
+        util::remove_if_exists(zstd_filename);
+        tarxx::tarfile tar_file(zstd_filename, tarxx::tarfile::compression_mode::zstd, tar_type);
+        tar_file.set_header_mode(header_mode);
+        tar_file.add_from_filesystem_recursive(dir);
+        tar_file.close();
+        return std::filesystem::file_size(zstd_filename);
+    };
+
+    EXPECT_LT(compressed_size(tarxx::tarfile::header_mode::fixed_size) * 4, compressed_size(tarxx::tarfile::header_mode::rewrite));
+    util::remove_if_exists(dir);
+}
+
+TEST_P(zstd_tests, higher_level_and_window_decompress)
+{
+    const auto tar_type = GetParam();
+    const auto tar_filename = util::tar_file_name();
+    const auto zstd_filename = tar_filename + ".zst";
+    const auto test_file = util::create_test_file(tar_type, std::filesystem::temp_directory_path() / "test_file", util::create_input_data(600 * 1024));
+    util::remove_if_exists(tar_filename);
+    util::remove_if_exists(zstd_filename);
+
+    tarxx::tarfile f(zstd_filename, tarxx::tarfile::compression_mode::zstd, tar_type);
+    tarxx::zstd_options options;
+    options.level = 19;
+    options.window_log = 20;
+    f.set_zstd_options(options);
+    f.add_from_filesystem(test_file.path);
+    f.close();
+
+    util::decompress_zstd(zstd_filename, tar_filename);
+    util::tar_first_files_matches_original(tar_filename, test_file, tar_type);
+}
+
+TEST(zstd_tests, set_zstd_options_requires_zstd_mode)
+{
+    const auto tar_filename = util::tar_file_name();
+    tarxx::tarfile f(tar_filename, tarxx::tarfile::compression_mode::none);
+    EXPECT_THROW(f.set_zstd_options({}), std::logic_error);
+}
+
+TEST(zstd_tests, set_zstd_options_after_compression_started)
+{
+    const auto tar_type = tarxx::tarfile::tar_type::ustar;
+    const auto zstd_filename = util::tar_file_name() + ".zst";
+    const auto test_file = util::create_test_file(tar_type);
+    tarxx::tarfile f(zstd_filename, tarxx::tarfile::compression_mode::zstd, tar_type);
+    f.add_from_filesystem(test_file.path);
+    EXPECT_THROW(f.set_zstd_options({}), std::logic_error);
+    EXPECT_THROW(f.set_compression_threads(2), std::logic_error);
+}
+
+INSTANTIATE_TEST_SUITE_P(tar_type_dependent, zstd_tests, ::testing::Values(tarxx::tarfile::tar_type::unix_v7, tarxx::tarfile::tar_type::ustar));
@@ -36,6 +36,7 @@
 #include <filesystem>
 #include <fstream>
 #include <gtest/gtest.h>
+#include <iomanip>
 #include <regex>
 #include <set>
 #include <sstream>
@@ -460,6 +461,21 @@ namespace util {
         tar_file.stream_file_complete(reference_file.path, reference_file.mode, platform.user_id(), platform.group_id(), reference_data.size(), reference_file.mtime.tv_sec);
     }
 
+    // passes the data in uneven pieces, so block boundaries fall in the middle of calls
+    inline void add_streaming_data_in_pieces(const std::string& reference_data, const util::file_info& reference_file, tarxx::tarfile& tar_file)
+    {
+        const tarxx::Platform platform;
+        const std::array<size_t, 5> piece_sizes = {1, 511, 4099, 300000, 2 * 1024 * 1024 + 17};
+        tar_file.add_file_streaming();
+        size_t pos = 0;
+        for (auto i = 0U; pos < reference_data.size(); ++i) {
+            const auto piece_size = std::min(piece_sizes.at(i % piece_sizes.size()), reference_data.size() - pos);
+            tar_file.add_file_streaming_data(reference_data.data() + pos, static_cast<std::streamsize>(piece_size));
+            pos += piece_size;
+        }
+        tar_file.stream_file_complete(reference_file.path, reference_file.mode, platform.user_id(), platform.group_id(), reference_data.size(), reference_file.mtime.tv_sec);
+    }
+
     inline std::string create_input_data(unsigned long size)
     {
         std::string reference_data;
@@ -470,6 +486,48 @@ namespace util {
         return reference_data;
     }
 
+    inline std::string create_binary_input_data(unsigned long size)
+    {
+        std::string reference_data;
+        reference_data.reserve(size);
+        for (auto i = 0U; i < size; ++i) {
+            reference_data.push_back(static_cast<char>((i * 7919U) % 251U));
+        }
+
+        return reference_data;
+    }
+
+    inline std::string read_file(const std::string& path)
+    {
+        std::ifstream ifs(path, std::ios::binary);
+        return {std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>()};
+    }
+
+    // creates a file of the given size which only contains data at the given offsets,
+    // returns its content including the holes
+    inline std::string create_sparse_file(const std::string& path, const tarxx::size_t size, const std::vector<std::pair<tarxx::size_t, std::string>>& extents)
+    {
+        std::filesystem::create_directories(std::filesystem::path(path).parent_path());
+        std::string content(size, '\0');
+        {
+            std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+            for (const auto& [offset, data] : extents) {
+                ofs.seekp(static_cast<std::streamoff>(offset));
+                ofs.write(data.data(), static_cast<std::streamsize>(data.size()));
+                std::copy(data.begin(), data.end(), content.begin() + static_cast<std::ptrdiff_t>(offset));
+            }
+        }
+        std::filesystem::resize_file(path, size);
+        return content;
+    }
+
+    inline tarxx::size_t allocated_size(const std::string& path)
+    {
+        struct stat file_stat {};
+        if (::stat(path.c_str(), &file_stat) != 0) throw std::runtime_error("stat failed for " + path);
+        return static_cast<tarxx::size_t>(file_stat.st_blocks) * 512U;
+    }
+
     inline std::string tar_file_name()
     {
         return std::filesystem::temp_directory_path() / "test.tar";
@@ -575,6 +633,55 @@ namespace util {
         return test_file;
     }
 
+    struct streamed_member {
+        std::string name;
+        std::string link_name;
+        tarxx::file_type_flag type;
+        tarxx::size_t size;
+        std::string content;
+    };
+
+    // collects the members passed on by the parser, including their content
+    inline tarxx::tar_stream_parser create_collecting_parser(std::vector<streamed_member>& members)
+    {
+        return tarxx::tar_stream_parser(
+                [&members](const tarxx::tar_member& member) {
+                    members.push_back({std::string(member.name), std::string(member.link_name), member.type, member.size, ""});
+                },
+                [&members](const tarxx::tar_member&, const char* data, tarxx::size_t size) {
+                    members.back().content.append(data, size);
+                });
+    }
+
+    inline void streamed_members_match_reader(const std::vector<streamed_member>& members, const tarxx::tarreader& reader)
+    {
+        ASSERT_EQ(members.size(), reader.members().size());
+        for (tarxx::size_t i = 0; i < members.size(); ++i) {
+            const auto& member = reader.members()[i];
+            EXPECT_EQ(members[i].name, member.name);
+            EXPECT_EQ(members[i].link_name, member.link_name);
+            EXPECT_EQ(members[i].type, member.type);
+            EXPECT_EQ(members[i].size, member.size);
+            EXPECT_EQ(members[i].content, reader.content(member)) << member.name;
+        }
+    }
+
+    inline void index_matches_reader(const tarxx::tar_index& index, const tarxx::tarreader& reader)
+    {
+        ASSERT_EQ(index.entries().size(), reader.members().size());
+        for (tarxx::size_t i = 0; i < index.entries().size(); ++i) {
+            const auto& entry = index.entries()[i];
+            const auto& member = reader.members()[i];
+            EXPECT_EQ(entry.name, member.name);
+            EXPECT_EQ(entry.type, member.type) << entry.name;
+            EXPECT_EQ(entry.size, member.size) << entry.name;
+            EXPECT_EQ(entry.content_offset, member.offset) << entry.name;
+            EXPECT_EQ(entry.header_offset + tarxx::BLOCK_SIZE, member.offset) << entry.name;
+            EXPECT_LE(entry.block_tar_offset, entry.header_offset) << entry.name;
+            EXPECT_EQ(index.find(entry.name), &entry);
+        }
+    }
+
 #ifdef WITH_LZ4
 
     inline void decompress_lz4(const std::string& lz4_in, const std::string& tar_out)
@@ -590,6 +697,21 @@ namespace util {
 
 #endif
 
+#ifdef WITH_ZSTD
+
+    inline void decompress_zstd(const std::string& zstd_in, const std::string& tar_out)
+    {
+        std::string zstd_output;
+        std::stringstream cmd;
+        cmd << "zstd -dcf " << zstd_in << ">" << tar_out;
+        const auto result = execute_with_output(cmd.str(), zstd_output);
+        if (result != 0) {
+            throw std::runtime_error("Failed to decompress zstd file: " + zstd_in + " code=" + std::to_string(result) + ", output=" + zstd_output);
+        }
+    }
+
+#endif
+
 
 } // namespace util
 